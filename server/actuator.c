@@ -4,10 +4,15 @@
  */
 
 #include <stdio.h>
+#include <math.h>
 #include "actuator.h"
 #include "options.h"
 // Files containing GPIO and PWM definitions
 #include "bbb_pin.h"
+#include "sensor.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
 
 /** Number of actuators **/
 int g_num_actuators = 0;
@@ -35,6 +40,8 @@ int Actuator_Add(const char * name, int user_id, SetFn set, InitFn init, CleanFn
 	a->id = g_num_actuators-1;
 	a->user_id = user_id;
 	Data_Init(&(a->data_file));
+	Data_Init(&(a->setpoint_file));
+	Data_Init(&(a->measurement_file));
 	a->name = name;
 	a->set = set; // Set read function
 	a->init = init; // Set init function
@@ -43,6 +50,12 @@ int Actuator_Add(const char * name, int user_id, SetFn set, InitFn init, CleanFn
 	a->sanity = sanity;
 	a->cleanup = cleanup;
 	pthread_mutex_init(&(a->mutex), NULL);
+	// Deadlines for the control thread are on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(a->cond), &attr);
+	pthread_condattr_destroy(&attr);
 
 	if (init != NULL)
 	{
@@ -81,11 +94,43 @@ void Actuator_Cleanup()
 		Actuator * a = g_actuators+i;
 		if (a->cleanup != NULL)
 			a->cleanup(a->user_id);
+		Waveform_Free(&(a->control.wave));
 	}
 	g_num_actuators = 0;
 }
 
 
+/**
+ * Stop an Actuator's control thread, waking it if it is waiting for a deadline
+ * @param a - The Actuator
+ */
+static void Actuator_Deactivate(Actuator * a)
+{
+	pthread_mutex_lock(&(a->mutex));
+	a->activated = false;
+	pthread_cond_broadcast(&(a->cond));
+	pthread_mutex_unlock(&(a->mutex));
+	pthread_join(a->thread, NULL); // Wait for thread to exit
+}
+
+/**
+ * Open one of an Actuator's DataFiles, discarding anything already in it
+ * @param df - The DataFile
+ * @param filename - Name of the Actuator's main DataFile
+ * @param suffix - Suffix to add to filename
+ */
+static void Actuator_OpenFile(DataFile * df, const char * filename, const char * suffix)
+{
+	char path[BUFSIZ];
+	if (snprintf(path, BUFSIZ, "%s%s", filename, suffix) >= BUFSIZ)
+	{
+		Fatal("Actuator filename \"%s%s\" too long", filename, suffix);
+	}
+	Data_Open(df, path);
+	freopen(NULL, "wb+", df->file);
+	df->num_points = 0;
+}
+
 /**
  * Sets the actuator to the desired mode. No checks are
  * done to see if setting to the desired mode will conflict with
@@ -115,9 +160,10 @@ void Actuator_SetMode(Actuator * a, ControlModes mode, void *arg)
 				}
 
 				Log(LOGDEBUG, "Actuator %d with DataFile \"%s\"", a->id, filename);
-				// Open DataFile
-				Data_Open(&(a->data_file), filename);
-				freopen(NULL, "wb+", a->data_file.file);
+				// Open DataFiles
+				Actuator_OpenFile(&(a->data_file), filename, "");
+				Actuator_OpenFile(&(a->setpoint_file), filename, ".setpoint");
+				Actuator_OpenFile(&(a->measurement_file), filename, ".measurement");
 			} 
 		case CONTROL_RESUME:  //Case fallthrough; no break before
 			{
@@ -137,9 +183,7 @@ void Actuator_SetMode(Actuator * a, ControlModes mode, void *arg)
 
 		case CONTROL_EMERGENCY: //TODO add proper case for emergency
 		case CONTROL_PAUSE:
-			a->activated = false;
-			Actuator_SetControl(a, NULL);
-			pthread_join(a->thread, NULL); // Wait for thread to exit
+			Actuator_Deactivate(a);
 
 			Log(LOGDEBUG, "Paused actuator %d", a->id);
 		break;
@@ -148,11 +192,11 @@ void Actuator_SetMode(Actuator * a, ControlModes mode, void *arg)
 		case CONTROL_STOP:
 			if (a->activated) //May have been paused before
 			{
-				a->activated = false;
-				Actuator_SetControl(a, NULL);
-				pthread_join(a->thread, NULL); // Wait for thread to exit	
+				Actuator_Deactivate(a);
 			}
-			Data_Close(&(a->data_file)); // Close DataFile
+			Data_Close(&(a->data_file)); // Close DataFiles
+			Data_Close(&(a->setpoint_file));
+			Data_Close(&(a->measurement_file));
 			
 			Log(LOGDEBUG, "Stopped actuator %d", a->id);
 		break;
@@ -177,6 +221,192 @@ void Actuator_SetModeAll(ControlModes mode, void * arg)
 		Actuator_Cleanup();
 }
 
+/**
+ * Wait for the deadline of a step of a control. Must be called with a->mutex locked.
+ * @param a - The Actuator
+ * @param start - When the control started
+ * @param offset - Time of the deadline after start (s)
+ * @param due - Set to the deadline
+ * @returns false if the control was changed or the Actuator deactivated while waiting
+ */
+static bool Actuator_WaitUntil(Actuator * a, const struct timespec * start, double offset, struct timespec * due)
+{
+	DOUBLE_TO_TIMEVAL(offset, due);
+	due->tv_sec += start->tv_sec;
+	due->tv_nsec += start->tv_nsec;
+	if (due->tv_nsec >= 1000000000)
+	{
+		due->tv_sec++;
+		due->tv_nsec -= 1000000000;
+	}
+	while (a->activated && !a->control_changed && pthread_cond_timedwait(&(a->cond), &(a->mutex), due) == 0);
+	return (a->activated && !a->control_changed);
+}
+
+/**
+ * Finish a step of a control; record its timing, and skip any steps that are already overdue.
+ * Must be called with a->mutex unlocked; returns with it locked.
+ * @param a - The Actuator
+ * @param start - When the control started
+ * @param due - Deadline of the step
+ * @param woke - When the step started
+ * @param period - Time between steps (s)
+ * @param k - Index of the step
+ * @param total - Number of steps in the control, or -1 if it doesn't end; the last step is never skipped
+ * @returns Index of the next step
+ */
+static long Actuator_FinishStep(Actuator * a, const struct timespec * start, const struct timespec * due,
+	const struct timespec * woke, double period, long k, long total)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double lateness = TIMEVAL_DIFF(*woke, *due);
+	double busy = TIMEVAL_DIFF(now, *due);
+
+	long next = k + 1;
+	if (period > 0)
+	{
+		long overdue = (long)(TIMEVAL_DIFF(now, *start) / period);
+		if (total >= 0 && overdue > total - 1)
+			overdue = total - 1;
+		if (overdue > next)
+			next = overdue;
+	}
+
+	pthread_mutex_lock(&(a->mutex));
+	a->timing.steps++;
+	a->timing.missed += next - k - 1;
+	a->timing.last = lateness;
+	a->timing.sum += lateness;
+	a->timing.sum_squares += lateness * lateness;
+	if (lateness > a->timing.max)
+		a->timing.max = lateness;
+	if (busy > a->timing.busy_max)
+		a->timing.busy_max = busy;
+	return next;
+}
+
+/**
+ * Run an open loop control, setting each value at its deadline. Deadlines are measured from the start of the control,
+ * so the time taken to set the Actuator doesn't accumulate. If the Actuator falls behind, values that
+ * are already overdue are skipped, but the last value is always set.
+ * Must be called with a->mutex locked; it is unlocked while values are set.
+ * @param a - The Actuator
+ * @param w - The values to set
+ */
+static void Actuator_Run(Actuator * a, const Waveform * w)
+{
+	long total = Waveform_Total(w);
+	struct timespec start, due, woke;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (long k = 0; total < 0 || k < total; )
+	{
+		if (!Actuator_WaitUntil(a, &start, k * w->step, &due))
+			return;
+		pthread_mutex_unlock(&(a->mutex));
+
+		clock_gettime(CLOCK_MONOTONIC, &woke);
+		Actuator_SetValue(a, Waveform_Value(w, k), true);
+		k = Actuator_FinishStep(a, &start, &due, &woke, w->step, k, total);
+	}
+}
+
+/**
+ * Run a closed loop control, setting the output every c->pid.period from the error between the setpoint and the
+ * latest measurement. The setpoint follows c->wave, and stays at its last value once c->wave is finished.
+ * The derivative is of the measurement rather than the error, so that setpoint steps don't kick the output. It is
+ * only updated when there is a new measurement, since the sensor is usually read less often than the output is set.
+ * The integral is limited to the output range, and doesn't grow while the output is limited (anti-windup).
+ * The loop is scheduled as the actuator thread's control role (see realtime.c).
+ * Must be called with a->mutex locked; it is unlocked while the output is set.
+ * @param a - The Actuator
+ * @param c - The control
+ */
+static void Actuator_RunPID(Actuator * a, const ActuatorControl * c)
+{
+	const ActuatorPID * pid = &(c->pid);
+	const Waveform * w = &(c->wave);
+	long total = Waveform_Total(w);
+	double integral = 0, derivative = 0;
+	double setpoint = NAN;
+	DataPoint last = {NAN, NAN};
+	bool timed_out = false;
+
+	struct timespec start, due, woke;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long k = 0; Actuator_WaitUntil(a, &start, k * pid->period, &due); )
+	{
+		pthread_mutex_unlock(&(a->mutex));
+		clock_gettime(CLOCK_MONOTONIC, &woke);
+		double now = TIMEVAL_DIFF(woke, *Control_GetStartTime());
+
+		// Setpoint
+		long index = (w->step > 0) ? (long)(k * pid->period / w->step) : 0;
+		if (total >= 0 && index > total - 1)
+			index = total - 1;
+		double value = Waveform_Value(w, index);
+		if (value != setpoint)
+		{
+			setpoint = value;
+			DataPoint d = {now, setpoint};
+			Data_Save(&(a->setpoint_file), &d, 1);
+		}
+
+		// Measurement
+		DataPoint measurement;
+		double output;
+		if (!Sensor_GetLatest(pid->sensor, &measurement) || !(now - measurement.time_stamp <= ACTUATOR_PID_TIMEOUT))
+		{
+			if (!timed_out)
+				Log(LOGWARN, "No recent measurement from %s for actuator %s", Sensor_GetName(pid->sensor), a->name);
+			timed_out = true;
+			integral = 0;
+			output = pid->min;
+		}
+		else
+		{
+			timed_out = false;
+			if (measurement.time_stamp != last.time_stamp)
+			{
+				if (!isnan(last.time_stamp) && measurement.time_stamp > last.time_stamp)
+					derivative = -pid->kd * (measurement.value - last.value) / (measurement.time_stamp - last.time_stamp);
+				last = measurement;
+				Data_Save(&(a->measurement_file), &measurement, 1);
+			}
+
+			double error = setpoint - measurement.value;
+			double proportional = pid->kp * error;
+			double next_integral = integral + pid->ki * error * pid->period;
+			if (next_integral > pid->max)
+				next_integral = pid->max;
+			else if (next_integral < pid->min)
+				next_integral = pid->min;
+
+			output = proportional + next_integral + derivative;
+			if (output > pid->max)
+			{
+				output = pid->max;
+				if (error < 0)
+					integral = next_integral;
+			}
+			else if (output < pid->min)
+			{
+				output = pid->min;
+				if (error > 0)
+					integral = next_integral;
+			}
+			else
+			{
+				integral = next_integral;
+			}
+		}
+
+		Actuator_SetValue(a, output, true);
+		k = Actuator_FinishStep(a, &start, &due, &woke, pid->period, k, -1);
+	}
+}
+
 /**
  * Actuator control thread
  * @param arg - Cast to an Actuator*
@@ -185,45 +415,38 @@ void Actuator_SetModeAll(ControlModes mode, void * arg)
 void * Actuator_Loop(void * arg)
 {
 	Actuator * a = (Actuator*)(arg);
+	Trace_ThreadName("actuator %s", a->name);
+	Realtime_SetRole(REALTIME_CONTROL);
 	
 	// Loop until stopped
+	pthread_mutex_lock(&(a->mutex));
 	while (a->activated)
 	{
-		pthread_mutex_lock(&(a->mutex));
-		while (!a->control_changed)
+		while (a->activated && !a->control_changed)
 		{
 			pthread_cond_wait(&(a->cond), &(a->mutex));
 		}
 		a->control_changed = false;
-		pthread_mutex_unlock(&(a->mutex));
-		if (!a->activated)
-			break;
-
-		Actuator_SetValue(a, a->control.start, true);
-		// Currently does discrete steps after specified time intervals
-
-		struct timespec wait;
-		DOUBLE_TO_TIMEVAL(a->control.stepwait, &wait);
-		while (!a->control_changed && a->control.steps > 0 && a->activated)
-		{
-			clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, NULL);
-			a->control.start += a->control.stepsize;
-			Actuator_SetValue(a, a->control.start, true);
-			
-			a->control.steps--;
-		}
-		if (a->control_changed)
+		if (!a->activated || a->control.wave.values == NULL)
 			continue;
-		clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, NULL);
+
+		// Take the control, so it can't be freed while it runs
+		ActuatorControl c = a->control;
+		a->control.wave.values = NULL;
+		memset(&(a->timing), 0, sizeof(ActuatorTiming));
+		if (c.pid.sensor >= 0)
+			Actuator_RunPID(a, &c);
+		else
+			Actuator_Run(a, &(c.wave));
+		Waveform_Free(&(c.wave));
 
 		//TODO:
-		// Note that although this loop has a sleep in it which would seem to make it hard to enforce urgent shutdowns,
+		// Note that although this loop waits for deadlines which would seem to make it hard to enforce urgent shutdowns,
 		//	You can call the Actuator's cleanup function immediately (and this loop should later just exit)
 		//	tl;dr This function isn't/shouldn't be responsible for the emergency Actuator stuff
 		// (That should be handled by the Fatal function... at some point)
 	}
-
-	//TODO: Cleanup?
+	pthread_mutex_unlock(&(a->mutex));
 	
 	// Keep pthreads happy
 	return NULL;
@@ -232,13 +455,18 @@ void * Actuator_Loop(void * arg)
 /**
  * Set an Actuators control variable
  * @param a - Actuator to control 
- * @param c - Control to set to
+ * @param c - Control to set to; the Actuator takes its schedule. If NULL, the Actuator is just woken.
  */
 void Actuator_SetControl(Actuator * a, ActuatorControl * c)
 {
 	pthread_mutex_lock(&(a->mutex));
 	if (c != NULL)
+	{
+		// Replaces any control Actuator_Loop hasn't taken yet
+		Waveform_Free(&(a->control.wave));
 		a->control = *c;
+		c->wave.values = NULL;
+	}
 	a->control_changed = true;
 	pthread_cond_broadcast(&(a->cond));
 	pthread_mutex_unlock(&(a->mutex));
@@ -259,14 +487,19 @@ void Actuator_SetValue(Actuator * a, double value, bool record)
 		Log(LOGERR,"Insane value %lf for actuator %s", value, a->name);
 		return;
 	}
+	struct timespec before;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	uint64_t trace = Trace_Begin();
 	if (!(a->set(a->user_id, value)))
 	{
 		Fatal("Failed to set actuator %s to %lf", a->name, value);
 	}
+	Trace_End(trace, "Actuator_Set", a->name, a->id);
 
 	// Set time stamp
 	struct timespec t;
 	clock_gettime(CLOCK_MONOTONIC, &t);
+	Metrics_Observe(METRIC_ACTUATOR_SET_DURATION, a->id, TIMEVAL_DIFF(t, before));
 	DataPoint d = {TIMEVAL_DIFF(t, *Control_GetStartTime()), a->last_setting.value};
 	// Record value change
 	if (record)
@@ -298,7 +531,7 @@ void Actuator_BeginResponse(FCGIContext * context, Actuator * a, DataFormat form
 			FCGI_JSONPair("name", a->name);
 			break;
 		default:
-			FCGI_PrintRaw("Content-type: text/plain\r\n\r\n");
+			FCGI_BeginBody(context, "text/plain", true);
 			break;
 	}
 }
@@ -323,6 +556,49 @@ void Actuator_EndResponse(FCGIContext * context, Actuator * a, DataFormat format
 }
 
 
+/**
+ * Check that every value of an open loop control is sane, before any of them are set
+ * @param a - The Actuator
+ * @param w - The values; freed if they aren't sane
+ * @returns true if the values are sane
+ */
+static bool Actuator_SanityAll(Actuator * a, Waveform * w)
+{
+	for (int i = 0; a->sanity != NULL && i <= w->length; ++i)
+	{
+		if (!a->sanity(a->user_id, w->values[i]))
+		{
+			Log(LOGDEBUG, "Insane value %lf at step %d of control for actuator %s", w->values[i], i, a->name);
+			Waveform_Free(w);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Helper: Add the timing of an Actuator's current control to a JSON response
+ * @param a - The Actuator
+ */
+static void Actuator_TimingResponse(Actuator * a)
+{
+	pthread_mutex_lock(&(a->mutex));
+	ActuatorTiming timing = a->timing;
+	pthread_mutex_unlock(&(a->mutex));
+
+	FCGI_JSONLong("steps", timing.steps);
+	FCGI_JSONLong("missed", timing.missed);
+	if (timing.steps > 0)
+	{
+		double mean = timing.sum / timing.steps;
+		FCGI_JSONDouble("lateness_last", timing.last);
+		FCGI_JSONDouble("lateness_mean", mean);
+		FCGI_JSONDouble("lateness_rms", sqrt(timing.sum_squares / timing.steps));
+		FCGI_JSONDouble("lateness_max", timing.max);
+		FCGI_JSONDouble("busy_max", timing.busy_max);
+	}
+}
+
 /**
  * Handle a request for an Actuator
  * @param context - FCGI context
@@ -339,6 +615,14 @@ void Actuator_Handler(FCGIContext * context, char * params)
 	double start_time = 0;
 	double end_time = current_time;
 	char * fmt_str;
+	char * wave = "";
+	double step = WAVEFORM_DEFAULT_STEP;
+	double duration = 0;
+	int cycles = 1;
+	char * feedback = "";
+	ActuatorPID pid = {-1, 0, 0, 0, 0, 0, 0};
+	double rate = ACTUATOR_PID_RATE;
+	char * channel = "output";
 
 	// key/value pairs
 	FCGIValue values[] = {
@@ -347,7 +631,19 @@ void Actuator_Handler(FCGIContext * context, char * params)
 		{"set", &set, FCGI_STRING_T},
 		{"start_time", &start_time, FCGI_DOUBLE_T},
 		{"end_time", &end_time, FCGI_DOUBLE_T},
-		{"format", &fmt_str, FCGI_STRING_T}
+		{"format", &fmt_str, FCGI_STRING_T},
+		{"wave", &wave, FCGI_STRING_T},
+		{"step", &step, FCGI_DOUBLE_T},
+		{"duration", &duration, FCGI_DOUBLE_T},
+		{"cycles", &cycles, FCGI_INT_T},
+		{"feedback", &feedback, FCGI_STRING_T},
+		{"kp", &(pid.kp), FCGI_DOUBLE_T},
+		{"ki", &(pid.ki), FCGI_DOUBLE_T},
+		{"kd", &(pid.kd), FCGI_DOUBLE_T},
+		{"min", &(pid.min), FCGI_DOUBLE_T},
+		{"max", &(pid.max), FCGI_DOUBLE_T},
+		{"rate", &rate, FCGI_DOUBLE_T},
+		{"channel", &channel, FCGI_STRING_T}
 	};
 
 	// enum to avoid the use of magic numbers
@@ -357,7 +653,19 @@ void Actuator_Handler(FCGIContext * context, char * params)
 		SET,
 		START_TIME,
 		END_TIME,
-		FORMAT
+		FORMAT,
+		WAVE,
+		STEP,
+		DURATION,
+		CYCLES,
+		FEEDBACK,
+		KP,
+		KI,
+		KD,
+		MIN,
+		MAX,
+		RATE,
+		CHANNEL
 	} ActuatorParams;
 	
 	// Fill values appropriately
@@ -402,28 +710,89 @@ void Actuator_Handler(FCGIContext * context, char * params)
 	
 
 	DataFormat format = Data_GetFormat(&(values[FORMAT]));
+	DataFile * df = &(a->data_file);
+	if (strcmp(channel, "setpoint") == 0)
+		df = &(a->setpoint_file);
+	else if (strcmp(channel, "measurement") == 0)
+		df = &(a->measurement_file);
+	else if (strcmp(channel, "output") != 0)
+	{
+		FCGI_RejectJSON(context, "Unknown channel; use output, setpoint or measurement");
+		return;
+	}
 
 
 
 
-	if (FCGI_RECEIVED(values[SET].flags))
+	if (FCGI_RECEIVED(values[SET].flags) && FCGI_RECEIVED(values[WAVE].flags))
 	{
-		
-	
-		ActuatorControl c = {0.0, 0.0, 0.0, 0}; // Need to set default values (since we don't require them all)
-		// sscanf returns the number of fields successfully read...
-		int n = sscanf(set, "%lf_%lf_%lf_%d", &(c.start), &(c.stepwait), &(c.stepsize), &(c.steps)); // Set provided values in order
-		if (n != 4)
+		FCGI_RejectJSON(context, "Can't supply both set and wave");
+		return;
+	}
+	if (FCGI_RECEIVED(values[FEEDBACK].flags))
+	{
+		// Closed loop control; set or wave give the setpoints
+		Sensor * s = Sensor_Identify(feedback);
+		if (s == NULL)
 		{
-			//	If the user doesn't provide all 4 values, the Actuator will get set *once* using the first of the provided values
-			//	(see Actuator_Loop)
-			//  Not really a problem if n = 1, but maybe generate a warning for 2 <= n < 4 ?
-			Log(LOGDEBUG, "Only provided %d values (expect %d) for Actuator setting", n, 4);
+			FCGI_RejectJSON(context, "Unknown feedback sensor name");
+			return;
+		}
+		if (!FCGI_RECEIVED(values[SET].flags) && !FCGI_RECEIVED(values[WAVE].flags))
+		{
+			FCGI_RejectJSON(context, "Closed loop control needs a setpoint (set or wave)");
+			return;
 		}
-		// SANITY CHECKS
-		if (c.stepwait < 0 || c.steps < 0 || (a->sanity != NULL && !a->sanity(a->user_id, c.start)))
+		if (!FCGI_RECEIVED(values[MIN].flags) || !FCGI_RECEIVED(values[MAX].flags) || !(pid.min < pid.max)
+			|| (a->sanity != NULL && (!a->sanity(a->user_id, pid.min) || !a->sanity(a->user_id, pid.max))))
 		{
-			FCGI_RejectJSON(context, "Bad Actuator setting");
+			FCGI_RejectJSON(context, "Closed loop control needs sane output limits (min and max)");
+			return;
+		}
+		if (!(rate > 0 && rate <= ACTUATOR_PID_MAX_RATE))
+		{
+			FCGI_RejectJSON(context, "Invalid closed loop control rate");
+			return;
+		}
+		pid.sensor = s->id;
+		pid.period = 1.0 / rate;
+	}
+
+	if (FCGI_RECEIVED(values[SET].flags) || FCGI_RECEIVED(values[WAVE].flags))
+	{
+		ActuatorControl c = {.pid = pid};
+		if (FCGI_RECEIVED(values[SET].flags))
+		{
+			double start = 0.0, stepwait = 0.0, stepsize = 0.0;
+			int steps = 0; // Need to set default values (since we don't require them all)
+			// sscanf returns the number of fields successfully read...
+			int n = sscanf(set, "%lf_%lf_%lf_%d", &start, &stepwait, &stepsize, &steps); // Set provided values in order
+			if (n != 4)
+			{
+				//	If the user doesn't provide all 4 values, the Actuator will get set *once* using the first of the provided values
+				//	(see Actuator_Loop)
+				//  Not really a problem if n = 1, but maybe generate a warning for 2 <= n < 4 ?
+				Log(LOGDEBUG, "Only provided %d values (expect %d) for Actuator setting", n, 4);
+			}
+			if (!Waveform_Steps(&(c.wave), start, stepwait, stepsize, steps))
+			{
+				FCGI_RejectJSON(context, "Bad Actuator setting");
+				return;
+			}
+		}
+		else
+		{
+			const char * error;
+			if (!Waveform_Parse(&(c.wave), wave, step, duration, cycles, &error))
+			{
+				FCGI_RejectJSON(context, error);
+				return;
+			}
+		}
+		// Setpoints of closed loop control aren't values of the actuator
+		if (pid.sensor < 0 && !Actuator_SanityAll(a, &(c.wave)))
+		{
+			FCGI_RejectJSON(context, FCGI_RECEIVED(values[SET].flags) ? "Bad Actuator setting" : "Waveform has values the actuator can't be set to");
 			return;
 		}
 		Actuator_SetControl(a, &c);
@@ -432,10 +801,18 @@ void Actuator_Handler(FCGIContext * context, char * params)
 	// Begin response
 	Actuator_BeginResponse(context, a, format);
 	if (format == JSON)
+	{
 		FCGI_JSONPair("set", set);
+		if (FCGI_RECEIVED(values[WAVE].flags))
+			FCGI_JSONPair("wave", wave);
+		if (FCGI_RECEIVED(values[FEEDBACK].flags))
+			FCGI_JSONPair("feedback", feedback);
+		FCGI_JSONPair("channel", channel);
+		Actuator_TimingResponse(a);
+	}
 
 	// Print Data
-	Data_Handler(&(a->data_file), &(values[START_TIME]), &(values[END_TIME]), format, current_time);
+	Data_Handler(df, &(values[START_TIME]), &(values[END_TIME]), format, current_time);
 	
 	// Finish response
 	Actuator_EndResponse(context, a, format);
@@ -9,6 +9,7 @@
 #include "common.h"
 #include "data.h"
 #include "device.h"
+#include "waveform.h"
 
 
 /** 
@@ -18,26 +19,61 @@
 #define ACTUATORS_MAX 5
 extern int g_num_actuators; // in actuator.c
 
+/** Default rate of closed loop control (Hz) **/
+#define ACTUATOR_PID_RATE 200
+/** Highest rate of closed loop control (Hz) **/
+#define ACTUATOR_PID_MAX_RATE 2000
+/** Closed loop control sets the output to its minimum if the measurement is older than this (s) **/
+#define ACTUATOR_PID_TIMEOUT 1.0
 
 
-/** Control structure for Actuator setting **/
+/** Parameters for closed loop (PID) control **/
 typedef struct
 {
-	//TODO: Add functionality as needed
-	// Currently implements a simple piecewise step increase
-	// Would be cool to have a function specified as a string... eg: "1.0 + 0.5*s^2" with "s" the step number, and then give "stepwait" and "steps"
-	//	... But that, like so many things, is probably overkill
-	/** Current value of Actuator **/
-	double start;
-	/** Time to maintain Actuator at each value **/
-	double stepwait;
-	/**	Amount to increase/decrease Actuator on each step **/
-	double stepsize;
-	/** Number of steps still to perform **/
-	int steps; // Note that after it is first set, this will be decremented until it is zero
+	/** Sensor id of the measurement; -1 for open loop control **/
+	int sensor;
+	/** Proportional gain **/
+	double kp;
+	/** Integral gain (per s) **/
+	double ki;
+	/** Derivative gain (s) **/
+	double kd;
+	/** Lowest output **/
+	double min;
+	/** Highest output **/
+	double max;
+	/** Time between updates of the output (s) **/
+	double period;
+} ActuatorPID;
 
+/** Control structure for Actuator setting **/
+typedef struct
+{
+	/** Schedule of values to set (see waveform.h); the setpoints, for closed loop control **/
+	Waveform wave;
+	/** Closed loop control (pid.sensor < 0 for open loop) **/
+	ActuatorPID pid;
 } ActuatorControl;
 
+/** Timing of the values set by an Actuator. A value's lateness is how long after its deadline it was set. **/
+typedef struct
+{
+	/** Number of values set **/
+	long steps;
+	/** Number of values skipped because they were overdue **/
+	long missed;
+	/** Lateness of the last value (s) **/
+	double last;
+	/** Greatest lateness (s) **/
+	double max;
+	/** Sum of the lateness of the values (s) **/
+	double sum;
+	/** Sum of the squares of the lateness of the values (s^2) **/
+	double sum_squares;
+	/** Longest time taken by a step, from waking to the value being set (s) **/
+	double busy_max;
+} ActuatorTiming;
+
 typedef struct
 {
 	/** ID number of the actuator **/
@@ -46,17 +82,23 @@ typedef struct
 	int user_id;
 	/** Name **/
 	const char * name;
-	/** Control parameters for the Actuator **/
+	/** Next control for the Actuator; owned by the Actuator until Actuator_Loop takes it **/
 	ActuatorControl control;
+	/** Timing of the current control **/
+	ActuatorTiming timing;
 	/** Flag indicates if ActuatorControl has been changed **/
 	bool control_changed;
 	/** DataFile to store actuator settings **/
 	DataFile data_file;
+	/** DataFile to store setpoints of closed loop control **/
+	DataFile setpoint_file;
+	/** DataFile to store measurements used by closed loop control **/
+	DataFile measurement_file;
 	/** Thread the Actuator is controlled by **/
 	pthread_t thread;
-	/** Mutex around ActuatorControl **/
+	/** Mutex around ActuatorControl and ActuatorTiming **/
 	pthread_mutex_t mutex;
-	/** Used to wake up Actuator control thread **/
+	/** Used to wake up Actuator control thread; uses CLOCK_MONOTONIC **/
 	pthread_cond_t cond;
 	/** Indicates whether the Actuator is running **/
 	bool activated;
@@ -81,7 +123,7 @@ extern void Actuator_SetMode(Actuator * a, ControlModes mode, void *arg);
 
 extern void * Actuator_Loop(void * args); // Main loop for a thread that handles an Actuator
 extern void Actuator_SetValue(Actuator * a, double value, bool record); // Set an actuator by value
-extern void Actuator_SetControl(Actuator * a, ActuatorControl * c); // Set the control for an Actuator
+extern void Actuator_SetControl(Actuator * a, ActuatorControl * c); // Set the control for an Actuator (takes its schedule)
 extern Actuator * Actuator_Identify(const char * str); // Identify a Sensor from a string Id
 
 extern void Actuator_Handler(FCGIContext *context, char * params); // Handle a FCGI request for Actuator control
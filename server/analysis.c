@@ -0,0 +1,164 @@
+/**
+ * @file analysis.c
+ * @brief The image analysis stage. Each analysis runs in its own thread, taking
+ * the latest frame from its camera whenever it is ready for another, and
+ * publishes its results to sensors with the time the frame was captured.
+ * A slow analysis only skips frames; it doesn't hold up the camera, the
+ * other analyses, or any other sensor.
+ */
+
+#include "analysis.h"
+#include "sensor.h"
+#include "trace.h"
+#include "realtime.h"
+
+/** The analyses **/
+static Analysis g_analyses[ANALYSIS_MAX];
+/** Number of analyses **/
+static int g_num_analyses = 0;
+/** Mutex around Analysis::running (the rest is only changed while the analysis is stopped) **/
+static pthread_mutex_t g_analysis_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when analyses stop, so they needn't finish waiting for a missing camera; uses CLOCK_REALTIME **/
+static pthread_cond_t g_analysis_stopped = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Add an analysis. Its sensors must have been added with no read function.
+ * @param name - Human readable name of the analysis
+ * @param camera - Camera to analyse frames from
+ * @param analyse - Function to analyse a frame
+ * @param num_channels - Number of values the analysis produces
+ * @param sensors - Sensor id to publish each value to
+ */
+void Analysis_Add(const char * name, int camera, AnalyseFn analyse, int num_channels, const int * sensors)
+{
+	if (g_num_analyses >= ANALYSIS_MAX)
+		Fatal("Too many analyses; Increase ANALYSIS_MAX from %d in analysis.h and recompile", ANALYSIS_MAX);
+	if (num_channels > ANALYSIS_CHANNELS_MAX)
+		Fatal("Analysis %s has too many channels (%d, limit %d)", name, num_channels, ANALYSIS_CHANNELS_MAX);
+
+	Analysis * a = &(g_analyses[g_num_analyses++]);
+	memset(a, 0, sizeof(Analysis));
+	a->name = name;
+	a->camera = camera;
+	a->analyse = analyse;
+	a->num_channels = num_channels;
+	for (int i = 0; i < num_channels; ++i)
+		a->sensors[i] = sensors[i];
+}
+
+/**
+ * Main loop for an analysis thread
+ * @param arg - Cast to Analysis* - the analysis
+ * @returns NULL
+ */
+static void * Analysis_Loop(void * arg)
+{
+	Analysis * a = (Analysis*)(arg);
+	long seq = 0;
+	bool missing = false;
+	Log(LOGDEBUG, "Analysis %s starts", a->name);
+	Trace_ThreadName("analysis %s", a->name);
+	Realtime_SetRole(REALTIME_VISION);
+
+	while (true)
+	{
+		pthread_mutex_lock(&g_analysis_mutex);
+		bool running = a->running;
+		pthread_mutex_unlock(&g_analysis_mutex);
+		if (!running)
+			break;
+
+		CameraFrame * frame = Camera_WaitFrame(a->camera, seq);
+		if (frame == NULL)
+		{
+			// The camera isn't working; try again when it would next be opened
+			if (!missing)
+				Log(LOGERR, "No frame from camera %d for analysis %s; trying every %d s", a->camera, a->name, CAMERA_RETRY_TIME);
+			missing = true;
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += CAMERA_RETRY_TIME;
+			pthread_mutex_lock(&g_analysis_mutex);
+			while (a->running && pthread_cond_timedwait(&g_analysis_stopped, &g_analysis_mutex, &until) == 0);
+			pthread_mutex_unlock(&g_analysis_mutex);
+			continue;
+		}
+		if (missing)
+			Log(LOGNOTE, "Camera %d is back for analysis %s", a->camera, a->name);
+		missing = false;
+		if (seq > 0)
+			a->skipped += frame->seq - seq - 1;
+		seq = frame->seq;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t trace = Trace_Begin();
+		double values[ANALYSIS_CHANNELS_MAX];
+		unsigned set = a->analyse(frame, values);
+		Trace_End(trace, "Analysis", a->name, seq);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		DataPoint d;
+		d.time_stamp = TIMEVAL_DIFF(frame->time, *Control_GetStartTime());
+		Camera_ReleaseFrame(a->camera, frame);
+
+		a->frames++;
+		a->busy += TIMEVAL_DIFF(end, start);
+		for (int i = 0; i < a->num_channels; ++i)
+		{
+			if (set & (1 << i))
+			{
+				d.value = values[i];
+				Sensor_Push(a->sensors[i], d);
+			}
+		}
+	}
+
+	Log(LOGDEBUG, "Analysis %s finished; %ld frames, %ld skipped, %f ms each", a->name,
+		a->frames, a->skipped, (a->frames > 0) ? 1e3 * a->busy / a->frames : 0);
+	return NULL;
+}
+
+/**
+ * Start or stop all analyses. They run whenever the sensors are recording,
+ * so this must be called after the sensors start, and before they stop.
+ * @param mode - The mode the sensors are changing to
+ */
+void Analysis_SetModeAll(ControlModes mode)
+{
+	for (int i = 0; i < g_num_analyses; ++i)
+	{
+		Analysis * a = &(g_analyses[i]);
+		switch (mode)
+		{
+			case CONTROL_START:
+			case CONTROL_RESUME:
+				a->running = true;
+				if (pthread_create(&(a->thread), NULL, Analysis_Loop, (void*)(a)) != 0)
+					Fatal("Failed to create Analysis_Loop for %s", a->name);
+				break;
+			case CONTROL_PAUSE:
+			case CONTROL_STOP:
+			case CONTROL_EMERGENCY:
+				pthread_mutex_lock(&g_analysis_mutex);
+				bool running = a->running;
+				a->running = false;
+				pthread_cond_broadcast(&g_analysis_stopped);
+				pthread_mutex_unlock(&g_analysis_mutex);
+				//May have been paused before
+				if (running)
+					pthread_join(a->thread, NULL);
+				break;
+			default:
+				Fatal("Unknown control mode: %d", mode);
+		}
+	}
+}
+
+/**
+ * Remove all analyses; they must have been stopped
+ */
+void Analysis_Cleanup()
+{
+	g_num_analyses = 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file analysis.h
+ * @brief Declarations for the image analysis stage, which turns camera frames into sensor values
+ */
+
+#ifndef _ANALYSIS_H
+#define _ANALYSIS_H
+
+#include "common.h"
+#include "image.h"
+
+/** Maximum number of analyses **/
+#define ANALYSIS_MAX 4
+/** Maximum number of sensors an analysis can publish to **/
+#define ANALYSIS_CHANNELS_MAX 4
+
+/**
+ * Function that analyses a frame. It must not keep the frame.
+ * @param frame - The frame
+ * @param values - Set to the value of each channel
+ * @returns Bit mask of the values that were set (bit i for values[i])
+ */
+typedef unsigned (*AnalyseFn)(const CameraFrame * frame, double values[ANALYSIS_CHANNELS_MAX]);
+
+/** An analysis of the frames from a camera **/
+typedef struct
+{
+	/** Human readable name of the analysis **/
+	const char * name;
+	/** Camera to analyse frames from **/
+	int camera;
+	/** Function to analyse a frame **/
+	AnalyseFn analyse;
+	/** Sensor ids to publish each value to **/
+	int sensors[ANALYSIS_CHANNELS_MAX];
+	/** Number of channels **/
+	int num_channels;
+	/** Whether the analysis is running **/
+	bool running;
+	/** Thread the analysis runs in **/
+	pthread_t thread;
+	/** Number of frames analysed **/
+	long frames;
+	/** Number of frames captured while analysing others, and not analysed **/
+	long skipped;
+	/** Total time spent analysing frames (s) **/
+	double busy;
+} Analysis;
+
+/**
+ * Stages of an analysis can be timed by compiling with -DANALYSIS_PROFILE, and defining Analysis_Profile
+ * (as testing/vision does). Otherwise the stages aren't timed at all.
+ */
+#ifdef ANALYSIS_PROFILE
+extern void Analysis_Profile(const char * stage, const struct timespec * start); // Add the time since start to a stage
+#define ANALYSIS_STAGE_START(start) struct timespec start; clock_gettime(CLOCK_MONOTONIC, &start)
+#define ANALYSIS_STAGE_END(stage, start) Analysis_Profile(stage, &start)
+#else
+#define ANALYSIS_STAGE_START(start)
+#define ANALYSIS_STAGE_END(stage, start)
+#endif //ANALYSIS_PROFILE
+
+extern void Analysis_Add(const char * name, int camera, AnalyseFn analyse, int num_channels, const int * sensors);
+extern void Analysis_SetModeAll(ControlModes mode); // Start/stop all analyses with the sensors
+extern void Analysis_Cleanup(); // Remove all analyses
+
+#endif //_ANALYSIS_H
+
+//EOF
@@ -1,17 +1,19 @@
 /**
  * @file bbb_pin.c
  * @brief Implementation of BBB pin control functions and structures
- * On non-beaglebone (actually non-arm) platforms, this code is disabled.
+ * The pin files are accessed through a backend; the real sysfs files on the BBB, or a simulation of them
+ * elsewhere (see pin_sim.c).
+ * The state last written to each pin is shadowed, and only the parts that change are written again.
  * THIS CODE IS NOT THREADSAFE
  */
 
-#define _BBB_PIN_SRC
 #include "bbb_pin.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "options.h"
+#include "pin_sim.h"
 
 /**
  * Structure to represent a GPIO pin
@@ -22,6 +24,11 @@ typedef struct
 	bool initialised;
 	int fd_value;
 	int fd_direction;
+	/** Direction last written; 1 for out, 0 for in, -1 if unknown **/
+	int direction;
+	/** Value last written; -1 if unknown **/
+	int value;
+	PinCounters counters;
 } GPIO_Pin;
 
 /**
@@ -32,6 +39,7 @@ typedef struct
 {
 	bool initialised;
 	int fd_value;
+	PinCounters counters;
 } ADC_Pin;
 
 /**
@@ -42,9 +50,18 @@ typedef struct
 {
 	bool initialised;
 	int fd_run;
-	FILE * file_duty;
-	FILE * file_period;
+	int fd_duty;
+	int fd_period;
 	int fd_polarity;
+	/** 1 if running, 0 if stopped, -1 if unknown **/
+	int running;
+	/** Polarity last written; -1 if unknown **/
+	int polarity;
+	/** Period last written (ns); -1 if unknown **/
+	long period;
+	/** Duty last written (ns); -1 if unknown **/
+	long duty;
+	PinCounters counters;
 } PWM_Pin;
 
 /** Array of GPIO pins **/
@@ -56,6 +73,138 @@ static PWM_Pin g_pwm[PWM_NUM_PINS] = {{0}};
 
 static char g_buffer[BUFSIZ] = {0};
 
+/** open(2) for the sysfs backend **/
+static int Sysfs_Open(const char * path, int flags)
+{
+	return open(path, flags);
+}
+
+/** The real pins, through sysfs **/
+static const PinBackend g_pin_sysfs = {"sysfs", Sysfs_Open, pread, pwrite, close};
+
+/** Backend the pin files are accessed through **/
+#ifdef _BBB
+static const PinBackend * g_pin_backend = &g_pin_sysfs;
+#else
+static const PinBackend * g_pin_backend = &g_pin_sim;
+#endif //_BBB
+
+/**
+ * Select the backend the pin files are accessed through. Must be called before any pins are exported.
+ * @param spec - "sysfs" for the real pins, or "sim" followed by an optional ":" and
+ *		configuration for the simulator (see PinSim_Configure; its items are separated by ';', which
+ *		no value can contain); NULL for PIN_BACKEND_DEFAULT
+ * @returns true if the backend was selected, false if spec isn't valid
+ */
+bool Pin_SetBackend(const char * spec)
+{
+	if (spec == NULL)
+		spec = PIN_BACKEND_DEFAULT;
+
+	for (int i = 0; i < GPIO_NUM_PINS; ++i)
+	{
+		if (g_gpio[i].initialised)
+			AbortBool("Can't change the pin backend after GPIO %d was exported", g_pin_index_to_gpio[i]);
+	}
+	for (int i = 0; i < ADC_NUM_PINS; ++i)
+	{
+		if (g_adc[i].initialised)
+			AbortBool("Can't change the pin backend after ADC %d was exported", i);
+	}
+	for (int i = 0; i < PWM_NUM_PINS; ++i)
+	{
+		if (g_pwm[i].initialised)
+			AbortBool("Can't change the pin backend after PWM %d was exported", i);
+	}
+
+	if (strcmp(spec, g_pin_sysfs.name) == 0)
+	{
+		g_pin_backend = &g_pin_sysfs;
+	}
+	else if (strncmp(spec, g_pin_sim.name, 3) == 0 && (spec[3] == '\0' || spec[3] == ':'))
+	{
+		const char * error = NULL;
+		if (!PinSim_Configure((spec[3] == ':') ? spec + 4 : "", &error))
+			AbortBool("Invalid pin simulator configuration \"%s\" - %s", spec, error);
+		g_pin_backend = &g_pin_sim;
+	}
+	else
+	{
+		AbortBool("Unknown pin backend \"%s\"", spec);
+	}
+	Log(LOGNOTE, "Using the %s pin backend", g_pin_backend->name);
+	return true;
+}
+
+/**
+ * @returns The name of the backend the pin files are accessed through
+ */
+const char * Pin_GetBackend()
+{
+	return g_pin_backend->name;
+}
+
+/**
+ * Write a pin number to an export or unexport file
+ * @param path - The file
+ * @param pin - The pin number
+ * @returns false if the file couldn't be opened. Failing to write is ignored, as it happens
+ *		when the pin is already (un)exported.
+ */
+static bool Pin_WriteExport(const char * path, int pin)
+{
+	int fd = g_pin_backend->open(path, O_WRONLY);
+	if (fd < 0)
+		return false;
+
+	char str[32];
+	int len = snprintf(str, sizeof(str), "%d", pin);
+	if (g_pin_backend->write(fd, str, len, 0) != len)
+		Log(LOGDEBUG, "Writing %d to %s failed - %s", pin, path, strerror(errno));
+	g_pin_backend->close(fd);
+	return true;
+}
+
+/**
+ * Write a value to a pin's sysfs file
+ * @param fd - The file
+ * @param str - The value
+ * @param counters - Counters of the pin
+ * @returns true on success, false otherwise
+ */
+static bool Pin_Write(int fd, const char * str, PinCounters * counters)
+{
+	size_t len = strlen(str);
+	__atomic_fetch_add(&(counters->writes), 1, __ATOMIC_RELAXED);
+	return (g_pin_backend->write(fd, str, len, 0) == (ssize_t)(len));
+}
+
+/**
+ * Write a number to a pin's sysfs file
+ * @param fd - The file
+ * @param value - The number
+ * @param counters - Counters of the pin
+ * @returns true on success, false otherwise
+ */
+static bool Pin_WriteLong(int fd, long value, PinCounters * counters)
+{
+	char str[32];
+	snprintf(str, sizeof(str), "%ld", value);
+	return Pin_Write(fd, str, counters);
+}
+
+/**
+ * Count the writes that didn't have to be made, because the pin was already in the state they would set
+ * @param counters - Counters of the pin
+ * @param unshadowed - Number of writes that would have been made without the shadow state
+ * @param made - Number of writes made
+ */
+static void Pin_Elide(PinCounters * counters, int unshadowed, int made)
+{
+	if (made < unshadowed)
+		__atomic_fetch_add(&(counters->elided), unshadowed - made, __ATOMIC_RELAXED);
+}
+
 /**
  * Maps a GPIO number to an index into g_gpio (only for use in bbb_pin.c)
  * If there is no index for that GPIO number, 128 is returned.
@@ -103,17 +252,14 @@ bool GPIO_Export(int pin)
 
 	// Export the pin
 	sprintf(g_buffer, "%s/export", GPIO_DEVICE_PATH);
-	FILE * file_export = fopen(g_buffer, "w");
-	if (file_export == NULL)
+	if (!Pin_WriteExport(g_buffer, pin))
 	{
 		AbortBool("Couldn't open %s to export GPIO pin %d - %s", g_buffer, pin, strerror(errno));
 	}
-	fprintf(file_export, "%d", pin);	
-	fclose(file_export);
 	
 	// Setup direction file descriptor
 	sprintf(g_buffer, "%s/gpio%d/direction", GPIO_DEVICE_PATH, pin);
-	gpio->fd_direction = open(g_buffer, O_RDWR);
+	gpio->fd_direction = g_pin_backend->open(g_buffer, O_RDWR);
 	if (gpio->fd_direction < 0)
 	{
 		AbortBool("Couldn't open %s for GPIO pin %d - %s", g_buffer, pin, strerror(errno));
@@ -121,13 +267,15 @@ bool GPIO_Export(int pin)
 
 	// Setup value file descriptor
 	sprintf(g_buffer, "%s/gpio%d/value", GPIO_DEVICE_PATH, pin);
-	gpio->fd_value = open(g_buffer, O_RDWR);
+	gpio->fd_value = g_pin_backend->open(g_buffer, O_RDWR);
 	if (gpio->fd_value < 0)
 	{
-		close(gpio->fd_direction);
+		g_pin_backend->close(gpio->fd_direction);
 		AbortBool("Couldn't open %s for GPIO pin %d - %s", g_buffer, pin, strerror(errno));
 	}
 
+	gpio->direction = -1;
+	gpio->value = -1;
 	gpio->initialised = true;
 	Log(LOGDEBUG, "Exported GPIO%d", pin);
 	return true;
@@ -151,22 +299,17 @@ void GPIO_Unexport(int pin)
 	}
 
 	// Close file descriptors
-	close(gpio->fd_value);
-	close(gpio->fd_direction);
+	g_pin_backend->close(gpio->fd_value);
+	g_pin_backend->close(gpio->fd_direction);
 	// Uninitialise this one
 	gpio->initialised = false;
 
 	// Unexport the pin
-	if (g_buffer[0] == '\0')
-		sprintf(g_buffer, "%s/unexport", GPIO_DEVICE_PATH);	
-	FILE * file_export = fopen(g_buffer, "w");
-	if (file_export == NULL)
+	sprintf(g_buffer, "%s/unexport", GPIO_DEVICE_PATH);
+	if (!Pin_WriteExport(g_buffer, pin))
 	{
-		Abort("Couldn't open %s to export GPIO pin %d - %s", g_buffer, pin, strerror(errno));
+		Abort("Couldn't open %s to unexport GPIO pin %d - %s", g_buffer, pin, strerror(errno));
 	}
-
-	fprintf(file_export, "%d", pin);	
-	fclose(file_export);
 }
 
 /**
@@ -191,54 +334,52 @@ bool PWM_Export(int pin)
 
 	// Try export the pin, doesn't matter if it's already exported.
 	sprintf(g_buffer, "%s/export", PWM_DEVICE_PATH);
-	FILE * file_export = fopen(g_buffer, "w");
-	if (file_export == NULL)
+	if (!Pin_WriteExport(g_buffer, pin))
 	{
 		AbortBool("Couldn't open %s to export PWM pin %d - %s", 
 				g_buffer, pin, strerror(errno));
 	}
-	fprintf(file_export, "%d\n", pin);
-	fclose(file_export);
 
 	// Open file descriptors
 	sprintf(g_buffer, "%s/pwm%d/run", PWM_DEVICE_PATH, pin);
-	pwm->fd_run = open(g_buffer, O_WRONLY);
+	pwm->fd_run = g_pin_backend->open(g_buffer, O_WRONLY);
 	if (pwm->fd_run < 0)
 	{
 		AbortBool("Couldn't open %s for PWM%d - %s", g_buffer, pin, strerror(errno));
 	}
 
 	sprintf(g_buffer, "%s/pwm%d/polarity", PWM_DEVICE_PATH, pin);
-	pwm->fd_polarity = open(g_buffer, O_WRONLY);
+	pwm->fd_polarity = g_pin_backend->open(g_buffer, O_WRONLY);
 	if (pwm->fd_polarity < 0)
 	{
-		close(pwm->fd_run);
+		g_pin_backend->close(pwm->fd_run);
 		AbortBool("Couldn't open %s for PWM%d - %s", g_buffer, pin, strerror(errno));
 	}
 
 	sprintf(g_buffer, "%s/pwm%d/period_ns", PWM_DEVICE_PATH, pin);
-	pwm->file_period = fopen(g_buffer, "w");
-	if (pwm->file_period == NULL)
+	pwm->fd_period = g_pin_backend->open(g_buffer, O_WRONLY);
+	if (pwm->fd_period < 0)
 	{
-		close(pwm->fd_run);
-		close(pwm->fd_polarity);
+		g_pin_backend->close(pwm->fd_run);
+		g_pin_backend->close(pwm->fd_polarity);
 		AbortBool("Couldn't open %s for PWM%d - %s", g_buffer, pin, strerror(errno));
 	}
 
 	sprintf(g_buffer, "%s/pwm%d/duty_ns", PWM_DEVICE_PATH, pin);
-	pwm->file_duty = fopen(g_buffer, "w");
-	if (pwm->file_duty == NULL)
+	pwm->fd_duty = g_pin_backend->open(g_buffer, O_WRONLY);
+	if (pwm->fd_duty < 0)
 	{
-		close(pwm->fd_run);
-		close(pwm->fd_polarity);
-		fclose(pwm->file_period);
+		g_pin_backend->close(pwm->fd_run);
+		g_pin_backend->close(pwm->fd_polarity);
+		g_pin_backend->close(pwm->fd_period);
 		AbortBool("Couldn't open %s for PWM%d - %s", g_buffer, pin, strerror(errno));
 	}
 
-	// Don't buffer the streams
-	setbuf(pwm->file_period, NULL);
-	setbuf(pwm->file_duty, NULL);	
-
+	// The state of the PWM isn't known until it is first set
+	pwm->running = -1;
+	pwm->polarity = -1;
+	pwm->period = -1;
+	pwm->duty = -1;
 	pwm->initialised = true;
 	Log(LOGDEBUG, "Exported PWM%d", pin);
 	return true;
@@ -263,24 +404,21 @@ void PWM_Unexport(int pin)
 	}
 
 	// Close the file descriptors
-	close(pwm->fd_polarity);
+	g_pin_backend->close(pwm->fd_polarity);
 	//Stop it, if it's still running
-	pwrite(pwm->fd_run, "0", 1, 0);
-	close(pwm->fd_run);
-	fclose(pwm->file_period);
-	fclose(pwm->file_duty);
+	Pin_Write(pwm->fd_run, "0", &(pwm->counters));
+	g_pin_backend->close(pwm->fd_run);
+	g_pin_backend->close(pwm->fd_period);
+	g_pin_backend->close(pwm->fd_duty);
 
 	pwm->initialised = false;
 
 	// Try unexport the pin, doesn't matter if it's already unexported.
 	sprintf(g_buffer, "%s/unexport", PWM_DEVICE_PATH);
-	FILE * file_unexport = fopen(g_buffer, "w");
-	if (file_unexport == NULL)
+	if (!Pin_WriteExport(g_buffer, pin))
 	{
 		Abort("Couldn't open %s to unexport PWM pin %d - %s", g_buffer, pin, strerror(errno));
 	}
-	fprintf(file_unexport, "%d\n", pin);
-	fclose(file_unexport);
 }
 
 /**
@@ -300,7 +438,7 @@ bool ADC_Export(int pin)
 	}
 
 	sprintf(g_buffer, "%s/in_voltage%d_raw", ADC_DEVICE_PATH, pin);
-	g_adc[pin].fd_value = open(g_buffer, O_RDONLY);
+	g_adc[pin].fd_value = g_pin_backend->open(g_buffer, O_RDONLY);
 	if (g_adc[pin].fd_value <0)
 	{
 		AbortBool("Couldn't open ADC %d device file %s - %s", pin, g_buffer, strerror(errno));
@@ -326,7 +464,7 @@ void ADC_Unexport(int pin)
 		Abort("ADC %d already uninitialised", pin);
 	}
 
-	close(g_adc[pin].fd_value);	
+	g_pin_backend->close(g_adc[pin].fd_value);	
 	g_adc[pin].fd_value = -1;
 	g_adc[pin].initialised = false;
 }
@@ -348,18 +486,32 @@ bool GPIO_Set(int pin, bool value)
 	{
 		AbortBool("GPIO %d is not initialised.", pin);
 	}
-	//Set the pin direction
-	if (pwrite(gpio->fd_direction, "out", 3, 0) != 3)
+	int made = 0;
+	//Set the pin direction; this also sets the value low
+	if (gpio->direction != 1)
 	{
-		AbortBool("Couldn't set GPIO %d direction - %s", pin, strerror(errno));
+		made++;
+		gpio->value = -1;
+		if (!Pin_Write(gpio->fd_direction, "out", &(gpio->counters)))
+		{
+			gpio->direction = -1;
+			AbortBool("Couldn't set GPIO %d direction - %s", pin, strerror(errno));
+		}
+		gpio->direction = 1;
 	}
 
-	char c = value ? '1' : '0';
-	if (pwrite(gpio->fd_value, &c, 1, 0) != 1)
+	if (gpio->value != value)
 	{
-		AbortBool("Couldn't read GPIO %d value - %s", pin, strerror(errno));
+		made++;
+		if (!Pin_Write(gpio->fd_value, value ? "1" : "0", &(gpio->counters)))
+		{
+			gpio->value = -1;
+			AbortBool("Couldn't set GPIO %d value - %s", pin, strerror(errno));
+		}
+		gpio->value = value;
 	}
 
+	Pin_Elide(&(gpio->counters), 2, made);
 	return true;
 }
 
@@ -382,13 +534,24 @@ bool GPIO_Read(int pin, bool *result)
 		AbortBool("GPIO %d is not initialised.", pin);
 	}
 
-	if (pwrite(gpio->fd_direction, "in", 2, 0) != 2)
+	if (gpio->direction != 0)
 	{
-		AbortBool("Couldn't set GPIO %d direction - %s", pin, strerror(errno));
+		gpio->value = -1;
+		if (!Pin_Write(gpio->fd_direction, "in", &(gpio->counters)))
+		{
+			gpio->direction = -1;
+			AbortBool("Couldn't set GPIO %d direction - %s", pin, strerror(errno));
+		}
+		gpio->direction = 0;
+	}
+	else
+	{
+		Pin_Elide(&(gpio->counters), 1, 0);
 	}
 	
 	char c = '0';
-	if (pread(gpio->fd_value, &c, 1, 0) != 1)
+	__atomic_fetch_add(&(gpio->counters.reads), 1, __ATOMIC_RELAXED);
+	if (g_pin_backend->read(gpio->fd_value, &c, 1, 0) != 1)
 	{
 		AbortBool("Couldn't read GPIO %d value - %s", pin, strerror(errno));
 	}
@@ -419,41 +582,90 @@ bool PWM_Set(int pin, bool polarity, long period, long duty)
 		AbortBool("PWM %d is not initialised.", pin);
 	}
 
-	// Have to stop PWM before changing it
-	if (pwrite(pwm->fd_run, "0", 1, 0) != 1)
-	{
-		AbortBool("Couldn't stop PWM %d - %s", pin, strerror(errno));
-	}
-
-	char c = polarity ? '1' : '0';
-	if (pwrite(pwm->fd_polarity, &c, 1, 0) != 1)
-	{
-		AbortBool("Couldn't set PWM %d polarity - %s", pin, strerror(errno));
-	}
-
-	//This must be done first, otherwise period/duty settings can conflict
-	if (fwrite("0", 1, 1, pwm->file_duty) < 1)
-	{
-		AbortBool("Couldn't zero the duty for PWM %d - %s", pin, strerror(errno));
-	}
-
-	if (fprintf(pwm->file_period, "%lu", period) < 0)
-	{
-		AbortBool("Couldn't set period for PWM %d - %s", pin, strerror(errno));
-	}
-
-
-	if (fprintf(pwm->file_duty, "%lu", duty) < 0)
-	{
-		AbortBool("Couldn't set duty cycle for PWM %d - %s", pin, strerror(errno));
+	int made = 0;
+	if (pwm->running == 1 && pwm->polarity == polarity && pwm->period == period)
+	{
+		// Only the duty may have changed, and it can be changed while running
+		if (pwm->duty != duty)
+		{
+			made++;
+			if (!Pin_WriteLong(pwm->fd_duty, duty, &(pwm->counters)))
+			{
+				pwm->duty = -1;
+				AbortBool("Couldn't set duty cycle for PWM %d - %s", pin, strerror(errno));
+			}
+			pwm->duty = duty;
+		}
+		Pin_Elide(&(pwm->counters), 6, made);
+		return true;
 	}
 
-
-	if (pwrite(pwm->fd_run, "1", 1, 0) != 1)
-	{
+	// Have to stop PWM before changing it
+	if (pwm->running != 0)
+	{
+		made++;
+		if (!Pin_Write(pwm->fd_run, "0", &(pwm->counters)))
+		{
+			pwm->running = -1;
+			AbortBool("Couldn't stop PWM %d - %s", pin, strerror(errno));
+		}
+		pwm->running = 0;
+	}
+
+	if (pwm->polarity != polarity)
+	{
+		made++;
+		if (!Pin_Write(pwm->fd_polarity, polarity ? "1" : "0", &(pwm->counters)))
+		{
+			pwm->polarity = -1;
+			AbortBool("Couldn't set PWM %d polarity - %s", pin, strerror(errno));
+		}
+		pwm->polarity = polarity;
+	}
+
+	if (pwm->period != period)
+	{
+		//The duty must be zeroed first, otherwise period/duty settings can conflict
+		if (pwm->duty != 0)
+		{
+			made++;
+			if (!Pin_Write(pwm->fd_duty, "0", &(pwm->counters)))
+			{
+				pwm->duty = -1;
+				AbortBool("Couldn't zero the duty for PWM %d - %s", pin, strerror(errno));
+			}
+			pwm->duty = 0;
+		}
+
+		made++;
+		if (!Pin_WriteLong(pwm->fd_period, period, &(pwm->counters)))
+		{
+			pwm->period = -1;
+			AbortBool("Couldn't set period for PWM %d - %s", pin, strerror(errno));
+		}
+		pwm->period = period;
+	}
+
+	if (pwm->duty != duty)
+	{
+		made++;
+		if (!Pin_WriteLong(pwm->fd_duty, duty, &(pwm->counters)))
+		{
+			pwm->duty = -1;
+			AbortBool("Couldn't set duty cycle for PWM %d - %s", pin, strerror(errno));
+		}
+		pwm->duty = duty;
+	}
+
+	made++;
+	if (!Pin_Write(pwm->fd_run, "1", &(pwm->counters)))
+	{
+		pwm->running = -1;
 		AbortBool("Couldn't start PWM %d - %s", pin, strerror(errno));
 	}
+	pwm->running = 1;
 
+	Pin_Elide(&(pwm->counters), 6, made);
 	return true;
 }
 
@@ -473,10 +685,18 @@ bool PWM_Stop(int pin)
 		AbortBool("PWM %d is not initialised.", pin);
 	}
 
-	if (pwrite(g_pwm[pin].fd_run, "0", 1, 0) != 1)
+	PWM_Pin *pwm = &g_pwm[pin];
+	if (pwm->running == 0)
+	{
+		Pin_Elide(&(pwm->counters), 1, 0);
+		return true;
+	}
+	if (!Pin_Write(pwm->fd_run, "0", &(pwm->counters)))
 	{
+		pwm->running = -1;
 		AbortBool("Couldn't stop PWM %d - %s", pin, strerror(errno));
 	}
+	pwm->running = 0;
 
 	return true;
 }
@@ -500,7 +720,8 @@ bool ADC_Read(int id, int *value)
 		AbortBool("ADC %d is not initialised.", id);
 	}
 
-	if (pread(g_adc[id].fd_value, adc_str, ADC_DIGITS-1, 0) == -1)
+	__atomic_fetch_add(&(g_adc[id].counters.reads), 1, __ATOMIC_RELAXED);
+	if (g_pin_backend->read(g_adc[id].fd_value, adc_str, ADC_DIGITS-1, 0) == -1)
 	{
 		//AbortBool("ADC %d read failed: %s", id, strerror(errno));
 		return false;
@@ -510,9 +731,60 @@ bool ADC_Read(int id, int *value)
 	return true;
 }
 
-#ifndef _BBB
-//For running on systems that are not the BBB
-bool True_Stub(int arg, ...) { return true; }
-bool ADC_Read_Stub(int *val, ...) { *val = 0; return true; }
-bool GPIO_Read_Stub(bool *val, ...) { *val = false; return true; }
-#endif
+/**
+ * Get the counts of system calls made for a pin. These are counted even when the pin isn't exported.
+ * @param type - Type of the pin
+ * @param pin - The GPIO number, or the ADC or PWM pin number
+ * @param counters - Set to the counts
+ * @returns false if the pin number isn't valid
+ */
+bool Pin_GetCounters(PinType type, int pin, PinCounters * counters)
+{
+	PinCounters * c;
+	switch (type)
+	{
+		case PIN_GPIO:
+			if (pin < 0 || pin > GPIO_MAX_NUMBER || g_pin_gpio_to_index[pin] == 128)
+				return false;
+			c = &(g_gpio[g_pin_gpio_to_index[pin]].counters);
+			break;
+		case PIN_ADC:
+			if (pin < 0 || pin >= ADC_NUM_PINS)
+				return false;
+			c = &(g_adc[pin].counters);
+			break;
+		case PIN_PWM:
+			if (pin < 0 || pin >= PWM_NUM_PINS)
+				return false;
+			c = &(g_pwm[pin].counters);
+			break;
+		default:
+			return false;
+	}
+	counters->writes = __atomic_load_n(&(c->writes), __ATOMIC_RELAXED);
+	counters->reads = __atomic_load_n(&(c->reads), __ATOMIC_RELAXED);
+	counters->elided = __atomic_load_n(&(c->elided), __ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Check if a pin is exported
+ * @param type - Type of the pin
+ * @param pin - The GPIO number, or the ADC or PWM pin number
+ * @returns true if the pin is exported, false if it isn't or the pin number isn't valid
+ */
+bool Pin_IsExported(PinType type, int pin)
+{
+	switch (type)
+	{
+		case PIN_GPIO:
+			return (pin >= 0 && pin <= GPIO_MAX_NUMBER && g_pin_gpio_to_index[pin] != 128
+				&& g_gpio[g_pin_gpio_to_index[pin]].initialised);
+		case PIN_ADC:
+			return (pin >= 0 && pin < ADC_NUM_PINS && g_adc[pin].initialised);
+		case PIN_PWM:
+			return (pin >= 0 && pin < PWM_NUM_PINS && g_pwm[pin].initialised);
+		default:
+			return false;
+	}
+}
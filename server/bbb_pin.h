@@ -7,10 +7,65 @@
 #define _BBB_PIN_H
 
 #include "common.h"
+#include <sys/types.h>
 
 #include "bbb_pin_defines.h"
 
-#if defined(_BBB) || defined(_BBB_PIN_SRC)
+/** Types of pin **/
+typedef enum
+{
+	PIN_GPIO,
+	PIN_ADC,
+	PIN_PWM
+} PinType;
+
+/** Counts of the system calls made for a pin **/
+typedef struct
+{
+	/** Number of writes to the pin's files **/
+	long writes;
+	/** Number of reads from the pin's files **/
+	long reads;
+	/** Number of writes not made, because the pin was already in the state they would set **/
+	long elided;
+} PinCounters;
+
+extern bool Pin_GetCounters(PinType type, int pin, PinCounters * counters); // Get the counts of system calls for a pin
+extern bool Pin_IsExported(PinType type, int pin); // Check if a pin is exported
+
+/** Function pointer for opening a file that controls a pin **/
+typedef int (*PinOpenFn)(const char * path, int flags);
+/** Function pointer for reading from a file that controls a pin **/
+typedef ssize_t (*PinReadFn)(int fd, void * buf, size_t count, off_t offset);
+/** Function pointer for writing to a file that controls a pin **/
+typedef ssize_t (*PinWriteFn)(int fd, const void * buf, size_t count, off_t offset);
+/** Function pointer for closing a file that controls a pin **/
+typedef int (*PinCloseFn)(int fd);
+
+/**
+ * The files that control the pins are all accessed through a backend, so that the pins can be
+ * simulated on machines that aren't the BBB. The functions behave like open, pread, pwrite and close.
+ */
+typedef struct
+{
+	/** Name the backend is selected by **/
+	const char * name;
+	PinOpenFn open;
+	PinReadFn read;
+	PinWriteFn write;
+	PinCloseFn close;
+} PinBackend;
+
+/** Backend used if none is selected **/
+#ifdef _BBB
+	#define PIN_BACKEND_DEFAULT "sysfs"
+#else
+	#define PIN_BACKEND_DEFAULT "sim"
+#endif //_BBB
+
+extern bool Pin_SetBackend(const char * spec); // Select the backend; "sysfs" or "sim[:config]"
+extern const char * Pin_GetBackend(); // Name of the backend in use
+
 // Initialise / Deinitialise functions
 extern bool GPIO_Export(int pin);
 extern void GPIO_Unexport(int pin);
@@ -30,33 +85,6 @@ extern bool ADC_Read(int id, int *value);
 extern bool PWM_Set(int pin, bool polarity, long period, long duty); // period and duty are in ns
 extern bool PWM_Stop(int pin);
 
-#else
-//! @cond Doxygen_Suppress
-//Horrible hacks to silence gcc when compiling on systems that are not the BBB
-extern bool True_Stub(int arg, ...);
-extern bool ADC_Read_Stub(int *val, ...);
-extern bool GPIO_Read_Stub(bool *val, ...);
-
-#define GPIO_Export(pin) True_Stub((int)pin)
-#define GPIO_Unexport(pin) (void)0
-
-#define PWM_Export(pin) True_Stub((int)pin)
-#define PWM_Unexport(pin) (void)0
-
-#define ADC_Export(pin) True_Stub((int)pin)
-#define ADC_Unexport(pin) (void)0
-
-#define GPIO_Read(pin, result) GPIO_Read_Stub(result, pin)
-#define GPIO_Set(pin, value) True_Stub((int)pin, value)
-
-#define ADC_Read(id, value) ADC_Read_Stub(value, id)
-
-#define PWM_Set(pin, polarity, period, duty) True_Stub((int)pin, polarity, period, duty)
-#define PWM_Stop(pin) True_Stub((int)pin) 
-//yuck
-//! @endcond
-#endif //_BBB
-
 #endif //_BBB_PIN_H
 
 //EOF
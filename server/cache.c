@@ -0,0 +1,258 @@
+/**
+ * @file cache.c
+ * @brief Bounded LRU cache of formatted response bodies.
+ * Formatting a long DataFile as text is expensive, but the files of finished
+ * experiments never change, so the result of a query on them can be kept.
+ * All functions are thread safe.
+ */
+
+#include "cache.h"
+
+/** The cache; a hash table of entries which are also kept in an LRU list **/
+static struct
+{
+	/** Hash buckets **/
+	CacheEntry * buckets[CACHE_BUCKETS];
+	/** Most recently used entry **/
+	CacheEntry * head;
+	/** Least recently used entry **/
+	CacheEntry * tail;
+	/** Mutex around everything **/
+	pthread_mutex_t mutex;
+	/** Statistics **/
+	CacheStats stats;
+} g_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * FNV-1a hash of a string
+ * @param key - The string
+ * @returns The hash
+ */
+static unsigned long Cache_Hash(const char * key)
+{
+	unsigned long hash = 2166136261UL;
+	while (*key != '\0')
+	{
+		hash ^= (unsigned char)(*key++);
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Free an entry once nothing is using it
+ * @param entry - The entry
+ */
+static void Cache_Unref(CacheEntry * entry)
+{
+	if (--(entry->refcount) > 0)
+		return;
+	free(entry->key);
+	free(entry->data);
+	free(entry);
+}
+
+/**
+ * Take an entry out of the hash table and LRU list. Call with the mutex held.
+ * @param entry - The entry
+ */
+static void Cache_Remove(CacheEntry * entry)
+{
+	CacheEntry ** link = &(g_cache.buckets[entry->hash & (CACHE_BUCKETS-1)]);
+	while (*link != entry)
+		link = &((*link)->chain);
+	*link = entry->chain;
+
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		g_cache.head = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		g_cache.tail = entry->prev;
+
+	g_cache.stats.entries--;
+	g_cache.stats.bytes -= entry->len;
+	Cache_Unref(entry);
+}
+
+/**
+ * Set the memory budget for the cache
+ * @param budget - Maximum total size of cached bodies in bytes; 0 disables caching
+ */
+void Cache_Init(size_t budget)
+{
+	pthread_mutex_lock(&(g_cache.mutex));
+	g_cache.stats.budget = budget;
+	pthread_mutex_unlock(&(g_cache.mutex));
+	Log(LOGDEBUG, "Response cache budget %lu bytes", (unsigned long)budget);
+}
+
+/**
+ * Remove all entries from the cache
+ */
+void Cache_Cleanup()
+{
+	pthread_mutex_lock(&(g_cache.mutex));
+	while (g_cache.head != NULL)
+		Cache_Remove(g_cache.head);
+	pthread_mutex_unlock(&(g_cache.mutex));
+}
+
+/**
+ * Look up an entry in the cache. If found, it is marked as most recently used.
+ * @param key - The key
+ * @returns The entry, which must be returned with Cache_Release, or NULL if not found
+ */
+CacheEntry * Cache_Get(const char * key)
+{
+	unsigned long hash = Cache_Hash(key);
+	pthread_mutex_lock(&(g_cache.mutex));
+
+	CacheEntry * entry = g_cache.buckets[hash & (CACHE_BUCKETS-1)];
+	while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0))
+		entry = entry->chain;
+
+	if (entry != NULL)
+	{
+		// Move to the front of the LRU list
+		if (entry->prev != NULL)
+		{
+			entry->prev->next = entry->next;
+			if (entry->next != NULL)
+				entry->next->prev = entry->prev;
+			else
+				g_cache.tail = entry->prev;
+			entry->prev = NULL;
+			entry->next = g_cache.head;
+			g_cache.head->prev = entry;
+			g_cache.head = entry;
+		}
+		entry->refcount++;
+		g_cache.stats.hits++;
+	}
+	else
+	{
+		g_cache.stats.misses++;
+	}
+
+	pthread_mutex_unlock(&(g_cache.mutex));
+	return entry;
+}
+
+/**
+ * Finish using an entry obtained from Cache_Get
+ * @param entry - The entry
+ */
+void Cache_Release(CacheEntry * entry)
+{
+	pthread_mutex_lock(&(g_cache.mutex));
+	Cache_Unref(entry);
+	pthread_mutex_unlock(&(g_cache.mutex));
+}
+
+/**
+ * Add a body to the cache, evicting least recently used entries to stay within budget.
+ * Replaces any existing entry with the same key.
+ * @param key - The key (copied)
+ * @param data - The body; must have been allocated with malloc, and is owned by the cache after this call
+ * @param len - Length of data in bytes
+ * @param encoding - Content encoding of the body
+ */
+void Cache_Put(const char * key, char * data, size_t len, int encoding)
+{
+	if (len > Cache_MaxEntrySize())
+	{
+		free(data);
+		return;
+	}
+
+	CacheEntry * entry = calloc(1, sizeof(CacheEntry));
+	if (entry == NULL || (entry->key = strdup(key)) == NULL)
+	{
+		Log(LOGWARN, "Couldn't allocate cache entry for %s", key);
+		free(entry);
+		free(data);
+		return;
+	}
+	entry->data = data;
+	entry->len = len;
+	entry->encoding = encoding;
+	entry->hash = Cache_Hash(key);
+	entry->refcount = 1;
+
+	pthread_mutex_lock(&(g_cache.mutex));
+
+	// Replace an existing entry
+	CacheEntry * old = g_cache.buckets[entry->hash & (CACHE_BUCKETS-1)];
+	while (old != NULL && (old->hash != entry->hash || strcmp(old->key, key) != 0))
+		old = old->chain;
+	if (old != NULL)
+		Cache_Remove(old);
+
+	// Make room
+	while (g_cache.tail != NULL && g_cache.stats.bytes + len > g_cache.stats.budget)
+	{
+		Cache_Remove(g_cache.tail);
+		g_cache.stats.evictions++;
+	}
+
+	CacheEntry ** bucket = &(g_cache.buckets[entry->hash & (CACHE_BUCKETS-1)]);
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	entry->next = g_cache.head;
+	if (g_cache.head != NULL)
+		g_cache.head->prev = entry;
+	else
+		g_cache.tail = entry;
+	g_cache.head = entry;
+
+	g_cache.stats.entries++;
+	g_cache.stats.bytes += len;
+	pthread_mutex_unlock(&(g_cache.mutex));
+}
+
+/**
+ * Remove all entries whose key starts with prefix
+ * (eg: the directory of an experiment that is about to be overwritten)
+ * @param prefix - The prefix
+ */
+void Cache_Invalidate(const char * prefix)
+{
+	size_t len = strlen(prefix);
+	pthread_mutex_lock(&(g_cache.mutex));
+	CacheEntry * entry = g_cache.head;
+	while (entry != NULL)
+	{
+		CacheEntry * next = entry->next;
+		if (strncmp(entry->key, prefix, len) == 0)
+			Cache_Remove(entry);
+		entry = next;
+	}
+	pthread_mutex_unlock(&(g_cache.mutex));
+}
+
+/**
+ * @returns The size of the largest body that will be cached.
+ * Bigger bodies would push out too much else to be worth keeping.
+ */
+size_t Cache_MaxEntrySize()
+{
+	pthread_mutex_lock(&(g_cache.mutex));
+	size_t result = g_cache.stats.budget / 4;
+	pthread_mutex_unlock(&(g_cache.mutex));
+	return result;
+}
+
+/**
+ * Get statistics about the cache
+ * @param stats - Filled with the statistics
+ */
+void Cache_GetStats(CacheStats * stats)
+{
+	pthread_mutex_lock(&(g_cache.mutex));
+	*stats = g_cache.stats;
+	pthread_mutex_unlock(&(g_cache.mutex));
+}
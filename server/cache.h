@@ -0,0 +1,65 @@
+/**
+ * @file cache.h
+ * @brief Declarations for the cache of formatted response bodies
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "common.h"
+
+/** Default memory budget for the cache in MiB **/
+#define CACHE_DEFAULT_MB 64
+/** Number of hash buckets in the cache (must be a power of 2) **/
+#define CACHE_BUCKETS 1024
+
+/** A cached response body. Do not modify; obtain with Cache_Get and return with Cache_Release **/
+typedef struct CacheEntry
+{
+	/** Key identifying the response (owned by the entry) **/
+	char * key;
+	/** The body, exactly as it was sent **/
+	char * data;
+	/** Length of data in bytes **/
+	size_t len;
+	/** Content encoding of data (see fastcgi.c) **/
+	int encoding;
+	/** Hash of the key **/
+	unsigned long hash;
+	/** Number of users of the entry (including the cache itself while it is present) **/
+	int refcount;
+	/** Next entry in the same hash bucket **/
+	struct CacheEntry * chain;
+	/** Neighbours in the LRU list; most recently used first **/
+	struct CacheEntry * prev, * next;
+} CacheEntry;
+
+/** Statistics about the cache **/
+typedef struct
+{
+	/** Number of lookups that found an entry **/
+	long hits;
+	/** Number of lookups that didn't **/
+	long misses;
+	/** Number of entries evicted to stay within budget **/
+	long evictions;
+	/** Number of entries present **/
+	long entries;
+	/** Bytes used by entries present **/
+	size_t bytes;
+	/** Memory budget in bytes **/
+	size_t budget;
+} CacheStats;
+
+extern void Cache_Init(size_t budget); // Set the memory budget (0 disables the cache)
+extern void Cache_Cleanup(); // Free all entries
+extern CacheEntry * Cache_Get(const char * key); // Look up an entry
+extern void Cache_Release(CacheEntry * entry); // Finish using an entry from Cache_Get
+extern void Cache_Put(const char * key, char * data, size_t len, int encoding); // Add an entry (takes ownership of data)
+extern void Cache_Invalidate(const char * prefix); // Remove entries with keys starting with prefix
+extern size_t Cache_MaxEntrySize(); // Largest body worth trying to cache
+extern void Cache_GetStats(CacheStats * stats);
+
+#endif //_CACHE_H
+
+//EOF
@@ -7,6 +7,8 @@
 #include "control.h"
 #include "sensor.h"
 #include "actuator.h"
+#include "cache.h"
+#include "timelapse.h"
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -223,6 +225,10 @@ const char* Control_SetMode(ControlModes desired_mode, void * arg)
 						path, strerror(errno));
 					ret = "Couldn't create experiment directory.";
 				} else {
+					// The experiment may be overwriting one whose downloads were cached
+					char prefix[BUFSIZ];
+					snprintf(prefix, BUFSIZ, "%s/", path);
+					Cache_Invalidate(prefix);
 					clock_gettime(CLOCK_MONOTONIC, &(g_controls.start_time));
 				}
 			} else 
@@ -247,6 +253,7 @@ const char* Control_SetMode(ControlModes desired_mode, void * arg)
 	if (ret == NULL) {
 		Actuator_SetModeAll(desired_mode, arg);
 		Sensor_SetModeAll(desired_mode, arg);
+		Timelapse_SetModeAll(desired_mode, arg);
 		if (desired_mode != CONTROL_RESUME)
 			g_controls.current_mode = desired_mode;
 		else
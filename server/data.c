@@ -4,7 +4,75 @@
  */
 
 #include "data.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
 #include <assert.h> //TODO: Remove asserts
+#include <math.h>
+#include <sys/stat.h>
+
+/** State of a chunk of DataPoints being printed in parallel **/
+typedef enum
+{
+	CHUNK_FREE, /** Not in use */
+	CHUNK_QUEUED, /** Waiting for a worker */
+	CHUNK_BUSY, /** Being formatted by a worker */
+	CHUNK_DONE /** Formatted; waiting to be printed */
+} ChunkState;
+
+/** A range of DataPoints formatted as text by a worker **/
+typedef struct
+{
+	/** Index of the first DataPoint **/
+	int start_index;
+	/** Index after the last DataPoint **/
+	int end_index;
+	/** Formatted DataPoints (kept between exports) **/
+	char * text;
+	/** Number of characters in text **/
+	size_t len;
+	/** Size of text **/
+	size_t size;
+	/** State of the chunk **/
+	ChunkState state;
+} DataChunk;
+
+/**
+ * Pool of workers that format large ranges of DataPoints. The chunks of an 
+ * export are handed out in order from a ring, so the memory used is bounded
+ * and they can be printed in order as they finish.
+ */
+static struct
+{
+	/** Number of worker threads (0 if printing in parallel is not worthwhile) **/
+	int num_workers;
+	/** The worker threads **/
+	pthread_t workers[DATA_MAX_WORKERS];
+	/** Ring of chunks; num_chunks are used **/
+	DataChunk chunks[2*DATA_MAX_WORKERS];
+	/** Number of chunks in the ring **/
+	int num_chunks;
+	/** Chunk that the next worker should take **/
+	int next;
+	/** File descriptor of the DataFile being printed **/
+	int fd;
+	/** Format of each DataPoint **/
+	const char * fmt_string;
+	/** Separator between DataPoints **/
+	char separator;
+	/** Mutex around the chunks and the export details **/
+	pthread_mutex_t mutex;
+	/** Signalled when a chunk is queued **/
+	pthread_cond_t queued;
+	/** Signalled when a chunk is done **/
+	pthread_cond_t done;
+	/** Only one export can use the workers at a time **/
+	pthread_mutex_t export_mutex;
+} g_export = {.mutex = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER, 
+		.done = PTHREAD_COND_INITIALIZER, .export_mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/** Ensures the workers are only started once **/
+static pthread_once_t g_export_once = PTHREAD_ONCE_INIT;
 
 /**
  * One off initialisation of DataFile
@@ -30,15 +98,46 @@ void Data_Open(DataFile * df, const char * filename)
 	// Set the filename
  	df->filename = strdup(filename);
 
-	// Set number of DataPoints
- 	df->num_points = 0; 
-
 	// Set file pointer
 	df->file = fopen(filename, "rb+");
 	if (df->file == NULL) df->file = fopen(filename, "wb+");
 	if (df->file == NULL) {
 		Fatal("Error opening DataFile %s - %s", filename, strerror(errno));
 	}
+
+	// Set number of DataPoints from what is already in the file
+	struct stat st;
+	if (fstat(fileno(df->file), &st) != 0) {
+		Fatal("Error getting size of DataFile %s - %s", filename, strerror(errno));
+	}
+	df->num_points = st.st_size / sizeof(DataPoint);
+}
+
+/**
+ * Open an existing DataFile to read it only (eg: from a finished experiment)
+ * @param df - DataFile to open
+ * @param filename - Name of the file
+ * @returns false if the file couldn't be opened
+ */
+bool Data_OpenReadOnly(DataFile * df, const char * filename)
+{
+	assert(filename != NULL);
+	assert(df != NULL);
+
+	struct stat st;
+	df->file = fopen(filename, "rb");
+	if (df->file == NULL)
+		return false;
+	if (fstat(fileno(df->file), &st) != 0)
+	{
+		Log(LOGERR, "Error getting size of DataFile %s - %s", filename, strerror(errno));
+		fclose(df->file);
+		df->file = NULL;
+		return false;
+	}
+	df->filename = strdup(filename);
+	df->num_points = st.st_size / sizeof(DataPoint);
+	return true;
 }
 
 /**
@@ -69,6 +168,7 @@ void Data_Close(DataFile * df)
  */
 void Data_Save(DataFile * df, DataPoint * buffer, int amount)
 {
+	uint64_t trace = Trace_Begin();
 	pthread_mutex_lock(&(df->mutex));
 	assert(df != NULL);
 	assert(buffer != NULL);
@@ -93,6 +193,8 @@ void Data_Save(DataFile * df, DataPoint * buffer, int amount)
 	df->num_points += amount_written;
 
 	pthread_mutex_unlock(&(df->mutex));
+	Metrics_Add(METRIC_DATA_BYTES_WRITTEN, 0, amount_written * sizeof(DataPoint));
+	Trace_End(trace, "Data_Save", NULL, amount_written);
 }
 
 /**
@@ -141,6 +243,247 @@ int Data_Read(DataFile * df, DataPoint * buffer, int index, int amount)
 	return amount_read;
 }
 
+/**
+ * Format a chunk of DataPoints into its text buffer
+ * @param chunk - The chunk to format
+ * @param fd - File descriptor of the DataFile (read with pread, so the file position isn't used)
+ * @param fmt_string - Format of each DataPoint
+ * @param separator - Character between successive DataPoints
+ */
+static void Data_FormatChunk(DataChunk * chunk, int fd, const char * fmt_string, char separator)
+{
+	DataPoint buffer[DATA_AGG_BUFSIZ];
+	int index = chunk->start_index;
+	chunk->len = 0;
+
+	while (index < chunk->end_index)
+	{
+		int amount = chunk->end_index - index;
+		if (amount > DATA_AGG_BUFSIZ)
+			amount = DATA_AGG_BUFSIZ;
+
+		ssize_t amount_read = pread(fd, buffer, amount * sizeof(DataPoint), (off_t)index * sizeof(DataPoint));
+		if (amount_read < (ssize_t)(amount * sizeof(DataPoint)))
+		{
+			Log(LOGERR, "Read %ld bytes instead of %lu at index %d - %s", (long)amount_read, 
+				(unsigned long)(amount * sizeof(DataPoint)), index, strerror(errno));
+			if (amount_read <= 0)
+				break;
+			amount = amount_read / sizeof(DataPoint);
+		}
+
+		for (int i = 0; i < amount; ++i, ++index)
+		{
+			size_t sep = (index != chunk->start_index) ? 1 : 0; // Room for the separator
+			int n = 0;
+			while (chunk->size - chunk->len <= sep || (size_t)(n = snprintf(chunk->text + chunk->len + sep, 
+				chunk->size - chunk->len - sep, fmt_string, buffer[i].time_stamp, buffer[i].value)) 
+				>= chunk->size - chunk->len - sep)
+			{
+				// Not enough room; a chunk is usually the same size as the last, so this is rare
+				size_t size = (chunk->size == 0) ? (size_t)DATA_CHUNK_SIZE * 32 : 2 * chunk->size;
+				char * text = realloc(chunk->text, size);
+				if (text == NULL)
+					Fatal("Couldn't allocate %lu bytes to print DataPoints", (unsigned long)size);
+				chunk->text = text;
+				chunk->size = size;
+			}
+
+			if (sep)
+				chunk->text[chunk->len] = separator;
+			chunk->len += sep + n;
+		}
+	}
+}
+
+/**
+ * Main loop for a thread that formats chunks of DataPoints
+ * @param arg - Unused
+ * @returns Never
+ */
+static void * Data_ExportWorker(void * arg)
+{
+	Trace_ThreadName("export");
+	Realtime_SetRole(REALTIME_EXPORT);
+	pthread_mutex_lock(&(g_export.mutex));
+	while (true)
+	{
+		DataChunk * chunk = &(g_export.chunks[g_export.next]);
+		if (g_export.num_chunks == 0 || chunk->state != CHUNK_QUEUED)
+		{
+			pthread_cond_wait(&(g_export.queued), &(g_export.mutex));
+			continue;
+		}
+
+		chunk->state = CHUNK_BUSY;
+		g_export.next = (g_export.next + 1) % g_export.num_chunks;
+		int fd = g_export.fd;
+		const char * fmt_string = g_export.fmt_string;
+		char separator = g_export.separator;
+		pthread_mutex_unlock(&(g_export.mutex));
+
+		uint64_t trace = Trace_Begin();
+		Data_FormatChunk(chunk, fd, fmt_string, separator);
+		Trace_End(trace, "Data_FormatChunk", NULL, chunk->start_index);
+
+		pthread_mutex_lock(&(g_export.mutex));
+		chunk->state = CHUNK_DONE;
+		pthread_cond_broadcast(&(g_export.done));
+	}
+	return NULL;
+}
+
+/**
+ * Start the workers used to print large ranges, if there is more than one core
+ */
+static void Data_StartWorkers()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 2)
+		return;
+	if (cores > DATA_MAX_WORKERS)
+		cores = DATA_MAX_WORKERS;
+
+	// Workers wait until they are all started
+	pthread_mutex_lock(&(g_export.mutex));
+	for (int i = 0; i < cores; ++i)
+	{
+		if (pthread_create(&(g_export.workers[i]), NULL, Data_ExportWorker, NULL) != 0)
+		{
+			Log(LOGWARN, "Only started %d of %ld export workers - %s", i, cores, strerror(errno));
+			break;
+		}
+		pthread_detach(g_export.workers[i]);
+		g_export.num_workers++;
+	}
+	g_export.num_chunks = 2 * g_export.num_workers;
+	pthread_mutex_unlock(&(g_export.mutex));
+	Log(LOGDEBUG, "Started %d export workers", g_export.num_workers);
+}
+
+/**
+ * Print a large range of DataPoints, formatted by the workers.
+ * The range is split into chunks that are formatted in parallel and printed in order.
+ * @param df - DataFile to print
+ * @param start_index - Index to start at (inclusive)
+ * @param end_index - Index to end at (exclusive)
+ * @param fmt_string - Format of each DataPoint
+ * @param separator - Character between successive DataPoints
+ * @returns false if there are no workers to print with
+ */
+static bool Data_PrintParallel(DataFile * df, int start_index, int end_index, const char * fmt_string, char separator)
+{
+	pthread_once(&g_export_once, Data_StartWorkers);
+	if (g_export.num_workers < 2)
+		return false;
+
+	// Make sure everything up to end_index is in the file, for pread
+	pthread_mutex_lock(&(df->mutex));
+	fflush(df->file);
+	int fd = fileno(df->file);
+	pthread_mutex_unlock(&(df->mutex));
+
+	pthread_mutex_lock(&(g_export.export_mutex));
+	pthread_mutex_lock(&(g_export.mutex));
+	g_export.fd = fd;
+	g_export.fmt_string = fmt_string;
+	g_export.separator = separator;
+	g_export.next = 0;
+
+	int num_chunks = (end_index - start_index + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+	int queued = 0; // Number of chunks queued so far
+	for (int c = 0; c < num_chunks; ++c)
+	{
+		// Keep the ring full
+		while (queued < num_chunks && queued < c + g_export.num_chunks)
+		{
+			DataChunk * chunk = &(g_export.chunks[queued % g_export.num_chunks]);
+			chunk->start_index = start_index + queued * DATA_CHUNK_SIZE;
+			chunk->end_index = chunk->start_index + DATA_CHUNK_SIZE;
+			if (chunk->end_index > end_index)
+				chunk->end_index = end_index;
+			chunk->state = CHUNK_QUEUED;
+			++queued;
+			pthread_cond_signal(&(g_export.queued));
+		}
+		Metrics_Set(METRIC_EXPORT_RING_DEPTH, 0, queued - c);
+
+		DataChunk * chunk = &(g_export.chunks[c % g_export.num_chunks]);
+		if (chunk->state != CHUNK_DONE)
+			Metrics_Add(METRIC_EXPORT_WAITS, 0, 1);
+		while (chunk->state != CHUNK_DONE)
+			pthread_cond_wait(&(g_export.done), &(g_export.mutex));
+		Metrics_Add(METRIC_EXPORT_CHUNKS, 0, 1);
+
+		// Print without holding the mutex; the workers won't touch a done chunk
+		pthread_mutex_unlock(&(g_export.mutex));
+		if (c > 0)
+			FCGI_Write(&separator, 1);
+		FCGI_Write(chunk->text, chunk->len);
+		pthread_mutex_lock(&(g_export.mutex));
+		chunk->state = CHUNK_FREE;
+		Metrics_Set(METRIC_EXPORT_RING_DEPTH, 0, queued - c - 1);
+	}
+
+	pthread_mutex_unlock(&(g_export.mutex));
+	pthread_mutex_unlock(&(g_export.export_mutex));
+	return true;
+}
+
+/**
+ * Print data points between two indexes on this thread
+ * @param df - DataFile to print
+ * @param start_index - Index to start at (inclusive)
+ * @param end_index - Index to end at (exclusive)
+ * @param fmt_string - Format of each DataPoint
+ * @param separator - Character between successive DataPoints
+ */
+static void Data_PrintSerial(DataFile * df, int start_index, int end_index, const char * fmt_string, char separator)
+{
+	DataPoint buffer[DATA_AGG_BUFSIZ]; // Buffer
+	char text[BUFSIZ]; // Formatted DataPoints not yet printed
+	int len = 0; // Number of characters in text
+	int index = start_index;
+
+	// Repeat until all DataPoints are printed
+	while (index < end_index)
+	{
+		// Fill the buffer from the DataFile
+		int amount_read = Data_Read(df, buffer, index, DATA_AGG_BUFSIZ);
+
+		// Print all points in the buffer
+		for (int i = 0; i < amount_read && (index < end_index); ++i)
+		{
+			// Print in large pieces rather than point by point
+			if (len > BUFSIZ - 128)
+			{
+				FCGI_Write(text, len);
+				len = 0;
+			}
+
+			if (index != start_index)
+				text[len++] = separator;
+
+			// Print individual DataPoint
+			int n = snprintf(text + len, BUFSIZ - len, fmt_string, buffer[i].time_stamp, buffer[i].value);
+			if (n >= BUFSIZ - len)
+			{
+				// Absurdly large value; too big to buffer
+				FCGI_Write(text, len);
+				FCGI_PrintRaw(fmt_string, buffer[i].time_stamp, buffer[i].value);
+				n = len = 0;
+			}
+			len += n;
+
+			// Advance the position in the DataFile
+			++index;
+		}
+
+		if (amount_read < DATA_AGG_BUFSIZ) break;
+	}
+	FCGI_Write(text, len);
+}
+
 /**
  * Print data points between two indexes using a given format
  * @param df - DataFile to print
@@ -175,31 +518,19 @@ void Data_PrintByIndexes(DataFile * df, int start_index, int end_index, DataForm
 			break;
 	}
 
-	DataPoint buffer[DATA_BUFSIZ] = {{0}}; // Buffer
-	int index = start_index;
-
-	if (Data_Read(df, buffer, index++, 1) != 1) return;
-	FCGI_PrintRaw(fmt_string, buffer[0].time_stamp, buffer[0].value);
-
-	// Repeat until all DataPoints are printed
-	while (index < end_index || end_index == -1)
+	// Resolve the end of a file that is still being written
+	if (end_index == -1)
 	{
-		// Fill the buffer from the DataFile
-		int amount_read = Data_Read(df, buffer, index, DATA_BUFSIZ);
-
-		// Print all points in the buffer
-		for (int i = 0; i < amount_read && (index < end_index || end_index == -1); ++i)
-		{
-			FCGI_PrintRaw("%c", separator);
-
-			// Print individual DataPoint
-			FCGI_PrintRaw(fmt_string, buffer[i].time_stamp, buffer[i].value);
-
-			// Advance the position in the DataFile
-			++index;
-		}
+		pthread_mutex_lock(&(df->mutex));
+		end_index = df->num_points;
+		pthread_mutex_unlock(&(df->mutex));
+	}
 
-		if (amount_read < DATA_BUFSIZ) break;
+	// Large ranges are formatted on all cores
+	if (end_index - start_index < DATA_MAX_WORKERS * DATA_CHUNK_SIZE
+		|| !Data_PrintParallel(df, start_index, end_index, fmt_string, separator))
+	{
+		Data_PrintSerial(df, start_index, end_index, fmt_string, separator);
 	}
 	
 	switch (format)
@@ -213,6 +544,40 @@ void Data_PrintByIndexes(DataFile * df, int start_index, int end_index, DataForm
 	}
 }
 
+/**
+ * Print part of a DataFile exactly as it is stored.
+ * @param df - DataFile to print
+ * @param start - Offset in bytes to start from (inclusive)
+ * @param end - Offset in bytes to end at (exclusive)
+ */
+void Data_PrintBinary(DataFile * df, long start, long end)
+{
+	assert(df != NULL);
+	assert(start >= 0);
+
+	char buffer[DATA_AGG_BUFSIZ * sizeof(DataPoint)];
+	while (start < end)
+	{
+		size_t amount = (end - start < (long)sizeof(buffer)) ? (size_t)(end - start) : sizeof(buffer);
+
+		pthread_mutex_lock(&(df->mutex));
+		if (fseek(df->file, start, SEEK_SET))
+		{
+			Fatal("Error seeking to offset %ld in DataFile %s - %s", start, df->filename, strerror(errno));
+		}
+		size_t amount_read = fread(buffer, 1, amount, df->file);
+		pthread_mutex_unlock(&(df->mutex));
+
+		if (amount_read == 0)
+		{
+			Log(LOGWARN, "DataFile %s ended at %ld, before %ld", df->filename, start, end);
+			break;
+		}
+		FCGI_Write(buffer, amount_read);
+		start += amount_read;
+	}
+}
+
 /**
  * Print data points between two time stamps using a given format.
  * Prints nothing if the time stamp
@@ -282,6 +647,10 @@ int Data_FindByTime(DataFile * df, double time_stamp, DataPoint * closest)
 		{
 			lower = index;
 		}
+		else
+		{
+			break; // Exact match
+		}
 	}
 
 	// Store closest DataPoint
@@ -363,6 +732,290 @@ DataFormat Data_GetFormat(FCGIValue * fmt)
 	return JSON;
 }
 
+/** Names of the DataStatistics as used in requests and responses **/
+static const char * g_stat_names[STAT_NUM] = {"min", "max", "mean", "std", "count"};
+
+/**
+ * Helper - Convert a comma separated list of statistic names to a DataAggregation
+ * @param str - String to parse (eg: "min,max,mean")
+ * @param agg - DataAggregation to fill; the window is not modified
+ * @returns true on success, false if a name is unknown or repeated
+ */
+bool Data_GetAggregation(const char * str, DataAggregation * agg)
+{
+	char buffer[BUFSIZ];
+	char * save = NULL;
+	snprintf(buffer, BUFSIZ, "%s", str);
+
+	agg->num_stats = 0;
+	for (char * tok = strtok_r(buffer, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+	{
+		int stat = 0;
+		while (stat < STAT_NUM && strcmp(tok, g_stat_names[stat]) != 0)
+			++stat;
+		if (stat == STAT_NUM)
+		{
+			Log(LOGDEBUG, "Unknown statistic \"%s\"", tok);
+			return false;
+		}
+		for (int i = 0; i < agg->num_stats; ++i)
+		{
+			if (agg->stats[i] == stat)
+				return false;
+		}
+		agg->stats[agg->num_stats++] = stat;
+	}
+	return (agg->num_stats > 0);
+}
+
+/**
+ * Running totals for a single window of DataPoints.
+ * Sums are taken relative to the first value in the window, which keeps the
+ * variance from cancelling catastrophically when values are large and the spread small.
+ */
+typedef struct
+{
+	double min;
+	double max;
+	double sum;
+	double sum_sq;
+	double offset;
+	long count;
+} DataAccumulator;
+
+/**
+ * Add a block of DataPoints to the totals for a window.
+ * The loop is split into four independent lanes so that the compiler can keep
+ * the reductions in vector registers without reassociating floating point sums.
+ * @param block - DataPoints to add, all belonging to the same window
+ * @param n - Number of DataPoints in the block
+ * @param acc - Totals for the window
+ */
+static void Data_AggregateBlock(const DataPoint * block, int n, DataAccumulator * acc)
+{
+	if (n <= 0)
+		return;
+
+	if (acc->count == 0)
+	{
+		acc->offset = block[0].value;
+		acc->min = block[0].value;
+		acc->max = block[0].value;
+	}
+
+	const double offset = acc->offset;
+	double lmin[4], lmax[4], lsum[4] = {0}, lsq[4] = {0};
+	for (int k = 0; k < 4; ++k)
+	{
+		lmin[k] = acc->min;
+		lmax[k] = acc->max;
+	}
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		for (int k = 0; k < 4; ++k)
+		{
+			double v = block[i+k].value;
+			double d = v - offset;
+			lmin[k] = (v < lmin[k]) ? v : lmin[k];
+			lmax[k] = (v > lmax[k]) ? v : lmax[k];
+			lsum[k] += d;
+			lsq[k] += d*d;
+		}
+	}
+	for (; i < n; ++i)
+	{
+		double v = block[i].value;
+		double d = v - offset;
+		lmin[0] = (v < lmin[0]) ? v : lmin[0];
+		lmax[0] = (v > lmax[0]) ? v : lmax[0];
+		lsum[0] += d;
+		lsq[0] += d*d;
+	}
+
+	for (int k = 0; k < 4; ++k)
+	{
+		acc->min = (lmin[k] < acc->min) ? lmin[k] : acc->min;
+		acc->max = (lmax[k] > acc->max) ? lmax[k] : acc->max;
+		acc->sum += lsum[k];
+		acc->sum_sq += lsq[k];
+	}
+	acc->count += n;
+}
+
+/**
+ * Print the statistics for a single window
+ * @param time - Start time of the window
+ * @param acc - Totals for the window (count must be > 0)
+ * @param agg - Statistics to print
+ * @param format - The format to use
+ * @param first - Whether this is the first window printed
+ */
+static void Data_PrintWindow(double time, DataAccumulator * acc, DataAggregation * agg, DataFormat format, bool first)
+{
+	double mean = acc->sum / acc->count;
+	double variance = acc->sum_sq / acc->count - mean*mean;
+
+	switch (format)
+	{
+		case JSON:
+			FCGI_PrintRaw(first ? "[%.9f" : ",[%.9f", time);
+			break;
+		default:
+			FCGI_PrintRaw(first ? "%.9f" : "\n%.9f", time);
+			break;
+	}
+
+	char separator = (format == JSON) ? ',' : '\t';
+	for (int i = 0; i < agg->num_stats; ++i)
+	{
+		switch (agg->stats[i])
+		{
+			case STAT_MIN:
+				FCGI_PrintRaw("%c%f", separator, acc->min);
+				break;
+			case STAT_MAX:
+				FCGI_PrintRaw("%c%f", separator, acc->max);
+				break;
+			case STAT_MEAN:
+				FCGI_PrintRaw("%c%f", separator, acc->offset + mean);
+				break;
+			case STAT_STD:
+				FCGI_PrintRaw("%c%f", separator, (variance > 0) ? sqrt(variance) : 0);
+				break;
+			case STAT_COUNT:
+				FCGI_PrintRaw("%c%ld", separator, acc->count);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (format == JSON)
+		FCGI_PrintRaw("]");
+}
+
+/**
+ * Print statistics of the DataPoints in consecutive windows between two time stamps.
+ * Windows start at start_time and are window seconds wide; windows without any
+ * DataPoints are not printed.
+ * @param df - DataFile to aggregate
+ * @param start_time - Time to start from (inclusive)
+ * @param end_time - Time to end at (exclusive)
+ * @param agg - Window width and statistics to print
+ * @param format - The format to use
+ */
+void Data_PrintAggregate(DataFile * df, double start_time, double end_time, DataAggregation * agg, DataFormat format)
+{
+	assert(df != NULL);
+	assert(agg != NULL);
+	assert(agg->window > 0);
+
+	//Clamp boundaries
+	if (start_time < 0)
+		start_time = 0;
+	if (end_time < start_time)
+		end_time = start_time;
+
+	if (format == JSON)
+		FCGI_PrintRaw("[");
+
+	DataPoint buffer[DATA_AGG_BUFSIZ];
+	DataAccumulator acc = {0};
+	double window_start = start_time;
+	bool first = true;
+	bool done = (start_time >= end_time);
+	int index = (start_time > 0) ? Data_FindByTime(df, start_time, NULL) : 0;
+
+	while (!done)
+	{
+		int amount_read = Data_Read(df, buffer, index, DATA_AGG_BUFSIZ);
+		index += amount_read;
+
+		int i = 0;
+		while (i < amount_read)
+		{
+			double t = buffer[i].time_stamp;
+			if (t < start_time)
+			{
+				++i;
+				continue;
+			}
+			if (t >= end_time)
+			{
+				done = true;
+				break;
+			}
+
+			// Move on to the window containing this point
+			if (t >= window_start + agg->window)
+			{
+				if (acc.count > 0)
+				{
+					Data_PrintWindow(window_start, &acc, agg, format, first);
+					first = false;
+				}
+				memset(&acc, 0, sizeof(acc));
+				window_start = start_time + floor((t - start_time) / agg->window) * agg->window;
+			}
+
+			// Find the run of points in the current window and add them all at once
+			double window_end = window_start + agg->window;
+			if (window_end > end_time)
+				window_end = end_time;
+			int j = i + 1;
+			while (j < amount_read && buffer[j].time_stamp < window_end)
+				++j;
+			Data_AggregateBlock(buffer+i, j-i, &acc);
+			i = j;
+		}
+
+		if (amount_read < DATA_AGG_BUFSIZ)
+			break;
+	}
+
+	if (acc.count > 0)
+		Data_PrintWindow(window_start, &acc, agg, format, first);
+
+	if (format == JSON)
+		FCGI_PrintRaw("]");
+}
+
+/**
+ * Helper; handle FCGI response that requires windowed statistics
+ * @param df - DataFile to access
+ * @param start - Info about start_time param
+ * @param end - Info about end_time param
+ * @param agg - Window width and statistics to compute
+ * @param format - Format to print in
+ * @param current_time - Current time
+ */
+void Data_AggregateHandler(DataFile * df, FCGIValue * start, FCGIValue * end, DataAggregation * agg, DataFormat format, double current_time)
+{
+	double start_time = *(double*)(start->value);
+	double end_time = *(double*)(end->value);
+
+	// Wrap times relative to the current time
+	if (start_time < 0)
+		start_time += current_time;
+	if (end_time < 0)
+		end_time += current_time;
+
+	if (format == JSON)
+	{
+		FCGI_JSONDouble("window", agg->window);
+		FCGI_JSONKey("statistics");
+		FCGI_PrintRaw("[\"time\"");
+		for (int i = 0; i < agg->num_stats; ++i)
+			FCGI_PrintRaw(",\"%s\"", g_stat_names[agg->stats[i]]);
+		FCGI_PrintRaw("]");
+		FCGI_JSONKey("data");
+	}
+
+	Data_PrintAggregate(df, start_time, end_time, agg, format);
+}
+
 /**
  * Binary search for index of a double in an array
  * @param value - The value
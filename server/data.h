@@ -8,6 +8,12 @@
 
 /** Size to use for DataPoint buffers (TODO: Optimise) **/
 #define DATA_BUFSIZ 10 
+/** Size of the blocks of DataPoints read when computing aggregates or printing whole files **/
+#define DATA_AGG_BUFSIZ 4096
+/** Number of DataPoints each worker formats at a time when printing large ranges in parallel **/
+#define DATA_CHUNK_SIZE 16384
+/** Maximum number of worker threads that print large ranges **/
+#define DATA_MAX_WORKERS 16
 
 
 #include "common.h"
@@ -28,6 +34,28 @@ typedef enum
 	TSV /** Tab seperated vector */
 } DataFormat;
 
+/** Enum of statistics that can be computed over a window of DataPoints **/
+typedef enum
+{
+	STAT_MIN, /** Minimum value */
+	STAT_MAX, /** Maximum value */
+	STAT_MEAN, /** Arithmetic mean */
+	STAT_STD, /** Standard deviation (population) */
+	STAT_COUNT, /** Number of DataPoints */
+	STAT_NUM /** Number of statistics; not a statistic */
+} DataStatistic;
+
+/** Structure to describe a windowed aggregation query **/
+typedef struct
+{
+	/** Width of each window in seconds **/
+	double window;
+	/** Number of statistics requested **/
+	int num_stats;
+	/** Statistics to print, in the order they were requested **/
+	DataStatistic stats[STAT_NUM];
+} DataAggregation;
+
 /** 
  * Structure to represent a collection of data. 
  * All operations involving this structure are thread safe.
@@ -44,15 +72,20 @@ typedef struct
 
 extern void Data_Init(DataFile * df);  // One off initialisation of DataFile
 extern void Data_Open(DataFile * df, const char * filename); // Open data file
+extern bool Data_OpenReadOnly(DataFile * df, const char * filename); // Open an existing data file to read it
 extern void Data_Close(DataFile * df);
 extern void Data_Save(DataFile * df, DataPoint * buffer, int amount); // Save data to file
 extern int Data_Read(DataFile * df, DataPoint * buffer, int index, int amount); // Retrieve data from file
 extern void Data_PrintByIndexes(DataFile * df, int start_index, int end_index, DataFormat format);  // Print data buffer
 extern void Data_PrintByTimes(DataFile * df, double start_time, double end_time, DataFormat format); // Print data between time values
+extern void Data_PrintBinary(DataFile * df, long start, long end); // Print raw bytes of the file
 extern int Data_FindByTime(DataFile * df, double time_stamp, DataPoint * closest); // Find index of DataPoint with the closest timestamp to that given
 extern double Data_Calibrate(double value, double x[], double y[], int size);
+extern void Data_PrintAggregate(DataFile * df, double start_time, double end_time, DataAggregation * agg, DataFormat format); // Print windowed statistics
 
 extern void Data_Handler(DataFile * df, FCGIValue * start, FCGIValue * end, DataFormat format, double current_time); // Helper; given FCGI params print data
 extern DataFormat Data_GetFormat(FCGIValue * fmt); // Helper; convert human readable format string to DataFormat
+extern void Data_AggregateHandler(DataFile * df, FCGIValue * start, FCGIValue * end, DataAggregation * agg, DataFormat format, double current_time); // Helper; given FCGI params print windowed statistics
+extern bool Data_GetAggregation(const char * str, DataAggregation * agg); // Helper; convert "min,max,..." to a DataAggregation
 
 #endif //_DATAPOINT_H
@@ -12,6 +12,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <zlib.h>
+#include <float.h>
 
 #include "common.h"
 #include "sensor.h"
@@ -22,10 +24,120 @@
 #include "image.h"
 #include "pin_test.h"
 #include "login.h"
+#include "cache.h"
+#include "timelapse.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
 
 /**The time period (in seconds) before the control key expires */
 #define CONTROL_TIMEOUT 180
 
+/**Responses shorter than this (in bytes) are never compressed */
+#define COMPRESS_MIN_SIZE 1024
+
+/**Output is sent to the client in writes of (up to) this many bytes */
+#define OUTPUT_BUFSIZ 65536
+
+/**Size of the blocks that the per-request arena allocates from */
+#define ARENA_BLOCK_SIZE 65536
+
+/** Content encodings that a response body may be sent with **/
+typedef enum {ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_DEFLATE} ContentEncoding;
+
+/** State of the response body for the current request **/
+typedef enum {
+	BODY_HEADERS, /** Still sending headers; nothing is encoded */
+	BODY_PENDING, /** Headers are open; body is held back until we know if it is worth compressing */
+	BODY_IDENTITY, /** Body is being sent as is */
+	BODY_COMPRESSED /** Body is being sent through zlib */
+} BodyState;
+
+/** Result of parsing a Range request header **/
+typedef enum {
+	RANGE_NONE, /** No usable range; send the whole body */
+	RANGE_OK, /** Send the range */
+	RANGE_UNSATISFIABLE /** The range is outside the body */
+} RangeResult;
+
+/**
+ * Output state of the current response (there is only one request thread).
+ * @see FCGI_BeginBody
+ */
+static struct
+{
+	/** Current state of the body **/
+	BodyState state;
+	/** Encoding accepted by the client for this request **/
+	ContentEncoding encoding;
+	/** zlib stream used while BODY_COMPRESSED **/
+	z_stream stream;
+	/** Body held back while BODY_PENDING **/
+	char pending[COMPRESS_MIN_SIZE];
+	/** Number of bytes in pending **/
+	size_t pending_len;
+	/** Key to store the body under in the response cache, or NULL if not caching it **/
+	char * cache_key;
+	/** Copy of the body as sent, for the response cache **/
+	char * capture;
+	/** Number of bytes in capture **/
+	size_t capture_len;
+	/** Size of the capture buffer **/
+	size_t capture_size;
+} g_body;
+
+/** A block of memory in the per-request arena **/
+typedef struct ArenaBlock
+{
+	/** Next block **/
+	struct ArenaBlock * next;
+	/** Number of bytes in data **/
+	size_t size;
+	/** Number of bytes of data allocated **/
+	size_t used;
+	/** The memory **/
+	char data[];
+} ArenaBlock;
+
+/**
+ * Memory for the current request (there is only one request thread). 
+ * Everything is freed at once when the next request starts, and the 
+ * blocks are kept for it, so handling a request doesn't use the heap.
+ * @see FCGI_Alloc
+ */
+static struct
+{
+	/** First block **/
+	ArenaBlock * head;
+	/** Block currently being allocated from **/
+	ArenaBlock * current;
+} g_arena;
+
+/**
+ * Append-only buffer of output not yet sent to the client. 
+ * Normally a whole response is sent with a single write.
+ */
+static struct
+{
+	/** The buffer (OUTPUT_BUFSIZ bytes, allocated once) **/
+	char * data;
+	/** Number of bytes waiting to be sent **/
+	size_t len;
+} g_output;
+
+/** Context of the request loop; other threads may only read the control key through FCGI_CheckControlCookie **/
+static FCGIContext g_context = {0};
+
+/** Protects the control key and timestamp of g_context **/
+static pthread_mutex_t g_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ContentEncoding FCGI_AcceptedEncoding();
+static void FCGI_ETag(const struct stat *st, ContentEncoding encoding, char *buffer, size_t size);
+static bool FCGI_NotModified(FCGIContext *context, const struct stat *st, bool compressible);
+static void FCGI_Emit(const void * data, size_t len);
+static void FCGI_Output(const void * data, size_t len);
+static void FCGI_Flush();
+
 
 
 /**
@@ -33,16 +145,17 @@
  * Also useful for testing that the API is running and identifying the 
  * sensors and actuators present.
  * @param context The context to work in
- * @param params User specified paramters: [actuators, sensors]
+ * @param params User specified paramters: [actuators, sensors, cache]
  */ 
 static void IdentifyHandler(FCGIContext *context, char *params)
 {
-	bool ident_sensors = false, ident_actuators = false;
+	bool ident_sensors = false, ident_actuators = false, ident_cache = false;
 	int i;
 
-	FCGIValue values[2] = {{"sensors", &ident_sensors, FCGI_BOOL_T},
-					 {"actuators", &ident_actuators, FCGI_BOOL_T}};
-	if (!FCGI_ParseRequest(context, params, values, 2))
+	FCGIValue values[3] = {{"sensors", &ident_sensors, FCGI_BOOL_T},
+					 {"actuators", &ident_actuators, FCGI_BOOL_T},
+					 {"cache", &ident_cache, FCGI_BOOL_T}};
+	if (!FCGI_ParseRequest(context, params, values, 3))
 		return;
 
 	FCGI_BeginJSON(context, STATUS_OK);
@@ -91,104 +204,278 @@ static void IdentifyHandler(FCGIContext *context, char *params)
 		FCGI_JSONValue("\n\t}");
 		if (initflag) Actuator_Cleanup();
 	}
+	if (ident_cache) {
+		CacheStats stats;
+		Cache_GetStats(&stats);
+		FCGI_JSONKey("cache");
+		FCGI_JSONValue("{\"hits\" : %ld, \"misses\" : %ld, \"evictions\" : %ld, "
+			"\"entries\" : %ld, \"bytes\" : %lu, \"budget\" : %lu}", stats.hits, stats.misses, 
+			stats.evictions, stats.entries, (unsigned long)stats.bytes, (unsigned long)stats.budget);
+	}
 	FCGI_EndJSON();
 }
 
+/** Describes where the DataFiles for a download come from (sensors or actuators) **/
+typedef struct
+{
+	/** Prefix of the DataFile names in an experiment directory (eg: "sensor") **/
+	const char * kind;
+	/** Number of channels of this kind initialised **/
+	int * num;
+	/** One off initialisation of all channels **/
+	void (*init)();
+	/** Cleanup all channels **/
+	void (*cleanup)();
+	/** Name of a channel **/
+	const char * (*get_name)(int id);
+	/** DataFile of a running channel **/
+	DataFile * (*get_file)(int id);
+} DataSource;
+
+static const DataSource g_sensor_source = {"sensor", &g_num_sensors, 
+	Sensor_Init, Sensor_Cleanup, Sensor_GetName, Sensor_GetFile};
+static const DataSource g_actuator_source = {"actuator", &g_num_actuators, 
+	Actuator_Init, Actuator_Cleanup, Actuator_GetName, Actuator_GetFile};
+
 /**
- * Download TSV of sensor data for particular experiment and sensor.
- * @param context The context to work in
- * @param params The input parameters
+ * Work out which DataPoints a download selects, from either the start_index and
+ * end_index params or the start_time and end_time params
+ * @param df The DataFile to select from
+ * @param values The start_index, end_index, start_time and end_time params, in that order
+ * @param start_index Set to the first DataPoint selected
+ * @param end_index Set to one past the last DataPoint selected
  */
-static void SensorDL_Handler(FCGIContext *context, char *params) {
-	const char *name = "";
-	int id;
-
-	FCGIValue values[2] = {
-		{"name", &name, FCGI_REQUIRED(FCGI_STRING_T)},
-		{"id", &id, FCGI_REQUIRED(FCGI_INT_T)}
-	};
+static void DataDL_Select(DataFile * df, FCGIValue values[4], int * start_index, int * end_index)
+{
+	pthread_mutex_lock(&(df->mutex));
+		int num_points = df->num_points;
+	pthread_mutex_unlock(&(df->mutex));
 
-	if (!FCGI_ParseRequest(context, params, values, 2))
-		return;
+	if (FCGI_RECEIVED(values[2].flags) || FCGI_RECEIVED(values[3].flags))
+	{
+		double start_time = *(double*)(values[2].value);
+		double end_time = *(double*)(values[3].value);
+		if (start_time < 0)
+			start_time = 0;
+
+		*start_index = FCGI_RECEIVED(values[2].flags) ? Data_FindByTime(df, start_time, NULL) : 0;
+		*end_index = num_points;
+		if (FCGI_RECEIVED(values[3].flags))
+			*end_index = (end_time > start_time) ? Data_FindByTime(df, end_time, NULL) : *start_index;
+	}
+	else
+	{
+		*start_index = FCGI_RECEIVED(values[0].flags) ? *(int*)(values[0].value) : 0;
+		*end_index = FCGI_RECEIVED(values[1].flags) ? *(int*)(values[1].value) : num_points;
+	}
 
-	if ((strcmp(Control_GetExpName(), name) == 0) && (g_num_sensors != 0)) {
-		DataFile * df;
-		df = Sensor_GetFile(id);
-	
-		FCGI_PrintRaw("Content-Type:application/x-download\n");
-		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.tsv\n\n", Sensor_GetName(id));
-		
-		Data_PrintByIndexes(df, 0, df->num_points, TSV);
-	} else {
-		DataFile df;
-		Data_Init(&df);
+	// Clamp boundaries
+	if (*end_index > num_points)
+		*end_index = num_points;
+	if (*start_index > *end_index)
+		*start_index = *end_index;
+}
 
-		char filename[BUFSIZ];
-		int ret;
+/**
+ * Parse the Range request header for a single byte range
+ * (Multiple ranges are not supported; the whole body is sent instead)
+ * @param header The value of the Range header
+ * @param size Size in bytes of the whole body
+ * @param start Set to the first byte of the range
+ * @param end Set to one past the last byte of the range
+ * @return Whether the range can be satisfied
+ */
+static RangeResult FCGI_ParseRange(const char * header, long size, long * start, long * end)
+{
+	long first, last;
+	int length = 0;
 
-		ret = snprintf(filename, BUFSIZ, "%s/%s.exp/sensor_%d", context->user_dir, name, id);
+	if (strncmp(header, "bytes=", 6) != 0 || strchr(header, ',') != NULL)
+		return RANGE_NONE;
+	header += 6;
 
-		if (ret >= BUFSIZ) {
-			FCGI_RejectJSON(context, "File path too long. Check experiment name.");
-			return;
-		}
+	if (sscanf(header, "-%ld%n", &last, &length) == 1 && header[length] == '\0')
+	{
+		// Suffix; the last bytes of the body
+		if (last <= 0 || size == 0)
+			return RANGE_UNSATISFIABLE;
+		*start = (last < size) ? size - last : 0;
+		*end = size;
+	}
+	else if (sscanf(header, "%ld-%n", &first, &length) == 1 && first >= 0)
+	{
+		if (header[length] == '\0')
+			last = size - 1;
+		else if (sscanf(header + length, "%ld%n", &last, &length) != 1 || last < first)
+			return RANGE_NONE;
+
+		if (first >= size)
+			return RANGE_UNSATISFIABLE;
+		*start = first;
+		*end = (last < size) ? last + 1 : size;
+	}
+	else
+	{
+		return RANGE_NONE;
+	}
+	return RANGE_OK;
+}
 
-		struct stat st;
-		int result = stat(filename, &st);
-		if (result != 0) {
-			FCGI_RejectJSON(context, "File does not exist.");
-			return;
+/**
+ * Send selected DataPoints as they are stored (native endianness), honouring
+ * a byte range request. The length is known in advance, so the body is never
+ * compressed and clients can resume or split the download.
+ * @param context The context to work in
+ * @param df The DataFile to send from
+ * @param start_index The first DataPoint to send
+ * @param end_index One past the last DataPoint to send
+ * @param etag ETag of the DataFile, or NULL if it is still being written
+ */
+static void DataDL_SendBinary(FCGIContext *context, DataFile * df, int start_index, int end_index, const char * etag)
+{
+	long offset = (long)start_index * sizeof(DataPoint);
+	long size = (long)(end_index - start_index) * sizeof(DataPoint);
+	long start = 0, end = size;
+	const char * range = getenv("HTTP_RANGE");
+	const char * if_range = getenv("HTTP_IF_RANGE");
+
+	FCGI_PrintRaw("Accept-Ranges: bytes\r\n");
+	// If the client's partial copy is out of date, it needs all of it
+	if (range != NULL && *range != '\0' && (if_range == NULL || (etag != NULL && strcmp(if_range, etag) == 0)))
+	{
+		switch (FCGI_ParseRange(range, size, &start, &end))
+		{
+			case RANGE_UNSATISFIABLE:
+				FCGI_PrintRaw("Content-Range: bytes */%ld\r\n", size);
+				FCGI_PrintRaw("Status: 416 Range Not Satisfiable\r\n\r\n");
+				return;
+			case RANGE_OK:
+				FCGI_PrintRaw("Status: 206 Partial Content\r\n");
+				FCGI_PrintRaw("Content-Range: bytes %ld-%ld/%ld\r\n", start, end - 1, size);
+				break;
+			default:
+				break;
 		}
+	}
 
-		Data_Open(&df, filename);
-
-		bool initflag = false;
-		if ((initflag = (g_num_sensors == 0))) Sensor_Init();
-		FCGI_PrintRaw("Content-Type:application/x-download\n");
-		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.tsv\n\n", Sensor_GetName(id));
-		if (initflag) Sensor_Cleanup();
-
-		Data_PrintByIndexes(&df, 0, -1, TSV);
+	FCGI_PrintRaw("Content-Length: %ld\r\n", end - start);
+	FCGI_BeginBody(context, "application/octet-stream", false);
+	Data_PrintBinary(df, offset + start, offset + end);
+}
 
-		Data_Close(&df);
+/**
+ * Print the body of a text download
+ * @param df The DataFile to print
+ * @param values The start_index, end_index, start_time and end_time params, in that order
+ * @param agg Window and statistics to print, or NULL to print every DataPoint
+ * @param format The format to print in
+ */
+static void DataDL_Print(DataFile * df, FCGIValue values[4], DataAggregation * agg, DataFormat format)
+{
+	if (agg != NULL)
+	{
+		double start_time = *(double*)(values[2].value);
+		double end_time = FCGI_RECEIVED(values[3].flags) ? *(double*)(values[3].value) : DBL_MAX;
+		Data_PrintAggregate(df, start_time, end_time, agg, format);
+	}
+	else
+	{
+		int start_index, end_index;
+		DataDL_Select(df, values, &start_index, &end_index);
+		Data_PrintByIndexes(df, start_index, end_index, format);
 	}
-
-	return;
 }
 
 /**
- * Download TSV of actuator data for particular experiment and actuator.
+ * Download the data of a particular experiment and sensor or actuator.
+ * A range of DataPoints can be selected by index (end exclusive) or by time.
+ * The "bin" format is the DataFile itself, and supports HTTP byte ranges.
+ * Text downloads from finished experiments are kept in the response cache.
  * @param context The context to work in
- * @param params The input parameters
+ * @param params The input parameters: name, id, [format, start_index, end_index, start_time, end_time, agg, window]
+ * @param source Where the data comes from
  */
-static void ActuatorDL_Handler(FCGIContext *context, char *params) {
-	const char *name = "";
-	int id;
-
-	FCGIValue values[2] = {
+static void DataDL_Handler(FCGIContext *context, char *params, const DataSource * source) {
+	const char *name = "", *fmt_str = "tsv", *agg_str = "";
+	int id, start_index = 0, end_index = 0;
+	double start_time = 0, end_time = 0, window = 1.0;
+	DataFormat format = TSV;
+	bool binary = false;
+	DataAggregation agg = {0};
+
+	enum {NAME, ID, FORMAT, START_INDEX, END_INDEX, START_TIME, END_TIME, AGG, WINDOW};
+	FCGIValue values[] = {
 		{"name", &name, FCGI_REQUIRED(FCGI_STRING_T)},
-		{"id", &id, FCGI_REQUIRED(FCGI_INT_T)}
+		{"id", &id, FCGI_REQUIRED(FCGI_INT_T)},
+		{"format", &fmt_str, FCGI_STRING_T},
+		{"start_index", &start_index, FCGI_INT_T},
+		{"end_index", &end_index, FCGI_INT_T},
+		{"start_time", &start_time, FCGI_DOUBLE_T},
+		{"end_time", &end_time, FCGI_DOUBLE_T},
+		{"agg", &agg_str, FCGI_STRING_T},
+		{"window", &window, FCGI_DOUBLE_T}
 	};
 
-	if (!FCGI_ParseRequest(context, params, values, 2))
+	if (!FCGI_ParseRequest(context, params, values, sizeof(values)/sizeof(FCGIValue)))
+		return;
+
+	if (!strcmp(fmt_str, "tsv")) {
+		format = TSV;
+	} else if (!strcmp(fmt_str, "json")) {
+		format = JSON;
+	} else if (!strcmp(fmt_str, "bin")) {
+		binary = true;
+	} else {
+		FCGI_RejectJSON(context, "Unknown format; use tsv, json or bin.");
+		return;
+	}
+
+	bool by_index = FCGI_RECEIVED(values[START_INDEX].flags) || FCGI_RECEIVED(values[END_INDEX].flags);
+	if (by_index && (FCGI_RECEIVED(values[START_TIME].flags) || FCGI_RECEIVED(values[END_TIME].flags))) {
+		FCGI_RejectJSON(context, "Select by either index or time, not both.");
+		return;
+	} else if (by_index && (start_index < 0 || (FCGI_RECEIVED(values[END_INDEX].flags) && end_index < start_index))) {
+		FCGI_RejectJSON(context, "Invalid index range.");
 		return;
+	}
 
-	if ((strcmp(Control_GetExpName(), name) == 0) && (g_num_actuators != 0)) {
-		DataFile * df;
-		df = Actuator_GetFile(id);
+	bool aggregate = FCGI_RECEIVED(values[AGG].flags);
+	if (aggregate) {
+		if (binary || by_index) {
+			FCGI_RejectJSON(context, "Aggregation requires a text format and a time range.");
+			return;
+		} else if (!Data_GetAggregation(agg_str, &agg)) {
+			FCGI_RejectJSON(context, "Invalid aggregation; use a list of min, max, mean, std or count.");
+			return;
+		} else if (!(window > 0)) {
+			FCGI_RejectJSON(context, "The aggregation window must be positive.");
+			return;
+		}
+		agg.window = window;
+	}
+
+	if ((strcmp(Control_GetExpName(), name) == 0) && (*(source->num) != 0)) {
+		// Still being written; can't be cached
+		if (id < 0 || id >= *(source->num)) {
+			FCGI_RejectJSON(context, "Invalid id.");
+			return;
+		}
+		DataFile * df = source->get_file(id);
 	
-		FCGI_PrintRaw("Content-Type:application/x-download\n");
-		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.tsv\n\n", Actuator_GetName(id));
+		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.%s\r\n", source->get_name(id), fmt_str);
+		if (binary) {
+			DataDL_Select(df, values + START_INDEX, &start_index, &end_index);
+			DataDL_SendBinary(context, df, start_index, end_index, NULL);
+			return;
+		}
+		FCGI_BeginBody(context, "application/x-download", true);
 		
-		Data_PrintByIndexes(df, 0, -1, TSV);
+		DataDL_Print(df, values + START_INDEX, aggregate ? &agg : NULL, format);
 	} else {
-		DataFile df;
-		Data_Init(&df);
-
 		char filename[BUFSIZ];
 		int ret;
 
-		ret = snprintf(filename, BUFSIZ, "%s/%s.exp/actuator_%d", context->user_dir, name, id);
+		ret = snprintf(filename, BUFSIZ, "%s/%s.exp/%s_%d", context->user_dir, name, source->kind, id);
 
 		if (ret >= BUFSIZ) {
 			FCGI_RejectJSON(context, "File path too long. Check experiment name.");
@@ -202,20 +489,147 @@ static void ActuatorDL_Handler(FCGIContext *context, char *params) {
 			return;
 		}
 
-		Data_Open(&df, filename);
+		// Finished experiments rarely change; the client may already have it
+		if (FCGI_NotModified(context, &st, !binary))
+			return;
 
 		bool initflag = false;
-		if ((initflag = (g_num_actuators == 0))) Actuator_Init();
-		FCGI_PrintRaw("Content-Type:application/x-download\n");
-		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.tsv\n\n", Actuator_GetName(id));
-		if (initflag) Actuator_Cleanup();
+		if ((initflag = (*(source->num) == 0))) source->init();
+		if (id < 0 || id >= *(source->num)) {
+			if (initflag) source->cleanup();
+			FCGI_RejectJSON(context, "Invalid id.");
+			return;
+		}
+		FCGI_PrintRaw("Content-Disposition: attachment; filename=%s.%s\r\n", source->get_name(id), fmt_str);
+		if (initflag) source->cleanup();
+
+		DataFile df;
+		Data_Init(&df);
+		if (binary) {
+			char etag[BUFSIZ];
+			FCGI_ETag(&st, ENCODING_IDENTITY, etag, BUFSIZ);
+			Data_Open(&df, filename);
+			DataDL_Select(&df, values + START_INDEX, &start_index, &end_index);
+			DataDL_SendBinary(context, &df, start_index, end_index, etag);
+			Data_Close(&df);
+			return;
+		}
 
-		Data_PrintByIndexes(&df, 0, -1, TSV);
+		// Everything that determines the body; the file identity guards against it being replaced
+		char key[2*BUFSIZ];
+		snprintf(key, sizeof(key), "%s|%lx-%lx-%lx|%s|%s%d|%s%d|%s%.17g|%s%.17g|%s|%.17g", filename, 
+			(unsigned long)st.st_ino, (unsigned long)st.st_size, (unsigned long)st.st_mtime, fmt_str,
+			FCGI_RECEIVED(values[START_INDEX].flags) ? "" : "-", start_index,
+			FCGI_RECEIVED(values[END_INDEX].flags) ? "" : "-", end_index,
+			FCGI_RECEIVED(values[START_TIME].flags) ? "" : "-", start_time,
+			FCGI_RECEIVED(values[END_TIME].flags) ? "" : "-", end_time,
+			aggregate ? agg_str : "", aggregate ? window : 0);
+		if (FCGI_CachedBody(context, key, "application/x-download"))
+			return;
 
+		Data_Open(&df, filename);
+		DataDL_Print(&df, values + START_INDEX, aggregate ? &agg : NULL, format);
 		Data_Close(&df);
 	}
+}
 
-	return;
+/**
+ * Download sensor data for particular experiment and sensor.
+ * @param context The context to work in
+ * @param params The input parameters
+ * @see DataDL_Handler
+ */
+static void SensorDL_Handler(FCGIContext *context, char *params) {
+	DataDL_Handler(context, params, &g_sensor_source);
+}
+
+/**
+ * Download actuator data for particular experiment and actuator.
+ * @param context The context to work in
+ * @param params The input parameters
+ * @see DataDL_Handler
+ */
+static void ActuatorDL_Handler(FCGIContext *context, char *params) {
+	DataDL_Handler(context, params, &g_actuator_source);
+}
+
+/**
+ * Make a strong ETag for a file, from its identity, size and modification time,
+ * and the content encoding it is sent with.
+ * @param st The result of stat(2) on the file
+ * @param encoding The content encoding of the body
+ * @param buffer Filled with the ETag (including quotes)
+ * @param size Size of buffer
+ */
+static void FCGI_ETag(const struct stat *st, ContentEncoding encoding, char *buffer, size_t size)
+{
+	snprintf(buffer, size, "\"%lx-%lx-%lx-%lx%s\"", (unsigned long)st->st_dev, (unsigned long)st->st_ino,
+		(unsigned long)st->st_size, (unsigned long)st->st_mtime, 
+		(encoding == ENCODING_GZIP) ? "-gz" : (encoding == ENCODING_DEFLATE) ? "-df" : "");
+}
+
+/**
+ * Sends caching headers for a file that is unlikely to change (ie: from a finished
+ * experiment), then checks whether the client's cached copy is still current.
+ * Clients may keep the file, but must check it with the server before using it,
+ * since a forced restart of an experiment rewrites its files under the same URL;
+ * the check is answered with a 304 unless the file has changed.
+ * Must be called before FCGI_BeginBody.
+ * @param context The context to work in
+ * @param st The result of stat(2) on the file
+ * @param compressible Whether the body will be compressible (see FCGI_BeginBody)
+ * @return true if the client's copy is current; a 304 response has been sent
+ *         and nothing else should be. false if the body should be sent as usual.
+ */
+static bool FCGI_NotModified(FCGIContext *context, const struct stat *st, bool compressible)
+{
+	char etag[BUFSIZ];
+	char last_modified[64];
+	struct tm tm;
+	bool compress = compressible && g_options.compression_level > 0;
+	ContentEncoding encoding = compress ? FCGI_AcceptedEncoding() : ENCODING_IDENTITY;
+
+	FCGI_ETag(st, encoding, etag, BUFSIZ);
+	gmtime_r(&(st->st_mtime), &tm);
+	strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	FCGI_PrintRaw("ETag: %s\r\n", etag);
+	FCGI_PrintRaw("Last-Modified: %s\r\n", last_modified);
+	// Don't let shared caches give one user's data to another if we authenticate
+	FCGI_PrintRaw("Cache-Control: %s, no-cache\r\n", (g_options.auth_method == AUTH_NONE) ? "public" : "private");
+
+	bool not_modified = false;
+	const char * if_none_match = getenv("HTTP_IF_NONE_MATCH");
+	const char * if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
+	if (if_none_match != NULL && *if_none_match != '\0')
+	{
+		// If-None-Match takes precedence over If-Modified-Since
+		not_modified = (strstr(if_none_match, etag) != NULL || strcmp(if_none_match, "*") == 0);
+	}
+	else if (if_modified_since != NULL)
+	{
+		// IMF-fixdate, eg: "Sun, 06 Nov 1994 08:49:37 GMT"
+		static const char * months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+		struct tm since = {0};
+		char month[4] = {0};
+		if (sscanf(if_modified_since, "%*3s, %d %3s %d %d:%d:%d GMT", &(since.tm_mday), month, 
+			&(since.tm_year), &(since.tm_hour), &(since.tm_min), &(since.tm_sec)) == 6
+			&& strlen(month) == 3 && strstr(months, month) != NULL)
+		{
+			since.tm_mon = (strstr(months, month) - months) / 3;
+			since.tm_year -= 1900;
+			not_modified = (timegm(&since) >= st->st_mtime);
+		}
+	}
+
+	if (not_modified)
+	{
+		Log(LOGDEBUG, "%s: Client has current copy %s", context->current_module, etag);
+		if (compress)
+			FCGI_PrintRaw("Vary: Accept-Encoding\r\n");
+		FCGI_PrintRaw("Status: 304 Not Modified\r\n\r\n");
+	}
+	return not_modified;
 }
 
 /**
@@ -241,19 +655,23 @@ bool FCGI_LockControl(FCGIContext *context, const char * user_name, UserType use
 	// Release any existing control (if any)
 	FCGI_ReleaseControl(context);
 
-	// Set timestamp
-	context->control_timestamp = now;
-
 	// Generate a SHA1 hash for the user
 	SHA_CTX sha1ctx;
 	unsigned char sha1[20];
+	char key[CONTROL_KEY_BUFSIZ];
 	i = rand();
 	SHA1_Init(&sha1ctx);
 	SHA1_Update(&sha1ctx, &now, sizeof(now));
 	SHA1_Update(&sha1ctx, &i, sizeof(i));
 	SHA1_Final(sha1, &sha1ctx);
 	for (i = 0; i < sizeof(sha1); i++)
-		sprintf(context->control_key + i * 2, "%02x", sha1[i]);
+		sprintf(key + i * 2, "%02x", sha1[i]);
+
+	// Set the key and timestamp
+	pthread_mutex_lock(&g_control_mutex);
+	context->control_timestamp = now;
+	memcpy(context->control_key, key, sizeof(key));
+	pthread_mutex_unlock(&g_control_mutex);
 
 	// Set the IPv4 address
 	snprintf(context->control_ip, 16, "%s", getenv("REMOTE_ADDR"));
@@ -304,7 +722,9 @@ bool FCGI_HasControl(FCGIContext *context)
 			context->control_key[0] != '\0' &&
 			!strcmp(context->control_key, context->received_key);
 	if (result) {
+		pthread_mutex_lock(&g_control_mutex);
 		context->control_timestamp = now; //Update the control_timestamp
+		pthread_mutex_unlock(&g_control_mutex);
 	}
 	return result;
 }
@@ -316,20 +736,22 @@ bool FCGI_HasControl(FCGIContext *context)
  */
 void FCGI_ReleaseControl(FCGIContext *context)
 {
+	pthread_mutex_lock(&g_control_mutex);
 	*(context->control_key) = 0;
+	pthread_mutex_unlock(&g_control_mutex);
 	// Note: context->user_name should *not* be cleared
 	return;
 }
 
 /**
- * Gets the control cookie
+ * Gets the control key from a cookie string
+ * @param cookies The cookies sent by the client (may be NULL)
  * @param buffer A storage buffer of exactly CONTROL_KEY_BUFSIZ length to
                  store the control key
  */
-void FCGI_GetControlCookie(char buffer[CONTROL_KEY_BUFSIZ])
+static void FCGI_ParseControlCookie(const char * cookies, char buffer[CONTROL_KEY_BUFSIZ])
 {
-	const char *cookies = getenv("COOKIE_STRING");
-	const char *start = strstr(cookies, "mctxkey=");
+	const char *start = cookies ? strstr(cookies, "mctxkey=") : NULL;
 
 	*buffer = 0; //Clear the buffer
 	if (start != NULL) {
@@ -345,6 +767,38 @@ void FCGI_GetControlCookie(char buffer[CONTROL_KEY_BUFSIZ])
 	}
 }
 
+/**
+ * Gets the control cookie
+ * @param buffer A storage buffer of exactly CONTROL_KEY_BUFSIZ length to
+                 store the control key
+ */
+void FCGI_GetControlCookie(char buffer[CONTROL_KEY_BUFSIZ])
+{
+	FCGI_ParseControlCookie(getenv("COOKIE_STRING"), buffer);
+}
+
+/**
+ * Checks if a client has control, from a thread other than the request loop.
+ * As with FCGI_HasControl, a valid key updates the control timestamp.
+ * @param cookies The cookies sent by the client (may be NULL)
+ * @return TRUE if authorized, FALSE if not.
+ */
+bool FCGI_CheckControlCookie(const char * cookies)
+{
+	char key[CONTROL_KEY_BUFSIZ];
+	FCGI_ParseControlCookie(cookies, key);
+
+	time_t now = time(NULL);
+	pthread_mutex_lock(&g_control_mutex);
+	bool result = (now - g_context.control_timestamp) <= CONTROL_TIMEOUT &&
+			g_context.control_key[0] != '\0' &&
+			!strcmp(g_context.control_key, key);
+	if (result)
+		g_context.control_timestamp = now;
+	pthread_mutex_unlock(&g_control_mutex);
+	return result;
+}
+
 /**
  * Sends the control key to the user as a cookie.
  * @param context the context to work in
@@ -352,9 +806,9 @@ void FCGI_GetControlCookie(char buffer[CONTROL_KEY_BUFSIZ])
  */
 void FCGI_SendControlCookie(FCGIContext *context, bool set) {
 	if (set) {
-		printf("Set-Cookie: mctxkey=%s\r\n", context->control_key);
+		FCGI_PrintRaw("Set-Cookie: mctxkey=%s\r\n", context->control_key);
 	} else {
-		printf("Set-Cookie: mctxkey=\r\n");
+		FCGI_PrintRaw("Set-Cookie: mctxkey=\r\n");
 	}
 }
 
@@ -416,7 +870,7 @@ char *FCGI_KeyPair(char *in, const char **key, const char **value)
 bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], size_t count)
 {
 	const char *key, *value;
-	char buf[BUFSIZ], *ptr;
+	char *ptr;
 	size_t i;
 	
 	while ((params = FCGI_KeyPair(params, &key, &value))) {
@@ -425,8 +879,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 				FCGIValue *val = &values[i];
 
 				if (FCGI_RECEIVED(val->flags)) {
-					snprintf(buf, BUFSIZ, "Value already specified for '%s'.", key);
-					FCGI_RejectJSON(context, buf);
+					FCGI_RejectJSON(context, FCGI_Sprintf("Value already specified for '%s'.", key));
 					return false;
 				}
 				val->flags |= FCGI_PARAM_RECEIVED;
@@ -438,8 +891,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 						else {
 							*((bool*) val->value) = !!(strtol(value, &ptr, 10));
 							if (*ptr) {
-								snprintf(buf, BUFSIZ, "Expected bool for '%s' but got '%s'", key, value);
-								FCGI_RejectJSON(context, buf);
+								FCGI_RejectJSON(context, FCGI_Sprintf("Expected bool for '%s' but got '%s'", key, value));
 								return false;
 							}
 						}
@@ -447,8 +899,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 					case FCGI_INT_T: case FCGI_LONG_T: {
 						long parsed = strtol(value, &ptr, 10);
 						if (!*value || *ptr) {
-							snprintf(buf, BUFSIZ, "Expected int for '%s' but got '%s'", key, value);
-							FCGI_RejectJSON(context, buf);
+							FCGI_RejectJSON(context, FCGI_Sprintf("Expected int for '%s' but got '%s'", key, value));
 							return false;
 						}
 
@@ -460,8 +911,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 					case FCGI_DOUBLE_T:
 						*((double*) val->value) = strtod(value, &ptr);
 						if (!*value || *ptr) {
-							snprintf(buf, BUFSIZ, "Expected float for '%s' but got '%s'", key, value);
-							FCGI_RejectJSON(context, buf);
+							FCGI_RejectJSON(context, FCGI_Sprintf("Expected float for '%s' but got '%s'", key, value));
 							return false;
 						}
 						break;
@@ -475,8 +925,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 			}
 		} //End for loop
 		if (i == count) {
-			snprintf(buf, BUFSIZ, "Unknown key '%s' specified", key);
-			FCGI_RejectJSON(context, buf);
+			FCGI_RejectJSON(context, FCGI_Sprintf("Unknown key '%s' specified", key));
 			return false;
 		}
 	}
@@ -484,8 +933,7 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
 	//Check that required parameters are received
 	for (i = 0; i < count; i++) {
 		if (FCGI_IS_REQUIRED(values[i].flags) && !FCGI_RECEIVED(values[i].flags)) {
-			snprintf(buf, BUFSIZ, "Key '%s' required, but was not given.", values[i].key);
-			FCGI_RejectJSON(context, buf);
+			FCGI_RejectJSON(context, FCGI_Sprintf("Key '%s' required, but was not given.", values[i].key));
 			return false;
 		}
 	}
@@ -499,9 +947,10 @@ bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], s
  */
 void FCGI_BeginJSON(FCGIContext *context, StatusCodes status_code)
 {
-	printf("Content-type: application/json; charset=utf-8\r\n\r\n");
-	printf("{\r\n");
-	printf("\t\"module\" : \"%s\"", context->current_module);
+	FCGI_BeginBody(context, "application/json; charset=utf-8", true);
+	FCGI_JSONString("{\r\n\t\"module\" : \"");
+	FCGI_JSONString(context->current_module);
+	FCGI_JSONString("\"");
 	FCGI_JSONLong("status", status_code);
 	//Time and running statistics
 	struct timespec now;
@@ -519,9 +968,10 @@ void FCGI_BeginJSON(FCGIContext *context, StatusCodes status_code)
  */
 void FCGI_AcceptJSON(FCGIContext *context, const char *description)
 {
-	printf("Content-type: application/json; charset=utf-8\r\n");
-	printf("\r\n{\r\n");
-	printf("\t\"module\" : \"%s\"", context->current_module);
+	FCGI_BeginBody(context, "application/json; charset=utf-8", true);
+	FCGI_JSONString("{\r\n\t\"module\" : \"");
+	FCGI_JSONString(context->current_module);
+	FCGI_JSONString("\"");
 	FCGI_JSONLong("status", STATUS_OK);
 	FCGI_JSONPair("description", description);
 	FCGI_EndJSON();
@@ -535,7 +985,10 @@ void FCGI_AcceptJSON(FCGIContext *context, const char *description)
  */
 void FCGI_JSONPair(const char *key, const char *value)
 {
-	printf(",\r\n\t\"%s\" : \"%s\"", key, value);
+	FCGI_JSONKey(key);
+	FCGI_Write("\"", 1);
+	FCGI_JSONString(value);
+	FCGI_Write("\"", 1);
 }
 
 /**
@@ -545,7 +998,20 @@ void FCGI_JSONPair(const char *key, const char *value)
  */
 void FCGI_JSONLong(const char *key, long value)
 {
-	printf(",\r\n\t\"%s\" : %ld", key, value);
+	// Formatted by hand; this is in every response
+	char buffer[32];
+	char * digits = buffer + sizeof(buffer);
+	unsigned long magnitude = (value < 0) ? -(unsigned long)value : (unsigned long)value;
+	do
+	{
+		*(--digits) = '0' + (magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		*(--digits) = '-';
+
+	FCGI_JSONKey(key);
+	FCGI_Write(digits, buffer + sizeof(buffer) - digits);
 }
 
 /**
@@ -555,7 +1021,10 @@ void FCGI_JSONLong(const char *key, long value)
  */
 void FCGI_JSONDouble(const char *key, double value)
 {
-	printf(",\r\n\t\"%s\" : %.9f", key, value);
+	char buffer[BUFSIZ];
+	int len = snprintf(buffer, BUFSIZ, "%.9f", value);
+	FCGI_JSONKey(key);
+	FCGI_Write(buffer, (len < BUFSIZ) ? len : BUFSIZ - 1);
 }
 
 /**
@@ -565,7 +1034,8 @@ void FCGI_JSONDouble(const char *key, double value)
  */
 void FCGI_JSONBool(const char *key, bool value)
 {
-	printf(",\r\n\t\"%s\" : %s", key, value ? "true" : "false");
+	FCGI_JSONKey(key);
+	FCGI_JSONString(value ? "true" : "false");
 }
 
 /**
@@ -575,7 +1045,20 @@ void FCGI_JSONBool(const char *key, bool value)
  */
 void FCGI_JSONKey(const char *key)
 {
-	printf(",\r\n\t\"%s\" : ", key);
+	FCGI_Write(",\r\n\t\"", 5);
+	FCGI_JSONString(key);
+	FCGI_Write("\" : ", 4);
+}
+
+/**
+ * Adds a string to a JSON response as it is. Special characters are not 
+ * escaped (and quotes are not added). Cheaper than FCGI_JSONValue.
+ * @param str The string (NULL is treated as empty)
+ */
+void FCGI_JSONString(const char *str)
+{
+	if (str != NULL)
+		FCGI_Write(str, strlen(str));
 }
 
 /**
@@ -583,7 +1066,7 @@ void FCGI_JSONKey(const char *key)
  */
 void FCGI_EndJSON() 
 {
-	printf("\r\n}\r\n");
+	FCGI_Write("\r\n}\r\n", 5);
 }
 
 /**
@@ -619,10 +1102,26 @@ void FCGI_RejectJSONEx(FCGIContext *context, StatusCodes status, const char *des
  */
 void FCGI_PrintRaw(const char *format, ...)
 {
+	char buffer[BUFSIZ];
 	va_list list;
 	va_start(list, format);
-	vprintf(format, list);
+	int len = vsnprintf(buffer, BUFSIZ, format, list);
 	va_end(list);
+
+	if (len < 0)
+		return;
+	if (len < BUFSIZ)
+	{
+		FCGI_Write(buffer, len);
+		return;
+	}
+
+	// Didn't fit; format again into a big enough buffer
+	char * big = FCGI_Alloc(len + 1);
+	va_start(list, format);
+	vsnprintf(big, len + 1, format, list);
+	va_end(list);
+	FCGI_Write(big, len);
 }
 
 
@@ -633,7 +1132,427 @@ void FCGI_PrintRaw(const char *format, ...)
 void FCGI_WriteBinary(void * data, size_t size, size_t num_elem)
 {
 	Log(LOGDEBUG,"Writing!");
-	fwrite(data, size, num_elem, stdout);
+	FCGI_Write(data, size * num_elem);
+}
+
+/**
+ * Determine the best content encoding that the client accepts, from
+ * the Accept-Encoding request header. gzip is preferred over deflate.
+ * @return The encoding to use
+ */
+static ContentEncoding FCGI_AcceptedEncoding()
+{
+	const char * header = getenv("HTTP_ACCEPT_ENCODING");
+	bool gzip = false, deflate = false;
+	char buffer[BUFSIZ];
+	char * save = NULL;
+
+	if (header == NULL)
+		return ENCODING_IDENTITY;
+
+	snprintf(buffer, BUFSIZ, "%s", header);
+	for (char * tok = strtok_r(buffer, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+	{
+		while (isspace(*tok))
+			++tok;
+
+		// A q value of zero means "not acceptable"
+		char * q = strstr(tok, ";");
+		bool refused = false;
+		if (q != NULL)
+		{
+			*q++ = '\0';
+			q = strstr(q, "q=");
+			refused = (q != NULL && strtod(q + 2, NULL) <= 0);
+		}
+		
+		size_t len = strlen(tok);
+		while (len > 0 && isspace(tok[len-1]))
+			tok[--len] = '\0';
+
+		if (!strcmp(tok, "gzip") || !strcmp(tok, "x-gzip"))
+			gzip = !refused;
+		else if (!strcmp(tok, "deflate"))
+			deflate = !refused;
+	}
+
+	if (gzip)
+		return ENCODING_GZIP;
+	else if (deflate)
+		return ENCODING_DEFLATE;
+	return ENCODING_IDENTITY;
+}
+
+/**
+ * Send output from zlib until it has consumed all of its input
+ * @param flush - zlib flush mode (Z_NO_FLUSH or Z_FINISH)
+ */
+static void FCGI_Deflate(int flush)
+{
+	char out[BUFSIZ];
+	int ret;
+	do
+	{
+		g_body.stream.next_out = (Bytef*)out;
+		g_body.stream.avail_out = BUFSIZ;
+		ret = deflate(&(g_body.stream), flush);
+		if (ret == Z_STREAM_ERROR)
+			Fatal("deflate failed - %s", g_body.stream.msg);
+		FCGI_Emit(out, BUFSIZ - g_body.stream.avail_out);
+	} while (g_body.stream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+/**
+ * Finish the headers and switch to compressing everything written after this.
+ * Falls back to an uncompressed body if zlib can't be initialised.
+ */
+static void FCGI_StartCompression()
+{
+	// gzip adds 16 to the window bits; "deflate" is the zlib format
+	int window_bits = (g_body.encoding == ENCODING_GZIP) ? 15 + 16 : 15;
+	memset(&(g_body.stream), 0, sizeof(g_body.stream));
+	if (deflateInit2(&(g_body.stream), g_options.compression_level, Z_DEFLATED, 
+		window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		Log(LOGERR, "deflateInit2 failed - %s", g_body.stream.msg);
+		FCGI_Output("\r\n", 2);
+		g_body.state = BODY_IDENTITY;
+		return;
+	}
+
+	const char * header = (g_body.encoding == ENCODING_GZIP) ? "Content-Encoding: gzip\r\n\r\n" : "Content-Encoding: deflate\r\n\r\n";
+	FCGI_Output(header, strlen(header));
+	g_body.state = BODY_COMPRESSED;
+}
+
+/**
+ * Write data to the client. Before FCGI_BeginBody is called this writes headers;
+ * after it is called, this writes the body, compressed if appropriate.
+ * @param data The data to write
+ * @param len The number of bytes to write
+ */
+void FCGI_Write(const void * data, size_t len)
+{
+	switch (g_body.state)
+	{
+		case BODY_PENDING:
+			if (g_body.pending_len + len <= COMPRESS_MIN_SIZE)
+			{
+				memcpy(g_body.pending + g_body.pending_len, data, len);
+				g_body.pending_len += len;
+				return;
+			}
+			// Big enough to be worth compressing
+			FCGI_StartCompression();
+			FCGI_Write(g_body.pending, g_body.pending_len);
+			g_body.pending_len = 0;
+			FCGI_Write(data, len);
+			break;
+		case BODY_COMPRESSED:
+			g_body.stream.next_in = (Bytef*)data;
+			g_body.stream.avail_in = len;
+			FCGI_Deflate(Z_NO_FLUSH);
+			break;
+		case BODY_IDENTITY:
+			FCGI_Emit(data, len);
+			break;
+		default:
+			FCGI_Output(data, len);
+			break;
+	}
+}
+
+/**
+ * Queue data to be sent to the client, exactly as it is. 
+ * Data is sent once OUTPUT_BUFSIZ bytes are waiting, or the response is finished.
+ * @param data The data to send
+ * @param len The number of bytes to send
+ */
+static void FCGI_Output(const void * data, size_t len)
+{
+	if (g_output.data == NULL && (g_output.data = malloc(OUTPUT_BUFSIZ)) == NULL)
+		Fatal("Couldn't allocate output buffer");
+
+	if (g_output.len + len > OUTPUT_BUFSIZ)
+	{
+		FCGI_Flush();
+		if (len >= OUTPUT_BUFSIZ)
+		{
+			// No point copying it
+			fwrite(data, 1, len, stdout);
+			return;
+		}
+	}
+	memcpy(g_output.data + g_output.len, data, len);
+	g_output.len += len;
+}
+
+/**
+ * Send any queued output to the client
+ */
+static void FCGI_Flush()
+{
+	if (g_output.len > 0)
+		fwrite(g_output.data, 1, g_output.len, stdout);
+	g_output.len = 0;
+}
+
+/**
+ * Allocate memory that lasts until the end of the current request.
+ * Never fails; there is no need (or way) to free the memory.
+ * Must only be used from the request thread.
+ * @param size The number of bytes to allocate
+ * @return The memory (aligned for any type)
+ */
+void * FCGI_Alloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	ArenaBlock * block = g_arena.current;
+	while (block != NULL && block->used + size > block->size)
+	{
+		// Move on to the next block, which has nothing from this request yet
+		block = block->next;
+		if (block != NULL)
+			block->used = 0;
+	}
+
+	if (block == NULL)
+	{
+		size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(ArenaBlock) + block_size);
+		if (block == NULL)
+			Fatal("Couldn't allocate %lu bytes for request", (unsigned long)block_size);
+		block->next = NULL;
+		block->size = block_size;
+		block->used = 0;
+		if (g_arena.current != NULL)
+		{
+			block->next = g_arena.current->next;
+			g_arena.current->next = block;
+		}
+		else
+		{
+			g_arena.head = block;
+		}
+	}
+
+	g_arena.current = block;
+	void * result = block->data + block->used;
+	block->used += size;
+	return result;
+}
+
+/**
+ * Copy a string into memory that lasts until the end of the current request
+ * @param str The string to copy
+ * @return The copy
+ * @see FCGI_Alloc
+ */
+char * FCGI_StrDup(const char * str)
+{
+	size_t len = strlen(str);
+	char * result = FCGI_Alloc(len + 1);
+	memcpy(result, str, len + 1);
+	return result;
+}
+
+/**
+ * Format a string (exactly like sprintf) into memory that lasts until 
+ * the end of the current request
+ * @param format The format string
+ * @param ... Any extra arguments as required by the format string.
+ * @return The formatted string
+ * @see FCGI_Alloc
+ */
+char * FCGI_Sprintf(const char * format, ...)
+{
+	va_list list;
+	va_start(list, format);
+	int len = vsnprintf(NULL, 0, format, list);
+	va_end(list);
+	if (len < 0)
+		len = 0;
+
+	char * result = FCGI_Alloc(len + 1);
+	va_start(list, format);
+	vsnprintf(result, len + 1, format, list);
+	va_end(list);
+	return result;
+}
+
+/**
+ * Free everything allocated during the last request. Blocks that were 
+ * bigger than normal are given back; the others are kept for the next request.
+ */
+static void FCGI_ResetArena()
+{
+	ArenaBlock ** link = &(g_arena.head);
+	while (*link != NULL)
+	{
+		ArenaBlock * block = *link;
+		if (block->size > ARENA_BLOCK_SIZE)
+		{
+			*link = block->next;
+			free(block);
+			continue;
+		}
+		block->used = 0;
+		link = &(block->next);
+	}
+	g_arena.current = g_arena.head;
+}
+
+/**
+ * Send part of the body exactly as it goes to the client, keeping a
+ * copy if it is to be cached. Gives up on caching bodies that get too big.
+ * @param data The data to send
+ * @param len The number of bytes to send
+ */
+static void FCGI_Emit(const void * data, size_t len)
+{
+	FCGI_Output(data, len);
+	if (g_body.cache_key == NULL || len == 0)
+		return;
+
+	if (g_body.capture_len + len > g_body.capture_size)
+	{
+		size_t size = (g_body.capture_size == 0) ? BUFSIZ : g_body.capture_size;
+		while (size < g_body.capture_len + len)
+			size *= 2;
+		char * capture = NULL;
+		if (size <= Cache_MaxEntrySize())
+			capture = realloc(g_body.capture, size);
+		if (capture == NULL)
+		{
+			// Not worth caching; send the rest without keeping it
+			free(g_body.capture);
+			free(g_body.cache_key);
+			g_body.cache_key = NULL;
+			g_body.capture = NULL;
+			g_body.capture_len = g_body.capture_size = 0;
+			return;
+		}
+		g_body.capture = capture;
+		g_body.capture_size = size;
+	}
+	memcpy(g_body.capture + g_body.capture_len, data, len);
+	g_body.capture_len += len;
+}
+
+/**
+ * Like FCGI_BeginBody (with a compressible body), but first looks for the body
+ * in the response cache. If it is there, the cached body is sent and nothing 
+ * else should be. Otherwise the body that is then written is added to the cache
+ * when the request is finished.
+ * Only use for bodies that depend on nothing but the key (eg: a finished experiment).
+ * @param context The context to work in
+ * @param key Identifies the body; must include everything the body depends on
+ * @param content_type The MIME type of the body
+ * @return true if the body was sent from the cache, false if it must be written
+ */
+bool FCGI_CachedBody(FCGIContext *context, const char *key, const char *content_type)
+{
+	char full_key[BUFSIZ*2];
+	ContentEncoding encoding = (g_options.compression_level > 0) ? FCGI_AcceptedEncoding() : ENCODING_IDENTITY;
+	snprintf(full_key, sizeof(full_key), "%s|%d", key, (int)encoding);
+
+	CacheEntry * entry = Cache_Get(full_key);
+	if (entry == NULL)
+	{
+		FCGI_BeginBody(context, content_type, true);
+		g_body.cache_key = strdup(full_key);
+		return false;
+	}
+
+	Log(LOGDEBUG, "%s: Sending %lu cached bytes", context->current_module, (unsigned long)entry->len);
+	FCGI_PrintRaw("Content-type: %s\r\n", content_type);
+	if (g_options.compression_level > 0)
+		FCGI_PrintRaw("Vary: Accept-Encoding\r\n");
+	if (entry->encoding != ENCODING_IDENTITY)
+		FCGI_PrintRaw("Content-Encoding: %s\r\n", (entry->encoding == ENCODING_GZIP) ? "gzip" : "deflate");
+	FCGI_PrintRaw("\r\n");
+	FCGI_Output(entry->data, entry->len);
+	Cache_Release(entry);
+	return true;
+}
+
+/**
+ * Ends the response headers with a Content-type, and starts the body.
+ * If the body is compressible and the client accepts it, the body is compressed
+ * (unless it turns out to be smaller than COMPRESS_MIN_SIZE).
+ * Any other headers must be sent before calling this.
+ * @param context The context to work in
+ * @param content_type The MIME type of the body
+ * @param compressible Whether the body is worth compressing (ie: not an image)
+ */
+void FCGI_BeginBody(FCGIContext *context, const char *content_type, bool compressible)
+{
+	FCGI_PrintRaw("Content-type: %s\r\n", content_type);
+	if (compressible && g_options.compression_level > 0)
+	{
+		// The response may differ depending on the client, so caches need to know
+		FCGI_PrintRaw("Vary: Accept-Encoding\r\n");
+		g_body.encoding = FCGI_AcceptedEncoding();
+	}
+	else
+	{
+		g_body.encoding = ENCODING_IDENTITY;
+	}
+
+	g_body.pending_len = 0;
+	if (g_body.encoding != ENCODING_IDENTITY)
+	{
+		g_body.state = BODY_PENDING;
+	}
+	else
+	{
+		FCGI_PrintRaw("\r\n");
+		g_body.state = BODY_IDENTITY;
+	}
+}
+
+/**
+ * Finishes the body of the current response; flushes anything held back
+ * or buffered by zlib. Called after each request is handled.
+ */
+static void FCGI_EndBody()
+{
+	switch (g_body.state)
+	{
+		case BODY_PENDING:
+			// Too small to bother compressing
+			FCGI_Output("\r\n", 2);
+			g_body.encoding = ENCODING_IDENTITY;
+			FCGI_Emit(g_body.pending, g_body.pending_len);
+			break;
+		case BODY_COMPRESSED:
+			g_body.stream.next_in = NULL;
+			g_body.stream.avail_in = 0;
+			FCGI_Deflate(Z_FINISH);
+			deflateEnd(&(g_body.stream));
+			break;
+		case BODY_IDENTITY:
+			g_body.encoding = ENCODING_IDENTITY;
+			break;
+		default:
+			break;
+	}
+
+	if (g_body.cache_key != NULL)
+	{
+		if (g_body.capture != NULL)
+		{
+			Cache_Put(g_body.cache_key, g_body.capture, g_body.capture_len, g_body.encoding);
+			Log(LOGDEBUG, "Cached %lu bytes for %s", (unsigned long)g_body.capture_len, g_body.cache_key);
+		}
+		free(g_body.cache_key);
+		g_body.cache_key = NULL;
+		g_body.capture = NULL;
+		g_body.capture_len = g_body.capture_size = 0;
+	}
+	g_body.state = BODY_HEADERS;
+	g_body.pending_len = 0;
+	FCGI_Flush();
 }
 
 /**
@@ -703,6 +1622,57 @@ char *FCGI_URLDecode(char *buf)
 	return buf;
 }
 
+/** Modules that requests can be made of, and their handlers **/
+static const struct
+{
+	const char * name;
+	ModuleHandler handler;
+} g_modules[] = {
+	{"identify", IdentifyHandler},
+	{"sensordl", SensorDL_Handler},
+	{"actuatordl", ActuatorDL_Handler},
+	{"control", Control_Handler},
+	{"sensors", Sensor_Handler},
+	{"actuators", Actuator_Handler},
+	{"image", Image_Handler},
+	{"timelapse", Timelapse_Handler},
+	{"pin", Pin_Handler}, // *Debug only* pin test module
+	{"bind", Login_Handler},
+	{"unbind", Logout_Handler},
+	{"metrics", Metrics_Handler},
+	{"trace", Trace_Handler},
+	{"latency", Realtime_Handler}
+};
+
+/** Number of modules **/
+#define NUM_MODULES (int)(sizeof(g_modules)/sizeof(g_modules[0]))
+
+/**
+ * Get the name of a module, for metrics
+ * @param index Index of the module; NUM_MODULES for requests of modules that don't exist
+ * @returns The name, or NULL if index is past the last module
+ */
+const char * FCGI_GetModuleName(int index)
+{
+	if (index < NUM_MODULES)
+		return g_modules[index].name;
+	return (index == NUM_MODULES) ? "unknown" : NULL;
+}
+
+/**
+ * Record how long a request took
+ * @param module_index Index of the module requested (see FCGI_GetModuleName)
+ * @param start When the request was accepted
+ * @param trace Result of Trace_Begin when the request was accepted
+ */
+static void FCGI_EndRequest(int module_index, const struct timespec * start, uint64_t trace)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	Metrics_Observe(METRIC_FCGI_DURATION, module_index, TIMEVAL_DIFF(end, *start));
+	Trace_End(trace, "FCGI_Request", FCGI_GetModuleName(module_index), g_context.response_number);
+}
+
 /**
  * Main FCGI request loop that receives/responds to client requests.
  * @param data Reserved.
@@ -711,74 +1681,74 @@ char *FCGI_URLDecode(char *buf)
  */ 
 void * FCGI_RequestLoop (void *data)
 {
-	FCGIContext context = {0};
+	FCGIContext * context = &g_context;
 	
 	Log(LOGDEBUG, "Start loop");
+	Trace_ThreadName("fcgi");
+	Realtime_SetRole(REALTIME_WEB);
+
+	// Allocate (and fault in) the first block of the arena now, rather than during the first request
+	memset(FCGI_Alloc(ARENA_BLOCK_SIZE), 0, ARENA_BLOCK_SIZE);
+	FCGI_ResetArena();
+
 	while (FCGI_Accept() >= 0) {
 		
 		ModuleHandler module_handler = NULL;
-		char module[BUFSIZ], params[BUFSIZ];
+		char *module, *params;
+		const char *env;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t trace = Trace_Begin();
+
+		//Everything from the last request is finished with
+		FCGI_ResetArena();
 		
-		//strncpy doesn't zero-truncate properly
-		snprintf(module, BUFSIZ, "%s", getenv("DOCUMENT_URI_LOCAL"));
+		module = FCGI_StrDup((env = getenv("DOCUMENT_URI_LOCAL")) ? env : "");
 		
 		//Get the GET query string
-		snprintf(params, BUFSIZ, "%s", getenv("QUERY_STRING"));
+		params = FCGI_StrDup((env = getenv("QUERY_STRING")) ? env : "");
 		//URL decode the parameters
 		FCGI_URLDecode(params);
 
-		FCGI_GetControlCookie(context.received_key);
-		Log(LOGDEBUG, "Got request #%d - Module %s, params %s", context.response_number, module, params);
-		Log(LOGDEBUG, "Control key: %s", context.received_key);
+		FCGI_GetControlCookie(context->received_key);
+		Log(LOGDEBUG, "Got request #%d - Module %s, params %s", context->response_number, module, params);
+		Log(LOGDEBUG, "Control key: %s", context->received_key);
 
 		
 		//Remove trailing slashes (if present) from module query
-		size_t lastchar = strlen(module) - 1;
-		if (lastchar > 0 && module[lastchar] == '/')
-			module[lastchar] = 0;
+		size_t length = strlen(module);
+		if (length > 1 && module[length-1] == '/')
+			module[length-1] = 0;
 
 		//Default to the 'identify' module if none specified
 		if (!*module) 
-			strcpy(module, "identify");
+			module = FCGI_StrDup("identify");
 		
-		if (!strcmp("identify", module)) {
-			module_handler = IdentifyHandler;
-		} else if (!strcmp("sensordl", module)) {
-			module_handler = SensorDL_Handler;
-		} else if (!strcmp("actuatordl", module)) {
-			module_handler = ActuatorDL_Handler;
-		} else if (!strcmp("control", module)) {
-			module_handler = Control_Handler;
-		} else if (!strcmp("sensors", module)) {
-			module_handler = Sensor_Handler;
-		} else if (!strcmp("actuators", module)) {
-			module_handler = Actuator_Handler;
-		} else if (!strcmp("image", module)) {
-			module_handler = Image_Handler;
-		} else if (!strcmp("pin", module)) { 
-			module_handler = Pin_Handler; // *Debug only* pin test module
-		} else if (!strcmp("bind", module)) {
-			module_handler = Login_Handler;
-		} else if (!strcmp("unbind", module)) {
-			module_handler = Logout_Handler;
-		}
-
-		context.current_module = module;
-		context.response_number++;
+		int module_index = 0;
+		while (module_index < NUM_MODULES && strcmp(g_modules[module_index].name, module))
+			module_index++;
+		if (module_index < NUM_MODULES)
+			module_handler = g_modules[module_index].handler;
+
+		context->current_module = module;
+		context->response_number++;
 		
 		if (module_handler) {
-			if (module_handler == IdentifyHandler) {
+			if (module_handler == IdentifyHandler || module_handler == Metrics_Handler) {
 				FCGI_EscapeText(params);
 			} else if (module_handler != Login_Handler) {
-				if (!FCGI_HasControl(&context))
+				if (!FCGI_HasControl(context))
 				{
 					if (g_options.auth_method == AUTH_NONE) {	//:(
 						Log(LOGWARN, "Locking control (no auth!)");
-						FCGI_LockControl(&context, NOAUTH_USERNAME, USER_ADMIN);
-						FCGI_SendControlCookie(&context, true);
+						FCGI_LockControl(context, NOAUTH_USERNAME, USER_ADMIN);
+						FCGI_SendControlCookie(context, true);
 					}
 					else {
-						FCGI_RejectJSON(&context, "Please login. Invalid control key.");
+						FCGI_RejectJSON(context, "Please login. Invalid control key.");
+						FCGI_EndBody();
+						FCGI_EndRequest(module_index, &start, trace);
 						continue;
 					}
 				}
@@ -790,16 +1760,22 @@ void * FCGI_RequestLoop (void *data)
 				//If GET data is empty, use POST instead.
 				if (*params == '\0') {
 					Log(LOGDEBUG, "Using POST!");
-					fgets(params, BUFSIZ, stdin); 
+					params = FCGI_Alloc(BUFSIZ);
+					if (fgets(params, BUFSIZ, stdin) == NULL)
+						*params = '\0';
 					FCGI_URLDecode(params);
 				}
 			}
 
-			module_handler(&context, params);
+			uint64_t handler_trace = Trace_Begin();
+			module_handler(context, params);
+			Trace_End(handler_trace, "FCGI_Handler", FCGI_GetModuleName(module_index), context->response_number);
 		} 
 		else {
-			FCGI_RejectJSON(&context, "Unhandled module");
+			FCGI_RejectJSON(context, "Unhandled module");
 		}
+		FCGI_EndBody();
+		FCGI_EndRequest(module_index, &start, trace);
 	}
 
 	Log(LOGDEBUG, "Thread exiting.");
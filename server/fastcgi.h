@@ -81,6 +81,7 @@ extern bool FCGI_LockControl(FCGIContext *context, const char * user_name, UserT
 extern void FCGI_ReleaseControl(FCGIContext *context);
 extern bool FCGI_HasControl(FCGIContext *context);
 extern void FCGI_GetControlCookie(char buffer[CONTROL_KEY_BUFSIZ]);
+extern bool FCGI_CheckControlCookie(const char * cookies);
 extern void FCGI_SendControlCookie(FCGIContext *context, bool set);
 extern char *FCGI_KeyPair(char *in, const char **key, const char **value);
 extern bool FCGI_ParseRequest(FCGIContext *context, char *params, FCGIValue values[], size_t count);
@@ -91,15 +92,24 @@ extern void FCGI_JSONLong(const char *key, long value);
 extern void FCGI_JSONDouble(const char *key, double value);
 extern void FCGI_JSONBool(const char *key, bool value);
 extern void FCGI_JSONKey(const char *key);
+extern void FCGI_JSONString(const char *str);
 extern void FCGI_PrintRaw(const char *format, ...);
+extern void FCGI_Write(const void * data, size_t len);
+extern void FCGI_BeginBody(FCGIContext *context, const char *content_type, bool compressible);
+extern bool FCGI_CachedBody(FCGIContext *context, const char *key, const char *content_type);
 extern void FCGI_EndJSON();
 extern void FCGI_RejectJSONEx(FCGIContext *context, StatusCodes status, const char *description);
 extern char *FCGI_URLDecode(char *buf);
 extern char *FCGI_EscapeText(char *buf);
 extern void *FCGI_RequestLoop (void *data);
+extern const char *FCGI_GetModuleName(int index); // Name of a module, by index (for metrics)
 
 extern void FCGI_WriteBinary(void * data, size_t size, size_t num_elem);
 
+extern void * FCGI_Alloc(size_t size); // Allocate memory for the current request
+extern char * FCGI_StrDup(const char * str);
+extern char * FCGI_Sprintf(const char * format, ...);
+
 /**
  * Shortcut to calling FCGI_RejectJSONEx. Sets the error code
  * to STATUS_ERROR.
@@ -1,114 +1,748 @@
 #include "cv.h"
 #include "highgui_c.h"
 #include "image.h"
+#include "options.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
+#include <fcgiapp.h>
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sys/socket.h>
 
-static CvCapture * g_capture = NULL;
-static int g_captureID = -1;
+/** A frame encoded as a JPEG **/
+typedef struct
+{
+	/** Sequence number of the frame **/
+	long seq;
+	/** Size of the image **/
+	int width, height;
+	/** JPEG quality **/
+	int quality;
+	/** The JPEG, or NULL if the entry is unused **/
+	CvMat * encoded;
+	/** Scaled copy of the frame; kept to be reused by the next encode of the same size **/
+	IplImage * scaled;
+	/** Whether encoded is complete **/
+	bool ready;
+	/** Number of threads using the entry (including the one encoding it) **/
+	int readers;
+	/** When the entry was last used, for choosing which to replace **/
+	long used;
+} EncodedImage;
+
+/**
+ * A camera, the thread that continuously captures frames from it, and
+ * the frames encoded for clients. Sessions are independent, so several
+ * cameras can be open at once without holding each other up.
+ * The capture thread fills a buffer nobody is reading, then publishes it
+ * as the latest frame; readers never wait for the camera.
+ */
+typedef struct
+{
+	/** Camera number **/
+	int num;
+	/** Frame buffers **/
+	CameraFrame frames[CAMERA_BUFFERS];
+	/** Most recently captured frame, or NULL if there isn't one yet **/
+	CameraFrame * latest;
+	/** Sequence number of the last frame captured (only the capture thread uses this) **/
+	long seq;
+	/** Whether the capture thread is running **/
+	bool running;
+	/** Whether the capture thread has been started and not yet joined **/
+	bool joinable;
+	/** The capture thread **/
+	pthread_t thread;
+	/** Time of the last Camera_AcquireFrame; used to stop capturing when nobody is looking **/
+	struct timespec last_access;
+	/** Time the camera last failed to open, or zero **/
+	struct timespec failed;
+	/** Mutex around the frames, except the images (which the capture thread writes without it) **/
+	pthread_mutex_t mutex;
+	/** Signalled when a frame is published **/
+	pthread_cond_t published;
+
+	/** Encoded images; every client wanting the same frame, size and quality shares one encode **/
+	EncodedImage encoded[IMAGE_ENCODED_MAX];
+	/** Counter for EncodedImage::used **/
+	long uses;
+	/** Mutex around the encoded images (but not the images while being encoded) **/
+	pthread_mutex_t encode_mutex;
+	/** Signalled when an image is encoded or released **/
+	pthread_cond_t changed;
+} CameraSession;
+
+/** Sessions by camera number, created the first time each camera is used **/
+static CameraSession * g_sessions[CAMERA_MAX] = {NULL};
+/** Mutex around g_sessions **/
+static pthread_mutex_t g_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Threads serving image streams (FCGI_RequestLoop can't be held up by a stream) **/
+static struct
+{
+	/** Listening socket, or -1 if streaming is disabled **/
+	int socket;
+	/** Thread accepting streams **/
+	pthread_t thread;
+	/** Number of streams being served **/
+	int count;
+	/** Whether streams should keep going **/
+	bool running;
+	/** Mutex around count and running **/
+	pthread_mutex_t mutex;
+	/** Signalled when a stream finishes **/
+	pthread_cond_t finished;
+} g_streams = {.socket = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+static EncodedImage * Image_Encode(int num, int width, int height, int quality);
+static void Image_ReleaseEncoded(int num, EncodedImage * image);
+
+/**
+ * Get the session of a camera, creating it if necessary
+ * @param num - Camera number
+ * @returns The session, or NULL if num is invalid
+ */
+static CameraSession * Camera_GetSession(int num)
+{
+	if (num < 0 || num >= CAMERA_MAX)
+		return NULL;
+
+	pthread_mutex_lock(&g_sessions_mutex);
+	CameraSession * session = g_sessions[num];
+	if (session == NULL) {
+		session = calloc(1, sizeof(CameraSession));
+		if (session == NULL)
+			Fatal("Couldn't allocate camera session - %s", strerror(errno));
+		session->num = num;
+		pthread_mutex_init(&(session->mutex), NULL);
+		pthread_cond_init(&(session->published), NULL);
+		pthread_mutex_init(&(session->encode_mutex), NULL);
+		pthread_cond_init(&(session->changed), NULL);
+		g_sessions[num] = session;
+	}
+	pthread_mutex_unlock(&g_sessions_mutex);
+	return session;
+}
 
 /**
  * Image stream handler. Returns an image to the user.
+ * With stream set, redirects the client to the stream socket instead,
+ * which sends a JPEG at a time until the client disconnects.
  * @param context The context to work in
  * @param params User specified parameters
  */
 void Image_Handler(FCGIContext * context, char * params)
 {
 
-	int num = 0, width = 1600, height = 1200;	// Set Default values
+	int num = 0, width = CAMERA_WIDTH, height = CAMERA_HEIGHT;	// Set Default values
+	int quality = IMAGE_QUALITY, fps = IMAGE_STREAM_FPS;
+	bool stream = false;
 	FCGIValue val[] = {
 		{"num", &num, FCGI_INT_T},
 		{"width", &width, FCGI_INT_T},
-		{"height", &height, FCGI_INT_T}
+		{"height", &height, FCGI_INT_T},
+		{"quality", &quality, FCGI_INT_T},
+		{"stream", &stream, FCGI_BOOL_T},
+		{"fps", &fps, FCGI_INT_T}
 	};
-	if (!FCGI_ParseRequest(context, params, val, 3))	// Populate val
+	if (!FCGI_ParseRequest(context, params, val, sizeof(val)/sizeof(FCGIValue)))	// Populate val
 		return;
-	// Ensure the camera id is 0 or 1. Even though we plan to only have 1 camera attached at a time, this will allow 2. increase
-	else if (num < 0 || num > 1) {				
+	// Ensure the camera id is valid.
+	else if (num < 0 || num >= CAMERA_MAX) {
 		FCGI_RejectJSON(context, "Invalid capture number");
 		return;
 	// Ensure valid widths
 	} else if (width <= 0 || height <= 0) {
 		FCGI_RejectJSON(context, "Invalid width/height");
 		return;
+	} else if (quality < 1 || quality > 100) {
+		FCGI_RejectJSON(context, "Invalid quality");
+		return;
 	}
-	
-	IplImage * src = NULL;   // Source Image
-	CvMat * encoded = NULL;   	// Encoded Image
 
-	Camera_GetImage( num, width, height ,&src); 
+	if (stream) {
+		if (g_streams.socket < 0) {
+			FCGI_RejectJSON(context, "Streaming is not enabled");
+			return;
+		} else if (fps < 1 || fps > IMAGE_STREAM_MAX_FPS) {
+			FCGI_RejectJSON(context, "Invalid frame rate");
+			return;
+		}
+		// nginx passes /api/stream to the stream socket
+		FCGI_PrintRaw("Status: 307 Temporary Redirect\r\n");
+		FCGI_PrintRaw("Location: /api/stream?num=%d&width=%d&height=%d&quality=%d&fps=%d\r\n",
+			num, width, height, quality, fps);
+		FCGI_BeginBody(context, "text/plain", false);
+		return;
+	}
 
-	Log(LOGDEBUG, "About to encode");
-	encoded = cvEncodeImage(".jpg",src,0);
-	Log(LOGDEBUG, "Encoded");
+	EncodedImage * image = Image_Encode(num, width, height, quality);
+	if (image == NULL) {
+		FCGI_RejectJSON(context, "Failed to capture an image");
+		return;
+	}
 
 	Log(LOGNOTE, "Sending image!");
-	FCGI_PrintRaw("Content-type: image/jpg\r\n");
-	FCGI_PrintRaw("Cache-Control: no-cache, no-store, must-revalidate\r\n\r\n");
+	FCGI_PrintRaw("Cache-Control: no-cache, no-store, must-revalidate\r\n");
+	FCGI_BeginBody(context, "image/jpg", false);
 	//FCGI_PrintRaw("Content-Length: %d", g_encoded->rows*g_encoded->cols);
-	FCGI_WriteBinary(encoded->data.ptr,1,encoded->rows*encoded->cols);
-	
-	cvReleaseMat(&encoded);
-	cvReleaseImageHeader(&src);
+	FCGI_WriteBinary(image->encoded->data.ptr,1,image->encoded->rows*image->encoded->cols);
+
+	Image_ReleaseEncoded(num, image);
 }
-	
+
 /**
- * Attempts to get an image from a camera
- * @param num - Camera id
- * @param width - Width to force
- * @param height - Height to force
- * @param frame - Pointer to IplImage* to set with result
- * @returns true on success, false on error 
+ * Get the latest frame from a camera as a JPEG. The frame is only encoded
+ * once for each size and quality, however many clients ask for it.
+ * @param num - Camera number
+ * @param width, height - Size of the image
+ * @param quality - JPEG quality
+ * @returns The image, which must be returned with Image_ReleaseEncoded, or NULL on error
  */
- bool Camera_GetImage(int num, int width, int height,  IplImage ** frame)
- {
-	Log(LOGDEBUG, "Called with arguments num=%d width=%d height=%d frame=%p", num,width,height, frame);
-	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // Need to use a mutex to ensure 2 captures are not open at once
-	pthread_mutex_lock(&mutex);
-	bool result = false;
-
-	if( g_capture == NULL)
+static EncodedImage * Image_Encode(int num, int width, int height, int quality)
+{
+	CameraSession * session = Camera_GetSession(num);
+	CameraFrame * frame = Camera_AcquireFrame(num);
+	if (frame == NULL)
 	{
-		g_capture = cvCreateCameraCapture(num);
-		g_captureID = num;
+		Log(LOGERR, "No frame from camera %d", num);
+		return NULL;
 	}
-	else if( num != g_captureID)
-	{
-		cvReleaseCapture(&g_capture);
-		g_capture = cvCreateCameraCapture(num);	
-		g_captureID = num;
+
+	EncodedImage * image = NULL;
+	pthread_mutex_lock(&(session->encode_mutex));
+	while (image == NULL) {
+		EncodedImage * unused = NULL;
+		for (int i = 0; i < IMAGE_ENCODED_MAX && image == NULL; ++i) {
+			EncodedImage * e = &(session->encoded[i]);
+			if (e->seq == frame->seq && e->width == width
+				&& e->height == height && e->quality == quality)
+				image = e;
+			else if (e->readers == 0 && (unused == NULL || e->used < unused->used))
+				unused = e;
+		}
+
+		if (image != NULL) {
+			// Already encoded (or being encoded by another thread)
+			image->readers++;
+			while (!image->ready)
+				pthread_cond_wait(&(session->changed), &(session->encode_mutex));
+		} else if (unused != NULL) {
+			// Encode it ourselves, replacing the least recently used image
+			image = unused;
+			image->seq = frame->seq;
+			image->width = width;
+			image->height = height;
+			image->quality = quality;
+			image->ready = false;
+			image->readers = 1;
+			if (image->encoded != NULL)
+				cvReleaseMat(&(image->encoded));
+			pthread_mutex_unlock(&(session->encode_mutex));
+
+			IplImage * src = Camera_ScaleFrame(frame, width, height, &(image->scaled));
+
+			int encode_params[] = {CV_IMWRITE_JPEG_QUALITY, quality, 0};
+			Log(LOGDEBUG, "About to encode frame %ld", frame->seq);
+			uint64_t trace = Trace_Begin();
+			CvMat * encoded = cvEncodeImage(".jpg", src, encode_params);
+			Trace_End(trace, "Image_Encode", NULL, frame->seq);
+			Log(LOGDEBUG, "Encoded");
+			if (encoded != NULL)
+				Metrics_Add(METRIC_IMAGE_FRAMES_ENCODED, num, 1);
+
+			pthread_mutex_lock(&(session->encode_mutex));
+			image->encoded = encoded;
+			image->ready = true;
+			if (encoded == NULL) {
+				// Don't let anyone else find it (frames start at 1)
+				image->seq = 0;
+			}
+			pthread_cond_broadcast(&(session->changed));
+		} else {
+			// Every image is being sent somewhere
+			pthread_cond_wait(&(session->changed), &(session->encode_mutex));
+		}
 	}
 
-	if (g_capture != NULL)
-	{
+	image->used = ++(session->uses);
+	if (image->encoded == NULL) {
+		image->readers--;
+		pthread_cond_broadcast(&(session->changed));
+		image = NULL;
+	}
+	pthread_mutex_unlock(&(session->encode_mutex));
+	Camera_ReleaseFrame(num, frame);
+	return image;
+}
+
+/**
+ * Finish using an image from Image_Encode, so it can be replaced
+ * @param num - Camera number
+ * @param image - The image
+ */
+static void Image_ReleaseEncoded(int num, EncodedImage * image)
+{
+	CameraSession * session = Camera_GetSession(num);
+	pthread_mutex_lock(&(session->encode_mutex));
+	image->readers--;
+	pthread_cond_broadcast(&(session->changed));
+	pthread_mutex_unlock(&(session->encode_mutex));
+}
+
+/**
+ * Send a response with an error to a stream request
+ * @param out - Output stream of the request
+ * @param status - HTTP status line
+ * @param description - The error
+ */
+static void Image_StreamError(FCGX_Stream * out, const char * status, const char * description)
+{
+	FCGX_FPrintF(out, "Status: %s\r\nContent-type: text/plain\r\n\r\n%s\n", status, description);
+}
+
+/**
+ * Serve an image stream as a multipart/x-mixed-replace response, sending
+ * the latest frame at most fps times a second until the client goes away,
+ * loses control, or the program exits.
+ * @param arg - The FCGX_Request, which is freed when the stream finishes
+ * @returns NULL
+ */
+static void * Image_Stream(void * arg)
+{
+	FCGX_Request * request = arg;
+	int num = 0, width = CAMERA_WIDTH, height = CAMERA_HEIGHT;
+	Trace_ThreadName("stream");
+	Realtime_SetRole(REALTIME_WEB);
+	int quality = IMAGE_QUALITY, fps = IMAGE_STREAM_FPS;
+
+	// Can't use FCGI_ParseRequest here; it responds through FCGI_RequestLoop
+	const char * query = FCGX_GetParam("QUERY_STRING", request->envp);
+	char * params = strdup(query ? query : "");
+	char * next = params;
+	const char * key, * value;
+	while ((next = FCGI_KeyPair(next, &key, &value)) != NULL) {
+		int * field = NULL;
+		if (!strcmp(key, "num"))
+			field = &num;
+		else if (!strcmp(key, "width"))
+			field = &width;
+		else if (!strcmp(key, "height"))
+			field = &height;
+		else if (!strcmp(key, "quality"))
+			field = &quality;
+		else if (!strcmp(key, "fps"))
+			field = &fps;
+		if (field != NULL)
+			*field = strtol(value, NULL, 10);
+	}
+	free(params);
+
+	const char * cookies = FCGX_GetParam("COOKIE_STRING", request->envp);
+	bool authorised = (g_options.auth_method == AUTH_NONE || FCGI_CheckControlCookie(cookies));
+
+	if (!authorised) {
+		Image_StreamError(request->out, "403 Forbidden", "Please login. Invalid control key.");
+	} else if (num < 0 || num >= CAMERA_MAX || width <= 0 || height <= 0
+		|| quality < 1 || quality > 100 || fps < 1 || fps > IMAGE_STREAM_MAX_FPS) {
+		Image_StreamError(request->out, "400 Bad Request", "Invalid stream parameters");
+	} else {
+		Log(LOGDEBUG, "Streaming camera %d at %dx%d, %d fps", num, width, height, fps);
+		FCGX_FPrintF(request->out, "Content-type: multipart/x-mixed-replace; boundary=" IMAGE_STREAM_BOUNDARY "\r\n");
+		FCGX_FPrintF(request->out, "Cache-Control: no-cache, no-store, must-revalidate\r\n\r\n");
+
+		long last_seq = 0;
+		struct timespec wake;
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		while (true) {
+			pthread_mutex_lock(&(g_streams.mutex));
+			bool running = g_streams.running;
+			pthread_mutex_unlock(&(g_streams.mutex));
+			if (!running || (g_options.auth_method != AUTH_NONE && !FCGI_CheckControlCookie(cookies)))
+				break;
 
-		cvSetCaptureProperty(g_capture, CV_CAP_PROP_FRAME_WIDTH, width);
-		cvSetCaptureProperty(g_capture, CV_CAP_PROP_FRAME_HEIGHT, height);
+			EncodedImage * image = Image_Encode(num, width, height, quality);
+			if (image == NULL)
+				break;
 
-		*frame = cvQueryFrame(g_capture);
-		result = (*frame != NULL);
+			// Only send new frames
+			int sent = 0;
+			if (image->seq != last_seq) {
+				int len = image->encoded->rows * image->encoded->cols;
+				last_seq = image->seq;
+				FCGX_FPrintF(request->out, "--" IMAGE_STREAM_BOUNDARY "\r\nContent-type: image/jpeg\r\nContent-Length: %d\r\n\r\n", len);
+				FCGX_PutStr((const char*)image->encoded->data.ptr, len, request->out);
+				FCGX_PutS("\r\n", request->out);
+				sent = FCGX_FFlush(request->out);
+			}
+			Image_ReleaseEncoded(num, image);
+			if (sent < 0 || FCGX_GetError(request->out) != 0) {
+				Log(LOGDEBUG, "Stream of camera %d closed", num);
+				break;
+			}
 
-	//cvShowImage("display", *image);
-	//cvWaitKey(0); 
-	//cvSaveImage("test.jpg",*image,0);
-		
-		Log(LOGDEBUG, "At end of mutex");
+			// Wait for the next frame time; if we've fallen behind, don't try to catch up
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wake.tv_nsec += 1000000000L / fps;
+			if (wake.tv_nsec >= 1000000000L) {
+				wake.tv_sec++;
+				wake.tv_nsec -= 1000000000L;
+			}
+			if (TIMEVAL_DIFF(wake, now) < 0)
+				wake = now;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+		}
 	}
 
-	pthread_mutex_unlock(&mutex);	//Close the mutex
+	FCGX_Finish_r(request);
+	free(request);
 
-	//NOTE: Never have a "return" statement before the mutex is unlocked; it causes deadlocks!
-	return result;
+	pthread_mutex_lock(&(g_streams.mutex));
+	g_streams.count--;
+	pthread_cond_broadcast(&(g_streams.finished));
+	pthread_mutex_unlock(&(g_streams.mutex));
+	return NULL;
 }
 
 /**
- * Executed on cleanup. Releases the OpenCV Capture structs.
+ * Accept stream requests and start a thread to serve each of them.
+ * @param arg - Unused
+ * @returns NULL
  */
-void Image_Cleanup()
+static void * Image_StreamServer(void * arg)
 {
-	// Release the capture and IplImage pointers
-	//cvReleaseImageHeader(&g_frame);
-	cvReleaseCapture(&g_capture);
+	while (true) {
+		FCGX_Request * request = malloc(sizeof(FCGX_Request));
+		if (request == NULL || FCGX_InitRequest(request, g_streams.socket, 0) != 0) {
+			Log(LOGERR, "Couldn't allocate a stream request");
+			free(request);
+			break;
+		}
+		if (FCGX_Accept_r(request) < 0) {
+			// Image_Cleanup shut the socket down
+			FCGX_Free(request, true);
+			free(request);
+			break;
+		}
+
+		pthread_t thread;
+		pthread_mutex_lock(&(g_streams.mutex));
+		bool accepted = g_streams.running && g_streams.count < IMAGE_STREAM_MAX;
+		if (accepted) {
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			accepted = (pthread_create(&thread, &attr, Image_Stream, request) == 0);
+			pthread_attr_destroy(&attr);
+			if (accepted)
+				g_streams.count++;
+		}
+		pthread_mutex_unlock(&(g_streams.mutex));
+
+		if (!accepted) {
+			Image_StreamError(request->out, "503 Service Unavailable", "Too many streams");
+			FCGX_Finish_r(request);
+			free(request);
+		}
+	}
+	return NULL;
 }
 
+/**
+ * Start serving image streams, if enabled.
+ * Must be called before FCGI_RequestLoop, which also initialises the FastCGI library.
+ */
+void Image_Init()
+{
+	if (strcmp(g_options.stream_socket, "0") == 0)
+		return;
+
+	if (FCGX_Init() != 0) {
+		Log(LOGERR, "Couldn't initialise FastCGI for streams");
+		return;
+	}
+	g_streams.socket = FCGX_OpenSocket(g_options.stream_socket, IMAGE_STREAM_MAX);
+	if (g_streams.socket < 0) {
+		Log(LOGERR, "Couldn't open stream socket %s - %s", g_options.stream_socket, strerror(errno));
+		return;
+	}
+	g_streams.running = true;
+	if (pthread_create(&(g_streams.thread), NULL, Image_StreamServer, NULL) != 0) {
+		Log(LOGERR, "Couldn't start stream thread - %s", strerror(errno));
+		g_streams.running = false;
+		close(g_streams.socket);
+		g_streams.socket = -1;
+	}
+}
+
+/**
+ * Main loop for a thread that captures frames from a camera, until nobody
+ * has asked for a frame for CAMERA_IDLE_TIMEOUT seconds.
+ * @param arg - The camera number
+ * @returns NULL
+ */
+static void * Camera_Loop(void * arg)
+{
+	CameraSession * cam = arg;
+	int num = cam->num;
+	Trace_ThreadName("camera %d", num);
+	Realtime_SetRole(REALTIME_VISION);
+
+	CvCapture * capture = cvCreateCameraCapture(num);
+	if (capture == NULL) {
+		Log(LOGERR, "Couldn't open camera %d", num);
+	} else {
+		// Only set once; changing it is slow and resets some cameras
+		cvSetCaptureProperty(capture, CV_CAP_PROP_FRAME_WIDTH, CAMERA_WIDTH);
+		cvSetCaptureProperty(capture, CV_CAP_PROP_FRAME_HEIGHT, CAMERA_HEIGHT);
+		Log(LOGDEBUG, "Opened camera %d at %dx%d", num, 
+			(int)cvGetCaptureProperty(capture, CV_CAP_PROP_FRAME_WIDTH), 
+			(int)cvGetCaptureProperty(capture, CV_CAP_PROP_FRAME_HEIGHT));
+	}
+
+	while (capture != NULL) {
+		uint64_t trace = Trace_Begin();
+		// Always grab, so the next frame is current even if it is dropped
+		if (!cvGrabFrame(capture)) {
+			Log(LOGERR, "Couldn't grab a frame from camera %d", num);
+			break;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		// Find a buffer nobody is reading
+		pthread_mutex_lock(&(cam->mutex));
+		if (TIMEVAL_DIFF(now, cam->last_access) > CAMERA_IDLE_TIMEOUT) {
+			pthread_mutex_unlock(&(cam->mutex));
+			Log(LOGDEBUG, "Camera %d is idle", num);
+			break;
+		}
+		CameraFrame * back = NULL;
+		int in_use = 0;
+		for (int i = 0; i < CAMERA_BUFFERS; ++i) {
+			if (&(cam->frames[i]) != cam->latest && cam->frames[i].readers == 0)
+				back = (back == NULL) ? &(cam->frames[i]) : back;
+			else
+				in_use++;
+		}
+		pthread_mutex_unlock(&(cam->mutex));
+		Metrics_Set(METRIC_CAMERA_BUFFERS_IN_USE, num, in_use);
+
+		// All buffers are being read; drop the frame
+		if (back == NULL) {
+			Metrics_Add(METRIC_CAMERA_FRAMES_DROPPED, num, 1);
+			continue;
+		}
+
+		IplImage * image = cvRetrieveFrame(capture, 0);
+		if (image == NULL)
+			continue;
+		if (back->image == NULL || back->image->width != image->width || back->image->height != image->height
+			|| back->image->nChannels != image->nChannels || back->image->depth != image->depth) {
+			if (back->image != NULL)
+				cvReleaseImage(&(back->image));
+			back->image = cvCreateImage(cvSize(image->width, image->height), image->depth, image->nChannels);
+		}
+		cvCopy(image, back->image, NULL);
+		back->seq = ++(cam->seq);
+		back->time = now;
+		Metrics_Add(METRIC_CAMERA_FRAMES_CAPTURED, num, 1);
+
+		// Publish
+		pthread_mutex_lock(&(cam->mutex));
+		cam->latest = back;
+		pthread_cond_broadcast(&(cam->published));
+		pthread_mutex_unlock(&(cam->mutex));
+		Trace_End(trace, "Camera_Capture", NULL, back->seq);
+	}
+
+	bool opened = (capture != NULL);
+	if (capture != NULL)
+		cvReleaseCapture(&capture);
+
+	pthread_mutex_lock(&(cam->mutex));
+	if (opened) {
+		cam->failed.tv_sec = 0;
+		cam->failed.tv_nsec = 0;
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &(cam->failed));
+	}
+	cam->running = false;
+	pthread_cond_broadcast(&(cam->published));
+	pthread_mutex_unlock(&(cam->mutex));
+	return NULL;
+}
+
+/**
+ * Get the most recent frame from a camera, starting the camera if necessary.
+ * Only waits if the camera has not captured anything yet.
+ * @param num - Camera number
+ * @returns The frame, which must be returned with Camera_ReleaseFrame, or NULL on error
+ */
+CameraFrame * Camera_AcquireFrame(int num)
+{
+	return Camera_WaitFrame(num, 0);
+}
+
+/**
+ * Wait for a frame newer than one already seen, starting the camera if necessary.
+ * @param num - Camera number
+ * @param seq - Sequence number of the frame already seen (0 for any frame)
+ * @returns The frame, which must be returned with Camera_ReleaseFrame, or NULL on error 
+ *	or if there was no new frame within CAMERA_START_TIMEOUT; callers log this, as they may retry
+ */
+CameraFrame * Camera_WaitFrame(int num, long seq)
+{
+	CameraSession * cam = Camera_GetSession(num);
+	if (cam == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&(cam->mutex));
+	clock_gettime(CLOCK_MONOTONIC, &(cam->last_access));
+
+	// Don't keep trying to open a camera that isn't there
+	if (!cam->running && cam->failed.tv_sec != 0 
+		&& TIMEVAL_DIFF(cam->last_access, cam->failed) < CAMERA_RETRY_TIME) {
+		pthread_mutex_unlock(&(cam->mutex));
+		return NULL;
+	}
+
+	if (!cam->running) {
+		// The thread has exited (it won't need the mutex again)
+		if (cam->joinable)
+			pthread_join(cam->thread, NULL);
+		// The last frame is stale; wait for a new one
+		cam->latest = NULL;
+		cam->running = true;
+		cam->joinable = true;
+		if (pthread_create(&(cam->thread), NULL, Camera_Loop, cam) != 0) {
+			Log(LOGERR, "Couldn't start capture thread for camera %d - %s", num, strerror(errno));
+			cam->running = false;
+			cam->joinable = false;
+		}
+	}
+
+	struct timespec timeout = cam->last_access;
+	timeout.tv_sec += CAMERA_START_TIMEOUT;
+	while ((cam->latest == NULL || cam->latest->seq <= seq) && cam->running) {
+		// The condition variable uses CLOCK_REALTIME
+		struct timespec now, until;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (TIMEVAL_DIFF(timeout, now) <= 0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += 1;
+		pthread_cond_timedwait(&(cam->published), &(cam->mutex), &until);
+	}
+
+	CameraFrame * frame = cam->latest;
+	if (frame != NULL && frame->seq > seq)
+		frame->readers++;
+	else
+		frame = NULL;
+	pthread_mutex_unlock(&(cam->mutex));
+	return frame;
+}
+
+/**
+ * Finish using a frame from Camera_AcquireFrame, so it can be reused
+ * @param num - Camera number
+ * @param frame - The frame
+ */
+void Camera_ReleaseFrame(int num, CameraFrame * frame)
+{
+	CameraSession * cam = Camera_GetSession(num);
+	pthread_mutex_lock(&(cam->mutex));
+	frame->readers--;
+	pthread_mutex_unlock(&(cam->mutex));
+}
+
+/**
+ * Scale a frame to the size a client wants, whatever size the camera captures at
+ * @param frame - The frame
+ * @param width, height - Size wanted
+ * @param scaled - Image to scale into; (re)allocated if it is NULL or the wrong size, 
+ *		and should be kept by the caller to reuse
+ * @returns The frame's image if it is already the right size, otherwise *scaled
+ */
+IplImage * Camera_ScaleFrame(CameraFrame * frame, int width, int height, IplImage ** scaled)
+{
+	IplImage * src = frame->image;
+	if (width == src->width && height == src->height)
+		return src;
+
+	if (*scaled == NULL || (*scaled)->width != width || (*scaled)->height != height
+		|| (*scaled)->nChannels != src->nChannels || (*scaled)->depth != src->depth) {
+		if (*scaled != NULL)
+			cvReleaseImage(scaled);
+		*scaled = cvCreateImage(cvSize(width, height), src->depth, src->nChannels);
+	}
+	// Area interpolation is best for shrinking
+	cvResize(src, *scaled, (width < src->width) ? CV_INTER_AREA : CV_INTER_LINEAR);
+	return *scaled;
+}
+
+/**
+ * Executed on cleanup. Stops the streams and capture threads and releases the images.
+ */
+void Image_Cleanup()
+{
+	if (g_streams.socket >= 0) {
+		pthread_mutex_lock(&(g_streams.mutex));
+		g_streams.running = false;
+		pthread_mutex_unlock(&(g_streams.mutex));
+
+		// Wakes the stream thread up from accept
+		shutdown(g_streams.socket, SHUT_RDWR);
+		pthread_join(g_streams.thread, NULL);
+		close(g_streams.socket);
+		g_streams.socket = -1;
+
+		// Streams notice within a frame time
+		pthread_mutex_lock(&(g_streams.mutex));
+		while (g_streams.count > 0)
+			pthread_cond_wait(&(g_streams.finished), &(g_streams.mutex));
+		pthread_mutex_unlock(&(g_streams.mutex));
+	}
+
+	pthread_mutex_lock(&g_sessions_mutex);
+	for (int num = 0; num < CAMERA_MAX; ++num) {
+		CameraSession * cam = g_sessions[num];
+		if (cam == NULL)
+			continue;
+
+		pthread_mutex_lock(&(cam->mutex));
+		bool started = cam->joinable;
+		cam->joinable = false;
+		// Make the thread think it is idle
+		cam->last_access.tv_sec = 0;
+		cam->last_access.tv_nsec = 0;
+		pthread_mutex_unlock(&(cam->mutex));
+
+		if (started)
+			pthread_join(cam->thread, NULL);
+		for (int i = 0; i < CAMERA_BUFFERS; ++i) {
+			if (cam->frames[i].image != NULL)
+				cvReleaseImage(&(cam->frames[i].image));
+		}
+		for (int i = 0; i < IMAGE_ENCODED_MAX; ++i) {
+			EncodedImage * e = &(cam->encoded[i]);
+			if (e->encoded != NULL)
+				cvReleaseMat(&(e->encoded));
+			if (e->scaled != NULL)
+				cvReleaseImage(&(e->scaled));
+		}
+
+		pthread_mutex_destroy(&(cam->mutex));
+		pthread_cond_destroy(&(cam->published));
+		pthread_mutex_destroy(&(cam->encode_mutex));
+		pthread_cond_destroy(&(cam->changed));
+		free(cam);
+		g_sessions[num] = NULL;
+	}
+	pthread_mutex_unlock(&g_sessions_mutex);
+}
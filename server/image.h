@@ -9,10 +9,56 @@
 #include "common.h"
 #include "cv.h"
 
-//extern void Image_Init();
+/** Maximum number of cameras that can be used **/
+#define CAMERA_MAX 4
+/** Number of frame buffers per camera (a triple buffer) **/
+#define CAMERA_BUFFERS 3
+/** Width to capture frames at **/
+#define CAMERA_WIDTH 1600
+/** Height to capture frames at **/
+#define CAMERA_HEIGHT 1200
+/** Time (in seconds) without any readers before a camera stops capturing **/
+#define CAMERA_IDLE_TIMEOUT 10
+/** Time (in seconds) to wait for the first frame from a camera **/
+#define CAMERA_START_TIMEOUT 5
+/** Time (in seconds) before trying to open a camera again after it failed **/
+#define CAMERA_RETRY_TIME 5
+
+/** Default JPEG quality (1-100) of images sent to clients **/
+#define IMAGE_QUALITY 80
+/** Number of encoded images kept per camera; each is shared by all clients wanting that frame, size and quality **/
+#define IMAGE_ENCODED_MAX 6
+/** Default address to serve image streams on **/
+#define IMAGE_STREAM_SOCKET "127.0.0.1:9006"
+/** Maximum number of streams served at once **/
+#define IMAGE_STREAM_MAX 4
+/** Default frame rate of a stream **/
+#define IMAGE_STREAM_FPS 10
+/** Maximum frame rate of a stream **/
+#define IMAGE_STREAM_MAX_FPS 25
+/** Boundary between the frames of a stream **/
+#define IMAGE_STREAM_BOUNDARY "mctxframe"
+
+/** A frame captured by a camera. Obtain with Camera_AcquireFrame and return with Camera_ReleaseFrame. **/
+typedef struct
+{
+	/** The image; do not modify **/
+	IplImage * image;
+	/** Sequence number of the frame; increases by one for each frame captured, and is never reused **/
+	long seq;
+	/** Time at which the frame was captured (CLOCK_MONOTONIC) **/
+	struct timespec time;
+	/** Number of readers using the frame **/
+	int readers;
+} CameraFrame;
+
+extern void Image_Init();
 extern void Image_Handler(FCGIContext * context, char * params); 
 extern void Image_Cleanup();
-extern bool Camera_GetImage(int num, int width, int height,  IplImage ** image);
+extern CameraFrame * Camera_AcquireFrame(int num); // Get the latest frame from a camera
+extern CameraFrame * Camera_WaitFrame(int num, long seq); // Wait for a frame newer than seq
+extern void Camera_ReleaseFrame(int num, CameraFrame * frame); // Finish using a frame
+extern IplImage * Camera_ScaleFrame(CameraFrame * frame, int width, int height, IplImage ** scaled); // Scale a frame on the fly
 
 #endif //_IMAGE_H
 
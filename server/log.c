@@ -8,17 +8,360 @@
 #include "common.h"
 #include "log.h"
 #include "options.h"
+#include "metrics.h"
+#include "realtime.h"
 
 #include <unistd.h>
 #include <syslog.h>
 #include <stdarg.h>
+#include <stdint.h>
+
+/** Number of places in the code each thread remembers for rate limiting (must be a power of 2) **/
+#define LOG_RATE_SITES 32
 
 static const char * unspecified_funct = "???";
 
+/** A message waiting to be written **/
+typedef struct
+{
+	/** When it was logged (CLOCK_REALTIME) **/
+	struct timespec time;
+	/** Level (see log.h) **/
+	int level;
+	/** Where it was logged (strings that live as long as the program) **/
+	const char * funct;
+	const char * file;
+	int line;
+	/** Number of messages from the same place that were suppressed before this one **/
+	unsigned suppressed;
+	/** The formatted message **/
+	char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+/**
+ * Messages queued by a thread; the thread adds to the head, and the log thread takes from the tail,
+ * so neither needs a lock.
+ */
+typedef struct
+{
+	/** Whether a thread is using the ring **/
+	bool owned;
+	/** Messages; those from tail to head are waiting to be written **/
+	LogRecord records[LOG_RING_SIZE];
+	/** Number of messages queued; only the owner writes this **/
+	unsigned long head;
+	/** Number of messages written; only the log thread writes this **/
+	unsigned long tail;
+	/** Number of messages dropped since the log thread last looked, because the ring was full **/
+	unsigned long dropped;
+} LogRing;
+
+/** Rate limiting of the messages from one place in the code **/
+typedef struct
+{
+	const char * file;
+	int line;
+	/** Start of the current interval (s) **/
+	time_t start;
+	/** Messages logged in the current interval **/
+	unsigned count;
+	/** Messages suppressed in the current interval **/
+	unsigned suppressed;
+} LogSite;
+
+static struct
+{
+	/** Whether messages are queued for the log thread **/
+	bool running;
+	/** Rings; num_rings are allocated **/
+	LogRing * rings[LOG_MAX_THREADS];
+	int num_rings;
+	/** Mutex around giving out rings **/
+	pthread_mutex_t mutex;
+	/** Mutex around taking messages out of the rings **/
+	pthread_mutex_t drain_mutex;
+	/** Used to give a ring back when its thread exits **/
+	pthread_key_t key;
+	/** The log thread **/
+	pthread_t thread;
+	/** File messages are written to instead of syslog, or NULL **/
+	FILE * file;
+} g_log = {.mutex = PTHREAD_MUTEX_INITIALIZER, .drain_mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/** Ring of the current thread **/
+static __thread LogRing * t_ring = NULL;
+/** Places in the code the current thread has logged from, for rate limiting **/
+static __thread LogSite t_sites[LOG_RATE_SITES];
+
+/**
+ * Give a ring back when its thread exits; any messages left in it are still written
+ * @param arg - The ring
+ */
+static void Log_ReleaseRing(void * arg)
+{
+	LogRing * ring = arg;
+	pthread_mutex_lock(&(g_log.mutex));
+	ring->owned = false;
+	pthread_mutex_unlock(&(g_log.mutex));
+}
+
+/**
+ * Get the ring of the current thread, reusing the ring of a thread that has exited if possible
+ * @returns The ring, or NULL if there are too many threads
+ */
+static LogRing * Log_Ring()
+{
+	if (t_ring != NULL)
+		return t_ring;
+
+	pthread_mutex_lock(&(g_log.mutex));
+	LogRing * ring = NULL;
+	for (int i = 0; i < g_log.num_rings && ring == NULL; ++i)
+	{
+		if (!g_log.rings[i]->owned)
+			ring = g_log.rings[i];
+	}
+	if (ring == NULL && g_log.num_rings < LOG_MAX_THREADS)
+	{
+		// Don't Log here; the caller is in the middle of logging
+		ring = malloc(sizeof(LogRing));
+		if (ring != NULL)
+		{
+			memset(ring, 0, sizeof(LogRing)); // Fault in every page now
+			g_log.rings[g_log.num_rings] = ring;
+			__atomic_store_n(&(g_log.num_rings), g_log.num_rings+1, __ATOMIC_RELEASE);
+		}
+	}
+	if (ring != NULL)
+	{
+		ring->owned = true;
+		pthread_setspecific(g_log.key, ring);
+	}
+	pthread_mutex_unlock(&(g_log.mutex));
+
+	t_ring = ring;
+	return ring;
+}
+
+/**
+ * Give the current thread its queue now, rather than when it first logs (which might be at a bad time)
+ */
+void Log_ThreadInit()
+{
+	if (__atomic_load_n(&(g_log.running), __ATOMIC_ACQUIRE))
+		Log_Ring();
+}
+
+/**
+ * Get the number of threads' queues of messages
+ * @returns The number of queues; queues are numbered from 0, and are reused when their thread exits
+ */
+int Log_NumQueues()
+{
+	return __atomic_load_n(&(g_log.num_rings), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Rate limit the messages from a place in the code, to LOG_RATE_BURST in each LOG_RATE_INTERVAL.
+ * The number suppressed is reported with the next message from there that is logged.
+ * @param file, line - The place in the code
+ * @param now - Current time (s)
+ * @param suppressed - Set to the number of messages suppressed since the last one logged from there
+ * @returns true if the message should be logged
+ */
+static bool Log_Allow(const char * file, int line, time_t now, unsigned * suppressed)
+{
+	LogSite * site = &(t_sites[((uintptr_t)file + 31 * line) & (LOG_RATE_SITES-1)]);
+	*suppressed = 0;
+	if (site->file != file || site->line != line)
+	{
+		// Forget whatever was there before
+		site->file = file;
+		site->line = line;
+		site->start = now;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+	else if (now - site->start >= LOG_RATE_INTERVAL)
+	{
+		*suppressed = site->suppressed;
+		site->start = now;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+
+	if (++(site->count) <= LOG_RATE_BURST)
+		return true;
+	site->suppressed++;
+	return false;
+}
+
+/**
+ * Get the severity of a level
+ * @param level - Level (see log.h)
+ * @param priority - Set to the syslog priority of the level
+ * @returns Human readable severity
+ */
+static const char * Log_Severity(int level, int * priority)
+{
+	switch (level)
+	{
+		case LOGERR:
+			*priority = LOG_ERR;
+			return "ERROR";
+		case LOGWARN:
+			*priority = LOG_WARNING;
+			return "WARNING";
+		case LOGNOTE:
+			*priority = LOG_NOTICE;
+			return "NOTICE";
+		case LOGINFO:
+			*priority = LOG_INFO;
+			return "INFO";
+		default:
+			*priority = LOG_DEBUG;
+			return "DEBUG";
+	}
+}
+
+/**
+ * Write a message to syslog, or to the log file if there is one
+ * @param record - The message
+ */
+static void Log_Write(const LogRecord * record)
+{
+	int priority;
+	const char * severity = Log_Severity(record->level, &priority);
+	char suppressed[64] = "";
+	if (record->suppressed > 0)
+		snprintf(suppressed, sizeof(suppressed), " (%u similar messages suppressed)", record->suppressed);
+
+	if (g_log.file != NULL)
+	{
+		struct tm local;
+		char date[32];
+		localtime_r(&(record->time.tv_sec), &local);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+		fprintf(g_log.file, "%s.%06ld mctxserv[%d]: %s: %s (%s:%d) - %s%s\n", date, record->time.tv_nsec / 1000,
+			getpid(), severity, record->funct, record->file, record->line, record->message, suppressed);
+	}
+	else
+	{
+		syslog(priority, "%s: %s (%s:%d) - %s%s", severity, record->funct, record->file, record->line,
+			record->message, suppressed);
+	}
+}
+
+/**
+ * Write the messages queued in every ring, oldest first
+ */
+static void Log_Drain()
+{
+	pthread_mutex_lock(&(g_log.drain_mutex));
+	int num_rings = __atomic_load_n(&(g_log.num_rings), __ATOMIC_ACQUIRE);
+	unsigned long heads[LOG_MAX_THREADS];
+	for (int i = 0; i < num_rings; ++i)
+	{
+		heads[i] = __atomic_load_n(&(g_log.rings[i]->head), __ATOMIC_ACQUIRE);
+		Metrics_Set(METRIC_LOG_QUEUE_DEPTH, i, heads[i] - g_log.rings[i]->tail);
+	}
+
+	while (true)
+	{
+		// Find the oldest message
+		LogRing * oldest = NULL;
+		const LogRecord * record = NULL;
+		for (int i = 0; i < num_rings; ++i)
+		{
+			LogRing * ring = g_log.rings[i];
+			if (ring->tail == heads[i])
+				continue;
+			const LogRecord * next = &(ring->records[ring->tail & (LOG_RING_SIZE-1)]);
+			if (record == NULL || next->time.tv_sec < record->time.tv_sec
+				|| (next->time.tv_sec == record->time.tv_sec && next->time.tv_nsec < record->time.tv_nsec))
+			{
+				oldest = ring;
+				record = next;
+			}
+		}
+		if (oldest == NULL)
+			break;
+		Log_Write(record);
+		__atomic_store_n(&(oldest->tail), oldest->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	for (int i = 0; i < num_rings; ++i)
+	{
+		unsigned long dropped = __atomic_exchange_n(&(g_log.rings[i]->dropped), 0, __ATOMIC_RELAXED);
+		if (dropped > 0)
+		{
+			LogRecord record = {.level = LOGWARN, .funct = __func__, .file = __FILE__, .line = __LINE__};
+			clock_gettime(CLOCK_REALTIME, &(record.time));
+			snprintf(record.message, sizeof(record.message), "Dropped %lu messages logged faster than they could be written", dropped);
+			Log_Write(&record);
+		}
+	}
+	if (g_log.file != NULL)
+		fflush(g_log.file);
+	pthread_mutex_unlock(&(g_log.drain_mutex));
+}
+
+/**
+ * Write the queued messages every LOG_DRAIN_INTERVAL, until Log_Stop is called
+ * @param arg - Unused
+ * @returns NULL
+ */
+static void * Log_Loop(void * arg)
+{
+	struct timespec interval = {0, LOG_DRAIN_INTERVAL};
+	Realtime_SetRole(REALTIME_BACKGROUND);
+	while (__atomic_load_n(&(g_log.running), __ATOMIC_ACQUIRE))
+	{
+		Log_Drain();
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
 
 /**
- * Print a message to stderr and log it via syslog. The message must be
- * less than BUFSIZ characters long, or it will be truncated.
+ * Start writing messages from a thread of their own; until this is called (and after Log_Stop),
+ * messages are written by the thread that logs them.
+ * If g_options.log_file is set, messages are appended to it instead of syslog.
+ */
+void Log_Init()
+{
+	if (g_options.log_file != NULL && g_options.log_file[0] != '\0')
+	{
+		g_log.file = fopen(g_options.log_file, "a");
+		if (g_log.file == NULL)
+			Log(LOGWARN, "Couldn't open log file %s - %s; using syslog", g_options.log_file, strerror(errno));
+	}
+	if (pthread_key_create(&(g_log.key), Log_ReleaseRing) != 0)
+		Fatal("Couldn't create key for log rings - %s", strerror(errno));
+
+	__atomic_store_n(&(g_log.running), true, __ATOMIC_RELEASE);
+	if (pthread_create(&(g_log.thread), NULL, Log_Loop, NULL) != 0)
+	{
+		__atomic_store_n(&(g_log.running), false, __ATOMIC_RELEASE);
+		Log(LOGWARN, "Couldn't start the log thread - %s; logging synchronously", strerror(errno));
+	}
+}
+
+/**
+ * Write any queued messages, and write messages synchronously again
+ */
+void Log_Stop()
+{
+	if (!__atomic_exchange_n(&(g_log.running), false, __ATOMIC_ACQ_REL))
+		return;
+	pthread_join(g_log.thread, NULL);
+	Log_Drain();
+}
+
+/**
+ * Log a message. It is queued for the log thread (see Log_Init) and written to syslog (which also prints
+ * it to stderr), or the log file. Messages more than LOG_MESSAGE_SIZE characters long are truncated.
+ * Only LOG_RATE_BURST messages from each place in the code are logged in LOG_RATE_INTERVAL.
  * @param level - Specify how severe the message is.
 	If level is higher (less urgent) than the program's verbosity (see options.h) no message will be printed
  * @param funct - String indicating the function name from which this function was called.
@@ -30,14 +373,24 @@ static const char * unspecified_funct = "???";
  */
 void LogEx(int level, const char * funct, const char * file, int line, ...)
 {
-	//Todo: consider setlogmask(3) to filter messages
 	const char *fmt;
-	char buffer[BUFSIZ];
 	va_list va;
 
 	// Don't print the message unless we need to
 	if (level > g_options.verbosity)
 		return;
+	if (level > LOGDEBUG)
+		level = LOGDEBUG;
+	Metrics_Add(METRIC_LOG_MESSAGES, level, 1);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned suppressed;
+	if (!Log_Allow(file, line, now.tv_sec, &suppressed))
+	{
+		Metrics_Add(METRIC_LOG_SUPPRESSED, level, 1);
+		return;
+	}
 
 	va_start(va, line);
 	fmt = va_arg(va, const char*);
@@ -45,39 +398,38 @@ void LogEx(int level, const char * funct, const char * file, int line, ...)
 	if (fmt == NULL) // sanity check
 		Fatal("Format string is NULL");
 
-	vsnprintf(buffer, BUFSIZ, fmt, va);
-	va_end(va);
-
 	if (funct == NULL)
 		funct = unspecified_funct;
 
-	// Make a human readable severity string
-	const char *severity;
-	switch (level)
+	LogRing * ring = __atomic_load_n(&(g_log.running), __ATOMIC_ACQUIRE) ? Log_Ring() : NULL;
+	if (ring == NULL)
 	{
-		case LOGERR:
-			level = LOG_ERR;
-			severity = "ERROR";
-			break;
-		case LOGWARN:
-			level = LOG_WARNING;
-			severity = "WARNING";
-			break;
-		case LOGNOTE:
-			level = LOG_NOTICE;
-			severity = "NOTICE";
-			break;
-		case LOGINFO:
-			level = LOG_INFO;
-			severity = "INFO";
-			break;
-		default:
-			level = LOG_DEBUG;
-			severity = "DEBUG";
-			break;
+		// Write it now
+		LogRecord record = {now, level, funct, file, line, suppressed};
+		vsnprintf(record.message, sizeof(record.message), fmt, va);
+		va_end(va);
+		Log_Write(&record);
+		return;
 	}
 
-	syslog(level, "%s: %s (%s:%d) - %s", severity, funct, file, line, buffer);
+	unsigned long head = ring->head;
+	if (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+	{
+		va_end(va);
+		__atomic_add_fetch(&(ring->dropped), 1, __ATOMIC_RELAXED);
+		Metrics_Add(METRIC_LOG_DROPPED, level, 1);
+		return;
+	}
+	LogRecord * record = &(ring->records[head & (LOG_RING_SIZE-1)]);
+	record->time = now;
+	record->level = level;
+	record->funct = funct;
+	record->file = file;
+	record->line = line;
+	record->suppressed = suppressed;
+	vsnprintf(record->message, sizeof(record->message), fmt, va);
+	va_end(va);
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
 }
 
 /**
@@ -111,6 +463,14 @@ void FatalEx(const char * funct, const char * file, int line, ...)
 	if (funct == NULL)
 		funct = unspecified_funct;
 
+	// Write what was logged before this first
+	if (__atomic_load_n(&(g_log.running), __ATOMIC_ACQUIRE))
+		Log_Drain();
+	if (g_log.file != NULL)
+	{
+		fprintf(g_log.file, "FATAL: %s (%s:%d) - %s\n", funct, file, line, buffer);
+		fflush(g_log.file);
+	}
 	syslog(LOG_CRIT, "FATAL: %s (%s:%d) - %s", funct, file, line, buffer);
 
 	exit(EXIT_FAILURE);
@@ -6,8 +6,26 @@
 #ifndef _LOG_H
 #define _LOG_H
 
+/** Least urgent level of message compiled in; less urgent messages are left out of the program (eg: -DLOG_MAX_LEVEL=LOGINFO) **/
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOGDEBUG
+#endif //LOG_MAX_LEVEL
+
+/** Number of messages queued for each thread before more are dropped (must be a power of 2) **/
+#define LOG_RING_SIZE 128
+/** Longest message queued (longer messages are truncated) **/
+#define LOG_MESSAGE_SIZE 512
+/** Largest number of threads with queues; other threads log synchronously **/
+#define LOG_MAX_THREADS 64
+/** Time between writing the queued messages (ns) **/
+#define LOG_DRAIN_INTERVAL 20000000
+/** Messages from one place in the code allowed in each LOG_RATE_INTERVAL; more are counted, not logged **/
+#define LOG_RATE_BURST 10
+/** Interval over which messages are rate limited (s) **/
+#define LOG_RATE_INTERVAL 10
+
 //To get around a 'pedantic' C99 rule that you must have at least 1 variadic arg, combine fmt into that.
-#define Log(level, ...) LogEx(level, __func__, __FILE__, __LINE__, __VA_ARGS__)
+#define Log(level, ...) do { if ((level) <= LOG_MAX_LEVEL) LogEx(level, __func__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
 #define Fatal(...) FatalEx(__func__, __FILE__, __LINE__, __VA_ARGS__)
 
 /*** Macro to abort function ***/
@@ -17,6 +35,10 @@
 /** An enum to make the severity of log messages human readable in code **/
 enum {LOGERR=0, LOGWARN=1, LOGNOTE=2, LOGINFO=3,LOGDEBUG=4};
 
+extern void Log_Init(); // Start writing messages from a thread of their own
+extern void Log_Stop(); // Write any queued messages, and write messages synchronously again
+extern void Log_ThreadInit(); // Give the current thread its queue now, rather than when it first logs
+extern int Log_NumQueues(); // Number of threads' queues of messages (for metrics)
 extern void LogEx(int level, const char * funct, const char * file, int line,  ...); // General function for printing log messages to stderr
 extern void FatalEx(const char * funct, const char * file, int line, ...); // Function that deals with a fatal error (prints a message, then exits the program).
 
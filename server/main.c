@@ -10,20 +10,17 @@
 #include "actuator.h"
 #include "control.h"
 #include "pin_test.h"
-#include "bbb_pin_defines.h"
+#include "bbb_pin.h"
+#include "cache.h"
+#include "image.h"
+#include "timelapse.h"
+#include "trace.h"
+#include "realtime.h"
 
 // --- Standard headers --- //
 #include <syslog.h> // for system logging
 #include <signal.h> // for signal handling
 
-
-#ifdef REALTIME_VERSION
-#include <time.h>
-#include <sched.h>
-#include <sys/mman.h>
-#include <sys/utsname.h>
-#endif //REALTIME_VERSION
-
 // --- Variable definitions --- //
 Options g_options; // options passed to program through command line arguments
 
@@ -49,6 +46,14 @@ void ParseArguments(int argc, char ** argv)
 	g_options.auth_uri = ""; // 
 	g_options.auth_options = "";
 	g_options.experiment_dir = ".";
+	g_options.compression_level = 6; // zlib's default trade off
+	g_options.cache_size = CACHE_DEFAULT_MB;
+	g_options.stream_socket = IMAGE_STREAM_SOCKET;
+	g_options.timelapse = TIMELAPSE_INTERVAL;
+	g_options.trace = false;
+	#ifdef REALTIME_VERSION
+	g_options.realtime = REALTIME_DEFAULT;
+	#endif //REALTIME_VERSION
 	
 	for (int i = 1; i < argc; ++i)
 	{
@@ -72,6 +77,10 @@ void ParseArguments(int argc, char ** argv)
 			case 'p':
 				g_options.enable_pin = !(strtol(argv[++i], &end, 10));
 				break;
+			// Pin backend
+			case 'b':
+				g_options.pin_backend = argv[++i];
+				break;
 			// Authentication URI and options
 			case 'A':
 				g_options.auth_uri = argv[++i];
@@ -80,6 +89,34 @@ void ParseArguments(int argc, char ** argv)
 			// Experiments directory
 				g_options.experiment_dir = argv[++i];
 				break;
+			// Response compression level
+			case 'z':
+				g_options.compression_level = strtol(argv[++i], &end, 10);
+				break;
+			// Response cache size
+			case 'c':
+				g_options.cache_size = strtol(argv[++i], &end, 10);
+				break;
+			// Image stream socket
+			case 's':
+				g_options.stream_socket = argv[++i];
+				break;
+			// Time between frames recorded with experiments
+			case 't':
+				g_options.timelapse = strtod(argv[++i], &end);
+				break;
+			// Record spans for traces
+			case 'T':
+				g_options.trace = (strtol(argv[++i], &end, 10) != 0);
+				break;
+			// Log to a file instead of syslog
+			case 'l':
+				g_options.log_file = argv[++i];
+				break;
+			// Priorities and CPUs of threads (see realtime.c)
+			case 'r':
+				g_options.realtime = argv[++i];
+				break;
 			default:
 				Fatal("Unrecognised switch %s", argv[i]);
 				break;
@@ -91,6 +128,21 @@ void ParseArguments(int argc, char ** argv)
 
 
 
+	if (g_options.compression_level < 0 || g_options.compression_level > 9)
+	{
+		Fatal("Compression level must be between 0 and 9 (got %d)", g_options.compression_level);
+	}
+
+	if (g_options.cache_size < 0)
+	{
+		Fatal("Cache size must not be negative (got %d)", g_options.cache_size);
+	}
+
+	if (g_options.timelapse < 0)
+	{
+		Fatal("Timelapse interval must not be negative (got %f)", g_options.timelapse);
+	}
+
 	if (!DirExists(g_options.experiment_dir))
 	{
 		Fatal("Experiment directory '%s' does not exist.", g_options.experiment_dir);
@@ -148,6 +200,12 @@ void ParseArguments(int argc, char ** argv)
 	Log(LOGDEBUG, "Auth Options: %s", g_options.auth_options);
 	//Log(LOGDEBUG, "Root directory: %s", g_options.root_dir);
 	Log(LOGDEBUG, "Experiment directory: %s", g_options.experiment_dir);
+	Log(LOGDEBUG, "Compression level: %d", g_options.compression_level);
+	Log(LOGDEBUG, "Cache size: %d MiB", g_options.cache_size);
+	Log(LOGDEBUG, "Stream socket: %s", g_options.stream_socket);
+	Log(LOGDEBUG, "Trace: %d", g_options.trace);
+	Log(LOGDEBUG, "Log file: %s", (g_options.log_file != NULL) ? g_options.log_file : "(syslog)");
+	Log(LOGDEBUG, "Real-time: %s", (g_options.realtime != NULL) ? g_options.realtime : "");
 
 
 	
@@ -161,41 +219,12 @@ void Cleanup()
 	Log(LOGDEBUG, "Begin cleanup.");
 	Sensor_Cleanup();
 	Actuator_Cleanup();
+	Image_Cleanup();
+	Cache_Cleanup();
 	Log(LOGDEBUG, "Finish cleanup.");
 }
 
 
-#ifdef REALTIME_VERSION
-
-#define MAX_SAFE_STACK (8*1024)
-#define NSEC_PER_SEC (1000000000)
-
-void stack_prefault()
-{
-	unsigned char dummy[MAX_SAFE_STACK];
-	memset(dummy, 0, MAX_SAFE_STACK);
-	return;
-}
-
-bool is_realtime()
-{
-	struct utsname u;
-	bool crit1 = 0;
-	bool crit2 = 0;
-	FILE * f;
-	uname(&u);
-	crit1 = (strcasestr(u.version, "PREEMPT RT") != NULL);
-	if (crit1 && ((f = fopen("/sys/kernel/realtime", "r")) != NULL))
-	{
-		int flag;
-		crit2 = ((fscanf(f, "%d", &flag) == 1) && (flag == 1));
-		fclose(f);
-	}
-	return (crit1 && crit2);
-}
-
-#endif //REALTIME_VERSION
-
 /**
  * Main entry point; start worker threads, setup signal handling, wait for threads to exit, exit
  * @param argc - Num args
@@ -210,6 +239,10 @@ int main(int argc, char ** argv)
 	openlog("mctxserv", LOG_PID | LOG_PERROR, LOG_USER);
 
 	ParseArguments(argc, argv); // Setup the g_options structure from program arguments
+	Realtime_Init(g_options.realtime); // Before any threads are started
+	Trace_Init();
+	Log_Init();
+	Cache_Init((size_t)g_options.cache_size * 1024 * 1024);
 
 	Log(LOGINFO, "Server started");
 
@@ -217,7 +250,7 @@ int main(int argc, char ** argv)
 	
 	#ifdef REALTIME_VERSION
 	
-	if (is_realtime())
+	if (Realtime_KernelIsRT())
 	{
 		Log(LOGDEBUG, "Running under realtime kernel");
 	}
@@ -225,18 +258,14 @@ int main(int argc, char ** argv)
 	{
 		Fatal("Not running under realtime kernel");
 	}
-	struct sched_param param;
-	param.sched_priority = 49;
-	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
-		Fatal("sched_setscheduler failed - %s", strerror(errno));
-	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
-		Fatal("mlockall failed - %s", strerror(errno));
-	stack_prefault();
 	#endif //REALTIME_VERSION
 
 	
 
+	if (!Pin_SetBackend(g_options.pin_backend))
+		Fatal("Couldn't set the pin backend");
 	Pin_Init();
+	Image_Init();
 	
 	// Try and start things
 	
@@ -259,6 +288,7 @@ int main(int argc, char ** argv)
 	Pin_Close();
 
 	Cleanup();
+	Log_Stop();
 	return 0;
 }
 
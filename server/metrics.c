@@ -0,0 +1,291 @@
+/**
+ * @file metrics.c
+ * @brief Counters, gauges and histograms of what the server is doing, served in Prometheus' text format.
+ * Counting must be cheap enough to do on every sample, so each thread adds to its own shard
+ * of the counters without locking, and the shards are only summed when the metrics are requested.
+ */
+
+#include "metrics.h"
+#include "sensor.h"
+#include "actuator.h"
+#include "image.h"
+
+#include <stdint.h>
+
+/** Function giving the value of the label of a metric; NULL if the metric has no value for the index **/
+typedef const char * (*MetricLabelFn)(int index, char * buffer, size_t size);
+
+/** Description of a metric **/
+typedef struct
+{
+	/** Name, as Prometheus knows it **/
+	const char * name;
+	/** Description **/
+	const char * help;
+	/** Name of the label; NULL if the metric has no label **/
+	const char * label;
+	/** Values of the label **/
+	MetricLabelFn label_value;
+} MetricInfo;
+
+/** A copy of the counters and histograms, added to by the threads that use it **/
+typedef struct
+{
+	int64_t counters[METRIC_NUM_COUNTERS][METRICS_MAX_LABELS];
+	/** Number of durations in each bucket; the last is for those longer than every bound **/
+	int64_t buckets[METRIC_NUM_HISTOGRAMS][METRICS_MAX_LABELS][METRICS_NUM_BUCKETS + 1];
+	/** Sum of the durations (ns) **/
+	int64_t sums[METRIC_NUM_HISTOGRAMS][METRICS_MAX_LABELS];
+} __attribute__((aligned(64))) MetricsShard;
+
+static const char * Metrics_NoLabel(int index, char * buffer, size_t size);
+static const char * Metrics_SensorLabel(int index, char * buffer, size_t size);
+static const char * Metrics_ActuatorLabel(int index, char * buffer, size_t size);
+static const char * Metrics_CameraLabel(int index, char * buffer, size_t size);
+static const char * Metrics_LevelLabel(int index, char * buffer, size_t size);
+static const char * Metrics_LogQueueLabel(int index, char * buffer, size_t size);
+static const char * Metrics_ModuleLabel(int index, char * buffer, size_t size);
+
+static const MetricInfo g_counter_info[METRIC_NUM_COUNTERS] = {
+	[METRIC_SENSOR_SAMPLES] = {"mctx_sensor_samples_total", "Values read from each sensor", "sensor", Metrics_SensorLabel},
+	[METRIC_SENSOR_READ_FAILURES] = {"mctx_sensor_read_failures_total", "Reads of each sensor that failed", "sensor", Metrics_SensorLabel},
+	[METRIC_SENSOR_STORED] = {"mctx_sensor_stored_total", "DataPoints saved for each sensor", "sensor", Metrics_SensorLabel},
+	[METRIC_SENSOR_OVERRUNS] = {"mctx_sensor_overruns_total", "Reads of each sensor that took longer than its sampling period", "sensor", Metrics_SensorLabel},
+	[METRIC_DATA_BYTES_WRITTEN] = {"mctx_data_written_bytes_total", "Bytes saved to DataFiles", NULL, Metrics_NoLabel},
+	[METRIC_EXPORT_CHUNKS] = {"mctx_export_chunks_total", "Chunks of DataPoints printed by the export workers", NULL, Metrics_NoLabel},
+	[METRIC_EXPORT_WAITS] = {"mctx_export_chunk_waits_total", "Chunks that weren't formatted when they were next to be printed", NULL, Metrics_NoLabel},
+	[METRIC_CAMERA_FRAMES_CAPTURED] = {"mctx_camera_frames_captured_total", "Frames captured by each camera", "camera", Metrics_CameraLabel},
+	[METRIC_CAMERA_FRAMES_DROPPED] = {"mctx_camera_frames_dropped_total", "Frames dropped because every buffer was being read", "camera", Metrics_CameraLabel},
+	[METRIC_IMAGE_FRAMES_ENCODED] = {"mctx_image_frames_encoded_total", "Frames of each camera encoded as JPEG", "camera", Metrics_CameraLabel},
+	[METRIC_LOG_MESSAGES] = {"mctx_log_messages_total", "Messages logged at each level", "level", Metrics_LevelLabel},
+	[METRIC_LOG_SUPPRESSED] = {"mctx_log_suppressed_total", "Messages at each level suppressed by rate limiting", "level", Metrics_LevelLabel},
+	[METRIC_LOG_DROPPED] = {"mctx_log_dropped_total", "Messages at each level dropped because their thread's queue was full", "level", Metrics_LevelLabel}
+};
+
+static const MetricInfo g_gauge_info[METRIC_NUM_GAUGES] = {
+	[METRIC_CAMERA_BUFFERS_IN_USE] = {"mctx_camera_buffers_in_use", "Frame buffers holding the latest frame or being read", "camera", Metrics_CameraLabel},
+	[METRIC_EXPORT_RING_DEPTH] = {"mctx_export_ring_depth", "Chunks in the export ring not yet printed", NULL, Metrics_NoLabel},
+	[METRIC_LOG_QUEUE_DEPTH] = {"mctx_log_queue_depth", "Messages waiting in each thread's log queue (the first few queues)", "queue", Metrics_LogQueueLabel}
+};
+
+static const MetricInfo g_histogram_info[METRIC_NUM_HISTOGRAMS] = {
+	[METRIC_FCGI_DURATION] = {"mctx_fcgi_request_duration_seconds", "Time to handle a request to each module", "module", Metrics_ModuleLabel},
+	[METRIC_ACTUATOR_SET_DURATION] = {"mctx_actuator_set_duration_seconds", "Time taken to set each actuator", "actuator", Metrics_ActuatorLabel}
+};
+
+static MetricsShard g_shards[METRICS_SHARDS];
+/** Shard that the next thread to count something uses **/
+static unsigned g_next_shard = 0;
+/** Shard of the current thread **/
+static __thread MetricsShard * t_shard = NULL;
+
+static long g_gauges[METRIC_NUM_GAUGES][METRICS_MAX_LABELS];
+
+static const double g_bounds[METRICS_NUM_BUCKETS] = METRICS_BUCKETS;
+
+/**
+ * Get the shard of the current thread; threads are given shards in turn as they first count something
+ */
+static MetricsShard * Metrics_Shard()
+{
+	if (t_shard == NULL)
+		t_shard = &(g_shards[__atomic_fetch_add(&g_next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS]);
+	return t_shard;
+}
+
+/**
+ * Add to a counter
+ * @param counter - The counter
+ * @param label - Index of the label's value (eg: sensor id); 0 if it has no label
+ * @param amount - Amount to add
+ */
+void Metrics_Add(MetricCounter counter, int label, long amount)
+{
+	if (label < 0 || label >= METRICS_MAX_LABELS)
+		return;
+	__atomic_fetch_add(&(Metrics_Shard()->counters[counter][label]), amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set a gauge
+ * @param gauge - The gauge
+ * @param label - Index of the label's value; 0 if it has no label
+ * @param value - Its value
+ */
+void Metrics_Set(MetricGauge gauge, int label, long value)
+{
+	if (label < 0 || label >= METRICS_MAX_LABELS)
+		return;
+	__atomic_store_n(&(g_gauges[gauge][label]), value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add a duration to a histogram
+ * @param histogram - The histogram
+ * @param label - Index of the label's value; 0 if it has no label
+ * @param seconds - The duration (s)
+ */
+void Metrics_Observe(MetricHistogram histogram, int label, double seconds)
+{
+	if (label < 0 || label >= METRICS_MAX_LABELS)
+		return;
+	int bucket = 0;
+	while (bucket < METRICS_NUM_BUCKETS && seconds > g_bounds[bucket])
+		++bucket;
+	MetricsShard * shard = Metrics_Shard();
+	__atomic_fetch_add(&(shard->buckets[histogram][label][bucket]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(shard->sums[histogram][label]), (int64_t)(1e9 * seconds), __ATOMIC_RELAXED);
+}
+
+/** Value of the label of a metric without one **/
+static const char * Metrics_NoLabel(int index, char * buffer, size_t size)
+{
+	return (index == 0) ? "" : NULL;
+}
+
+/** Name of a sensor **/
+static const char * Metrics_SensorLabel(int index, char * buffer, size_t size)
+{
+	return (index < g_num_sensors) ? Sensor_GetName(index) : NULL;
+}
+
+/** Name of an actuator **/
+static const char * Metrics_ActuatorLabel(int index, char * buffer, size_t size)
+{
+	return (index < g_num_actuators) ? Actuator_GetName(index) : NULL;
+}
+
+/** Number of a camera **/
+static const char * Metrics_CameraLabel(int index, char * buffer, size_t size)
+{
+	if (index >= CAMERA_MAX)
+		return NULL;
+	snprintf(buffer, size, "%d", index);
+	return buffer;
+}
+
+/** Name of a log level **/
+static const char * Metrics_LevelLabel(int index, char * buffer, size_t size)
+{
+	const char * levels[] = {"error", "warning", "notice", "info", "debug"};
+	return (index < sizeof(levels)/sizeof(levels[0])) ? levels[index] : NULL;
+}
+
+/** Number of a thread's log queue **/
+static const char * Metrics_LogQueueLabel(int index, char * buffer, size_t size)
+{
+	if (index >= Log_NumQueues())
+		return NULL;
+	snprintf(buffer, size, "%d", index);
+	return buffer;
+}
+
+/** Name of a module **/
+static const char * Metrics_ModuleLabel(int index, char * buffer, size_t size)
+{
+	return FCGI_GetModuleName(index);
+}
+
+/**
+ * Print the HELP and TYPE lines of a metric
+ */
+static void Metrics_PrintHeader(const MetricInfo * info, const char * type)
+{
+	FCGI_PrintRaw("# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, type);
+}
+
+/**
+ * Print the labels of a value of a metric
+ * @param info - The metric
+ * @param value - Value of its label
+ * @param le - Upper bound of a histogram bucket; NULL if not a bucket
+ */
+static void Metrics_PrintLabels(const MetricInfo * info, const char * value, const char * le)
+{
+	if (info->label != NULL && le != NULL)
+		FCGI_PrintRaw("{%s=\"%s\",le=\"%s\"}", info->label, value, le);
+	else if (info->label != NULL)
+		FCGI_PrintRaw("{%s=\"%s\"}", info->label, value);
+	else if (le != NULL)
+		FCGI_PrintRaw("{le=\"%s\"}", le);
+}
+
+/**
+ * Handle a request for the metrics; prints every metric in Prometheus' text exposition format
+ * @param context - The context to work in
+ * @param params - Parameters passed (none are used)
+ */
+void Metrics_Handler(FCGIContext * context, char * params)
+{
+	char buffer[32];
+	FCGI_BeginBody(context, "text/plain; version=0.0.4", true);
+
+	for (int c = 0; c < METRIC_NUM_COUNTERS; ++c)
+	{
+		const MetricInfo * info = &(g_counter_info[c]);
+		Metrics_PrintHeader(info, "counter");
+		for (int l = 0; l < METRICS_MAX_LABELS; ++l)
+		{
+			const char * value = info->label_value(l, buffer, sizeof(buffer));
+			if (value == NULL)
+				continue;
+			int64_t total = 0;
+			for (int s = 0; s < METRICS_SHARDS; ++s)
+				total += __atomic_load_n(&(g_shards[s].counters[c][l]), __ATOMIC_RELAXED);
+			FCGI_PrintRaw("%s", info->name);
+			Metrics_PrintLabels(info, value, NULL);
+			FCGI_PrintRaw(" %lld\n", (long long)total);
+		}
+	}
+
+	for (int g = 0; g < METRIC_NUM_GAUGES; ++g)
+	{
+		const MetricInfo * info = &(g_gauge_info[g]);
+		Metrics_PrintHeader(info, "gauge");
+		for (int l = 0; l < METRICS_MAX_LABELS; ++l)
+		{
+			const char * value = info->label_value(l, buffer, sizeof(buffer));
+			if (value == NULL)
+				continue;
+			FCGI_PrintRaw("%s", info->name);
+			Metrics_PrintLabels(info, value, NULL);
+			FCGI_PrintRaw(" %ld\n", __atomic_load_n(&(g_gauges[g][l]), __ATOMIC_RELAXED));
+		}
+	}
+
+	for (int h = 0; h < METRIC_NUM_HISTOGRAMS; ++h)
+	{
+		const MetricInfo * info = &(g_histogram_info[h]);
+		Metrics_PrintHeader(info, "histogram");
+		for (int l = 0; l < METRICS_MAX_LABELS; ++l)
+		{
+			const char * value = info->label_value(l, buffer, sizeof(buffer));
+			if (value == NULL)
+				continue;
+			int64_t count = 0, sum = 0;
+			for (int b = 0; b <= METRICS_NUM_BUCKETS; ++b)
+			{
+				// Buckets are cumulative
+				for (int s = 0; s < METRICS_SHARDS; ++s)
+					count += __atomic_load_n(&(g_shards[s].buckets[h][l][b]), __ATOMIC_RELAXED);
+				char le[32];
+				if (b < METRICS_NUM_BUCKETS)
+					snprintf(le, sizeof(le), "%g", g_bounds[b]);
+				else
+					strcpy(le, "+Inf");
+				FCGI_PrintRaw("%s_bucket", info->name);
+				Metrics_PrintLabels(info, value, le);
+				FCGI_PrintRaw(" %lld\n", (long long)count);
+			}
+			for (int s = 0; s < METRICS_SHARDS; ++s)
+				sum += __atomic_load_n(&(g_shards[s].sums[h][l]), __ATOMIC_RELAXED);
+			FCGI_PrintRaw("%s_sum", info->name);
+			Metrics_PrintLabels(info, value, NULL);
+			FCGI_PrintRaw(" %.9f\n%s_count", 1e-9 * sum, info->name);
+			Metrics_PrintLabels(info, value, NULL);
+			FCGI_PrintRaw(" %lld\n", (long long)count);
+		}
+	}
+}
+
+//EOF
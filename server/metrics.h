@@ -0,0 +1,63 @@
+/**
+ * @file metrics.h
+ * @brief Declarations for counters, gauges and histograms of what the server is doing, served in Prometheus' text format
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "common.h"
+
+/** Number of copies of each counter; each thread adds to one, so they don't fight over cache lines **/
+#define METRICS_SHARDS 16
+/** Largest number of values of the label of a metric (sensors, modules...) **/
+#define METRICS_MAX_LABELS 16
+/** Upper bounds of the buckets of the duration histograms (s) **/
+#define METRICS_BUCKETS {1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 1.0}
+/** Number of buckets (not counting +Inf) **/
+#define METRICS_NUM_BUCKETS 15
+
+/** Counters; only ever increase **/
+typedef enum
+{
+	METRIC_SENSOR_SAMPLES, /** Values read from each sensor */
+	METRIC_SENSOR_READ_FAILURES, /** Reads of each sensor that failed */
+	METRIC_SENSOR_STORED, /** DataPoints saved for each sensor */
+	METRIC_SENSOR_OVERRUNS, /** Reads of each sensor that took longer than its sampling period */
+	METRIC_DATA_BYTES_WRITTEN, /** Bytes saved to all DataFiles */
+	METRIC_EXPORT_CHUNKS, /** Chunks printed by the export workers (see data.c) */
+	METRIC_EXPORT_WAITS, /** Chunks that weren't formatted when they were next to be printed */
+	METRIC_CAMERA_FRAMES_CAPTURED, /** Frames captured by each camera */
+	METRIC_CAMERA_FRAMES_DROPPED, /** Frames of each camera dropped because every buffer was being read */
+	METRIC_IMAGE_FRAMES_ENCODED, /** Frames of each camera encoded as JPEG */
+	METRIC_LOG_MESSAGES, /** Log messages of each level */
+	METRIC_LOG_SUPPRESSED, /** Log messages of each level suppressed by rate limiting */
+	METRIC_LOG_DROPPED, /** Log messages of each level dropped because their thread's queue was full */
+	METRIC_NUM_COUNTERS /** Number of counters; not a counter */
+} MetricCounter;
+
+/** Gauges; the last value set **/
+typedef enum
+{
+	METRIC_CAMERA_BUFFERS_IN_USE, /** Frame buffers of each camera holding the latest frame or being read */
+	METRIC_EXPORT_RING_DEPTH, /** Chunks in the export ring that are queued, being formatted or formatted but not yet printed */
+	METRIC_LOG_QUEUE_DEPTH, /** Messages waiting in each thread's log queue when the log thread last looked */
+	METRIC_NUM_GAUGES /** Number of gauges; not a gauge */
+} MetricGauge;
+
+/** Histograms of durations **/
+typedef enum
+{
+	METRIC_FCGI_DURATION, /** Time to handle a request, for each module */
+	METRIC_ACTUATOR_SET_DURATION, /** Time taken to set each actuator */
+	METRIC_NUM_HISTOGRAMS /** Number of histograms; not a histogram */
+} MetricHistogram;
+
+extern void Metrics_Add(MetricCounter counter, int label, long amount); // Add to a counter
+extern void Metrics_Set(MetricGauge gauge, int label, long value); // Set a gauge
+extern void Metrics_Observe(MetricHistogram histogram, int label, double seconds); // Add a duration to a histogram
+extern void Metrics_Handler(FCGIContext * context, char * params); // Handle a FCGI request for the metrics
+
+#endif //_METRICS_H
+
+//EOF
@@ -21,6 +21,9 @@ typedef struct
 
 	/** Whether or not to enable the pin_test module **/
 	bool enable_pin;
+
+	/** Backend for the pins; "sysfs" or "sim[:config]" (NULL for the default) **/
+	const char * pin_backend;
 	
 	/** URI for authentication **/
 	const char * auth_uri;
@@ -33,6 +36,27 @@ typedef struct
 
 	/** Experiments directory **/
 	const char *experiment_dir;
+
+	/** zlib compression level for responses (0 disables compression) **/
+	int compression_level;
+
+	/** Memory budget for the response cache in MiB (0 disables the cache) **/
+	int cache_size;
+
+	/** Address (host:port) of the socket that image streams are served on ("0" to disable) **/
+	const char * stream_socket;
+
+	/** Time between frames recorded from the cameras during an experiment (s; 0 to disable) **/
+	double timelapse;
+
+	/** Whether spans are recorded for traces from the start (see trace.c); off unless -T 1 is given **/
+	bool trace;
+
+	/** File log messages are appended to instead of syslog, or NULL **/
+	const char * log_file;
+
+	/** Priorities and CPUs of each role of thread (see realtime.c), or NULL **/
+	const char * realtime;
 } Options;
 
 /** The only instance of the Options struct **/
@@ -0,0 +1,740 @@
+/**
+ * @file pin_sim.c
+ * @brief Simulates the sysfs files of the GPIO, PWM and ADC pins in memory, so that everything above the
+ * pins can be run and load tested on machines that aren't the BBB.
+ * The files behave like the real ones; pins must be exported before their files can be opened, a PWM has
+ * to be stopped to change its period or polarity, and so on. ADCs and GPIO inputs read signals that are
+ * generated from waveforms, or that respond to a PWM like a first order system. Every access can be
+ * delayed, to stand in for the time the real files take.
+ */
+
+#include "pin_sim.h"
+#include "waveform.h"
+#include <fcntl.h>
+#include <math.h>
+
+/** Kinds of simulated file **/
+typedef enum
+{
+	SIM_GPIO_EXPORT,
+	SIM_GPIO_UNEXPORT,
+	SIM_GPIO_DIRECTION,
+	SIM_GPIO_VALUE,
+	SIM_PWM_EXPORT,
+	SIM_PWM_UNEXPORT,
+	SIM_PWM_RUN,
+	SIM_PWM_POLARITY,
+	SIM_PWM_PERIOD,
+	SIM_PWM_DUTY,
+	SIM_ADC_VALUE
+} SimFileType;
+
+/** An open simulated file **/
+typedef struct
+{
+	bool open;
+	SimFileType type;
+	/** Number of the pin the file is for **/
+	int num;
+	/** Flags the file was opened with **/
+	int flags;
+} SimFile;
+
+/** Kinds of simulated signal **/
+typedef enum
+{
+	/** Reads as the value last written, or 0 **/
+	SIM_SIGNAL_NONE,
+	/** A waveform, repeated from when the simulator was configured **/
+	SIM_SIGNAL_WAVE,
+	/** First order response to the duty of a PWM **/
+	SIM_SIGNAL_PLANT
+} SimSignalType;
+
+/** A signal read by an ADC or GPIO input **/
+typedef struct
+{
+	SimSignalType type;
+	/** For SIM_SIGNAL_WAVE, the waveform **/
+	Waveform wave;
+	/** For SIM_SIGNAL_PLANT, the PWM that drives the signal **/
+	int pwm;
+	/** For SIM_SIGNAL_PLANT, the change in the signal from 0% to 100% duty **/
+	double gain;
+	/** For SIM_SIGNAL_PLANT, the signal at 0% duty, or with the PWM stopped **/
+	double offset;
+	/** For SIM_SIGNAL_PLANT, time constant of the response (s) **/
+	double tau;
+	/** For SIM_SIGNAL_PLANT, the signal when it was last read **/
+	double value;
+	/** For SIM_SIGNAL_PLANT, when the signal was last read **/
+	struct timespec time;
+} SimSignal;
+
+/** A simulated GPIO pin **/
+typedef struct
+{
+	bool exported;
+	bool output;
+	bool value;
+	/** Signal read while the pin is an input **/
+	SimSignal input;
+} SimGPIO;
+
+/** A simulated PWM pin **/
+typedef struct
+{
+	bool exported;
+	bool running;
+	bool polarity;
+	/** Period (ns) **/
+	long period;
+	/** Duty (ns) **/
+	long duty;
+} SimPWM;
+
+/** Mutex around all of the simulator's state **/
+static pthread_mutex_t g_sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Open files; file descriptors are indexes offset by PIN_SIM_FD_BASE **/
+static SimFile g_sim_files[PIN_SIM_MAX_FILES];
+/** GPIO pins, by GPIO number **/
+static SimGPIO g_sim_gpio[GPIO_MAX_NUMBER+1];
+/** PWM pins **/
+static SimPWM g_sim_pwm[PWM_NUM_PINS];
+/** Signals read by the ADCs (counts) **/
+static SimSignal g_sim_adc[ADC_NUM_PINS];
+/** When the simulator was configured; the waveforms start here **/
+static struct timespec g_sim_start;
+/** Time taken by each read (s) **/
+static double g_sim_read_latency = 0;
+/** Time taken by each write (s) **/
+static double g_sim_write_latency = 0;
+/** Largest random time added to each read or write (s) **/
+static double g_sim_jitter = 0;
+/** Standard deviation of the noise added to ADC readings (counts) **/
+static double g_sim_noise = 0;
+/** Seed for the jitter and noise **/
+static unsigned g_sim_seed = 1;
+
+/**
+ * Get the simulated file for a file descriptor. Call with g_sim_mutex held.
+ * @param fd - The file descriptor
+ * @returns The file, or NULL if fd isn't open
+ */
+static SimFile * PinSim_File(int fd)
+{
+	int index = fd - PIN_SIM_FD_BASE;
+	if (index < 0 || index >= PIN_SIM_MAX_FILES || !g_sim_files[index].open)
+		return NULL;
+	return &(g_sim_files[index]);
+}
+
+/**
+ * Check if a simulated file still exists; the files of a pin disappear when it is unexported.
+ * Call with g_sim_mutex held.
+ * @param file - The file
+ * @returns true if the file exists
+ */
+static bool PinSim_Exists(const SimFile * file)
+{
+	switch (file->type)
+	{
+		case SIM_GPIO_DIRECTION:
+		case SIM_GPIO_VALUE:
+			return g_sim_gpio[file->num].exported;
+		case SIM_PWM_RUN:
+		case SIM_PWM_POLARITY:
+		case SIM_PWM_PERIOD:
+		case SIM_PWM_DUTY:
+			return g_sim_pwm[file->num].exported;
+		default:
+			return true;
+	}
+}
+
+/**
+ * Helper: Get the part of a path under a directory
+ * @param path - The path
+ * @param dir - The directory
+ * @returns The rest of the path, or NULL if it isn't under dir
+ */
+static const char * PinSim_Under(const char * path, const char * dir)
+{
+	size_t len = strlen(dir);
+	while (len > 0 && dir[len-1] == '/')
+		--len;
+	if (strncmp(path, dir, len) != 0 || path[len] != '/')
+		return NULL;
+	path += len;
+	while (*path == '/')
+		++path;
+	return path;
+}
+
+/**
+ * Work out which simulated file a path is. Call with g_sim_mutex held.
+ * @param path - The path
+ * @param file - Set to the type and pin number of the file
+ * @returns false if there is no such file
+ */
+static bool PinSim_Lookup(const char * path, SimFile * file)
+{
+	const char * name;
+	char attr[16];
+	int end = 0;
+
+	if ((name = PinSim_Under(path, GPIO_DEVICE_PATH)) != NULL)
+	{
+		if (strcmp(name, "export") == 0)
+			file->type = SIM_GPIO_EXPORT;
+		else if (strcmp(name, "unexport") == 0)
+			file->type = SIM_GPIO_UNEXPORT;
+		else if (sscanf(name, "gpio%d/%15s%n", &(file->num), attr, &end) != 2 || name[end] != '\0'
+			|| file->num < 0 || file->num > GPIO_MAX_NUMBER || !g_sim_gpio[file->num].exported)
+			return false;
+		else if (strcmp(attr, "direction") == 0)
+			file->type = SIM_GPIO_DIRECTION;
+		else if (strcmp(attr, "value") == 0)
+			file->type = SIM_GPIO_VALUE;
+		else
+			return false;
+		return true;
+	}
+
+	if ((name = PinSim_Under(path, PWM_DEVICE_PATH)) != NULL)
+	{
+		if (strcmp(name, "export") == 0)
+			file->type = SIM_PWM_EXPORT;
+		else if (strcmp(name, "unexport") == 0)
+			file->type = SIM_PWM_UNEXPORT;
+		else if (sscanf(name, "pwm%d/%15s%n", &(file->num), attr, &end) != 2 || name[end] != '\0'
+			|| file->num < 0 || file->num >= PWM_NUM_PINS || !g_sim_pwm[file->num].exported)
+			return false;
+		else if (strcmp(attr, "run") == 0)
+			file->type = SIM_PWM_RUN;
+		else if (strcmp(attr, "polarity") == 0)
+			file->type = SIM_PWM_POLARITY;
+		else if (strcmp(attr, "period_ns") == 0)
+			file->type = SIM_PWM_PERIOD;
+		else if (strcmp(attr, "duty_ns") == 0)
+			file->type = SIM_PWM_DUTY;
+		else
+			return false;
+		return true;
+	}
+
+	if ((name = PinSim_Under(path, ADC_DEVICE_PATH)) != NULL)
+	{
+		if (sscanf(name, "in_voltage%d_raw%n", &(file->num), &end) != 1 || end == 0 || name[end] != '\0'
+			|| file->num < 0 || file->num >= ADC_NUM_PINS)
+			return false;
+		file->type = SIM_ADC_VALUE;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Get the current value of a signal. Call with g_sim_mutex held.
+ * @param signal - The signal
+ * @param unset - Value if no signal is configured
+ * @returns The value
+ */
+static double PinSim_Signal(SimSignal * signal, double unset)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	switch (signal->type)
+	{
+		case SIM_SIGNAL_WAVE:
+			return Waveform_Value(&(signal->wave), (long)(TIMEVAL_DIFF(now, g_sim_start) / signal->wave.step));
+		case SIM_SIGNAL_PLANT:
+		{
+			SimPWM * pwm = &(g_sim_pwm[signal->pwm]);
+			double duty = (pwm->running && pwm->period > 0) ? (double)(pwm->duty) / pwm->period : 0;
+			double target = signal->offset + signal->gain * duty;
+			double dt = TIMEVAL_DIFF(now, signal->time);
+			signal->value += (target - signal->value) * ((signal->tau > 0) ? 1 - exp(-dt / signal->tau) : 1);
+			signal->time = now;
+			return signal->value;
+		}
+		default:
+			return unset;
+	}
+}
+
+/**
+ * Get a sample of the noise added to ADC readings. Call with g_sim_mutex held.
+ * @returns The noise (counts)
+ */
+static double PinSim_Noise()
+{
+	if (g_sim_noise <= 0)
+		return 0;
+	// Box-Muller transform
+	double u1 = (rand_r(&g_sim_seed) + 1.0) / (RAND_MAX + 2.0);
+	double u2 = rand_r(&g_sim_seed) / (RAND_MAX + 1.0);
+	return g_sim_noise * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+/**
+ * Take the time that an access to a file takes
+ * @param latency - The time (s), to which the jitter is added
+ */
+static void PinSim_Delay(double latency)
+{
+	pthread_mutex_lock(&g_sim_mutex);
+	if (g_sim_jitter > 0)
+		latency += g_sim_jitter * rand_r(&g_sim_seed) / RAND_MAX;
+	pthread_mutex_unlock(&g_sim_mutex);
+	if (latency <= 0)
+		return;
+
+	struct timespec delay;
+	DOUBLE_TO_TIMEVAL(latency, &delay);
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &delay, &delay) == EINTR);
+}
+
+/**
+ * Open a simulated file
+ * @param path - Path of the file
+ * @param flags - O_RDONLY, O_WRONLY or O_RDWR
+ * @returns A file descriptor, or -1 with errno set
+ */
+static int PinSim_Open(const char * path, int flags)
+{
+	int fd = -1;
+	int error = ENOENT;
+	SimFile file = {true, SIM_GPIO_EXPORT, 0, flags};
+
+	pthread_mutex_lock(&g_sim_mutex);
+	if (PinSim_Lookup(path, &file))
+	{
+		error = EMFILE;
+		for (int i = 0; i < PIN_SIM_MAX_FILES; ++i)
+		{
+			if (!g_sim_files[i].open)
+			{
+				g_sim_files[i] = file;
+				fd = PIN_SIM_FD_BASE + i;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_sim_mutex);
+
+	if (fd < 0)
+		errno = error;
+	return fd;
+}
+
+/**
+ * Read from a simulated file
+ * @param fd - The file
+ * @param buf - Buffer to read into
+ * @param count - Size of the buffer
+ * @param offset - Where to start reading
+ * @returns The number of bytes read, or -1 with errno set
+ */
+static ssize_t PinSim_Read(int fd, void * buf, size_t count, off_t offset)
+{
+	char str[32];
+	int len = 0;
+	int error = 0;
+
+	pthread_mutex_lock(&g_sim_mutex);
+	double latency = g_sim_read_latency;
+	SimFile * file = PinSim_File(fd);
+	if (file == NULL || (file->flags & O_ACCMODE) == O_WRONLY)
+	{
+		error = EBADF;
+	}
+	else if (!PinSim_Exists(file))
+	{
+		error = ENODEV;
+	}
+	else
+	{
+		SimGPIO * gpio = &(g_sim_gpio[file->num]);
+		SimPWM * pwm = (file->num < PWM_NUM_PINS) ? &(g_sim_pwm[file->num]) : NULL;
+		switch (file->type)
+		{
+			case SIM_GPIO_DIRECTION:
+				len = snprintf(str, sizeof(str), "%s\n", gpio->output ? "out" : "in");
+				break;
+			case SIM_GPIO_VALUE:
+			{
+				bool value = gpio->output ? gpio->value : (PinSim_Signal(&(gpio->input), gpio->value) > 0.5);
+				len = snprintf(str, sizeof(str), "%d\n", value);
+				break;
+			}
+			case SIM_PWM_RUN:
+				len = snprintf(str, sizeof(str), "%d\n", pwm->running);
+				break;
+			case SIM_PWM_POLARITY:
+				len = snprintf(str, sizeof(str), "%d\n", pwm->polarity);
+				break;
+			case SIM_PWM_PERIOD:
+				len = snprintf(str, sizeof(str), "%ld\n", pwm->period);
+				break;
+			case SIM_PWM_DUTY:
+				len = snprintf(str, sizeof(str), "%ld\n", pwm->duty);
+				break;
+			case SIM_ADC_VALUE:
+			{
+				double value = round(PinSim_Signal(&(g_sim_adc[file->num]), 0) + PinSim_Noise());
+				value = (value < 0) ? 0 : (value > PIN_SIM_ADC_MAX) ? PIN_SIM_ADC_MAX : value;
+				len = snprintf(str, sizeof(str), "%d\n", (int)(value));
+				break;
+			}
+			default:
+				// The export files can only be written
+				error = EIO;
+				break;
+		}
+	}
+	pthread_mutex_unlock(&g_sim_mutex);
+
+	PinSim_Delay(latency);
+	if (error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+	if (offset >= len)
+		return 0;
+	if (count > (size_t)(len - offset))
+		count = len - offset;
+	memcpy(buf, str + offset, count);
+	return count;
+}
+
+/**
+ * Write to a simulated file. Like the real files, the whole value must be written at once.
+ * @param fd - The file
+ * @param buf - The value
+ * @param count - Length of the value
+ * @param offset - Ignored
+ * @returns count, or -1 with errno set
+ */
+static ssize_t PinSim_Write(int fd, const void * buf, size_t count, off_t offset)
+{
+	char str[32];
+	if (count >= sizeof(str))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(str, buf, count);
+	str[count] = '\0';
+	while (count > 0 && (str[count-1] == '\n' || str[count-1] == ' '))
+		str[--count] = '\0';
+	char * end;
+	long value = strtol(str, &end, 10);
+	bool number = (count > 0 && *end == '\0');
+	int error = 0;
+
+	pthread_mutex_lock(&g_sim_mutex);
+	double latency = g_sim_write_latency;
+	SimFile * file = PinSim_File(fd);
+	if (file == NULL || (file->flags & O_ACCMODE) == O_RDONLY)
+	{
+		error = EBADF;
+	}
+	else if (!PinSim_Exists(file))
+	{
+		error = ENODEV;
+	}
+	else
+	{
+		SimGPIO * gpio = &(g_sim_gpio[file->num]);
+		SimPWM * pwm = (file->num < PWM_NUM_PINS) ? &(g_sim_pwm[file->num]) : NULL;
+		switch (file->type)
+		{
+			case SIM_GPIO_EXPORT:
+			case SIM_GPIO_UNEXPORT:
+			{
+				bool export = (file->type == SIM_GPIO_EXPORT);
+				if (!number || value < 0 || value > GPIO_MAX_NUMBER)
+					error = EINVAL;
+				else if (g_sim_gpio[value].exported == export)
+					error = export ? EBUSY : EINVAL;
+				else
+				{
+					g_sim_gpio[value].exported = export;
+					g_sim_gpio[value].output = false;
+					g_sim_gpio[value].value = false;
+				}
+				break;
+			}
+			case SIM_GPIO_DIRECTION:
+				if (strcmp(str, "out") == 0)
+				{
+					gpio->output = true;
+					gpio->value = false;
+				}
+				else if (strcmp(str, "in") == 0)
+					gpio->output = false;
+				else
+					error = EINVAL;
+				break;
+			case SIM_GPIO_VALUE:
+				if (!gpio->output)
+					error = EPERM;
+				else if (!number)
+					error = EINVAL;
+				else
+					gpio->value = (value != 0);
+				break;
+			case SIM_PWM_EXPORT:
+			case SIM_PWM_UNEXPORT:
+			{
+				bool export = (file->type == SIM_PWM_EXPORT);
+				if (!number || value < 0 || value >= PWM_NUM_PINS)
+					error = EINVAL;
+				else if (g_sim_pwm[value].exported == export)
+					error = export ? EBUSY : EINVAL;
+				else
+					g_sim_pwm[value] = (SimPWM){.exported = export};
+				break;
+			}
+			case SIM_PWM_RUN:
+				if (!number || (value != 0 && value != 1))
+					error = EINVAL;
+				else
+					pwm->running = value;
+				break;
+			case SIM_PWM_POLARITY:
+				if (!number || (value != 0 && value != 1))
+					error = EINVAL;
+				else if (pwm->running)
+					error = EBUSY;
+				else
+					pwm->polarity = value;
+				break;
+			case SIM_PWM_PERIOD:
+				if (!number || value < 0 || value < pwm->duty)
+					error = EINVAL;
+				else if (pwm->running)
+					error = EBUSY;
+				else
+					pwm->period = value;
+				break;
+			case SIM_PWM_DUTY:
+				if (!number || value < 0 || value > pwm->period)
+					error = EINVAL;
+				else
+					pwm->duty = value;
+				break;
+			default:
+				error = EIO;
+				break;
+		}
+	}
+	pthread_mutex_unlock(&g_sim_mutex);
+
+	PinSim_Delay(latency);
+	if (error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+	return count;
+}
+
+/**
+ * Close a simulated file
+ * @param fd - The file
+ * @returns 0, or -1 with errno set
+ */
+static int PinSim_Close(int fd)
+{
+	pthread_mutex_lock(&g_sim_mutex);
+	SimFile * file = PinSim_File(fd);
+	if (file != NULL)
+		file->open = false;
+	pthread_mutex_unlock(&g_sim_mutex);
+
+	if (file == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	return 0;
+}
+
+const PinBackend g_pin_sim = {"sim", PinSim_Open, PinSim_Read, PinSim_Write, PinSim_Close};
+
+/**
+ * Set a signal from its description. Call with g_sim_mutex held.
+ * @param signal - The signal
+ * @param value - A waveform (see Waveform_Parse), or pwmN:gain,offset,tau
+ * @param period - Length of a cycle of an expression (s)
+ * @param error - Set to a description of the problem if the signal isn't valid
+ * @returns true if the signal was set
+ */
+static bool PinSim_ParseSignal(SimSignal * signal, const char * value, double period, const char ** error)
+{
+	Waveform_Free(&(signal->wave));
+	signal->type = SIM_SIGNAL_NONE;
+
+	if (strncmp(value, "pwm", 3) == 0)
+	{
+		int end = 0;
+		if (sscanf(value, "pwm%d:%lf,%lf,%lf%n", &(signal->pwm), &(signal->gain), &(signal->offset),
+				&(signal->tau), &end) != 4 || value[end] != '\0'
+			|| signal->pwm < 0 || signal->pwm >= PWM_NUM_PINS || signal->tau < 0)
+		{
+			*error = "PWM response should be pwmN:gain,offset,tau";
+			return false;
+		}
+		signal->value = signal->offset;
+		signal->time = g_sim_start;
+		signal->type = SIM_SIGNAL_PLANT;
+		return true;
+	}
+
+	if (!Waveform_Parse(&(signal->wave), value, PIN_SIM_STEP, period, 0, error))
+		return false;
+	signal->type = SIM_SIGNAL_WAVE;
+	return true;
+}
+
+/**
+ * Set one item of the simulator's configuration. Call with g_sim_mutex held.
+ * @param name - Name of the item
+ * @param value - Value of the item
+ * @param period - Length of a cycle of the expressions that follow (s); may be set
+ * @param error - Set to a description of the problem if the item isn't valid
+ * @returns true if the item was set
+ */
+static bool PinSim_ConfigureItem(const char * name, const char * value, double * period, const char ** error)
+{
+	int num = 0;
+	int end = 0;
+	if (sscanf(name, "adc%d%n", &num, &end) == 1 && name[end] == '\0')
+	{
+		if (num < 0 || num >= ADC_NUM_PINS)
+		{
+			*error = "Invalid ADC number";
+			return false;
+		}
+		return PinSim_ParseSignal(&(g_sim_adc[num]), value, *period, error);
+	}
+	else if (sscanf(name, "gpio%d%n", &num, &end) == 1 && name[end] == '\0')
+	{
+		if (num < 0 || num > GPIO_MAX_NUMBER)
+		{
+			*error = "Invalid GPIO number";
+			return false;
+		}
+		return PinSim_ParseSignal(&(g_sim_gpio[num].input), value, *period, error);
+	}
+
+	char * number_end;
+	double number = strtod(value, &number_end);
+	if (number_end == value || *number_end != '\0' || !(number >= 0))
+	{
+		*error = "Expected a number that isn't negative";
+		return false;
+	}
+
+	if (strcmp(name, "latency") == 0)
+	{
+		g_sim_read_latency = number;
+		g_sim_write_latency = number;
+	}
+	else if (strcmp(name, "read_latency") == 0)
+		g_sim_read_latency = number;
+	else if (strcmp(name, "write_latency") == 0)
+		g_sim_write_latency = number;
+	else if (strcmp(name, "jitter") == 0)
+		g_sim_jitter = number;
+	else if (strcmp(name, "noise") == 0)
+		g_sim_noise = number;
+	else if (strcmp(name, "seed") == 0)
+		g_sim_seed = (unsigned)(number);
+	else if (strcmp(name, "period") == 0)
+	{
+		if (number == 0)
+		{
+			*error = "Period should be positive";
+			return false;
+		}
+		*period = number;
+	}
+	else
+	{
+		*error = "Unknown setting";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Set the signals and latencies of the simulator. Everything not in the configuration is reset.
+ * The configuration is a list of name=value items separated by ';' (so no value, including a signal, can contain ';'):
+ *	adcN=signal	Signal read by an ADC (counts); see below
+ *	gpioN=signal	Signal read by a GPIO input; it reads 1 while the signal is over 0.5
+ *	latency=s	Time taken by each read and write of a file
+ *	read_latency=s, write_latency=s	Time taken by each read or each write
+ *	jitter=s	Largest random time added to each read and write
+ *	noise=counts	Standard deviation of gaussian noise added to ADC readings
+ *	seed=n	Seed for the jitter and noise
+ *	period=s	Length of a cycle of the expressions that follow (PIN_SIM_PERIOD by default)
+ * A signal is either a waveform (see Waveform_Parse), which repeats from when the simulator was
+ * configured, or pwmN:gain,offset,tau, which responds to the duty of PWM N like a first order system
+ * with a time constant of tau seconds.
+ * @param config - The configuration
+ * @param error - Set to a description of the problem if the configuration isn't valid
+ * @returns true if the simulator was configured
+ */
+bool PinSim_Configure(const char * config, const char ** error)
+{
+	char * copy = strdup(config);
+	if (copy == NULL)
+	{
+		*error = "Out of memory";
+		return false;
+	}
+
+	pthread_mutex_lock(&g_sim_mutex);
+	for (int i = 0; i < ADC_NUM_PINS; ++i)
+	{
+		Waveform_Free(&(g_sim_adc[i].wave));
+		g_sim_adc[i].type = SIM_SIGNAL_NONE;
+	}
+	for (int i = 0; i <= GPIO_MAX_NUMBER; ++i)
+	{
+		Waveform_Free(&(g_sim_gpio[i].input.wave));
+		g_sim_gpio[i].input.type = SIM_SIGNAL_NONE;
+	}
+	g_sim_read_latency = 0;
+	g_sim_write_latency = 0;
+	g_sim_jitter = 0;
+	g_sim_noise = 0;
+	g_sim_seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &g_sim_start);
+
+	bool result = true;
+	double period = PIN_SIM_PERIOD;
+	char * save = NULL;
+	for (char * item = strtok_r(copy, ";", &save); item != NULL && result; item = strtok_r(NULL, ";", &save))
+	{
+		char * value = strchr(item, '=');
+		if (value == NULL)
+		{
+			*error = "Settings should be name=value";
+			result = false;
+			break;
+		}
+		*(value++) = '\0';
+		result = PinSim_ConfigureItem(item, value, &period, error);
+	}
+	pthread_mutex_unlock(&g_sim_mutex);
+
+	free(copy);
+	return result;
+}
+
+//EOF
@@ -0,0 +1,30 @@
+/**
+ * @file pin_sim.h
+ * @brief Declarations for the pin simulator; a pin backend that keeps the GPIO, PWM and ADC files in memory
+ */
+
+#ifndef _PIN_SIM_H
+#define _PIN_SIM_H
+
+#include "common.h"
+#include "bbb_pin.h"
+
+/** Time between the values of generated signals (s) **/
+#define PIN_SIM_STEP 1e-3
+/** Length of a cycle of an expression, if none is configured (s) **/
+#define PIN_SIM_PERIOD 10.0
+/** Largest number of simulated files open at once **/
+#define PIN_SIM_MAX_FILES 128
+/** Offset of the simulated file descriptors, so they stand out from real ones **/
+#define PIN_SIM_FD_BASE 0x1000
+/** Largest value an ADC reads **/
+#define PIN_SIM_ADC_MAX 4095
+
+/** The simulated pins **/
+extern const PinBackend g_pin_sim;
+
+extern bool PinSim_Configure(const char * config, const char ** error); // Set the signals and latencies of the simulator
+
+#endif //_PIN_SIM_H
+
+//EOF
@@ -16,18 +16,27 @@ void Pin_Init()
 }
 
 /**
- * Unexport all pins
+ * Unexport all pins that are still exported
  */
 void Pin_Close()
 {
 	for (int i = 0; i < GPIO_NUM_PINS; ++i)
-		GPIO_Unexport(g_pin_index_to_gpio[i]);
+	{
+		if (Pin_IsExported(PIN_GPIO, g_pin_index_to_gpio[i]))
+			GPIO_Unexport(g_pin_index_to_gpio[i]);
+	}
 
 	for (int i = 0; i < ADC_NUM_PINS; ++i)
-		ADC_Unexport(i);
+	{
+		if (Pin_IsExported(PIN_ADC, i))
+			ADC_Unexport(i);
+	}
 
 	for (int i = 0; i < PWM_NUM_PINS; ++i)
-		PWM_Unexport(i);
+	{
+		if (Pin_IsExported(PIN_PWM, i))
+			PWM_Unexport(i);
+	}
 }
 
 /**
@@ -62,6 +71,43 @@ bool Pin_Configure(const char *type, int pin_export, int num)
 	return ret;
 }
 
+/**
+ * Helper: Print the system call counters of one type of pin, for the pins that have been used
+ * @param key - JSON key to print them under
+ * @param type - Type of pin
+ * @param max - Highest pin number
+ */
+static void Pin_CountersJSON(const char * key, PinType type, int max)
+{
+	bool first = true;
+	FCGI_JSONKey(key);
+	FCGI_JSONValue("{");
+	for (int i = 0; i <= max; ++i)
+	{
+		PinCounters c;
+		if (!Pin_GetCounters(type, i, &c) || c.writes + c.reads + c.elided == 0)
+			continue;
+		FCGI_JSONValue("%s\n\t\t\"%d\" : {\"writes\" : %ld, \"reads\" : %ld, \"elided\" : %ld}",
+			first ? "" : ",", i, c.writes, c.reads, c.elided);
+		first = false;
+	}
+	FCGI_JSONValue("\n\t}");
+}
+
+/**
+ * Respond with the system call counters of all pins
+ * @param context - The FastCGI context
+ */
+static void Pin_CountersResponse(FCGIContext * context)
+{
+	FCGI_BeginJSON(context, STATUS_OK);
+	FCGI_JSONPair("backend", Pin_GetBackend());
+	Pin_CountersJSON("gpio", PIN_GPIO, GPIO_MAX_NUMBER);
+	Pin_CountersJSON("adc", PIN_ADC, ADC_NUM_PINS - 1);
+	Pin_CountersJSON("pwm", PIN_PWM, PWM_NUM_PINS - 1);
+	FCGI_EndJSON();
+}
+
 /**
  * Handle a request to the Pin test module
  * @param context - The FastCGI context
@@ -82,7 +128,7 @@ void Pin_Handler(FCGIContext *context, char * params)
 	// key/value pairs
 	FCGIValue values[] = {
 		{"type", &type, FCGI_REQUIRED(FCGI_STRING_T)},
-		{"num", &num, FCGI_REQUIRED(FCGI_INT_T)}, 
+		{"num", &num, FCGI_INT_T}, 
 		{"export", &pin_export, FCGI_INT_T},
 		{"set", &set, FCGI_BOOL_T},
 		{"pol", &pol, FCGI_BOOL_T},
@@ -108,6 +154,17 @@ void Pin_Handler(FCGIContext *context, char * params)
 		return;
 	}
 
+	if (strcmp(type, "counters") == 0)
+	{
+		Pin_CountersResponse(context);
+		return;
+	}
+	else if (!FCGI_RECEIVED(values[NUM].flags))
+	{
+		FCGI_RejectJSON(context, "No pin number supplied");
+		return;
+	}
+
 	Log(LOGDEBUG, "Params: type = %s, num = %d, export = %d, set = %d, pol = %d, freq = %f, duty = %f", type, num, pin_export, set, pol, freq, duty);
 	if (pin_export != 0)
 	{
@@ -0,0 +1,426 @@
+/**
+ * @file realtime.c
+ * @brief Schedules each thread according to what it does. Sampling and control threads can run with
+ * real-time (SCHED_FIFO) priority and be pinned to CPUs, while threads that answer requests, export data
+ * or handle images run with normal priority so they can't hold them up.
+ * Also measures how late a thread of a role wakes up (like cyclictest), to check the configuration.
+ * A real-time thread that never sleeps (eg: a sensor sampling as fast as it can) starves every thread
+ * with the same or a lower priority on its CPUs, so give real-time roles CPUs of their own if they can.
+ */
+
+#include "realtime.h"
+#include "options.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+/** Scheduling of a role **/
+typedef struct
+{
+	/** SCHED_FIFO priority, or 0 for normal (SCHED_OTHER) scheduling **/
+	int priority;
+	/** Whether the role is pinned to cpus **/
+	bool pinned;
+	/** CPUs the role runs on **/
+	cpu_set_t cpus;
+} RealtimeRoleConfig;
+
+/** A wakeup latency self-test **/
+typedef struct
+{
+	/** Role of the thread that wakes up **/
+	RealtimeRole role;
+	/** Time between wakeups (ns) **/
+	long interval;
+	/** Number of wakeups asked for, and made **/
+	long loops;
+	long done;
+	/** Scheduling the thread actually got **/
+	int policy;
+	int priority;
+	/** Number of wakeups with each latency (us); the last bin counts any later **/
+	long histogram[REALTIME_HISTOGRAM_MAX+1];
+	/** Shortest, longest and total latency (ns) **/
+	long min;
+	long max;
+	double total;
+	/** Number of wakeups later than the interval **/
+	long overruns;
+} RealtimeTest;
+
+/** Names of the roles, as used in the configuration **/
+static const char * g_role_names[REALTIME_NUM_ROLES] = {
+	[REALTIME_SAMPLING] = "sampling",
+	[REALTIME_CONTROL] = "control",
+	[REALTIME_WEB] = "web",
+	[REALTIME_EXPORT] = "export",
+	[REALTIME_VISION] = "vision",
+	[REALTIME_BACKGROUND] = "background"
+};
+
+static struct
+{
+	/** Whether any role is given a priority or CPUs; if not, threads are left alone **/
+	bool active;
+	/** Scheduling of each role **/
+	RealtimeRoleConfig roles[REALTIME_NUM_ROLES];
+	/** CPUs the program was allowed to run on; roles that aren't pinned run on these **/
+	cpu_set_t all_cpus;
+	/** Whether the program's memory is locked **/
+	bool locked;
+} g_realtime;
+
+/**
+ * Write to the stack of the current thread, so that its pages are faulted in now rather than in the middle of something
+ */
+static void __attribute__((noinline)) Realtime_PrefaultStack()
+{
+	volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/**
+ * Check if the kernel is a PREEMPT_RT kernel
+ * @returns true if it is
+ */
+bool Realtime_KernelIsRT()
+{
+	struct utsname u;
+	bool result = false;
+	FILE * f;
+	uname(&u);
+	if (strcasestr(u.version, "PREEMPT RT") != NULL && (f = fopen("/sys/kernel/realtime", "r")) != NULL)
+	{
+		int flag;
+		result = ((fscanf(f, "%d", &flag) == 1) && (flag == 1));
+		fclose(f);
+	}
+	return result;
+}
+
+/**
+ * Parse a list of CPUs
+ * @param list - CPU numbers and ranges separated by ',' (eg: "1" or "0-1,3")
+ * @param cpus - Set to the CPUs
+ * @returns true if the list is valid, and the program may run on all of the CPUs
+ */
+static bool Realtime_ParseCPUs(const char * list, cpu_set_t * cpus)
+{
+	CPU_ZERO(cpus);
+	while (true)
+	{
+		char * end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list)
+			return false;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return false;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+		for (long cpu = first; cpu <= last; ++cpu)
+		{
+			if (!CPU_ISSET(cpu, &(g_realtime.all_cpus)))
+				return false;
+			CPU_SET(cpu, cpus);
+		}
+
+		if (*end == '\0')
+			return true;
+		if (*end != ',')
+			return false;
+		list = end + 1;
+	}
+}
+
+/**
+ * Set the scheduling of the roles. Roles not in the configuration get normal scheduling on any CPU.
+ * @param config - The configuration; see Realtime_Init
+ * @param error - Set to a description of the problem if the configuration isn't valid
+ * @returns true if the configuration is valid
+ */
+static bool Realtime_Configure(const char * config, const char ** error)
+{
+	char * copy = strdup(config);
+	if (copy == NULL)
+	{
+		*error = "Out of memory";
+		return false;
+	}
+
+	bool result = true;
+	char * save = NULL;
+	for (char * item = strtok_r(copy, ";", &save); item != NULL && result; item = strtok_r(NULL, ";", &save))
+	{
+		char * value = strchr(item, '=');
+		if (value == NULL)
+		{
+			*error = "Settings should be role=priority[@cpus]";
+			result = false;
+			break;
+		}
+		*(value++) = '\0';
+
+		int role = 0;
+		while (role < REALTIME_NUM_ROLES && strcmp(item, g_role_names[role]) != 0)
+			++role;
+		if (role == REALTIME_NUM_ROLES)
+		{
+			*error = "Unknown role";
+			result = false;
+			break;
+		}
+
+		RealtimeRoleConfig * rc = &(g_realtime.roles[role]);
+		char * end;
+		long priority = strtol(value, &end, 10);
+		if (end == value || (priority != 0 && (priority < sched_get_priority_min(SCHED_FIFO)
+			|| priority > sched_get_priority_max(SCHED_FIFO))))
+		{
+			*error = "Priority should be 0 (normal) or a SCHED_FIFO priority";
+			result = false;
+		}
+		else if (*end == '@' && !Realtime_ParseCPUs(end + 1, &(rc->cpus)))
+		{
+			*error = "CPUs should be a list like 0-1,3, of CPUs the program may run on";
+			result = false;
+		}
+		else if (*end != '@' && *end != '\0')
+		{
+			*error = "Settings should be role=priority[@cpus]";
+			result = false;
+		}
+		else
+		{
+			rc->priority = (int)priority;
+			rc->pinned = (*end == '@');
+			if (rc->priority > 0 || rc->pinned)
+				g_realtime.active = true;
+		}
+	}
+	free(copy);
+	return result;
+}
+
+/**
+ * Set the priority and CPUs of each role, and lock the program's memory if any role is real-time.
+ * Call before starting any threads. The configuration is a list of role=priority[@cpus] items separated by ';',
+ * where role is one of sampling, control, web, export, vision or background, priority is a SCHED_FIFO
+ * priority (or 0 for normal scheduling) and cpus is a list like "1" or "0-1,3" (eg: "sampling=49@1;control=48@1").
+ * @param config - The configuration; NULL or "" for normal scheduling of everything
+ */
+void Realtime_Init(const char * config)
+{
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &(g_realtime.all_cpus)) != 0)
+	{
+		Log(LOGWARN, "Couldn't get CPU affinity - %s", strerror(errno));
+		CPU_ZERO(&(g_realtime.all_cpus));
+		for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF) && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, &(g_realtime.all_cpus));
+	}
+
+	const char * error;
+	if (config != NULL && !Realtime_Configure(config, &error))
+		Fatal("Bad real-time configuration \"%s\" - %s", config, error);
+
+	bool realtime = false;
+	for (int i = 0; i < REALTIME_NUM_ROLES; ++i)
+	{
+		RealtimeRoleConfig * rc = &(g_realtime.roles[i]);
+		realtime |= (rc->priority > 0);
+		if (rc->priority > 0 || rc->pinned)
+			Log(LOGINFO, "%s threads: priority %d%s", g_role_names[i], rc->priority, rc->pinned ? ", pinned" : "");
+	}
+
+	if (realtime)
+	{
+		// Fault everything in now, and keep it in memory; a real-time thread that pages isn't real-time
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+			Fatal("Couldn't lock memory - %s", strerror(errno));
+		g_realtime.locked = true;
+	}
+}
+
+/**
+ * Schedule the current thread as a role; call when the thread starts.
+ * Real-time threads also fault in their stack and log queue, so they don't fault later.
+ * If the thread can't be scheduled as asked, the program exits if it is a REALTIME_VERSION build or the
+ * role was configured as real-time; otherwise (eg: a role that is only pinned) it carries on with a warning.
+ * @param role - What the thread does
+ */
+void Realtime_SetRole(RealtimeRole role)
+{
+	if (!g_realtime.active)
+		return;
+
+	const RealtimeRoleConfig * rc = &(g_realtime.roles[role]);
+	#ifdef REALTIME_VERSION
+	int level = LOGERR;
+	#else
+	int level = (rc->priority > 0) ? LOGERR : LOGWARN;
+	#endif //REALTIME_VERSION
+	struct sched_param param = {.sched_priority = rc->priority};
+	int err = pthread_setschedparam(pthread_self(), (rc->priority > 0) ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (err != 0)
+		Log(level, "Couldn't give a %s thread priority %d - %s", g_role_names[role], rc->priority, strerror(err));
+	int err_cpus = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), rc->pinned ? &(rc->cpus) : &(g_realtime.all_cpus));
+	if (err_cpus != 0)
+		Log(level, "Couldn't set the CPUs of a %s thread - %s", g_role_names[role], strerror(err_cpus));
+	if ((err != 0 || err_cpus != 0) && level == LOGERR)
+		Fatal("A %s thread couldn't be scheduled as configured", g_role_names[role]);
+
+	if (rc->priority > 0)
+	{
+		Realtime_PrefaultStack();
+		Log_ThreadInit();
+	}
+}
+
+/**
+ * Wake up at regular intervals and count how late each wakeup is
+ * @param arg - The RealtimeTest
+ * @returns NULL
+ */
+static void * Realtime_TestLoop(void * arg)
+{
+	RealtimeTest * test = arg;
+	Realtime_SetRole(test->role);
+	struct sched_param param;
+	pthread_getschedparam(pthread_self(), &(test->policy), &param);
+	test->priority = param.sched_priority;
+
+	struct timespec next, now;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (long i = 0; i < test->loops; ++i)
+	{
+		next.tv_nsec += test->interval;
+		while (next.tv_nsec >= 1000000000)
+		{
+			next.tv_nsec -= 1000000000;
+			next.tv_sec += 1;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long latency = (now.tv_sec - next.tv_sec) * 1000000000 + (now.tv_nsec - next.tv_nsec);
+		long bin = latency / 1000;
+		test->histogram[(bin < REALTIME_HISTOGRAM_MAX) ? bin : REALTIME_HISTOGRAM_MAX]++;
+		if (i == 0 || latency < test->min)
+			test->min = latency;
+		if (latency > test->max)
+			test->max = latency;
+		test->total += latency;
+		if (latency > test->interval)
+			test->overruns++;
+		test->done = i + 1;
+
+		// Don't hog the CPU if it can't keep up
+		if (test->done >= REALTIME_TEST_MIN_LOOPS && 2 * test->overruns > test->done)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Get a percentile of the latencies of a test
+ * @param test - The test
+ * @param fraction - Fraction of wakeups with that latency or less
+ * @returns The percentile (us; to the nearest us above it)
+ */
+static double Realtime_Percentile(const RealtimeTest * test, double fraction)
+{
+	long count = 0;
+	for (int bin = 0; bin < REALTIME_HISTOGRAM_MAX; ++bin)
+	{
+		count += test->histogram[bin];
+		if (count >= fraction * test->done)
+			return (bin + 1 < test->max / 1e3) ? bin + 1 : test->max / 1e3;
+	}
+	return test->max / 1e3;
+}
+
+/**
+ * Handle a request to measure how late a thread of a role wakes up, like cyclictest. A thread with the role's
+ * scheduling sleeps until the next interval, loops times, and the latencies of its wakeups are returned (in us).
+ * Comparing roles shows what real-time priority does (eg: role=sampling against role=web).
+ * The request takes loops * interval to answer, and nothing else is answered meanwhile. The test stops early
+ * if most wakeups are later than the interval, since the thread would otherwise spin at the role's priority.
+ * @param context - The context to work in
+ * @param params - Parameters: role (sampling by default), interval (us; 1000 by default, at least
+ * REALTIME_TEST_MIN_INTERVAL), loops (1000 by default)
+ */
+void Realtime_Handler(FCGIContext * context, char * params)
+{
+	const char * role = g_role_names[REALTIME_SAMPLING];
+	long interval = 1000;
+	long loops = 1000;
+	FCGIValue values[] = {
+		{"role", &role, FCGI_STRING_T},
+		{"interval", &interval, FCGI_LONG_T},
+		{"loops", &loops, FCGI_LONG_T}
+	};
+	if (!FCGI_ParseRequest(context, params, values, sizeof(values)/sizeof(FCGIValue)))
+		return;
+
+	int r = 0;
+	while (r < REALTIME_NUM_ROLES && strcmp(role, g_role_names[r]) != 0)
+		++r;
+	if (r == REALTIME_NUM_ROLES)
+	{
+		FCGI_RejectJSON(context, "Unknown role");
+		return;
+	}
+	if (interval < REALTIME_TEST_MIN_INTERVAL || loops <= 0 || interval > REALTIME_TEST_MAX_DURATION * 1000000L
+		|| loops > REALTIME_TEST_MAX_DURATION * 1000000L / interval)
+	{
+		FCGI_RejectJSON(context, "Interval should be at least 100us, loops positive, and the test shorter than a minute");
+		return;
+	}
+
+	RealtimeTest * test = calloc(1, sizeof(RealtimeTest));
+	if (test == NULL)
+	{
+		FCGI_RejectJSON(context, "Out of memory");
+		return;
+	}
+	test->role = r;
+	test->interval = interval * 1000;
+	test->loops = loops;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, Realtime_TestLoop, test) != 0)
+	{
+		free(test);
+		FCGI_RejectJSON(context, "Couldn't start the test thread");
+		return;
+	}
+	pthread_join(thread, NULL);
+
+	FCGI_BeginJSON(context, STATUS_OK);
+	FCGI_JSONPair("role", g_role_names[r]);
+	FCGI_JSONPair("policy", (test->policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_OTHER");
+	FCGI_JSONLong("priority", test->priority);
+	FCGI_JSONBool("memory_locked", g_realtime.locked);
+	FCGI_JSONBool("preempt_rt", Realtime_KernelIsRT());
+	FCGI_JSONLong("interval", interval);
+	FCGI_JSONLong("loops", test->done);
+	FCGI_JSONBool("stopped_early", test->done < loops);
+	FCGI_JSONDouble("latency_min", test->min / 1e3);
+	FCGI_JSONDouble("latency_mean", test->total / test->done / 1e3);
+	FCGI_JSONDouble("latency_p50", Realtime_Percentile(test, 0.5));
+	FCGI_JSONDouble("latency_p99", Realtime_Percentile(test, 0.99));
+	FCGI_JSONDouble("latency_p999", Realtime_Percentile(test, 0.999));
+	FCGI_JSONDouble("latency_max", test->max / 1e3);
+	FCGI_JSONLong("overruns", test->overruns);
+	FCGI_EndJSON();
+	free(test);
+}
+
+//EOF
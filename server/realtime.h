@@ -0,0 +1,43 @@
+/**
+ * @file realtime.h
+ * @brief Declarations for scheduling each thread according to its role, and measuring how late threads wake up
+ */
+
+#ifndef _REALTIME_H
+#define _REALTIME_H
+
+#include "common.h"
+
+/** Priorities of the roles if none are given with REALTIME_VERSION; below the kernel's IRQ threads (50) **/
+#define REALTIME_DEFAULT "sampling=49;control=48"
+/** Bytes of stack written by each real-time thread when it starts, so it doesn't fault later **/
+#define REALTIME_STACK_PREFAULT (64*1024)
+/** Wakeup latencies up to this are counted in a histogram of 1us bins; later wakeups are counted together (us) **/
+#define REALTIME_HISTOGRAM_MAX 10000
+/** Longest a latency self-test may run (s) **/
+#define REALTIME_TEST_MAX_DURATION 60
+/** Shortest interval between wakeups of a latency self-test (us); shorter ones just spin at the role's priority **/
+#define REALTIME_TEST_MIN_INTERVAL 100
+/** A latency self-test stops once more than half of this many wakeups (or more) have been later than the interval **/
+#define REALTIME_TEST_MIN_LOOPS 100
+
+/** What a thread does, which decides its priority and CPUs **/
+typedef enum
+{
+	REALTIME_SAMPLING, /** Sensor threads */
+	REALTIME_CONTROL, /** Actuator threads */
+	REALTIME_WEB, /** Threads answering requests (FastCGI and streams) */
+	REALTIME_EXPORT, /** Export workers (see data.c) */
+	REALTIME_VISION, /** Camera, analysis and timelapse threads */
+	REALTIME_BACKGROUND, /** Log and trace threads */
+	REALTIME_NUM_ROLES /** Number of roles; not a role */
+} RealtimeRole;
+
+extern void Realtime_Init(const char * config); // Set the priority and CPUs of each role; call before starting any threads
+extern void Realtime_SetRole(RealtimeRole role); // Schedule the current thread as a role
+extern bool Realtime_KernelIsRT(); // Check if the kernel is a PREEMPT_RT kernel
+extern void Realtime_Handler(FCGIContext * context, char * params); // Handle a FCGI request to measure wakeup latency
+
+#endif //_REALTIME_H
+
+//EOF
@@ -9,6 +9,10 @@
 #include "sensor.h"
 #include "options.h"
 #include "bbb_pin.h"
+#include "analysis.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
 #include <math.h>
 
 /** Array of sensors, initialised by Sensor_Init **/
@@ -22,7 +26,7 @@ int g_num_sensors = 0;
  * Add and initialise a Sensor
  * @param name - Human readable name of the sensor
  * @param user_id - User identifier
- * @param read - Function to call whenever the sensor should be read
+ * @param read - Function to call whenever the sensor should be read (NULL if its values are pushed with Sensor_Push)
  * @param init - Function to call to initialise the sensor (may be NULL)
  * @param cleanup - Function to call whenever to deinitialise the sensor (may be NULL)
  * @param sanity - Function to call to check that the sensor value is sane (may be NULL)
@@ -62,6 +66,7 @@ int Sensor_Add(const char * name, int user_id, ReadFn read, InitFn init, CleanFn
 
 	s->current_data.time_stamp = 0;
 	s->current_data.value = 0;
+	s->current_seq = 0;
 	s->averaged_data.time_stamp = 0;
 	s->averaged_data.value = 0;
 	return g_num_sensors;
@@ -77,6 +82,7 @@ int Sensor_Add(const char * name, int user_id, ReadFn read, InitFn init, CleanFn
 #include "sensors/pressure.h"
 #include "sensors/dilatometer.h"
 #include "sensors/microphone.h"
+#include "sensors/interferometer.h"
 void Sensor_Init()
 {
 	//Sensor_Add("cpu_stime", RESOURCE_CPU_SYS, Resource_Read, NULL, NULL, NULL);	
@@ -97,9 +103,13 @@ void Sensor_Init()
 	//Sensor_Add("pressure_feedback", PRESSURE_FEEDBACK, Pressure_Read, Pressure_Init, 5000,0,5000,0);
 	//Sensor_Add("enclosure", ENCLOSURE, Enclosure_Read, Enclosure_Init, 1,1,1,1); // Does not exist...
 
-	//NOTE: DO NOT ENABLE DILATOMETER WITHOUT FURTHER TESTING; CAUSES SEGFAULTS
-	//Sensor_Add("dilatometer0", 0, Dilatometer_Read, Dilatometer_Init, Dilatometer_Cleanup, NULL);
-	//Sensor_Add("dilatometer1",1, Dilatometer_Read, Dilatometer_Init, Dilatometer_Cleanup, NULL);
+	// Values are pushed by the analysis of each frame the camera captures
+	int dilatometers[2];
+	dilatometers[DIL_POS] = Sensor_Add("dilatometer0", DIL_POS, NULL, Dilatometer_Init, Dilatometer_Cleanup, NULL) - 1;
+	dilatometers[DIL_DIFF] = Sensor_Add("dilatometer1", DIL_DIFF, NULL, Dilatometer_Init, Dilatometer_Cleanup, NULL) - 1;
+	Analysis_Add("dilatometer", DILATOMETER_CAMERA, Dilatometer_Analyse, 2, dilatometers);
+	int interferometer = Sensor_Add("interferometer", 0, NULL, Interferometer_Init, Interferometer_Cleanup, NULL) - 1;
+	Analysis_Add("interferometer", INTERFEROMETER_CAMERA, Interferometer_Analyse, 1, &interferometer);
 }
 
 /**
@@ -114,6 +124,7 @@ void Sensor_Cleanup()
 			s->cleanup(s->user_id);
 	}
 	g_num_sensors = 0;
+	Analysis_Cleanup();
 }
 
 /**
@@ -148,12 +159,17 @@ void Sensor_SetMode(Sensor * s, ControlModes mode, void * arg)
 				// Open DataFile
 				Data_Open(&(s->data_file), filename);
 				freopen(NULL, "wb+", s->data_file.file);
+				s->data_file.num_points = 0;
 			}
 		case CONTROL_RESUME: //Case fallthrough, no break before
 			{
 				int ret;
 				s->activated = true; // Don't forget this!
 
+				// Sensors without a read function have their values pushed to them
+				if (s->read == NULL)
+					break;
+
 				// Create the thread
 				ret = pthread_create(&(s->thread), NULL, Sensor_Loop, (void*)(s));
 				if (ret != 0)
@@ -168,7 +184,8 @@ void Sensor_SetMode(Sensor * s, ControlModes mode, void * arg)
 		case CONTROL_EMERGENCY:
 		case CONTROL_PAUSE:
 			s->activated = false;
-			pthread_join(s->thread, NULL);
+			if (s->read != NULL)
+				pthread_join(s->thread, NULL);
 			Log(LOGDEBUG, "Paused sensor %d", s->id);
 		break;
 		
@@ -176,7 +193,8 @@ void Sensor_SetMode(Sensor * s, ControlModes mode, void * arg)
 			if (s->activated) //May have been paused before
 			{
 				s->activated = false;
-				pthread_join(s->thread, NULL);
+				if (s->read != NULL)
+					pthread_join(s->thread, NULL);
 			}
 
 			Data_Close(&(s->data_file)); // Close DataFile
@@ -197,13 +215,34 @@ void Sensor_SetModeAll(ControlModes mode, void * arg)
 {
 	if (mode == CONTROL_START)
 		Sensor_Init();
+	// Analyses push to sensors; stop them before the sensors, and start them after
+	if (mode != CONTROL_START && mode != CONTROL_RESUME)
+		Analysis_SetModeAll(mode);
 	for (int i = 0; i < g_num_sensors; i++)
 		Sensor_SetMode(&g_sensors[i], mode, arg);
+	if (mode == CONTROL_START || mode == CONTROL_RESUME)
+		Analysis_SetModeAll(mode);
 	if (mode == CONTROL_STOP)
 		Sensor_Cleanup();
 }
 
 
+/**
+ * Set the latest value of a Sensor. Readers never block the writer; they retry if the value changes while they read it.
+ * Only the thread that reads the sensor (or pushes its values) may call this.
+ * @param s - The Sensor
+ * @param d - The value and its time stamp
+ */
+static void Sensor_SetCurrent(Sensor * s, DataPoint d)
+{
+	unsigned seq = __atomic_load_n(&(s->current_seq), __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->current_seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store(&(s->current_data.time_stamp), &(d.time_stamp), __ATOMIC_RELAXED);
+	__atomic_store(&(s->current_data.value), &(d.value), __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->current_seq), seq + 2, __ATOMIC_RELEASE);
+}
+
 /**
  * Record data from a single Sensor; to be run in a seperate thread
  * @param arg - Cast to Sensor* - Sensor that the thread will handle
@@ -213,34 +252,48 @@ void * Sensor_Loop(void * arg)
 {
 	Sensor * s = (Sensor*)(arg);
 	Log(LOGDEBUG, "Sensor %d starts", s->id);
+	Trace_ThreadName("sensor %s", s->name);
+	Realtime_SetRole(REALTIME_SAMPLING);
 
 	// Until the sensor is stopped, record data points
 	while (s->activated)
 	{
-		
-		bool success = s->read(s->user_id, &(s->current_data.value));
+		DataPoint d;
+		struct timespec before;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		uint64_t trace = Trace_Begin();
+		bool success = s->read(s->user_id, &(d.value));
+		Trace_End(trace, "Sensor_Read", s->name, s->id);
 
 		struct timespec t;
 		clock_gettime(CLOCK_MONOTONIC, &t);
-		s->current_data.time_stamp = TIMEVAL_DIFF(t, *Control_GetStartTime());	
+		d.time_stamp = TIMEVAL_DIFF(t, *Control_GetStartTime());	
+
+		// Sampling as fast as possible (a sample_time of 0) can't overrun
+		double sample_time = TIMEVAL_TO_DOUBLE(s->sample_time);
+		if (sample_time > 0 && TIMEVAL_DIFF(t, before) > sample_time)
+			Metrics_Add(METRIC_SENSOR_OVERRUNS, s->id, 1);
 		
 		if (success)
 		{
+			Metrics_Add(METRIC_SENSOR_SAMPLES, s->id, 1);
 			if (s->sanity != NULL)
 			{
-				if (!s->sanity(s->user_id, s->current_data.value))
+				if (!s->sanity(s->user_id, d.value))
 				{
 					Fatal("Sensor %s (%d,%d) reads unsafe value", s->name, s->id, s->user_id);
 				}
 			}
-			s->averaged_data.time_stamp += s->current_data.time_stamp;
-			s->averaged_data.value = s->current_data.value;
+			Sensor_SetCurrent(s, d);
+			s->averaged_data.time_stamp += d.time_stamp;
+			s->averaged_data.value = d.value;
 			
 			if (++(s->num_read) >= s->averages)
 			{
 				s->averaged_data.time_stamp /= s->averages;
 				s->averaged_data.value /= s->averages;
 				Data_Save(&(s->data_file), &(s->averaged_data), 1); // Record it
+				Metrics_Add(METRIC_SENSOR_STORED, s->id, 1);
 				s->num_read = 0;
 				s->averaged_data.time_stamp = 0;
 				s->averaged_data.value = 0;
@@ -248,6 +301,7 @@ void * Sensor_Loop(void * arg)
 		}
 		else
 		{
+			Metrics_Add(METRIC_SENSOR_READ_FAILURES, s->id, 1);
 			// Silence because strain sensors fail ~50% of the time :S
 			//Log(LOGWARN, "Failed to read sensor %s (%d,%d)", s->name, s->id,s->user_id);
 		}
@@ -262,6 +316,27 @@ void * Sensor_Loop(void * arg)
 	return NULL;
 }
 
+/**
+ * Record a value for a Sensor that doesn't read itself, such as one fed by an analysis
+ * @param id - The sensor id
+ * @param d - The value and its time stamp
+ */
+void Sensor_Push(int id, DataPoint d)
+{
+	Sensor * s = &(g_sensors[id]);
+	if (!s->activated)
+		return;
+
+	if (s->sanity != NULL && !s->sanity(s->user_id, d.value))
+	{
+		Fatal("Sensor %s (%d,%d) reads unsafe value", s->name, s->id, s->user_id);
+	}
+	Sensor_SetCurrent(s, d);
+	Data_Save(&(s->data_file), &d, 1); // Record it
+	Metrics_Add(METRIC_SENSOR_SAMPLES, s->id, 1);
+	Metrics_Add(METRIC_SENSOR_STORED, s->id, 1);
+}
+
 /**
  * Get a Sensor given its name
  * @returns Sensor with the given name, NULL if there isn't one
@@ -294,7 +369,7 @@ void Sensor_BeginResponse(FCGIContext * context, Sensor * s, DataFormat format)
 			FCGI_JSONPair("name", s->name);
 			break;
 		default:
-			FCGI_PrintRaw("Content-type: text/plain\r\n\r\n");
+			FCGI_BeginBody(context, "text/plain", true);
 			break;
 	}
 }
@@ -334,6 +409,8 @@ void Sensor_Handler(FCGIContext *context, char * params)
 	double end_time = current_time;
 	const char * fmt_str;
 	double sample_s = 0;
+	const char * agg_str = "";
+	DataAggregation agg = {1.0, 0};
 
 	// key/value pairs
 	FCGIValue values[] = {
@@ -342,7 +419,9 @@ void Sensor_Handler(FCGIContext *context, char * params)
 		{"format", &fmt_str, FCGI_STRING_T}, 
 		{"start_time", &start_time, FCGI_DOUBLE_T}, 
 		{"end_time", &end_time, FCGI_DOUBLE_T},
-		{"sample_s", &sample_s, FCGI_DOUBLE_T}
+		{"sample_s", &sample_s, FCGI_DOUBLE_T},
+		{"agg", &agg_str, FCGI_STRING_T},
+		{"window", &(agg.window), FCGI_DOUBLE_T}
 	};
 
 	// enum to avoid the use of magic numbers
@@ -352,7 +431,9 @@ void Sensor_Handler(FCGIContext *context, char * params)
 		FORMAT,
 		START_TIME,
 		END_TIME,
-		SAMPLE_S
+		SAMPLE_S,
+		AGG,
+		WINDOW
 	} SensorParams;
 	
 	// Fill values appropriately
@@ -404,13 +485,29 @@ void Sensor_Handler(FCGIContext *context, char * params)
 	}
 	
 	
+	// Check the aggregation (if any)
+	bool aggregate = FCGI_RECEIVED(values[AGG].flags);
+	if (aggregate && !Data_GetAggregation(agg_str, &agg))
+	{
+		FCGI_RejectJSON(context, "Unknown or repeated statistic in agg");
+		return;
+	}
+	else if (aggregate && !(agg.window > 0))
+	{
+		FCGI_RejectJSON(context, "Window must be positive");
+		return;
+	}
+	
 	DataFormat format = Data_GetFormat(&(values[FORMAT]));
 
 	// Begin response
 	Sensor_BeginResponse(context, s, format);
 
 	// Print Data
-	Data_Handler(&(s->data_file), &(values[START_TIME]), &(values[END_TIME]), format, current_time);
+	if (aggregate)
+		Data_AggregateHandler(&(s->data_file), &(values[START_TIME]), &(values[END_TIME]), &agg, format, current_time);
+	else
+		Data_Handler(&(s->data_file), &(values[START_TIME]), &(values[END_TIME]), format, current_time);
 	
 	// Finish response
 	Sensor_EndResponse(context, s, format);
@@ -435,6 +532,27 @@ DataFile * Sensor_GetFile(int id)
 	return &g_sensors[id].data_file;
 }
 
+/**
+ * Get the latest value of a Sensor. It is read without locking, so any thread (such as an actuator's control loop)
+ * may call this at any rate.
+ * @param id - The sensor ID
+ * @param d - Set to the latest value
+ * @returns false if the Sensor hasn't got a value yet
+ */
+bool Sensor_GetLatest(int id, DataPoint * d)
+{
+	Sensor * s = &(g_sensors[id]);
+	unsigned seq;
+	do
+	{
+		seq = __atomic_load_n(&(s->current_seq), __ATOMIC_ACQUIRE);
+		__atomic_load(&(s->current_data.time_stamp), &(d->time_stamp), __ATOMIC_RELAXED);
+		__atomic_load(&(s->current_data.value), &(d->value), __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) != 0 || seq != __atomic_load_n(&(s->current_seq), __ATOMIC_RELAXED));
+	return (seq != 0);
+}
+
 /**
  * Returns the last DataPoint that is currently available.
  * @param id - The sensor ID for which to retrieve data from
@@ -442,8 +560,9 @@ DataFile * Sensor_GetFile(int id)
  */
 DataPoint Sensor_LastData(int id)
 {
-	Sensor * s = &(g_sensors[id]);
-	return s->current_data;
+	DataPoint d;
+	Sensor_GetLatest(id, &d);
+	return d;
 }
 
 
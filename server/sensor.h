@@ -14,7 +14,7 @@
  * Maximum number of sensors program can be compiled with
  * (If you get an error "Increase SENSORS_MAX from %d" this is what it refers to)
  */
-#define SENSORS_MAX 10
+#define SENSORS_MAX 12
 extern int g_num_sensors; // in sensor.c
 
 
@@ -59,8 +59,10 @@ typedef struct
 	struct timespec sample_time;
 	/** Number of averages per sample **/
 	int averages;
-	/** Current data **/
+	/** Current data; only written by the thread that reads the sensor (see Sensor_LastData) **/
 	DataPoint current_data;
+	/** Sequence lock on current_data; odd while it is being written **/
+	unsigned current_seq;
 
 	/** Summed data **/
 	DataPoint averaged_data;
@@ -80,12 +82,14 @@ extern void Sensor_SetModeAll(ControlModes mode, void * arg);
 extern void Sensor_SetMode(Sensor * s, ControlModes mode, void * arg);
 
 extern void * Sensor_Loop(void * args); // Main loop for a thread that handles a Sensor
+extern void Sensor_Push(int id, DataPoint d); // Record a value for a Sensor without a read function
 //extern bool Sensor_Read(Sensor * s, DataPoint * d); // Read a single DataPoint, indicating if it has changed since the last one
 extern Sensor * Sensor_Identify(const char * str); // Identify a Sensor from a string
 
 extern void Sensor_Handler(FCGIContext *context, char * params); // Handle a FCGI request for Sensor data
 
 extern DataPoint Sensor_LastData(int id);
+extern bool Sensor_GetLatest(int id, DataPoint * d); // Get the latest value of a Sensor, without locking
 
 extern const char * Sensor_GetName(int id);
 extern DataFile * Sensor_GetFile(int id);
@@ -4,283 +4,240 @@
  */
 
 #include "cv.h"
-#include "highgui_c.h"
 #include "dilatometer.h"
 #include "../image.h"
+#include "../analysis.h"
 #include <math.h>
-
-// test positions
-static double test_left, test_right;
+#include <pthread.h>
 
 // Remembers the last position to measure rate of expansion
 static double lastPosition;
 
-
-/** Buffers for storing image data.  **/
-static CvMat * g_srcRGB  = NULL; 	// Source Image
-static CvMat * g_srcGray = NULL; 	// Gray scale of source image
-static CvMat * g_edges 	 = NULL; 	// Detected Edges
-
-/** Pointers for capturing image **/
-//static CvCapture * g_capture = NULL;
-//static IplImage * frame  = NULL;	// This is required as you can not use capture with CvMat in C
-
+/** 
+ * State of the edge tracker, used by the dilatometer analysis.
+ * Positions are in pixels of a DILATOMETER_WIDTH wide image, whatever the camera captures at.
+ */
+static struct
+{
+	/** Centre of the search window; negative to search the whole width **/
+	double position;
+	/** Half width of the search window **/
+	double window;
+	/** Grayscale of part of a row **/
+	short * gray;
+	/** Gradient of part of a row **/
+	short * gradient;
+	/** Size of the row buffers **/
+	int size;
+	/** Mutex around everything (and lastPosition) **/
+	pthread_mutex_t mutex;
+} g_tracker = {.position = -1, .window = DILATOMETER_WIDTH, .mutex = PTHREAD_MUTEX_INITIALIZER};
 
 /**
- * Create a test image using left as left edge and right as right edge positions
+ * Create a test image with a bright sample on the left, whose edge fades out over a few pixels
+ * @param image - 8 bit BGR image to draw in
+ * @param edge - Position of the edge (pixels at DILATOMETER_WIDTH)
+ * @param noise - Amount of noise to add (fraction of full scale)
  */
-void Dilatometer_TestImage()
+void Dilatometer_TestImage(IplImage * image, double edge, double noise)
 {
-	
-	g_srcRGB = cvCreateMat(480, 640, CV_8UC3);
-
-	for( int x = 0; x < 640; ++x)
+	double to_frame = (double)(image->width) / DILATOMETER_WIDTH;
+	for (int y = 0; y < image->height; ++y)
 	{
-		for (int y = 0; y < 480; ++y)
+		unsigned char * row = (unsigned char*)(image->imageData) + y*image->widthStep;
+		for (int x = 0; x < image->width; ++x)
 		{
-			CvScalar s; 
-			for( int i = 0; i < 3; ++i)
+			double value = 30 + 180 / (1 + exp((x - edge*to_frame) / (DILATOMETER_TEST_BLUR*to_frame)));
+			for (int i = 0; i < 3; ++i)
 			{
-				s.val[i]  =  210 + (rand() % 1000) * 1e-0 - (rand() % 1000) * 1e-0;
-				// Produce an exponential decay around left edge
-				if( x < test_left)
-					s.val[i] *= exp( (x - test_left) / 25);
-				else if( x < 320)
-					s.val[i] *= exp( (test_left - x) / 25); 
-				// Produce an exponential decay around right edge
-				else if( x < test_right)
-					s.val[i] *= exp( (x - test_right) / 25); 
-				else
- 					s.val[i] *= exp( (test_right - x) / 25); 				
-			}	
-			cvSet2D(g_srcRGB,y,x,s);
+				double s = value + 255 * noise * ((rand() % 1000) - (rand() % 1000)) * 1e-3;
+				row[3*x + i] = (s < 0) ? 0 : (s > 255) ? 255 : (unsigned char)(s);
+			}
 		}
-		
-	}
-	if (g_srcGray == NULL)
-	{
-		g_srcGray = cvCreateMat(g_srcRGB->rows,g_srcRGB->cols,CV_8UC1);
 	}
-	cvCvtColor(g_srcRGB,g_srcGray,CV_RGB2GRAY);
-}	
+}
 
 /**
- * Cleanup Dilatometer pointers
+ * Cleanup the dilatometer; frees the edge tracker's buffers
  */
 bool Dilatometer_Cleanup(int id)
 {
-	//if (g_capture != NULL)
-	//	cvReleaseCapture(&g_capture);
-	//if (frame != NULL)
-	//	cvReleaseImageHeader(&frame);
-
-	//if (g_srcRGB != NULL)
-	//	cvReleaseMat(&g_srcRGB);	// Causing run time error in cvReleaseMat
-	if (g_srcGray != NULL)
-		cvReleaseMat(&g_srcGray);
-	if (g_edges != NULL)
-		cvReleaseMat(&g_edges);
+	pthread_mutex_lock(&(g_tracker.mutex));
+	free(g_tracker.gray);
+	free(g_tracker.gradient);
+	g_tracker.gray = NULL;
+	g_tracker.gradient = NULL;
+	g_tracker.size = 0;
+	pthread_mutex_unlock(&(g_tracker.mutex));
 	return true;
 }
 
 /**
- * Get an image from the Dilatometer. Replaced by Camera_GetImage in image.c
+ * Find the strongest edge in part of a row of a frame, to a fraction of a pixel.
+ * The row is read directly and smoothed with the rows either side of it, then 
+ * smoothed and differentiated along the row (together a Sobel operator with
+ * extra smoothing). The loops are simple so that the compiler vectorises them.
+ * @param image - The frame (8 bit, 1 or 3 channels)
+ * @param row - Row to search; not the first or last row
+ * @param start, end - Columns to search
+ * @param strength - Set to the gradient at the edge
+ * @returns Column of the edge, or -1 if no edge is stronger than DILATOMETER_MIN_GRADIENT
  */
-/*static bool Dilatometer_GetImage()
-{	
-	bool result = true;
-	// If more than one camera is connected, then input needs to be determined, however the camera ID may change after being unplugged
-	if( g_capture == NULL)
-	{
-		g_capture = cvCreateCameraCapture(0);
-		//If cvCreateCameraCapture returns NULL there is an error with the camera
-		if( g_capture == NULL)
-		{
-			result = false;
-			return;
+static double Dilatometer_RowEdge(const IplImage * image, int row, int start, int end, int * strength)
+{
+	const unsigned char * above = (const unsigned char*)(image->imageData) + (row-1) * image->widthStep;
+	const unsigned char * here = above + image->widthStep;
+	const unsigned char * below = here + image->widthStep;
+	short * restrict gray = g_tracker.gray;
+	short * restrict gradient = g_tracker.gradient;
+	int n = end - start;
+
+	// Grayscale, smoothed across the rows (1 2 1)
+	ANALYSIS_STAGE_START(luma_start);
+	if (image->nChannels == 3) {
+		// Frames are BGR; fixed point weights of the luma
+		above += 3*start;
+		here += 3*start;
+		below += 3*start;
+		for (int i = 0; i < n; ++i) {
+			int blue = above[3*i] + 2*here[3*i] + below[3*i];
+			int green = above[3*i+1] + 2*here[3*i+1] + below[3*i+1];
+			int red = above[3*i+2] + 2*here[3*i+2] + below[3*i+2];
+			gray[i] = (29*blue + 150*green + 77*red) >> 8;
 		}
+	} else {
+		above += start;
+		here += start;
+		below += start;
+		for (int i = 0; i < n; ++i)
+			gray[i] = above[i] + 2*here[i] + below[i];
 	}
-
-	// Get the frame and convert it to CvMat
-	frame =  cvQueryFrame(g_capture);
-	CvMat stub;
-	g_srcRGB = cvGetMat(frame,&stub,0,0);
-
-	if( g_srcRGB == NULL)
-		result = false;
-	
-	// Convert the image to grayscale
-	if (g_srcGray == NULL)
-	{
-		g_srcGray = cvCreateMat(g_srcRGB->rows,g_srcRGB->cols,CV_8UC1);
+	ANALYSIS_STAGE_END("luma", luma_start);
+
+	// Smoothed (1 2 1) and differentiated (-1 0 1) along the row
+	ANALYSIS_STAGE_START(gradient_start);
+	short peak = 0;
+	for (int i = 2; i < n-2; ++i) {
+		int g = gray[i+2] + 2*gray[i+1] - 2*gray[i-1] - gray[i-2];
+		gradient[i] = (g < 0) ? -g : g;
 	}
-
-	cvCvtColor(g_srcRGB,g_srcGray,CV_RGB2GRAY);
-	
-	return result;
-}*/
-
-void CannyThreshold()
-{
-
-	// Create greyscale array
-	if (g_srcGray == NULL)
-	{
-		Log(LOGDEBUG, "%d %d %d", g_srcRGB->rows, g_srcRGB->cols, CV_8UC1);
-		g_srcGray = cvCreateMat(g_srcRGB->rows,g_srcRGB->cols,CV_8UC1);
-	}
-
-	// Convert the RGB source file to grayscale
-	Log(LOGDEBUG, "About to cvCvtColor(%p, %p, %d)", g_srcRGB, g_srcGray, CV_RGB2GRAY);
-	cvCvtColor(g_srcRGB,g_srcGray,CV_RGB2GRAY);
-
-
-	Log(LOGDEBUG, "About to cvCreateMat");
-	if ( g_edges == NULL)
-	{
-		g_edges = cvCreateMat(g_srcGray->rows,g_srcGray->cols,CV_8UC1);
+	for (int i = 2; i < n-2; ++i)
+		peak = (gradient[i] > peak) ? gradient[i] : peak;
+	ANALYSIS_STAGE_END("gradient", gradient_start);
+	if (peak < DILATOMETER_MIN_GRADIENT)
+		return -1;
+
+	int best = 2;
+	while (gradient[best] != peak)
+		++best;
+
+	// Fit a parabola to the peak and its neighbours
+	double offset = 0;
+	if (best > 2 && best < n-3) {
+		int left = gradient[best-1], right = gradient[best+1];
+		int curve = left - 2*peak + right;
+		if (curve != 0)
+			offset = 0.5 * (left - right) / curve;
 	}
- 	
-	// Commented out lines are used during testing to show the image to screen, can also save the test images
-	//cvShowImage("display", g_srcGray);
-	//cvWaitKey(0); 	
-	
-	// Reduce noise with a kernel blurxblur. Input the grayscale source image, output to edges. (0's mean it's determined from kernel sizes)
-	cvSmooth( g_srcGray, g_edges, CV_GAUSSIAN, BLUR, BLUR ,0 ,0 );
-	
-	//Save the image
-	//cvSaveImage("test_blurred.jpg",g_edges,0);
-
-	//cvShowImage("display", g_edges);
-	//cvWaitKey(0); 
-
-	// Find the edges in the image
-	cvCanny( g_edges, g_edges, LOWTHRESHOLD, LOWTHRESHOLD*RATIO, KERNELSIZE );
-	
-	//Save the image
-	//cvSaveImage("test_edge.jpg",g_edges,0);
-
-	//cvShowImage("display", g_edges);
-	//cvWaitKey(0); 	
-
+	*strength = peak;
+	return start + best + offset;
 }
 
- /**
- * Read the dilatometer image. The value changed will correspond to the rate of expansion. If no edge is found then 
- * @param val - Will store the read value if successful
- * @param samples - Number of rows to scan (increasing will slow down performance!)
- * @returns true on successful read
+/**
+ * Find the edge in a frame, searching a band of rows around the middle of the frame, 
+ * and only the window around the edge found last time. If the edge isn't found
+ * the window is widened for the next frame, until the whole width is searched.
+ * @param image - The frame
+ * @param samples - Number of rows to search
+ * @param edge - Set to the edge (pixels at DILATOMETER_WIDTH) if found
+ * @returns true if the edge was found
  */
-bool Dilatometer_GetExpansion( int id, double * value, int samples)
+static bool Dilatometer_Track(const IplImage * image, int samples, double * edge)
 {
-	bool result = false; 
-	double average = 0;
-	// Get the image from the camera
-	Log(LOGDEBUG, "GET IMAGE?");
-
-	IplImage * frame = NULL;
-	result = Camera_GetImage( 0, 800, 600,&frame); // Get a 1600x1200 image and place it into src
-	Log(LOGDEBUG, "Got image...");
-
-	// If an error occured when capturing image then return
-
-
-	if (result)
-	{
-		CvMat stub;
-		g_srcRGB = cvGetMat(frame,&stub,0,0);
-		result = (g_srcRGB != NULL);
-		Log(LOGDEBUG, "Converted image %d %p", result, g_srcRGB);
+	if (image->depth != IPL_DEPTH_8U || (image->nChannels != 3 && image->nChannels != 1))
+		return false;
+
+	// Columns of the frame to search
+	double to_frame = (double)(image->width) / DILATOMETER_WIDTH;
+	int start = 0, end = image->width;
+	if (g_tracker.position >= 0 && g_tracker.window < DILATOMETER_WIDTH) {
+		start = (int)floor((g_tracker.position - g_tracker.window) * to_frame);
+		end = (int)ceil((g_tracker.position + g_tracker.window) * to_frame) + 1;
+		start = (start < 0) ? 0 : start;
+		end = (end > image->width) ? image->width : end;
 	}
-	cvReleaseImageHeader(&frame);
-
-	if (!result)
-		return result;
-
-
-	Log(LOGDEBUG, "GOT IMAGE (without error)!");
-
-	// Apply the Canny Edge theorem to the image
-	CannyThreshold();
-
-	Log(LOGDEBUG, "Got past CannyThreshold()");
-
-	int width = g_edges->cols;
-	int height = g_edges->rows;
-	
-	// If the number of samples is greater than the image height, sample every row
-	if( samples > height)
-	{
-		samples = height;
+	if (end - start < 5)
+		return false;
+
+	if (end - start > g_tracker.size) {
+		g_tracker.size = image->width;
+		g_tracker.gray = realloc(g_tracker.gray, g_tracker.size * sizeof(short));
+		g_tracker.gradient = realloc(g_tracker.gradient, g_tracker.size * sizeof(short));
+		if (g_tracker.gray == NULL || g_tracker.gradient == NULL)
+			Fatal("Couldn't allocate dilatometer buffers - %s", strerror(errno));
 	}
-	
-	int sample_height;
-	int num_edges = 0;	// Number of edges found. if each sample location has an edge, then num_edges = samples
 
-	for (int i=0; i<samples; i++)
-	{
-		// Determine the position in the rows to find the edges. 
-		// This will give you a number of evenly spaced samples
-		sample_height = ceil(height * (i + 1) / samples) -1;
-		
-		// Need to go through each pixel of a row and find all the locations of a line. If there is more than one pixel, average it. note this only works if the canny edge algorithm returns lines about the actual line (no outliers).
-		
-		int edge_location=0;
-		int num=0;
-		for ( int col = 0; col < width; col++)
-		{
-			// Count the number of points
-			// Get the threshold of the pixel at the current location
-			CvScalar value = cvGet2D(g_edges, sample_height, col);
-			if( value.val[0]> THRES)
-			{
-				edge_location += col;
-				num++;
-			}
-		}
-		if( num > 0)
-		{
-			average += ( edge_location / num );
-			num_edges++;
+	// Rows of the frame to search
+	int band = DILATOMETER_BAND * image->height / DILATOMETER_HEIGHT;
+	int top = (image->height - band) / 2;
+	if (samples > band)
+		samples = band;
+
+	// Centroid of the edges in each row, weighted by how strong they are
+	double sum = 0;
+	long weight = 0;
+	int found = 0;
+	for (int i = 0; i < samples; ++i) {
+		int row = top + (band * i + band / 2) / samples;
+		row = (row < 1) ? 1 : (row > image->height - 2) ? image->height - 2 : row;
+		int strength;
+		double column = Dilatometer_RowEdge(image, row, start, end, &strength);
+		if (column >= 0) {
+			sum += column * strength;
+			weight += strength;
+			++found;
 		}
 	}
-	if (num_edges > 0)
-		average /= num_edges;
-	else
-		return result; 	// As no edges were found
-	
-	if( average > 0)
-	{	
-		result = true; // Successfully found an edge
-		// If the experiment has already been initialised
-		switch (id)
-		{
-			case DIL_POS:
-				*value = average*SCALE;
-				return result;
-			case DIL_DIFF:
-				if( lastPosition > 0)
-				{	
-					// Find the rate of expansion and convert to mm. Will give a negative result for compression.
-					*value = (average - lastPosition) * SCALE *2;
-				}
-				lastPosition = average;	// Current position now becomes the last position
-				return result;
-			default:
-				return false;  		}
+
+	if (found < DILATOMETER_MIN_ROWS(samples)) {
+		// Lost it; look further next time
+		g_tracker.window = (g_tracker.window * 2 < DILATOMETER_WIDTH) ? g_tracker.window * 2 : DILATOMETER_WIDTH;
+		return false;
 	}
-	return result;
+	*edge = sum / weight / to_frame;
+	g_tracker.position = *edge;
+	g_tracker.window = DILATOMETER_WINDOW;
+	return true;
 }
 
- /**
- * Read the dilatometer image. The value changed will correspond to the new location of the edge.
- * @param val - Will store the read value if successful
- * @returns true on successful read
+/**
+ * Analyse a frame from the dilatometer camera; called by the analysis stage for each frame
+ * it takes. values[DIL_POS] is the position of the edge, and values[DIL_DIFF] the expansion
+ * since the last frame the edge was found in.
+ * @param frame - The frame
+ * @param values - Set to the values found
+ * @returns Bit mask of the values set; none if the edge wasn't found
  */
-bool Dilatometer_Read(int id, double * value)
+unsigned Dilatometer_Analyse(const CameraFrame * frame, double values[])
 {
-	bool result = Dilatometer_GetExpansion(id, value, SAMPLES);
-	return result;
+	unsigned set = 0;
+	double edge;
+
+	pthread_mutex_lock(&(g_tracker.mutex));
+	if (Dilatometer_Track(frame->image, SAMPLES, &edge))
+	{
+		values[DIL_POS] = edge*SCALE;
+		set |= 1 << DIL_POS;
+		if (lastPosition > 0)
+		{
+			// Find the rate of expansion and convert to mm. Will give a negative result for compression.
+			values[DIL_DIFF] = (edge - lastPosition) * SCALE *2;
+			set |= 1 << DIL_DIFF;
+		}
+		lastPosition = edge; // Current position now becomes the last position
+	}
+	pthread_mutex_unlock(&(g_tracker.mutex));
+	return set;
 }
 
 /**
@@ -288,58 +245,11 @@ bool Dilatometer_Read(int id, double * value)
  */
 bool Dilatometer_Init(const char * name, int id)
 {
-	// Make an initial reading (will allocate memory the first time only).
-	double val;
+	// Start searching the whole frame again
+	pthread_mutex_lock(&(g_tracker.mutex));
 	lastPosition = 0;  // Reset the last position
-	Dilatometer_GetExpansion(DIL_POS, &val, 1); 
+	g_tracker.position = -1;
+	g_tracker.window = DILATOMETER_WIDTH;
+	pthread_mutex_unlock(&(g_tracker.mutex));
 	return true;
 }
-
-// Overlays a line over the given edge position
-void Draw_Edge(double edge)
-{
-	CvScalar value;
-	value.val[0]=244;
-	for( int i = 0; i < g_srcGray->rows; i++)
-	{
-		cvSet2D(g_edges,i,edge,value);
-	}
-	cvShowImage("display", g_edges);
-	cvWaitKey(0); 	
-	//cvSaveImage("test_edge_avg.jpg",g_edges,0);
-}
-
-/* // Test algorithm
-static void Dilatometer_GetImageTest( )
-{	
-	//Generates Test image
-	//Dilatometer_TestImage();
-	
-	//Load Test image
-	g_srcGray = cvLoadImageM ("testimage4.jpg",CV_LOAD_IMAGE_GRAYSCALE );
-}*/
-
-/**
- * For testing purposes
- */
-/*int main(int argc, char ** argv)
-{
-	//cvNamedWindow( "display", CV_WINDOW_AUTOSIZE );// Create a window for display.
-	//gettimeofday(&start, NULL);
-	test_left = 100;
-	test_right = 500;
-	Dilatometer_Init();
-	
-	cvNamedWindow( "display", CV_WINDOW_AUTOSIZE);
-	//double width;
-	
-	double edge;
-	Dilatometer_GetEdge(&edge,20000);
-	//For testing purposes, overlay the given average line over the image
-	//Draw_Edge(edge);
-	
-	cvDestroyWindow("display");
-
-	Dilatometer_Cleanup();
-}*/
-
@@ -4,18 +4,36 @@
  */
 
 #include "../common.h"
+#include "../image.h"
 
-//Threshold to determine the edge of the can
-#define THRES 230
+//Number of rows of the band to search for the edge
+#define SAMPLES 32
 
-//Number of samples of the image to take
-#define SAMPLES 600
-
-// Canny Edge algorithm variables
-#define BLUR 5
+// Edge thresholds (as used with the Canny edge algorithm)
 #define LOWTHRESHOLD 30
 #define RATIO 3
-#define KERNELSIZE 3
+
+//Minimum gradient of an edge; the row search responds 3 times as strongly as a Sobel operator
+#define DILATOMETER_MIN_GRADIENT (3*LOWTHRESHOLD*RATIO)
+
+//Height of the band of rows (in the middle of the image) to search
+#define DILATOMETER_BAND 300
+
+//Half width of the window to search around the last edge found
+#define DILATOMETER_WINDOW 32
+
+//Number of rows the edge must be found in (out of samples)
+#define DILATOMETER_MIN_ROWS(samples) (((samples) + 3) / 4)
+
+//Camera that the dilatometer uses
+#define DILATOMETER_CAMERA 0
+
+//Size of the image that positions (and SCALE) are in terms of
+#define DILATOMETER_WIDTH 800
+#define DILATOMETER_HEIGHT 600
+
+//Width of the edge in the test image (pixels at DILATOMETER_WIDTH)
+#define DILATOMETER_TEST_BLUR 2
 
 //Scaling factor required to change from pixels to um
 #define SCALE 1 // Note camera has not been calibrated yet so result will be in pixels
@@ -31,5 +49,6 @@ typedef enum
 
 extern bool Dilatometer_Init(const char * name, int id); // Initialise the dilatometer
 extern bool Dilatometer_Cleanup(int id); // Cleanup
-extern bool Dilatometer_Read(int id, double * value); // Read the Dilatometer
+extern void Dilatometer_TestImage(IplImage * image, double edge, double noise); // Draw a test image
+extern unsigned Dilatometer_Analyse(const CameraFrame * frame, double values[]); // Find the edge in a frame
 
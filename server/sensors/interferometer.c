@@ -0,0 +1,344 @@
+/**
+ * @file interferometer.c
+ * @purpose Implementation of interferometer related functions
+ */
+
+#include "cv.h"
+#include "interferometer.h"
+#include "../analysis.h"
+#include <math.h>
+#include <pthread.h>
+
+/**
+ * State of the interferometer. The fringes run across the frame, so their phase is found from the
+ * spectrum of each of a number of columns. The spectra of the last frame are kept, so that the
+ * change in phase can be found at whichever bin the fringes are in.
+ * The tables and buffers for the FFT are only rebuilt when the height of the frames changes.
+ */
+static struct
+{
+	/** Number of pixels of each column transformed (a power of two); 0 if there are no tables yet **/
+	int length;
+	/** Bit reversed index of each element of the (length/2 point) complex transform **/
+	int * reverse;
+	/** cos and sin of 2*pi*k/length for k < length/2 **/
+	float * cos_table;
+	float * sin_table;
+	/** Hann window **/
+	float * window;
+	/** Real and imaginary parts of the complex transform **/
+	float * re;
+	float * im;
+	/** Spectrum of each column of the current and last frames; length/2 bins of (real, imaginary) each **/
+	float * spectra[2];
+	/** Index of the spectra of the current frame **/
+	int current;
+	/** Power of each bin, summed over the columns **/
+	float * power;
+	/** Bin the fringes were in in the last frame; 0 if they weren't found **/
+	int bin;
+	/** Unwrapped phase of the fringes (radians) **/
+	double phase;
+	/** Mutex around everything, so the analysis and Init or Cleanup can't run at once **/
+	pthread_mutex_t mutex;
+} g_interferometer = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Free the FFT tables and buffers; call with the mutex locked
+ */
+static void Interferometer_FreeTables()
+{
+	free(g_interferometer.reverse);
+	free(g_interferometer.cos_table);
+	free(g_interferometer.sin_table);
+	free(g_interferometer.window);
+	free(g_interferometer.re);
+	free(g_interferometer.im);
+	free(g_interferometer.spectra[0]);
+	free(g_interferometer.spectra[1]);
+	free(g_interferometer.power);
+
+	// The fringes must be found again, but the phase carries on from where it was
+	g_interferometer.length = 0;
+	g_interferometer.reverse = NULL;
+	g_interferometer.cos_table = g_interferometer.sin_table = g_interferometer.window = NULL;
+	g_interferometer.re = g_interferometer.im = NULL;
+	g_interferometer.spectra[0] = g_interferometer.spectra[1] = NULL;
+	g_interferometer.current = 0;
+	g_interferometer.power = NULL;
+	g_interferometer.bin = 0;
+}
+
+/**
+ * Build the FFT tables and buffers for columns of a given length; call with the mutex locked
+ * @param length - Number of pixels to transform (a power of two)
+ */
+static void Interferometer_MakeTables(int length)
+{
+	Interferometer_FreeTables();
+
+	int half = length / 2;
+	g_interferometer.length = length;
+	g_interferometer.reverse = malloc(half * sizeof(int));
+	g_interferometer.cos_table = malloc(half * sizeof(float));
+	g_interferometer.sin_table = malloc(half * sizeof(float));
+	g_interferometer.window = malloc(length * sizeof(float));
+	g_interferometer.re = malloc(half * sizeof(float));
+	g_interferometer.im = malloc(half * sizeof(float));
+	g_interferometer.spectra[0] = malloc(INTERFEROMETER_SAMPLES * length * sizeof(float));
+	g_interferometer.spectra[1] = malloc(INTERFEROMETER_SAMPLES * length * sizeof(float));
+	g_interferometer.power = malloc(half * sizeof(float));
+	if (g_interferometer.reverse == NULL || g_interferometer.cos_table == NULL || g_interferometer.sin_table == NULL
+		|| g_interferometer.window == NULL || g_interferometer.re == NULL || g_interferometer.im == NULL
+		|| g_interferometer.spectra[0] == NULL || g_interferometer.spectra[1] == NULL || g_interferometer.power == NULL)
+	{
+		Fatal("Couldn't allocate interferometer buffers - %s", strerror(errno));
+	}
+
+	int bits = 0;
+	while ((1 << bits) < half)
+		++bits;
+	for (int i = 0; i < half; ++i)
+	{
+		int r = 0;
+		for (int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		g_interferometer.reverse[i] = r;
+		g_interferometer.cos_table[i] = cos(2*M_PI*i / length);
+		g_interferometer.sin_table[i] = sin(2*M_PI*i / length);
+	}
+	for (int i = 0; i < length; ++i)
+		g_interferometer.window[i] = 0.5 - 0.5*cos(2*M_PI*i / length);
+	Log(LOGDEBUG, "Interferometer transforms %d pixels per column", length);
+}
+
+/**
+ * Take the spectrum of part of a column of a frame. The (real) pixels are packed in pairs into
+ * a complex transform of half the length, which is then split into the spectrum of the pixels.
+ * The power of each bin is added to g_interferometer.power.
+ * @param pixels - The first pixel of the column
+ * @param step - Bytes between the pixels of the column
+ * @param spectrum - Set to length/2 bins of (real, imaginary)
+ */
+static void Interferometer_Transform(const unsigned char * pixels, int step, float * spectrum)
+{
+	int length = g_interferometer.length;
+	int half = length / 2;
+	const int * reverse = g_interferometer.reverse;
+	const float * cos_table = g_interferometer.cos_table;
+	const float * sin_table = g_interferometer.sin_table;
+	const float * window = g_interferometer.window;
+	float * re = g_interferometer.re;
+	float * im = g_interferometer.im;
+
+	// Remove the background, so it doesn't leak into the bins near the fringes
+	ANALYSIS_STAGE_START(window_start);
+	int sum = 0;
+	for (int i = 0; i < length; ++i)
+		sum += pixels[i*step];
+	float mean = (float)(sum) / length;
+
+	// Pack even pixels into the real parts and odd pixels into the imaginary parts, in bit reversed order
+	for (int i = 0; i < half; ++i)
+	{
+		int r = reverse[i];
+		re[r] = (pixels[2*i*step] - mean) * window[2*i];
+		im[r] = (pixels[(2*i+1)*step] - mean) * window[2*i+1];
+	}
+	ANALYSIS_STAGE_END("window", window_start);
+
+	// Radix 2 decimation in time; the twiddle factor for w_size^j is cos_table[j*length/size]
+	ANALYSIS_STAGE_START(fft_start);
+	for (int size = 2; size <= half; size *= 2)
+	{
+		int span = size / 2;
+		int stride = length / size;
+		for (int start = 0; start < half; start += size)
+		{
+			for (int j = 0; j < span; ++j)
+			{
+				int a = start + j, b = a + span;
+				float c = cos_table[j*stride], s = sin_table[j*stride];
+				float tr = re[b]*c + im[b]*s;
+				float ti = im[b]*c - re[b]*s;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+	ANALYSIS_STAGE_END("fft", fft_start);
+
+	// Split into the spectra of the even and odd pixels, and combine them
+	ANALYSIS_STAGE_START(split_start);
+	float * power = g_interferometer.power;
+	for (int k = 0; k < half; ++k)
+	{
+		int kc = (half - k) & (half - 1);
+		float even_re = 0.5*(re[k] + re[kc]), even_im = 0.5*(im[k] - im[kc]);
+		float odd_re = 0.5*(im[k] + im[kc]), odd_im = -0.5*(re[k] - re[kc]);
+		float c = cos_table[k], s = sin_table[k];
+		float x_re = even_re + odd_re*c + odd_im*s;
+		float x_im = even_im + odd_im*c - odd_re*s;
+		spectrum[2*k] = x_re;
+		spectrum[2*k+1] = x_im;
+		power[k] += x_re*x_re + x_im*x_im;
+	}
+	ANALYSIS_STAGE_END("split", split_start);
+}
+
+/**
+ * Find the fringes in a frame, and add their change in phase since the last frame to the unwrapped phase;
+ * call with the mutex locked
+ * @param image - The frame
+ * @param values - values[0] is set to the unwrapped phase (radians)
+ * @returns Bit mask of the values set; none if the fringes weren't found
+ */
+static unsigned Interferometer_Track(const IplImage * image, double values[])
+{
+	if (image->depth != IPL_DEPTH_8U || (image->nChannels != 3 && image->nChannels != 1))
+		return 0;
+
+	// Transform as much of the middle of each column as a power of two allows
+	int length = INTERFEROMETER_MIN_LENGTH;
+	if (image->height < length)
+		return 0;
+	while (length * 2 <= image->height)
+		length *= 2;
+	if (length != g_interferometer.length)
+		Interferometer_MakeTables(length);
+	int half = length / 2;
+	int top = (image->height - length) / 2;
+
+	// The laser is red; that is the last channel of a BGR frame
+	const unsigned char * data = (const unsigned char*)(image->imageData) + top*image->widthStep
+		+ image->nChannels - 1;
+	float * spectra = g_interferometer.spectra[g_interferometer.current];
+	float * last = g_interferometer.spectra[1 - g_interferometer.current];
+	memset(g_interferometer.power, 0, half * sizeof(float));
+	for (int i = 0; i < INTERFEROMETER_SAMPLES; ++i)
+	{
+		int column = (image->width * (2*i + 1)) / (2*INTERFEROMETER_SAMPLES);
+		Interferometer_Transform(data + column*image->nChannels, image->widthStep, spectra + i*length);
+	}
+
+	// Find the fringes
+	ANALYSIS_STAGE_START(phase_start);
+	const float * power = g_interferometer.power;
+	int peak = INTERFEROMETER_MIN_BIN;
+	double total = 0;
+	for (int k = INTERFEROMETER_MIN_BIN; k < half; ++k)
+	{
+		total += power[k];
+		if (power[k] > power[peak])
+			peak = k;
+	}
+	if (power[peak] < INTERFEROMETER_MIN_CONTRAST * total / (half - INTERFEROMETER_MIN_BIN))
+	{
+		g_interferometer.bin = 0;
+		ANALYSIS_STAGE_END("phase", phase_start);
+		return 0;
+	}
+
+	// Stay with the bin the fringes were in unless they have clearly moved, so noise doesn't move them between bins
+	int bin = g_interferometer.bin;
+	if (bin == 0 || power[peak] > INTERFEROMETER_RELOCK * power[bin])
+		bin = peak;
+
+	if (g_interferometer.bin != 0)
+	{
+		// Sum the change in phase of each column (weighted by its power), so the columns needn't be in phase
+		double sum_re = 0, sum_im = 0;
+		for (int i = 0; i < INTERFEROMETER_SAMPLES; ++i)
+		{
+			const float * x = spectra + i*length + 2*bin;
+			const float * y = last + i*length + 2*bin;
+			sum_re += x[0]*y[0] + x[1]*y[1];
+			sum_im += x[1]*y[0] - x[0]*y[1];
+		}
+		g_interferometer.phase += atan2(sum_im, sum_re);
+	}
+	g_interferometer.bin = bin;
+	g_interferometer.current = 1 - g_interferometer.current;
+	ANALYSIS_STAGE_END("phase", phase_start);
+
+	values[0] = g_interferometer.phase;
+	return 1;
+}
+
+/**
+ * Analyse a frame from the interferometer camera; called by the analysis stage for each frame it takes.
+ * The fringes are found at the peak of the spectra of the columns, and their change in phase since the
+ * last frame added to the unwrapped phase. The phase can only be followed while it changes by less
+ * than half a fringe between frames; if the fringes are lost it is held until they are found again.
+ * @param frame - The frame
+ * @param values - values[0] is set to the unwrapped phase (radians)
+ * @returns Bit mask of the values set; none if the fringes weren't found
+ */
+unsigned Interferometer_Analyse(const CameraFrame * frame, double values[])
+{
+	pthread_mutex_lock(&(g_interferometer.mutex));
+	unsigned set = Interferometer_Track(frame->image, values);
+	pthread_mutex_unlock(&(g_interferometer.mutex));
+	return set;
+}
+
+/**
+ * Draw a pure sinusoid in the test direction, with noise and a background
+ * @param image - 8 bit BGR image to draw in
+ * @param background - Background image, added to the sinusoid (may be NULL)
+ * @param omega - Angular frequency of the sinusoid (radians per pixel)
+ * @param angle - Direction the sinusoid varies in (radians from the rows)
+ * @param phase - Phase of the sinusoid (radians)
+ * @param noise - Amount of noise to add to the red channel (fraction of full scale)
+ */
+void Interferometer_TestSinusoid(IplImage * image, const IplImage * background, double omega, double angle, double phase, double noise)
+{
+	for (int y = 0; y < image->height; ++y)
+	{
+		unsigned char * row = (unsigned char*)(image->imageData) + y*image->widthStep;
+		const unsigned char * b = NULL;
+		if (background != NULL && y < background->height)
+			b = (const unsigned char*)(background->imageData) + y*background->widthStep;
+
+		for (int x = 0; x < image->width; ++x)
+		{
+			// Calculate pure sine in test direction
+			double r = x*cos(angle) + y*sin(angle);
+			double s[3] = {0, 0, 0.5*(1+sin(omega*r + phase))};
+			s[2] += (rand() % 1000) * 1e-3 * noise;
+			for (int i = 0; i < 3; ++i)
+			{
+				// Add background image (0-255, same channel order)
+				if (b != NULL && x < background->width)
+					s[i] += b[3*x + i] / 255.0;
+				row[3*x + i] = (s[i] > 1) ? 255 : (unsigned char)(255*s[i]);
+			}
+		}
+	}
+}
+
+/**
+ * Initialise the interferometer
+ */
+bool Interferometer_Init(const char * name, int id)
+{
+	// Start counting the phase from zero, at whatever fringes are found first
+	pthread_mutex_lock(&(g_interferometer.mutex));
+	g_interferometer.bin = 0;
+	g_interferometer.phase = 0;
+	pthread_mutex_unlock(&(g_interferometer.mutex));
+	return true;
+}
+
+/**
+ * Cleanup the interferometer
+ */
+bool Interferometer_Cleanup(int id)
+{
+	pthread_mutex_lock(&(g_interferometer.mutex));
+	Interferometer_FreeTables();
+	pthread_mutex_unlock(&(g_interferometer.mutex));
+	return true;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file interferometer.h
+ * @brief Declarations for functions to deal with the interferometer
+ */
+
+#include "../common.h"
+#include "../image.h"
+
+//Camera that the interferometer uses
+#define INTERFEROMETER_CAMERA 1
+
+//Number of columns of the frame to take the spectrum of
+#define INTERFEROMETER_SAMPLES 16
+
+//Smallest spectrum (pixels along a column) that fringes can be found in
+#define INTERFEROMETER_MIN_LENGTH 16
+
+//Lowest spectrum bin the fringes can be in; below this is the background
+#define INTERFEROMETER_MIN_BIN 2
+
+//Power of the fringes must be this many times the mean power of the spectrum
+#define INTERFEROMETER_MIN_CONTRAST 8
+
+//Another bin must have this many times the power of the current one before the fringes are taken to be there
+#define INTERFEROMETER_RELOCK 2
+
+extern bool Interferometer_Init(const char * name, int id); // Initialise the interferometer
+extern bool Interferometer_Cleanup(int id); // Cleanup
+extern void Interferometer_TestSinusoid(IplImage * image, const IplImage * background, double omega, double angle, double phase, double noise); // Draw test fringes
+extern unsigned Interferometer_Analyse(const CameraFrame * frame, double values[]); // Find the phase of the fringes in a frame
+
@@ -0,0 +1,405 @@
+/**
+ * @file timelapse.c
+ * @brief Records frames from the cameras into the experiment directory, so they can be
+ * lined up with the sensor data. Each camera has a thread that takes the latest frame every
+ * g_options.timelapse seconds, encodes it and appends it to the recording; the capture
+ * threads are never held up.
+ */
+
+#include "cv.h"
+#include "highgui_c.h"
+#include "timelapse.h"
+#include "options.h"
+#include "realtime.h"
+#include <math.h>
+#include <sys/stat.h>
+
+/** Recordings, by camera number **/
+static Timelapse g_timelapses[TIMELAPSE_CAMERAS];
+/** Mutex around Timelapse::running **/
+static pthread_mutex_t g_timelapse_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when recording stops; uses CLOCK_MONOTONIC **/
+static pthread_cond_t g_timelapse_stopped;
+/** Ensures the recordings are only initialised once **/
+static pthread_once_t g_timelapse_once = PTHREAD_ONCE_INIT;
+
+/**
+ * One off initialisation of the recordings
+ */
+static void Timelapse_Init()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_timelapse_stopped, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (int i = 0; i < TIMELAPSE_CAMERAS; ++i)
+	{
+		g_timelapses[i].camera = i;
+		Data_Init(&(g_timelapses[i].index));
+	}
+}
+
+/**
+ * Record the next frame from a camera
+ * @param t - The recording
+ * @param seq - Sequence number of the last frame recorded; updated
+ */
+static void Timelapse_Record(Timelapse * t, long * seq)
+{
+	CameraFrame * frame = Camera_WaitFrame(t->camera, *seq);
+	if (frame != NULL && TIMEVAL_DIFF(frame->time, *Control_GetStartTime()) < 0)
+	{
+		// Captured before the experiment started
+		long old = frame->seq;
+		Camera_ReleaseFrame(t->camera, frame);
+		frame = Camera_WaitFrame(t->camera, old);
+	}
+	if (frame == NULL)
+	{
+		Log(LOGWARN, "No frame from camera %d to record", t->camera);
+		return;
+	}
+	*seq = frame->seq;
+
+	TimelapseHeader header;
+	memcpy(header.magic, TIMELAPSE_MAGIC, sizeof(header.magic));
+	header.time_stamp = TIMEVAL_DIFF(frame->time, *Control_GetStartTime());
+	IplImage * src = Camera_ScaleFrame(frame, TIMELAPSE_WIDTH, TIMELAPSE_HEIGHT, &(t->scaled));
+	int encode_params[] = {CV_IMWRITE_JPEG_QUALITY, IMAGE_QUALITY, 0};
+	CvMat * encoded = cvEncodeImage(".jpg", src, encode_params);
+	Camera_ReleaseFrame(t->camera, frame);
+	if (encoded == NULL)
+	{
+		Log(LOGERR, "Couldn't encode frame from camera %d", t->camera);
+		return;
+	}
+
+	// The frame must be complete in the file before it is indexed
+	header.length = encoded->rows * encoded->cols;
+	DataPoint d = {header.time_stamp, ftell(t->file)};
+	if (fwrite(&header, sizeof(header), 1, t->file) != 1
+		|| fwrite(encoded->data.ptr, header.length, 1, t->file) != 1 || fflush(t->file) != 0)
+	{
+		Log(LOGERR, "Couldn't write frame to %s - %s", t->filename, strerror(errno));
+		// Don't leave part of a frame where the next one will be indexed
+		fseek(t->file, (long)(d.value), SEEK_SET);
+	}
+	else
+	{
+		Data_Save(&(t->index), &d, 1);
+	}
+	cvReleaseMat(&encoded);
+}
+
+/**
+ * Main loop for a thread that records the frames from a camera
+ * @param arg - Cast to Timelapse* - the recording
+ * @returns NULL
+ */
+static void * Timelapse_Loop(void * arg)
+{
+	Timelapse * t = (Timelapse*)(arg);
+	long seq = 0;
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	Realtime_SetRole(REALTIME_VISION);
+	Log(LOGDEBUG, "Recording camera %d every %f s", t->camera, g_options.timelapse);
+
+	pthread_mutex_lock(&g_timelapse_mutex);
+	while (t->running)
+	{
+		pthread_mutex_unlock(&g_timelapse_mutex);
+		Timelapse_Record(t, &seq);
+
+		// Keep to the interval, unless recording fell behind
+		struct timespec interval, now;
+		DOUBLE_TO_TIMEVAL(g_options.timelapse, &interval);
+		due.tv_sec += interval.tv_sec;
+		due.tv_nsec += interval.tv_nsec;
+		if (due.tv_nsec >= 1000000000)
+		{
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (TIMEVAL_DIFF(due, now) < 0)
+			due = now;
+
+		pthread_mutex_lock(&g_timelapse_mutex);
+		while (t->running && pthread_cond_timedwait(&g_timelapse_stopped, &g_timelapse_mutex, &due) == 0);
+	}
+	pthread_mutex_unlock(&g_timelapse_mutex);
+
+	Log(LOGDEBUG, "Stopped recording camera %d", t->camera);
+	return NULL;
+}
+
+/**
+ * Start or stop recording with the experiment. Recording is disabled if g_options.timelapse is 0.
+ * @param mode - The mode the experiment is changing to
+ * @param arg - For CONTROL_START, the experiment directory
+ */
+void Timelapse_SetModeAll(ControlModes mode, void * arg)
+{
+	pthread_once(&g_timelapse_once, Timelapse_Init);
+	if (!(g_options.timelapse > 0))
+		return;
+
+	for (int i = 0; i < TIMELAPSE_CAMERAS; ++i)
+	{
+		Timelapse * t = &(g_timelapses[i]);
+		switch (mode)
+		{
+			case CONTROL_START:
+			{
+				char filename[BUFSIZ];
+				const char * experiment_path = (const char*)(arg);
+				if (snprintf(filename, BUFSIZ, "%s/camera_%d", experiment_path, t->camera) >= BUFSIZ)
+				{
+					Fatal("Experiment path \"%s\" too long", experiment_path);
+				}
+				Data_Open(&(t->index), filename);
+				if (freopen(NULL, "wb+", t->index.file) == NULL)
+				{
+					// The stream is closed even though freopen failed
+					Log(LOGERR, "Couldn't truncate %s - %s; not recording camera %d", filename, strerror(errno), t->camera);
+					t->index.file = NULL;
+					free(t->index.filename);
+					t->index.filename = NULL;
+					break;
+				}
+				t->index.num_points = 0;
+
+				strncat(filename, ".frames", BUFSIZ - strlen(filename) - 1);
+				t->filename = strdup(filename);
+				t->file = fopen(filename, "wb");
+				if (t->file == NULL)
+				{
+					Fatal("Couldn't open %s - %s", filename, strerror(errno));
+				}
+			}
+			case CONTROL_RESUME: //Case fallthrough, no break before
+				if (t->file == NULL)
+					break; // Recording failed to start
+				t->running = true;
+				if (pthread_create(&(t->thread), NULL, Timelapse_Loop, (void*)(t)) != 0)
+				{
+					Fatal("Failed to create Timelapse_Loop for camera %d", t->camera);
+				}
+				break;
+			case CONTROL_PAUSE:
+			case CONTROL_STOP:
+			case CONTROL_EMERGENCY:
+			{
+				pthread_mutex_lock(&g_timelapse_mutex);
+				bool running = t->running;
+				t->running = false;
+				pthread_cond_broadcast(&g_timelapse_stopped);
+				pthread_mutex_unlock(&g_timelapse_mutex);
+				//May have been paused before
+				if (running)
+					pthread_join(t->thread, NULL);
+
+				if (mode == CONTROL_STOP && t->file != NULL)
+				{
+					Data_Close(&(t->index));
+					fclose(t->file);
+					t->file = NULL;
+					free(t->filename);
+					t->filename = NULL;
+					if (t->scaled != NULL)
+						cvReleaseImage(&(t->scaled));
+				}
+				break;
+			}
+			default:
+				Fatal("Unknown control mode: %d", mode);
+		}
+	}
+}
+
+/**
+ * Find the recorded frame nearest a time
+ * @param index - Index of the recording
+ * @param time_stamp - The time, or NAN for the latest frame
+ * @param frame - Set to the time and offset of the frame
+ * @returns false if no frames have been recorded
+ */
+static bool Timelapse_FindFrame(DataFile * index, double time_stamp, DataPoint * frame)
+{
+	pthread_mutex_lock(&(index->mutex));
+	int num_points = index->num_points;
+	pthread_mutex_unlock(&(index->mutex));
+	if (num_points == 0)
+		return false;
+	if (isnan(time_stamp))
+		return (Data_Read(index, frame, num_points - 1, 1) == 1);
+
+	// The search only gets close; check its neighbours
+	int found = Data_FindByTime(index, time_stamp, NULL);
+	int start = (found > 0) ? found - 1 : 0;
+	DataPoint points[3];
+	int count = Data_Read(index, points, start, (num_points - start < 3) ? num_points - start : 3);
+	if (count <= 0)
+		return false;
+	*frame = points[0];
+	for (int i = 1; i < count; ++i)
+	{
+		if (fabs(points[i].time_stamp - time_stamp) < fabs(frame->time_stamp - time_stamp))
+			*frame = points[i];
+	}
+	return true;
+}
+
+/**
+ * Handle a request for a recorded frame. Sends the frame nearest a time (the latest by default),
+ * or with format set, lists the times of the frames.
+ * Frames of the current experiment are read from its recording; with name set to a finished
+ * experiment, they are read from the recording left in its directory.
+ * @param context - The context to work in
+ * @param params - Parameters passed
+ */
+void Timelapse_Handler(FCGIContext * context, char * params)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double current_time = TIMEVAL_DIFF(now, *Control_GetStartTime());
+	const char * name = "";
+	int num = 0;
+	double time_stamp = NAN;
+	const char * fmt_str;
+	double start_time = 0;
+	double end_time = current_time;
+
+	FCGIValue values[] = {
+		{"name", &name, FCGI_STRING_T},
+		{"num", &num, FCGI_INT_T},
+		{"time", &time_stamp, FCGI_DOUBLE_T},
+		{"format", &fmt_str, FCGI_STRING_T},
+		{"start_time", &start_time, FCGI_DOUBLE_T},
+		{"end_time", &end_time, FCGI_DOUBLE_T}
+	};
+
+	// enum to avoid the use of magic numbers
+	enum {
+		NAME,
+		NUM,
+		TIME,
+		FORMAT,
+		START_TIME,
+		END_TIME
+	};
+
+	if (!FCGI_ParseRequest(context, params, values, sizeof(values)/sizeof(FCGIValue)))
+		return;
+
+	pthread_once(&g_timelapse_once, Timelapse_Init);
+	if (num < 0 || num >= TIMELAPSE_CAMERAS)
+	{
+		FCGI_RejectJSON(context, "Invalid camera number");
+		return;
+	}
+	Timelapse * t = &(g_timelapses[num]);
+	bool live = (t->file != NULL && (!FCGI_RECEIVED(values[NAME].flags) || strcmp(name, Control_GetExpName()) == 0));
+
+	// The index and recording of the frames
+	DataFile finished;
+	DataFile * index = &(t->index);
+	const char * filename = t->filename;
+	if (!live)
+	{
+		if (!FCGI_RECEIVED(values[NAME].flags))
+		{
+			FCGI_RejectJSON(context, "No experiment is running; give the name of a finished experiment");
+			return;
+		}
+		else if (*name == '\0' || strchr(name, '/') != NULL)
+		{
+			FCGI_RejectJSON(context, "Invalid experiment name");
+			return;
+		}
+		filename = FCGI_Sprintf("%s/%s.exp/camera_%d.frames", context->user_dir, name, num);
+		char * index_name = FCGI_Sprintf("%s/%s.exp/camera_%d", context->user_dir, name, num);
+		Data_Init(&finished);
+		if (!Data_OpenReadOnly(&finished, index_name))
+		{
+			FCGI_RejectJSON(context, "No frames were recorded with that experiment");
+			return;
+		}
+		index = &finished;
+
+		// Times are relative to the end of the recording
+		DataPoint last;
+		current_time = Timelapse_FindFrame(index, NAN, &last) ? last.time_stamp : 0;
+		if (!FCGI_RECEIVED(values[END_TIME].flags))
+			end_time = current_time;
+	}
+
+	if (FCGI_RECEIVED(values[FORMAT].flags))
+	{
+		// List the frames; the values are their offsets in the recording
+		DataFormat format = Data_GetFormat(&(values[FORMAT]));
+		if (format == JSON)
+		{
+			FCGI_BeginJSON(context, STATUS_OK);
+			FCGI_JSONLong("num", num);
+		}
+		else
+		{
+			FCGI_BeginBody(context, "text/plain", true);
+		}
+		Data_Handler(index, &(values[START_TIME]), &(values[END_TIME]), format, current_time);
+		if (format == JSON)
+			FCGI_EndJSON();
+		if (!live)
+			Data_Close(&finished);
+		return;
+	}
+
+	DataPoint point;
+	bool found = !(time_stamp < 0) && Timelapse_FindFrame(index, time_stamp, &point);
+	if (!live)
+		Data_Close(&finished);
+	if (time_stamp < 0)
+	{
+		FCGI_RejectJSON(context, "Invalid time");
+		return;
+	}
+	else if (!found)
+	{
+		FCGI_RejectJSON(context, "No frames have been recorded yet");
+		return;
+	}
+
+	// Read the frame from a separate stream, so the recording thread can carry on appending
+	TimelapseHeader header;
+	char * jpeg = NULL;
+	FILE * file = fopen(filename, "rb");
+	struct stat st;
+	if (file != NULL && fstat(fileno(file), &st) == 0 && fseek(file, (long)(point.value), SEEK_SET) == 0
+		&& fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, TIMELAPSE_MAGIC, sizeof(header.magic)) == 0
+		// A torn or corrupt header mustn't make us allocate more than the frame could be
+		&& header.length <= TIMELAPSE_MAX_FRAME
+		&& header.length <= st.st_size - (off_t)(point.value) - (off_t)sizeof(header))
+	{
+		jpeg = FCGI_Alloc(header.length);
+		if (fread(jpeg, header.length, 1, file) != 1)
+			jpeg = NULL;
+	}
+	if (file != NULL)
+		fclose(file);
+	if (jpeg == NULL)
+	{
+		Log(LOGERR, "Couldn't read frame at %ld of %s", (long)(point.value), filename);
+		FCGI_RejectJSON(context, "Couldn't read the frame");
+		return;
+	}
+
+	FCGI_PrintRaw("Cache-Control: no-cache, no-store, must-revalidate\r\n");
+	FCGI_PrintRaw("X-Frame-Time: %f\r\n", header.time_stamp);
+	FCGI_BeginBody(context, "image/jpg", false);
+	FCGI_WriteBinary(jpeg, 1, header.length);
+}
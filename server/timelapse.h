@@ -0,0 +1,64 @@
+/**
+ * @file timelapse.h
+ * @brief Declarations for recording frames from the cameras with an experiment
+ */
+
+#ifndef _TIMELAPSE_H
+#define _TIMELAPSE_H
+
+#include "common.h"
+#include "data.h"
+#include "image.h"
+#include <stdint.h>
+
+/** Default time between frames recorded (s) **/
+#define TIMELAPSE_INTERVAL 5
+/** Number of cameras recorded (cameras 0 to TIMELAPSE_CAMERAS-1) **/
+#define TIMELAPSE_CAMERAS 2
+/** Size frames are recorded at **/
+#define TIMELAPSE_WIDTH 800
+#define TIMELAPSE_HEIGHT 600
+/** Largest JPEG a recorded frame may be; larger lengths are taken to be corrupt (bytes) **/
+#define TIMELAPSE_MAX_FRAME (TIMELAPSE_WIDTH*TIMELAPSE_HEIGHT*3)
+/** Marks the start of each frame in a recording **/
+#define TIMELAPSE_MAGIC "MCTX"
+
+/** Header of each frame in a recording; the JPEG follows it **/
+typedef struct
+{
+	/** TIMELAPSE_MAGIC **/
+	char magic[4];
+	/** Size of the JPEG **/
+	uint32_t length;
+	/** Time the frame was captured **/
+	double time_stamp;
+} TimelapseHeader;
+
+/** 
+ * Recording of the frames from a camera. Frames are appended to a file, 
+ * and their offsets indexed by time in a DataFile.
+ */
+typedef struct
+{
+	/** Camera number **/
+	int camera;
+	/** File the frames are appended to **/
+	FILE * file;
+	/** Name of the file **/
+	char * filename;
+	/** Index of the frames (time_stamp, offset of the frame's header) **/
+	DataFile index;
+	/** Whether the recording thread is running **/
+	bool running;
+	/** The recording thread **/
+	pthread_t thread;
+	/** Buffer for scaling frames **/
+	IplImage * scaled;
+} Timelapse;
+
+extern void Timelapse_SetModeAll(ControlModes mode, void * arg); // Start/stop recording with the experiment
+extern void Timelapse_Handler(FCGIContext * context, char * params); // Get a recorded frame
+
+#endif //_TIMELAPSE_H
+
+//EOF
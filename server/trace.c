@@ -0,0 +1,405 @@
+/**
+ * @file trace.c
+ * @brief Records spans of time (sensor reads, saves, requests...) in each thread, to be dumped as a
+ * Chrome/Perfetto trace (open it in chrome://tracing or ui.perfetto.dev) when something runs late.
+ * Each thread writes to its own ring of spans without locking; the rings always hold the latest spans,
+ * so a trace can be dumped after the event. A dump reads the rings while they are written; each span
+ * has a sequence number (like a seqlock), so spans that were overwritten as they were read are left out.
+ */
+
+#include "trace.h"
+#include "options.h"
+#include "realtime.h"
+
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+/** A span of time in a thread **/
+typedef struct
+{
+	/** What happened (a string that lives as long as the program) **/
+	const char * name;
+	/** What it happened to (a string that lives as long as the program), or NULL **/
+	const char * detail;
+	/** A number that goes with it (eg: an id, or a count) **/
+	long value;
+	/** Start (ns on CLOCK_MONOTONIC) **/
+	uint64_t start;
+	/** Duration (ns) **/
+	uint64_t duration;
+	/** Number of the span in its ring plus 1, once it is written; 0 while it is being written **/
+	unsigned long seq;
+} TraceSpan;
+
+/** The spans of a thread **/
+typedef struct
+{
+	/** Whether a thread is using the ring **/
+	bool owned;
+	/** Thread id of the thread using the ring, or that last used it **/
+	long tid;
+	/** Name of the thread **/
+	char name[32];
+	/** Spans; the latest TRACE_RING_SIZE of them **/
+	TraceSpan spans[TRACE_RING_SIZE];
+	/** Number of spans recorded; only the owner writes this **/
+	unsigned long head;
+	/** Spans before this were cleared; only used with the mutex **/
+	unsigned long cleared;
+} TraceRing;
+
+static struct
+{
+	/** Whether spans are recorded **/
+	bool enabled;
+	/** Rings; num_rings are allocated **/
+	TraceRing * rings[TRACE_MAX_THREADS];
+	int num_rings;
+	/** Mutex around giving out rings and dumping them **/
+	pthread_mutex_t mutex;
+	/** Used to free a ring when its thread exits **/
+	pthread_key_t key;
+	/** Thread that waits for TRACE_SIGNAL **/
+	pthread_t signal_thread;
+} g_trace = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/** Ring of the current thread **/
+static __thread TraceRing * t_ring = NULL;
+/** Name of the current thread, kept for when it gets a ring if tracing is off; empty if it wasn't named **/
+static __thread char t_name[sizeof(((TraceRing*)NULL)->name)];
+
+/**
+ * Current time on CLOCK_MONOTONIC (ns)
+ */
+static uint64_t Trace_Clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Give a ring back when its thread exits; it is given to the next new thread
+ * @param arg - The ring
+ */
+static void Trace_ReleaseRing(void * arg)
+{
+	TraceRing * ring = arg;
+	pthread_mutex_lock(&(g_trace.mutex));
+	ring->owned = false;
+	pthread_mutex_unlock(&(g_trace.mutex));
+}
+
+/**
+ * Get the ring of the current thread, reusing the ring of a thread that has exited if possible
+ * @returns The ring, or NULL if there are too many threads
+ */
+static TraceRing * Trace_Ring()
+{
+	if (t_ring != NULL)
+		return t_ring;
+
+	pthread_mutex_lock(&(g_trace.mutex));
+	TraceRing * ring = NULL;
+	for (int i = 0; i < g_trace.num_rings && ring == NULL; ++i)
+	{
+		if (!g_trace.rings[i]->owned)
+			ring = g_trace.rings[i];
+	}
+	if (ring == NULL && g_trace.num_rings < TRACE_MAX_THREADS)
+	{
+		ring = malloc(sizeof(TraceRing));
+		if (ring != NULL)
+		{
+			memset(ring, 0, sizeof(TraceRing)); // Fault in every page now, not while recording a span
+			g_trace.rings[g_trace.num_rings++] = ring;
+		}
+		else
+			Log(LOGWARN, "Couldn't allocate a trace ring - %s", strerror(errno));
+	}
+	if (ring != NULL)
+	{
+		// The spans of the thread that had it are forgotten
+		ring->owned = true;
+		ring->tid = syscall(SYS_gettid);
+		if (t_name[0] != '\0')
+			strcpy(ring->name, t_name);
+		else
+			snprintf(ring->name, sizeof(ring->name), "thread %ld", ring->tid);
+		__atomic_store_n(&(ring->head), 0, __ATOMIC_RELAXED);
+		ring->cleared = 0;
+		pthread_setspecific(g_trace.key, ring);
+	}
+	pthread_mutex_unlock(&(g_trace.mutex));
+
+	t_ring = ring;
+	return ring;
+}
+
+/**
+ * Name the current thread in the trace. Its ring is only allocated now if tracing is on; otherwise the
+ * name is kept until the thread records its first span.
+ * @param format - printf style format of the name
+ */
+void Trace_ThreadName(const char * format, ...)
+{
+	va_list va;
+	va_start(va, format);
+	vsnprintf(t_name, sizeof(t_name), format, va);
+	va_end(va);
+	if (t_ring == NULL && !__atomic_load_n(&(g_trace.enabled), __ATOMIC_RELAXED))
+		return;
+
+	TraceRing * ring = Trace_Ring();
+	if (ring == NULL)
+		return;
+	pthread_mutex_lock(&(g_trace.mutex));
+	strcpy(ring->name, t_name);
+	pthread_mutex_unlock(&(g_trace.mutex));
+}
+
+/**
+ * Start a span
+ * @returns The start time, to pass to Trace_End; 0 if tracing is off
+ */
+uint64_t Trace_Begin()
+{
+	if (!__atomic_load_n(&(g_trace.enabled), __ATOMIC_RELAXED))
+		return 0;
+	return Trace_Clock();
+}
+
+/**
+ * Record a span from Trace_Begin until now
+ * @param start - Result of Trace_Begin (nothing is recorded if it is 0)
+ * @param name - What happened; must live as long as the program (eg: a literal)
+ * @param detail - What it happened to (eg: the name of a sensor), or NULL; must live as long as the program
+ * @param value - A number that goes with it (eg: an id)
+ */
+void Trace_End(uint64_t start, const char * name, const char * detail, long value)
+{
+	if (start == 0)
+		return;
+	TraceRing * ring = Trace_Ring();
+	if (ring == NULL)
+		return;
+	uint64_t end = Trace_Clock();
+
+	unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+	TraceSpan * span = &(ring->spans[head % TRACE_RING_SIZE]);
+	// A reader that sees any of the new fields must see that the span is being written
+	__atomic_store_n(&(span->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&(span->name), name, __ATOMIC_RELAXED);
+	__atomic_store_n(&(span->detail), detail, __ATOMIC_RELAXED);
+	__atomic_store_n(&(span->value), value, __ATOMIC_RELAXED);
+	__atomic_store_n(&(span->start), start, __ATOMIC_RELAXED);
+	__atomic_store_n(&(span->duration), end - start, __ATOMIC_RELAXED);
+	__atomic_store_n(&(span->seq), head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Print a string as a JSON string, with quotes
+ * @param file - File to print to
+ * @param str - The string
+ */
+static void Trace_PrintString(FILE * file, const char * str)
+{
+	fputc('"', file);
+	for (; *str != '\0'; ++str)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(file, "\\%c", *str);
+		else if ((unsigned char)(*str) < 0x20)
+			fprintf(file, "\\u%04x", (unsigned char)(*str));
+		else
+			fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+/**
+ * Print the trace as Chrome trace event JSON. Spans are "complete" events, timed (in us) from when the server started.
+ * @param file - File to print to
+ * @returns true if it was all printed
+ */
+bool Trace_Dump(FILE * file)
+{
+	TraceSpan * copy = malloc(TRACE_RING_SIZE * sizeof(TraceSpan));
+	if (copy == NULL)
+		return false;
+	uint64_t origin = (uint64_t)g_options.start_time.tv_sec * 1000000000 + g_options.start_time.tv_nsec;
+	int pid = getpid();
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\" : \"ns\", \"traceEvents\" : [");
+	pthread_mutex_lock(&(g_trace.mutex));
+	for (int r = 0; r < g_trace.num_rings; ++r)
+	{
+		TraceRing * ring = g_trace.rings[r];
+		fprintf(file, "%s\n{\"name\" : \"thread_name\", \"ph\" : \"M\", \"pid\" : %d, \"tid\" : %ld, \"args\" : {\"name\" : ",
+			first ? "" : ",", pid, ring->tid);
+		Trace_PrintString(file, ring->name);
+		fprintf(file, "}}");
+		first = false;
+
+		unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		unsigned long count = head - ring->cleared;
+		if (count > TRACE_RING_SIZE)
+			count = TRACE_RING_SIZE;
+		for (unsigned long i = head - count; i != head; ++i)
+		{
+			TraceSpan * from = &(ring->spans[i % TRACE_RING_SIZE]), * to = &(copy[i % TRACE_RING_SIZE]);
+			unsigned long seq = __atomic_load_n(&(from->seq), __ATOMIC_ACQUIRE);
+			to->name = __atomic_load_n(&(from->name), __ATOMIC_RELAXED);
+			to->detail = __atomic_load_n(&(from->detail), __ATOMIC_RELAXED);
+			to->value = __atomic_load_n(&(from->value), __ATOMIC_RELAXED);
+			to->start = __atomic_load_n(&(from->start), __ATOMIC_RELAXED);
+			to->duration = __atomic_load_n(&(from->duration), __ATOMIC_RELAXED);
+
+			// Leave out the span if the thread overwrote it (or was writing it) while it was copied
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			to->seq = (seq == i + 1 && __atomic_load_n(&(from->seq), __ATOMIC_RELAXED) == seq) ? seq : 0;
+		}
+
+		for (unsigned long i = head - count; i != head; ++i)
+		{
+			TraceSpan * span = &(copy[i % TRACE_RING_SIZE]);
+			if (span->seq != i + 1)
+				continue;
+			fprintf(file, ",\n{\"name\" : ");
+			Trace_PrintString(file, span->name);
+			fprintf(file, ", \"ph\" : \"X\", \"pid\" : %d, \"tid\" : %ld, \"ts\" : %.3f, \"dur\" : %.3f, \"args\" : {\"detail\" : ",
+				pid, ring->tid, 1e-3 * (double)(span->start - origin), 1e-3 * span->duration);
+			Trace_PrintString(file, (span->detail != NULL) ? span->detail : "");
+			fprintf(file, ", \"value\" : %ld}}", span->value);
+		}
+	}
+	pthread_mutex_unlock(&(g_trace.mutex));
+	fprintf(file, "\n]}\n");
+	free(copy);
+	return !ferror(file);
+}
+
+/**
+ * Forget all the spans recorded so far
+ */
+static void Trace_Clear()
+{
+	pthread_mutex_lock(&(g_trace.mutex));
+	for (int r = 0; r < g_trace.num_rings; ++r)
+		g_trace.rings[r]->cleared = __atomic_load_n(&(g_trace.rings[r]->head), __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&(g_trace.mutex));
+}
+
+/**
+ * Main loop for a thread that dumps the trace to a file in the experiment directory whenever TRACE_SIGNAL is received
+ * @param arg - Set of signals to wait for
+ * @returns Never
+ */
+static void * Trace_SignalLoop(void * arg)
+{
+	sigset_t * signals = arg;
+	Trace_ThreadName("trace");
+	Realtime_SetRole(REALTIME_BACKGROUND);
+	while (true)
+	{
+		int signal;
+		if (sigwait(signals, &signal) != 0)
+			continue;
+
+		char filename[BUFSIZ];
+		snprintf(filename, sizeof(filename), "%s/trace_%ld.json", g_options.experiment_dir, (long)time(NULL));
+		FILE * file = fopen(filename, "w");
+		if (file == NULL)
+		{
+			Log(LOGERR, "Couldn't open %s - %s", filename, strerror(errno));
+			continue;
+		}
+		bool ok = Trace_Dump(file);
+		if (fclose(file) != 0 || !ok)
+			Log(LOGERR, "Couldn't write the trace to %s - %s", filename, strerror(errno));
+		else
+			Log(LOGNOTE, "Wrote the trace to %s", filename);
+	}
+	return NULL;
+}
+
+/**
+ * Start tracing (if g_options.trace is set) and start a thread that dumps the trace on TRACE_SIGNAL.
+ * The signal is blocked in this thread and so in every thread started after it; call this before starting any.
+ */
+void Trace_Init()
+{
+	static sigset_t signals;
+	if (pthread_key_create(&(g_trace.key), Trace_ReleaseRing) != 0)
+		Fatal("Couldn't create the key for trace rings - %s", strerror(errno));
+	__atomic_store_n(&(g_trace.enabled), g_options.trace, __ATOMIC_RELAXED);
+	Trace_ThreadName("main");
+
+	sigemptyset(&signals);
+	sigaddset(&signals, TRACE_SIGNAL);
+	if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0
+		|| pthread_create(&(g_trace.signal_thread), NULL, Trace_SignalLoop, &signals) != 0)
+	{
+		Log(LOGWARN, "Traces can't be dumped with a signal - %s", strerror(errno));
+	}
+	else
+	{
+		pthread_detach(g_trace.signal_thread);
+	}
+}
+
+/**
+ * Handle a request to the trace module; action is "dump" (the default) to get the trace,
+ * "start" or "stop" to turn tracing on or off, or "clear" to forget the spans recorded so far
+ * @param context - The context to work in
+ * @param params - Parameters passed
+ */
+void Trace_Handler(FCGIContext * context, char * params)
+{
+	const char * action = "dump";
+	FCGIValue values[] = {
+		{"action", &action, FCGI_STRING_T}
+	};
+	if (!FCGI_ParseRequest(context, params, values, sizeof(values)/sizeof(FCGIValue)))
+		return;
+
+	if (!strcmp(action, "dump"))
+	{
+		char * text = NULL;
+		size_t len = 0;
+		FILE * file = open_memstream(&text, &len);
+		if (file == NULL || !Trace_Dump(file))
+		{
+			if (file != NULL)
+				fclose(file);
+			free(text);
+			FCGI_RejectJSON(context, "Couldn't print the trace");
+			return;
+		}
+		fclose(file);
+		FCGI_PrintRaw("Content-Disposition: attachment; filename=trace.json\r\n");
+		FCGI_BeginBody(context, "application/json", true);
+		FCGI_Write(text, len);
+		free(text);
+	}
+	else if (!strcmp(action, "start") || !strcmp(action, "stop"))
+	{
+		__atomic_store_n(&(g_trace.enabled), !strcmp(action, "start"), __ATOMIC_RELAXED);
+		FCGI_AcceptJSON(context, "Ok");
+	}
+	else if (!strcmp(action, "clear"))
+	{
+		Trace_Clear();
+		FCGI_AcceptJSON(context, "Ok");
+	}
+	else
+	{
+		FCGI_RejectJSON(context, "Unknown action");
+	}
+}
+
+//EOF
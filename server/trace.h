@@ -0,0 +1,29 @@
+/**
+ * @file trace.h
+ * @brief Declarations for recording spans of time in each thread, dumped as a Chrome/Perfetto trace
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+/** Number of spans kept for each thread; older spans are overwritten (must be a power of 2) **/
+#define TRACE_RING_SIZE 4096
+/** Largest number of threads traced at once **/
+#define TRACE_MAX_THREADS 64
+/** Signal that dumps the trace to a file in the experiment directory **/
+#define TRACE_SIGNAL SIGUSR2
+
+extern void Trace_Init(); // Start tracing (if enabled) and listen for TRACE_SIGNAL; call before starting any threads
+extern void Trace_ThreadName(const char * format, ...); // Name the current thread in the trace
+extern uint64_t Trace_Begin(); // Start a span; returns 0 if tracing is off
+extern void Trace_End(uint64_t start, const char * name, const char * detail, long value); // Record a span since Trace_Begin
+extern bool Trace_Dump(FILE * file); // Print the trace as Chrome trace event JSON
+extern void Trace_Handler(FCGIContext * context, char * params); // Handle a FCGI request for the trace
+
+#endif //_TRACE_H
+
+//EOF
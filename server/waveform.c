@@ -0,0 +1,549 @@
+/**
+ * @file waveform.c
+ * @brief Makes schedules of actuator settings from waveforms. The whole schedule is worked out
+ * before it runs, so each value can be checked against the actuator's sanity function first, and
+ * running it is just a matter of setting each value at its deadline.
+ */
+
+#include "waveform.h"
+#include <math.h>
+#include <ctype.h>
+
+/** Instructions in a compiled expression **/
+typedef enum
+{
+	OP_CONST,
+	OP_TIME,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_POW,
+	OP_NEG,
+	OP_FUNC1,
+	OP_FUNC2
+} WaveformOpcode;
+
+/** An instruction in a compiled expression **/
+typedef struct
+{
+	/** What the instruction does **/
+	WaveformOpcode op;
+	/** Value to push for OP_CONST **/
+	double value;
+	/** Function for OP_FUNC1 **/
+	double (*fn1)(double);
+	/** Function for OP_FUNC2 **/
+	double (*fn2)(double, double);
+} WaveformOp;
+
+/** An expression compiled to instructions for a stack machine (in postfix order) **/
+typedef struct
+{
+	/** The instructions **/
+	WaveformOp ops[WAVEFORM_EXPR_MAX];
+	/** Number of instructions **/
+	int length;
+	/** Depth of the stack after the instructions so far **/
+	int depth;
+	/** Number of brackets open while compiling **/
+	int nesting;
+	/** Position in the expression while compiling **/
+	const char * pos;
+	/** Set if the expression couldn't be compiled **/
+	const char * error;
+} WaveformExpr;
+
+/** Functions that can be used in expressions **/
+static const struct
+{
+	const char * name;
+	double (*fn1)(double);
+	double (*fn2)(double, double);
+} g_waveform_functions[] = {
+	{"sin", sin, NULL},
+	{"cos", cos, NULL},
+	{"tan", tan, NULL},
+	{"exp", exp, NULL},
+	{"log", log, NULL},
+	{"sqrt", sqrt, NULL},
+	{"abs", fabs, NULL},
+	{"floor", floor, NULL},
+	{"ceil", ceil, NULL},
+	{"min", NULL, fmin},
+	{"max", NULL, fmax},
+	{"mod", NULL, fmod}
+};
+
+static void Waveform_Sum(WaveformExpr * e);
+
+/**
+ * Add an instruction to a compiled expression
+ * @param e - The expression
+ * @param op - The instruction
+ * @param pops - Number of values the instruction takes off the stack (it always pushes one)
+ */
+static void Waveform_Emit(WaveformExpr * e, WaveformOp op, int pops)
+{
+	if (e->error != NULL)
+		return;
+	if (e->length >= WAVEFORM_EXPR_MAX)
+	{
+		e->error = "Expression is too long";
+		return;
+	}
+	e->ops[e->length++] = op;
+	e->depth += 1 - pops;
+	if (e->depth > WAVEFORM_STACK_MAX)
+		e->error = "Expression is too deeply nested";
+}
+
+/**
+ * Skip spaces in an expression, then check for a character
+ * @param e - The expression
+ * @param c - The character
+ * @returns true (and skip the character) if it is next
+ */
+static bool Waveform_Accept(WaveformExpr * e, char c)
+{
+	while (isspace((unsigned char)(*e->pos)))
+		e->pos++;
+	if (*e->pos != c)
+		return false;
+	e->pos++;
+	return true;
+}
+
+/**
+ * Compile a number, t, pi, a function call or a bracketed expression
+ * @param e - The expression
+ */
+static void Waveform_Primary(WaveformExpr * e)
+{
+	if (e->error != NULL)
+		return;
+	if (Waveform_Accept(e, '('))
+	{
+		if (++e->nesting > WAVEFORM_STACK_MAX)
+		{
+			e->error = "Expression is too deeply nested";
+			return;
+		}
+		Waveform_Sum(e);
+		e->nesting--;
+		if (e->error == NULL && !Waveform_Accept(e, ')'))
+			e->error = "Expected ')' in expression";
+		return;
+	}
+
+	if (isdigit((unsigned char)(*e->pos)) || *e->pos == '.')
+	{
+		char * end;
+		WaveformOp op = {OP_CONST, strtod(e->pos, &end), NULL, NULL};
+		e->pos = end;
+		Waveform_Emit(e, op, 0);
+		return;
+	}
+
+	const char * name = e->pos;
+	while (isalpha((unsigned char)(*e->pos)))
+		e->pos++;
+	size_t len = e->pos - name;
+	if (len == 1 && *name == 't')
+	{
+		WaveformOp op = {OP_TIME, 0, NULL, NULL};
+		Waveform_Emit(e, op, 0);
+		return;
+	}
+	if (len == 2 && strncmp(name, "pi", 2) == 0)
+	{
+		WaveformOp op = {OP_CONST, M_PI, NULL, NULL};
+		Waveform_Emit(e, op, 0);
+		return;
+	}
+	for (int i = 0; i < sizeof(g_waveform_functions)/sizeof(g_waveform_functions[0]); ++i)
+	{
+		if (strlen(g_waveform_functions[i].name) != len || strncmp(g_waveform_functions[i].name, name, len) != 0)
+			continue;
+		if (!Waveform_Accept(e, '('))
+		{
+			e->error = "Expected '(' after function name in expression";
+			return;
+		}
+		e->nesting++;
+		Waveform_Sum(e);
+		WaveformOp op = {OP_FUNC1, 0, g_waveform_functions[i].fn1, g_waveform_functions[i].fn2};
+		if (op.fn2 != NULL)
+		{
+			op.op = OP_FUNC2;
+			if (e->error == NULL && !Waveform_Accept(e, ','))
+				e->error = "Expected ',' in expression";
+			Waveform_Sum(e);
+		}
+		e->nesting--;
+		if (e->error == NULL && !Waveform_Accept(e, ')'))
+			e->error = "Expected ')' in expression";
+		Waveform_Emit(e, op, (op.op == OP_FUNC2) ? 2 : 1);
+		return;
+	}
+	e->error = (len == 0) ? "Expected a value in expression" : "Unknown name in expression";
+}
+
+/**
+ * Compile a power, or a negated value; ^ binds tighter than unary minus, and to the right
+ * @param e - The expression
+ */
+static void Waveform_Unary(WaveformExpr * e)
+{
+	if (Waveform_Accept(e, '-'))
+	{
+		Waveform_Unary(e);
+		WaveformOp op = {OP_NEG, 0, NULL, NULL};
+		Waveform_Emit(e, op, 1);
+		return;
+	}
+	Waveform_Primary(e);
+	if (e->error == NULL && Waveform_Accept(e, '^'))
+	{
+		Waveform_Unary(e);
+		WaveformOp op = {OP_POW, 0, NULL, NULL};
+		Waveform_Emit(e, op, 2);
+	}
+}
+
+/**
+ * Compile a product or quotient
+ * @param e - The expression
+ */
+static void Waveform_Product(WaveformExpr * e)
+{
+	Waveform_Unary(e);
+	while (e->error == NULL)
+	{
+		WaveformOp op = {OP_MUL, 0, NULL, NULL};
+		if (Waveform_Accept(e, '/'))
+			op.op = OP_DIV;
+		else if (!Waveform_Accept(e, '*'))
+			return;
+		Waveform_Unary(e);
+		Waveform_Emit(e, op, 2);
+	}
+}
+
+/**
+ * Compile a sum or difference
+ * @param e - The expression
+ */
+static void Waveform_Sum(WaveformExpr * e)
+{
+	Waveform_Product(e);
+	while (e->error == NULL)
+	{
+		WaveformOp op = {OP_ADD, 0, NULL, NULL};
+		if (Waveform_Accept(e, '-'))
+			op.op = OP_SUB;
+		else if (!Waveform_Accept(e, '+'))
+			return;
+		Waveform_Product(e);
+		Waveform_Emit(e, op, 2);
+	}
+}
+
+/**
+ * Compile an expression of t
+ * @param e - Set to the compiled expression
+ * @param str - The expression. Note that a '+' in a query string arrives as a space, so must be sent as %2B.
+ * @returns false (and sets e->error) if the expression couldn't be compiled
+ */
+static bool Waveform_Compile(WaveformExpr * e, const char * str)
+{
+	memset(e, 0, sizeof(WaveformExpr));
+	e->pos = str;
+	Waveform_Sum(e);
+	while (isspace((unsigned char)(*e->pos)))
+		e->pos++;
+	if (e->error == NULL && *e->pos != '\0')
+		e->error = "Unexpected characters in expression";
+	return (e->error == NULL);
+}
+
+/**
+ * Evaluate a compiled expression
+ * @param e - The expression
+ * @param t - Time to evaluate it at
+ * @returns The value
+ */
+static double Waveform_Evaluate(const WaveformExpr * e, double t)
+{
+	double stack[WAVEFORM_STACK_MAX];
+	int top = -1;
+	for (int i = 0; i < e->length; ++i)
+	{
+		const WaveformOp * op = &(e->ops[i]);
+		switch (op->op)
+		{
+			case OP_CONST: stack[++top] = op->value; break;
+			case OP_TIME: stack[++top] = t; break;
+			case OP_ADD: top--; stack[top] += stack[top+1]; break;
+			case OP_SUB: top--; stack[top] -= stack[top+1]; break;
+			case OP_MUL: top--; stack[top] *= stack[top+1]; break;
+			case OP_DIV: top--; stack[top] /= stack[top+1]; break;
+			case OP_POW: top--; stack[top] = pow(stack[top], stack[top+1]); break;
+			case OP_NEG: stack[top] = -stack[top]; break;
+			case OP_FUNC1: stack[top] = op->fn1(stack[top]); break;
+			case OP_FUNC2: top--; stack[top] = op->fn2(stack[top], stack[top+1]); break;
+		}
+	}
+	return stack[0];
+}
+
+/**
+ * Read a comma separated list of numbers
+ * @param str - The list
+ * @param numbers - Set to the numbers
+ * @param max - Size of numbers
+ * @returns Number of numbers read, or -1 if the list is malformed or too long
+ */
+static int Waveform_Numbers(const char * str, double * numbers, int max)
+{
+	int count = 0;
+	while (true)
+	{
+		char * end;
+		if (count >= max)
+			return -1;
+		numbers[count++] = strtod(str, &end);
+		if (end == str)
+			return -1;
+		while (isspace((unsigned char)(*end)))
+			end++;
+		if (*end == '\0')
+			return count;
+		if (*end != ',')
+			return -1;
+		str = end + 1;
+	}
+}
+
+/**
+ * Allocate the schedule for a waveform. The step is shortened slightly if needed, so that the cycle is a whole
+ * number of steps long.
+ * @param w - The waveform
+ * @param type - Kind of waveform
+ * @param step - Time between settings (s)
+ * @param period - Length of a cycle (s)
+ * @param cycles - Number of cycles (0 to repeat until changed)
+ * @param error - Set to a description of the problem if the schedule can't be made
+ * @returns true if the schedule was allocated
+ */
+static bool Waveform_Alloc(Waveform * w, WaveformType type, double step, double period, int cycles, const char ** error)
+{
+	if (!(step >= WAVEFORM_MIN_STEP))
+	{
+		*error = "Waveform step is too short";
+		return false;
+	}
+	if (cycles < 0)
+	{
+		*error = "Invalid number of waveform cycles";
+		return false;
+	}
+	double length = ceil(period / step - 1e-9);
+	if (!(length >= 1))
+	{
+		*error = "Waveform is shorter than one step";
+		return false;
+	}
+	if (length > WAVEFORM_MAX_STEPS)
+	{
+		*error = "Waveform has too many steps; use a longer step";
+		return false;
+	}
+	w->type = type;
+	w->length = (int)(length);
+	w->step = period / w->length;
+	w->cycles = cycles;
+	w->values = malloc((w->length + 1) * sizeof(double));
+	if (w->values == NULL)
+	{
+		Log(LOGERR, "Couldn't allocate %d waveform steps", w->length + 1);
+		*error = "Out of memory for waveform";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Make the original stepped waveform; start, then increase by stepsize every stepwait for steps times
+ * @param w - Set to the waveform
+ * @param start - First value
+ * @param stepwait - Time between values (s)
+ * @param stepsize - Change in value each step
+ * @param steps - Number of steps after the first value
+ * @returns false if the waveform isn't valid
+ */
+bool Waveform_Steps(Waveform * w, double start, double stepwait, double stepsize, int steps)
+{
+	if (!(stepwait >= 0) || steps < 0 || steps > WAVEFORM_MAX_STEPS)
+		return false;
+	w->type = WAVEFORM_STEPS;
+	w->step = stepwait;
+	w->length = steps;
+	w->cycles = 1;
+	w->values = malloc((steps + 1) * sizeof(double));
+	if (w->values == NULL)
+		return false;
+	for (int i = 0; i <= steps; ++i)
+		w->values[i] = start + i * stepsize;
+	return true;
+}
+
+/**
+ * Make a waveform from its description, which is one of:
+ *	ramp:from,to,duration
+ *	sine:offset,amplitude,period[,phase]
+ *	table:t0,v0,t1,v1,...	(piecewise linear; times increasing, the cycle ends at the last)
+ *	expr:f(t)	(+ - * / ^, brackets, t, pi and sin cos tan exp log sqrt abs floor ceil min max mod)
+ * @param w - Set to the waveform
+ * @param wave - The description
+ * @param step - Time between settings (s)
+ * @param duration - Length of a cycle of an expression (s)
+ * @param cycles - Number of cycles (0 to repeat until changed)
+ * @param error - Set to a description of the problem if the waveform isn't valid
+ * @returns true if the waveform was made
+ */
+bool Waveform_Parse(Waveform * w, const char * wave, double step, double duration, int cycles, const char ** error)
+{
+	const char * args = strchr(wave, ':');
+	if (args == NULL)
+	{
+		*error = "Waveform should be kind:arguments";
+		return false;
+	}
+	size_t kind = args++ - wave;
+	double a[2*WAVEFORM_TABLE_MAX];
+	int n = 0;
+
+	if (kind == 4 && strncmp(wave, "ramp", kind) == 0)
+	{
+		if (Waveform_Numbers(args, a, 3) != 3)
+		{
+			*error = "Ramp should be ramp:from,to,duration";
+			return false;
+		}
+		if (!Waveform_Alloc(w, WAVEFORM_RAMP, step, a[2], cycles, error))
+			return false;
+		for (int i = 0; i <= w->length; ++i)
+			w->values[i] = a[0] + (a[1] - a[0]) * i / w->length;
+	}
+	else if (kind == 4 && strncmp(wave, "sine", kind) == 0)
+	{
+		n = Waveform_Numbers(args, a, 4);
+		if (n != 3 && n != 4)
+		{
+			*error = "Sine should be sine:offset,amplitude,period[,phase]";
+			return false;
+		}
+		double phase = (n == 4) ? a[3] : 0;
+		if (!Waveform_Alloc(w, WAVEFORM_SINE, step, a[2], cycles, error))
+			return false;
+		for (int i = 0; i <= w->length; ++i)
+			w->values[i] = a[0] + a[1] * sin(2 * M_PI * i / w->length + phase);
+	}
+	else if (kind == 5 && strncmp(wave, "table", kind) == 0)
+	{
+		n = Waveform_Numbers(args, a, 2*WAVEFORM_TABLE_MAX);
+		if (n < 4 || n % 2 != 0)
+		{
+			*error = "Table should be table:t0,v0,t1,v1,...";
+			return false;
+		}
+		for (int j = 2; j < n; j += 2)
+		{
+			if (!(a[j] > a[j-2]) || a[j-2] < 0)
+			{
+				*error = "Times in a table must be increasing from 0";
+				return false;
+			}
+		}
+		if (!Waveform_Alloc(w, WAVEFORM_TABLE, step, a[n-2], cycles, error))
+			return false;
+		int j = 0;
+		for (int i = 0; i <= w->length; ++i)
+		{
+			double t = (i == w->length) ? a[n-2] : i * w->step;
+			while (j + 2 < n - 2 && a[j+2] <= t)
+				j += 2;
+			if (t <= a[j])
+				w->values[i] = a[j+1];
+			else
+				w->values[i] = a[j+1] + (a[j+3] - a[j+1]) * (t - a[j]) / (a[j+2] - a[j]);
+		}
+	}
+	else if (kind == 4 && strncmp(wave, "expr", kind) == 0)
+	{
+		WaveformExpr e;
+		if (!Waveform_Compile(&e, args))
+		{
+			*error = e.error;
+			return false;
+		}
+		if (!Waveform_Alloc(w, WAVEFORM_EXPR, step, duration, cycles, error))
+			return false;
+		for (int i = 0; i <= w->length; ++i)
+			w->values[i] = Waveform_Evaluate(&e, i * w->step);
+	}
+	else
+	{
+		*error = "Unknown kind of waveform";
+		return false;
+	}
+
+	for (int i = 0; i <= w->length; ++i)
+	{
+		if (!isfinite(w->values[i]))
+		{
+			Waveform_Free(w);
+			*error = "Waveform has values that aren't finite";
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Free the schedule of a waveform
+ * @param w - The waveform
+ */
+void Waveform_Free(Waveform * w)
+{
+	free(w->values);
+	w->values = NULL;
+}
+
+/**
+ * Get the number of settings in the schedule of a waveform
+ * @param w - The waveform
+ * @returns Number of settings, or -1 if the waveform repeats until changed
+ */
+long Waveform_Total(const Waveform * w)
+{
+	if (w->cycles == 0)
+		return -1;
+	return (long)(w->cycles) * w->length + 1;
+}
+
+/**
+ * Get a setting from the schedule of a waveform
+ * @param w - The waveform
+ * @param index - Index of the setting; due at index * w->step after the waveform starts
+ * @returns The setting
+ */
+double Waveform_Value(const Waveform * w, long index)
+{
+	if (w->length == 0 || index == Waveform_Total(w) - 1)
+		return w->values[w->length];
+	return w->values[index % w->length];
+}
+
+//EOF
@@ -0,0 +1,65 @@
+/**
+ * @file waveform.h
+ * @brief Declarations for waveforms; schedules of actuator settings that are worked out before they are run
+ */
+
+#ifndef _WAVEFORM_H
+#define _WAVEFORM_H
+
+#include "common.h"
+
+/** Time between settings if none is given (s) **/
+#define WAVEFORM_DEFAULT_STEP 0.1
+/** Shortest time between settings (s) **/
+#define WAVEFORM_MIN_STEP 1e-3
+/** Largest number of settings in one cycle of a waveform **/
+#define WAVEFORM_MAX_STEPS 65536
+/** Largest number of points in a table **/
+#define WAVEFORM_TABLE_MAX 256
+/** Largest number of instructions in a compiled expression **/
+#define WAVEFORM_EXPR_MAX 128
+/** Deepest stack a compiled expression can use **/
+#define WAVEFORM_STACK_MAX 16
+
+/** Kinds of waveform **/
+typedef enum
+{
+	/** Steps of stepsize every stepwait; the original "set" format **/
+	WAVEFORM_STEPS,
+	/** Linear ramp between two values **/
+	WAVEFORM_RAMP,
+	/** Sine wave **/
+	WAVEFORM_SINE,
+	/** Piecewise linear table of times and values **/
+	WAVEFORM_TABLE,
+	/** Expression of the time t in the cycle **/
+	WAVEFORM_EXPR
+} WaveformType;
+
+/**
+ * A schedule of settings, evenly spaced in time. Each cycle is values[0] to values[length-1];
+ * after the last cycle, values[length] is set, so that the waveform finishes where it should.
+ */
+typedef struct
+{
+	/** Kind of waveform the schedule was made from **/
+	WaveformType type;
+	/** Time between settings (s) **/
+	double step;
+	/** Number of settings in a cycle **/
+	int length;
+	/** Number of cycles; 0 to repeat until the control is changed **/
+	int cycles;
+	/** Settings (length + 1 of them) **/
+	double * values;
+} Waveform;
+
+extern bool Waveform_Steps(Waveform * w, double start, double stepwait, double stepsize, int steps); // Make the original stepped waveform
+extern bool Waveform_Parse(Waveform * w, const char * wave, double step, double duration, int cycles, const char ** error); // Make a waveform from a description
+extern void Waveform_Free(Waveform * w); // Free the schedule of a waveform
+extern long Waveform_Total(const Waveform * w); // Number of settings in the schedule
+extern double Waveform_Value(const Waveform * w, long index); // Setting at an index in the schedule
+
+#endif //_WAVEFORM_H
+
+//EOF
@@ -0,0 +1,86 @@
+/**
+ * @file bench.c
+ * @purpose What the benchmarks share: stubs of the server's logging (warnings and errors go to stderr),
+ * and timing a measurement over generated inputs
+ */
+
+#include "bench.h"
+#include <math.h>
+#include <stdarg.h>
+
+/** Log warnings and errors from the server's code to stderr **/
+void LogEx(int level, const char * funct, const char * file, int line, ...)
+{
+	if (level > LOGWARN)
+		return;
+	va_list va;
+	va_start(va, line);
+	const char * fmt = va_arg(va, const char*);
+	fprintf(stderr, "%s:%d %s - ", file, line, funct);
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, "\n");
+	va_end(va);
+}
+
+/** Exit after a fatal error in the server's code **/
+void FatalEx(const char * funct, const char * file, int line, ...)
+{
+	va_list va;
+	va_start(va, line);
+	const char * fmt = va_arg(va, const char*);
+	fprintf(stderr, "FATAL %s:%d %s - ", file, line, funct);
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, "\n");
+	va_end(va);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Seconds since a time
+ * @param start - The time, on CLOCK_MONOTONIC
+ */
+double Bench_Since(const struct timespec * start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TIMEVAL_DIFF(now, *start);
+}
+
+/**
+ * Generate inputs one at a time, time measuring each, and compare the values found with the truth
+ * @param runs - Number of inputs
+ * @param generate - Function that generates an input; not timed
+ * @param measure - Function that measures it; timed
+ * @param found - Function called with each value found, or NULL
+ * @param arg - Passed to the functions
+ * @param relative - If true, values are measured from the first value found (eg: a phase), so the truth is too
+ * @param result - Set to the results
+ */
+void Bench_Run(int runs, BenchGenerateFn generate, BenchMeasureFn measure, BenchFoundFn found,
+	void * arg, bool relative, BenchResult * result)
+{
+	double sum_squares = 0, start = 0;
+	memset(result, 0, sizeof(BenchResult));
+	result->runs = runs;
+	for (int i = 0; i < runs; ++i)
+	{
+		double truth = generate(arg, i);
+		double value;
+		struct timespec before;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		bool set = measure(arg, &value);
+		result->busy += Bench_Since(&before);
+		if (!set)
+			continue;
+
+		if (result->found++ == 0 && relative)
+			start = truth;
+		truth -= start;
+		double error = fabs(value - truth);
+		sum_squares += error*error;
+		result->max_error = (error > result->max_error) ? error : result->max_error;
+		if (found != NULL)
+			found(arg, i, truth, value);
+	}
+	result->rms_error = (result->found > 0) ? sqrt(sum_squares / result->found) : 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file bench.h
+ * @purpose Declarations for what the benchmarks share: stubs of the server's logging, and timing a measurement
+ * over generated inputs
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "common.h"
+
+/** Results of timing a measurement over generated inputs, and comparing it with the truth **/
+typedef struct
+{
+	/** Number of inputs, and number that gave a value **/
+	int runs;
+	int found;
+	/** Total time spent measuring (s) **/
+	double busy;
+	/** Root mean square and largest error of the values found **/
+	double rms_error;
+	double max_error;
+} BenchResult;
+
+/**
+ * Function that generates an input
+ * @param arg - Argument given to Bench_Run
+ * @param i - Number of the input
+ * @returns The value the measurement should give
+ */
+typedef double (*BenchGenerateFn)(void * arg, int i);
+
+/**
+ * Function that measures the last input generated; this is what is timed
+ * @param arg - Argument given to Bench_Run
+ * @param value - Set to the value measured
+ * @returns false if no value was found
+ */
+typedef bool (*BenchMeasureFn)(void * arg, double * value);
+
+/**
+ * Function called with each value found (eg: to print it)
+ * @param arg - Argument given to Bench_Run
+ * @param i - Number of the input
+ * @param truth - The value that should have been found
+ * @param value - The value found
+ */
+typedef void (*BenchFoundFn)(void * arg, int i, double truth, double value);
+
+extern double Bench_Since(const struct timespec * start); // Seconds since a time on CLOCK_MONOTONIC
+extern void Bench_Run(int runs, BenchGenerateFn generate, BenchMeasureFn measure, BenchFoundFn found,
+	void * arg, bool relative, BenchResult * result); // Time a measurement over generated inputs
+
+#endif //_BENCH_H
+
+//EOF
@@ -0,0 +1,901 @@
+/**
+ * @file fcgi_bench.c
+ * @brief Load generator for measuring the throughput and latency of the server's API.
+ * Talks FastCGI to the server directly (as spawned by run.sh), so the web server is not measured,
+ * or HTTP to a local nginx (-H). Replays a weighted mix of requests (-m) from a number of concurrent
+ * clients (-c), and prints tab separated results including percentiles of the latency.
+ * Usage: ./fcgi_bench [options] module [query]
+ *        ./fcgi_bench [options] -m mix_file
+ * eg: ./fcgi_bench -n 10000 identify
+ *     ./fcgi_bench -n 10000 sensors "id=0"
+ *     ./fcgi_bench -c 4 -t 30 -m gui.mix
+ *     ./fcgi_bench -H -p 8080 -c 16 -t 30 -m gui.mix -D experiment=test
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/** FastCGI record types and constants (see the FastCGI specification) **/
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define REQUEST_ID 1
+
+/** Largest number of different requests in a mix **/
+#define MAX_ENTRIES 32
+/** Largest number of concurrent clients **/
+#define MAX_CLIENTS 256
+/** Largest number of -D substitutions **/
+#define MAX_DEFINES 16
+/** Size of the receive buffer of each connection **/
+#define RECV_BUFSIZ 65536
+/** Number of bytes of each response kept to look for its status and cookie **/
+#define HEAD_SIZE 1024
+/** Attempts at a request before giving up, if the server keeps closing the connection **/
+#define MAX_ATTEMPTS 3
+
+#define USAGE "Usage: %s [-h host] [-p port] [-n requests | -t seconds] [-w warmup] [-c clients] [-r] [-H] [-P prefix]\n" \
+	"\t[-D name=value] (module [query] | -m mix_file)\n"
+
+/** Header of a FastCGI record **/
+typedef struct
+{
+	uint8_t version;
+	uint8_t type;
+	uint8_t request_id[2];
+	uint8_t content_length[2];
+	uint8_t padding_length;
+	uint8_t reserved;
+} RecordHeader;
+
+/** A request in the mix **/
+typedef struct
+{
+	/** Name in the results; the module, numbered if it appears more than once **/
+	char name[64];
+	char * module;
+	char * query;
+	/** Relative number of times it is made **/
+	int weight;
+} Entry;
+
+/** Results of one request of the mix, made by one client **/
+typedef struct
+{
+	/** Latency of each request (s) **/
+	double * latency;
+	size_t count;
+	size_t size;
+	size_t bytes;
+	long errors;
+} Samples;
+
+/** A connection to the server **/
+typedef struct
+{
+	int sfd;
+	char buffer[RECV_BUFSIZ];
+	size_t start;
+	size_t end;
+} Connection;
+
+/** The response to a request **/
+typedef struct
+{
+	size_t bytes;
+	int status;
+	/** The beginning of the response (NULL terminated) **/
+	char head[HEAD_SIZE];
+	size_t head_len;
+} Response;
+
+/** A client; makes requests one after another on its own connection **/
+typedef struct
+{
+	pthread_t thread;
+	unsigned seed;
+	Connection connection;
+	Samples samples[MAX_ENTRIES];
+} Client;
+
+/** Command line options **/
+static struct
+{
+	const char * host;
+	const char * port;
+	long requests;
+	double duration;
+	long warmup;
+	int clients;
+	/** Open a new connection for each request (as nginx does by default) **/
+	bool reconnect;
+	/** Speak HTTP to a web server rather than FastCGI to the server **/
+	bool http;
+	/** Start of the URL of a module, for HTTP **/
+	const char * prefix;
+} g_options = {"localhost", "9005", 1000, 0, 100, 1, false, false, "/api/"};
+
+static Entry g_entries[MAX_ENTRIES];
+static int g_num_entries = 0;
+static int g_total_weight = 0;
+
+/** Control key given to us by the server, sent back as a cookie **/
+static char g_cookie[128] = "";
+static pthread_mutex_t g_cookie_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Number of requests that clients have started, when there is a fixed number **/
+static long g_started = 0;
+/** Time the clients stop, when they run for a fixed time **/
+static struct timespec g_deadline;
+
+/**
+ * Print an error and exit
+ * @param msg - The message
+ */
+static void Die(const char * msg)
+{
+	fprintf(stderr, "fcgi_bench: %s%s%s\n", msg, errno ? " - " : "", errno ? strerror(errno) : "");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Difference between two times in seconds
+ */
+static double Elapsed(const struct timespec * start, const struct timespec * end)
+{
+	return (end->tv_sec - start->tv_sec) + 1e-9 * (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Connect to the server
+ * @param connection - The connection; its buffer is emptied
+ */
+static void Connect(Connection * connection)
+{
+	struct addrinfo hints = {0}, * result;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(g_options.host, g_options.port, &hints, &result) != 0)
+		Die("Couldn't resolve host");
+
+	int sfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	if (sfd < 0 || connect(sfd, result->ai_addr, result->ai_addrlen) != 0)
+		Die("Couldn't connect to server");
+	freeaddrinfo(result);
+
+	int one = 1;
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	connection->sfd = sfd;
+	connection->start = connection->end = 0;
+}
+
+/**
+ * Close a connection, if it is open
+ */
+static void Disconnect(Connection * connection)
+{
+	if (connection->sfd >= 0)
+		close(connection->sfd);
+	connection->sfd = -1;
+}
+
+/**
+ * Send all of a buffer
+ * @returns false if the connection was closed
+ */
+static bool WriteAll(Connection * connection, const char * buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(connection->sfd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Make sure there is something in the receive buffer
+ * @returns false if the connection was closed
+ */
+static bool Fill(Connection * connection)
+{
+	while (connection->start == connection->end)
+	{
+		ssize_t n = read(connection->sfd, connection->buffer, RECV_BUFSIZ);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		connection->start = 0;
+		connection->end = n;
+	}
+	return true;
+}
+
+/**
+ * Read exactly len bytes
+ * @param buf - Where to put them; NULL to discard them
+ * @returns false if the connection was closed
+ */
+static bool ReadAll(Connection * connection, void * buf, size_t len)
+{
+	while (len > 0)
+	{
+		if (!Fill(connection))
+			return false;
+		size_t n = connection->end - connection->start;
+		if (n > len)
+			n = len;
+		if (buf != NULL)
+		{
+			memcpy(buf, connection->buffer + connection->start, n);
+			buf = (char*)buf + n;
+		}
+		connection->start += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * Read a line ending in "\r\n" (which is removed)
+ * @param line - Filled with the line; longer lines are cut short
+ * @param size - Size of line
+ * @returns false if the connection was closed
+ */
+static bool ReadLine(Connection * connection, char * line, size_t size)
+{
+	size_t len = 0;
+	while (true)
+	{
+		if (!Fill(connection))
+			return false;
+		char c = connection->buffer[connection->start++];
+		if (c == '\n')
+			break;
+		if (len + 1 < size)
+			line[len++] = c;
+	}
+	if (len > 0 && line[len-1] == '\r')
+		--len;
+	line[len] = '\0';
+	return true;
+}
+
+/**
+ * Read part of the body of a response, keeping its beginning
+ * @param response - The response; its head and bytes are updated
+ * @param len - Number of bytes
+ * @returns false if the connection was closed
+ */
+static bool ReadBody(Connection * connection, Response * response, size_t len)
+{
+	size_t keep = HEAD_SIZE - 1 - response->head_len;
+	if (keep > len)
+		keep = len;
+	if (!ReadAll(connection, response->head + response->head_len, keep)
+		|| !ReadAll(connection, NULL, len - keep))
+		return false;
+	response->head_len += keep;
+	response->head[response->head_len] = '\0';
+	response->bytes += len;
+	return true;
+}
+
+/**
+ * Remember the control key from a response, so the server doesn't generate a new one every request
+ * @param text - Headers of the response (NULL terminated)
+ */
+static void TakeCookie(const char * text)
+{
+	const char * key = strstr(text, "Set-Cookie: mctxkey=");
+	if (key == NULL)
+		return;
+	key += strlen("Set-Cookie: ");
+	size_t key_len = strcspn(key, "\r\n;");
+	pthread_mutex_lock(&g_cookie_mutex);
+	snprintf(g_cookie, sizeof(g_cookie), "%.*s", (int)key_len, key);
+	pthread_mutex_unlock(&g_cookie_mutex);
+}
+
+/**
+ * Append a record to a buffer
+ * @param buf - Buffer to append to
+ * @param len - Length of buf; updated
+ * @param type - Record type
+ * @param data - Content of the record
+ * @param data_len - Length of the content (< 65536)
+ */
+static void AddRecord(char * buf, size_t * len, int type, const void * data, size_t data_len)
+{
+	RecordHeader header = {FCGI_VERSION_1, type, {0, REQUEST_ID},
+		{(data_len >> 8) & 0xff, data_len & 0xff}, 0, 0};
+	memcpy(buf + *len, &header, sizeof(header));
+	memcpy(buf + *len + sizeof(header), data, data_len);
+	*len += sizeof(header) + data_len;
+}
+
+/**
+ * Append the length of a name or value to a FastCGI params stream; one byte if < 128, otherwise four
+ */
+static void AddLength(char * buf, size_t * len, size_t value_len)
+{
+	if (value_len > 127)
+	{
+		buf[(*len)++] = 0x80 | ((value_len >> 24) & 0x7f);
+		buf[(*len)++] = (value_len >> 16) & 0xff;
+		buf[(*len)++] = (value_len >> 8) & 0xff;
+	}
+	buf[(*len)++] = value_len & 0xff;
+}
+
+/**
+ * Append a name-value pair to a FastCGI params stream
+ * @param buf - Buffer to append to
+ * @param len - Length of buf; updated
+ * @param size - Size of buf
+ * @param name - Name of the parameter
+ * @param value - Value of the parameter
+ */
+static void AddParam(char * buf, size_t * len, size_t size, const char * name, const char * value)
+{
+	size_t name_len = strlen(name), value_len = strlen(value);
+	if (*len + 8 + name_len + value_len > size)
+		Die("Parameters too long");
+	AddLength(buf, len, name_len);
+	AddLength(buf, len, value_len);
+	memcpy(buf + *len, name, name_len);
+	*len += name_len;
+	memcpy(buf + *len, value, value_len);
+	*len += value_len;
+}
+
+/**
+ * Send a request over FastCGI and read the whole response
+ * @param connection - The connection
+ * @param entry - The request
+ * @param response - Set to the response
+ * @returns false if the connection was closed before the response ended
+ */
+static bool FastCGI_Request(Connection * connection, const Entry * entry, Response * response)
+{
+	char out[8192], params[4096], cookie[sizeof(g_cookie)];
+	size_t len = 0, params_len = 0;
+
+	pthread_mutex_lock(&g_cookie_mutex);
+	strcpy(cookie, g_cookie);
+	pthread_mutex_unlock(&g_cookie_mutex);
+
+	const unsigned char begin[8] = {0, FCGI_RESPONDER, g_options.reconnect ? 0 : FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+	AddRecord(out, &len, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+	AddParam(params, &params_len, sizeof(params), "DOCUMENT_URI_LOCAL", entry->module);
+	AddParam(params, &params_len, sizeof(params), "QUERY_STRING", entry->query);
+	AddParam(params, &params_len, sizeof(params), "REQUEST_METHOD", "GET");
+	AddParam(params, &params_len, sizeof(params), "COOKIE_STRING", cookie);
+	AddParam(params, &params_len, sizeof(params), "REMOTE_ADDR", "127.0.0.1");
+	AddRecord(out, &len, FCGI_PARAMS, params, params_len);
+	AddRecord(out, &len, FCGI_PARAMS, NULL, 0);
+	AddRecord(out, &len, FCGI_STDIN, NULL, 0);
+	if (!WriteAll(connection, out, len))
+		return false;
+
+	while (true)
+	{
+		RecordHeader header;
+		if (!ReadAll(connection, &header, sizeof(header)))
+			return false;
+		size_t content_len = (header.content_length[0] << 8) | header.content_length[1];
+
+		if (header.type == FCGI_STDOUT)
+		{
+			if (!ReadBody(connection, response, content_len))
+				return false;
+		}
+		else if (!ReadAll(connection, NULL, content_len))
+			return false;
+		if (!ReadAll(connection, NULL, header.padding_length))
+			return false;
+
+		if (header.type == FCGI_END_REQUEST)
+			break;
+	}
+
+	// The server only sends a status if it isn't 200
+	const char * status = strstr(response->head, "Status: ");
+	response->status = (status != NULL) ? atoi(status + strlen("Status: ")) : 200;
+	TakeCookie(response->head);
+	return true;
+}
+
+/**
+ * Send a request over HTTP (to nginx) and read the whole response
+ * @param connection - The connection
+ * @param entry - The request
+ * @param response - Set to the response
+ * @returns false if the connection was closed before the response ended
+ */
+static bool HTTP_Request(Connection * connection, const Entry * entry, Response * response)
+{
+	char out[8192], line[1024];
+	pthread_mutex_lock(&g_cookie_mutex);
+	int len = snprintf(out, sizeof(out), "GET %s%s%s%s HTTP/1.1\r\nHost: %s\r\n%s%s%sConnection: %s\r\n\r\n",
+		g_options.prefix, entry->module, *entry->query ? "?" : "", entry->query, g_options.host,
+		*g_cookie ? "Cookie: " : "", g_cookie, *g_cookie ? "\r\n" : "", g_options.reconnect ? "close" : "keep-alive");
+	pthread_mutex_unlock(&g_cookie_mutex);
+	if (len < 0 || (size_t)len >= sizeof(out))
+		Die("Request too long");
+	if (!WriteAll(connection, out, len))
+		return false;
+
+	if (!ReadLine(connection, line, sizeof(line)))
+		return false;
+	const char * status = strchr(line, ' ');
+	response->status = (status != NULL) ? atoi(status + 1) : 0;
+
+	long content_length = -1;
+	bool chunked = false, keep_alive = true;
+	while (true)
+	{
+		if (!ReadLine(connection, line, sizeof(line)))
+			return false;
+		if (*line == '\0')
+			break;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			content_length = atol(line + 15);
+		else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked") != NULL)
+			chunked = true;
+		else if (!strncasecmp(line, "Connection:", 11) && strstr(line, "close") != NULL)
+			keep_alive = false;
+		else if (!strncasecmp(line, "Set-Cookie:", 11))
+			TakeCookie(line);
+	}
+
+	if (chunked)
+	{
+		while (true)
+		{
+			if (!ReadLine(connection, line, sizeof(line)))
+				return false;
+			size_t chunk_len = strtoul(line, NULL, 16);
+			if (chunk_len == 0)
+				break;
+			if (!ReadBody(connection, response, chunk_len) || !ReadLine(connection, line, sizeof(line)))
+				return false;
+		}
+		// Trailers
+		do
+		{
+			if (!ReadLine(connection, line, sizeof(line)))
+				return false;
+		} while (*line != '\0');
+	}
+	else if (content_length >= 0)
+	{
+		if (!ReadBody(connection, response, content_length))
+			return false;
+	}
+	else
+	{
+		// The body ends when the connection does
+		while (Fill(connection))
+		{
+			if (!ReadBody(connection, response, connection->end - connection->start))
+				return false;
+		}
+		keep_alive = false;
+	}
+
+	if (!keep_alive)
+		Disconnect(connection);
+	return true;
+}
+
+/**
+ * Make a request, connecting as needed
+ * @param connection - The connection
+ * @param entry - The request
+ * @param response - Set to the response
+ * @returns true if the response was an error
+ */
+static bool Request(Connection * connection, const Entry * entry, Response * response)
+{
+	for (int attempt = 0; attempt < MAX_ATTEMPTS; ++attempt)
+	{
+		memset(response, 0, sizeof(Response));
+		if (connection->sfd < 0)
+			Connect(connection);
+		bool ok = g_options.http ? HTTP_Request(connection, entry, response)
+			: FastCGI_Request(connection, entry, response);
+		if (!ok || g_options.reconnect)
+			Disconnect(connection);
+		if (ok)
+		{
+			// The server's JSON responses have a negative status if the request failed
+			return response->status >= 400 || strstr(response->head, "\"status\" : -") != NULL;
+		}
+		// Server didn't keep the connection; try again on a new one
+	}
+	errno = 0;
+	Die("Server keeps closing the connection");
+	return true;
+}
+
+/**
+ * Choose a request from the mix, at random by weight
+ * @param seed - Seed for rand_r
+ */
+static const Entry * Choose(unsigned * seed)
+{
+	if (g_num_entries == 1)
+		return g_entries;
+	int pick = rand_r(seed) % g_total_weight;
+	for (int i = 0; i < g_num_entries; ++i)
+	{
+		pick -= g_entries[i].weight;
+		if (pick < 0)
+			return g_entries + i;
+	}
+	return g_entries + g_num_entries - 1;
+}
+
+/**
+ * Record the result of a request
+ */
+static void AddSample(Samples * samples, double latency, const Response * response, bool error)
+{
+	if (samples->count >= samples->size)
+	{
+		samples->size = (samples->size == 0) ? 1024 : 2 * samples->size;
+		samples->latency = realloc(samples->latency, samples->size * sizeof(double));
+		if (samples->latency == NULL)
+			Die("Out of memory");
+	}
+	samples->latency[samples->count++] = latency;
+	samples->bytes += response->bytes;
+	samples->errors += error;
+}
+
+/**
+ * Make requests until there are enough or the time is up
+ * @param arg - The Client
+ */
+static void * Client_Loop(void * arg)
+{
+	Client * client = arg;
+	Response response;
+	while (true)
+	{
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (g_options.duration > 0)
+		{
+			if (Elapsed(&g_deadline, &start) >= 0)
+				break;
+		}
+		else if (__atomic_fetch_add(&g_started, 1, __ATOMIC_RELAXED) >= g_options.requests)
+			break;
+
+		const Entry * entry = Choose(&client->seed);
+		bool error = Request(&client->connection, entry, &response);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		AddSample(client->samples + (entry - g_entries), Elapsed(&start, &end), &response, error);
+	}
+	Disconnect(&client->connection);
+	return NULL;
+}
+
+/**
+ * Compare doubles for qsort
+ */
+static int CompareDouble(const void * a, const void * b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Combine the results of some of the requests of every client
+ * @param clients - The clients
+ * @param first - First entry of the mix to include
+ * @param last - Last entry of the mix to include
+ * @returns The results; their latencies are sorted
+ */
+static Samples Combine(Client * clients, int first, int last)
+{
+	Samples all = {NULL, 0, 0, 0, 0};
+	for (int c = 0; c < g_options.clients; ++c)
+	{
+		for (int e = first; e <= last; ++e)
+			all.size += clients[c].samples[e].count;
+	}
+	all.latency = malloc((all.size + 1) * sizeof(double));
+	if (all.latency == NULL)
+		Die("Out of memory");
+	for (int c = 0; c < g_options.clients; ++c)
+	{
+		for (int e = first; e <= last; ++e)
+		{
+			Samples * s = clients[c].samples + e;
+			memcpy(all.latency + all.count, s->latency, s->count * sizeof(double));
+			all.count += s->count;
+			all.bytes += s->bytes;
+			all.errors += s->errors;
+		}
+	}
+	qsort(all.latency, all.count, sizeof(double), CompareDouble);
+	return all;
+}
+
+/**
+ * Get a percentile (by nearest rank) of sorted latencies, in us
+ */
+static double Percentile(const Samples * samples, double p)
+{
+	if (samples->count == 0)
+		return 0;
+	size_t rank = (size_t)(p / 100 * samples->count + 0.5);
+	rank = (rank < 1) ? 1 : (rank > samples->count) ? samples->count : rank;
+	return 1e6 * samples->latency[rank - 1];
+}
+
+/**
+ * Print the results of some requests
+ * @param prefix - Start of the name of each result
+ * @param samples - The combined results (see Combine)
+ * @param elapsed - Time taken by all the requests (s)
+ */
+static void PrintResults(const char * prefix, const Samples * samples, double elapsed)
+{
+	double total = 0;
+	for (size_t i = 0; i < samples->count; ++i)
+		total += samples->latency[i];
+	size_t n = (samples->count > 0) ? samples->count : 1;
+
+	printf("%srequests\t%zu\n%srequests_per_s\t%f\n%serrors\t%ld\n", prefix, samples->count,
+		prefix, samples->count / elapsed, prefix, samples->errors);
+	printf("%slatency_mean_us\t%f\n%slatency_min_us\t%f\n%slatency_p50_us\t%f\n%slatency_p90_us\t%f\n"
+		"%slatency_p99_us\t%f\n%slatency_p999_us\t%f\n%slatency_max_us\t%f\n", prefix, 1e6 * total / n,
+		prefix, Percentile(samples, 0), prefix, Percentile(samples, 50), prefix, Percentile(samples, 90),
+		prefix, Percentile(samples, 99), prefix, Percentile(samples, 99.9), prefix, Percentile(samples, 100));
+	printf("%sbytes_per_response\t%f\n", prefix, (double)samples->bytes / n);
+}
+
+/**
+ * Replace "{name}" with the value of each -D name=value
+ * @param text - Text to replace in
+ * @param defines - The -D options
+ * @param num_defines - Number of them
+ * @returns The text with the values in (allocated)
+ */
+static char * Substitute(const char * text, char ** defines, int num_defines)
+{
+	char * result = strdup(text);
+	for (int d = 0; d < num_defines && result != NULL; ++d)
+	{
+		char key[128];
+		const char * value = strchr(defines[d], '=') + 1;
+		snprintf(key, sizeof(key), "{%.*s}", (int)(value - 1 - defines[d]), defines[d]);
+		char * found;
+		while ((found = strstr(result, key)) != NULL)
+		{
+			char * replaced = malloc(strlen(result) - strlen(key) + strlen(value) + 1);
+			if (replaced == NULL)
+				Die("Out of memory");
+			sprintf(replaced, "%.*s%s%s", (int)(found - result), result, value, found + strlen(key));
+			free(result);
+			result = replaced;
+		}
+	}
+	if (result == NULL)
+		Die("Out of memory");
+	return result;
+}
+
+/**
+ * Add a request to the mix
+ * @param weight - Relative number of times it is made
+ * @param module - Module to request
+ * @param query - Query string (before substitution)
+ */
+static void AddEntry(int weight, const char * module, const char * query, char ** defines, int num_defines)
+{
+	if (g_num_entries >= MAX_ENTRIES)
+	{
+		errno = 0;
+		Die("Too many requests in the mix");
+	}
+	Entry * entry = g_entries + g_num_entries++;
+	entry->weight = weight;
+	entry->module = Substitute(module, defines, num_defines);
+	entry->query = Substitute(query, defines, num_defines);
+	g_total_weight += weight;
+
+	// Number entries for the same module so their results can be told apart
+	int same = 0;
+	for (int i = 0; i < g_num_entries - 1; ++i)
+		same += !strcmp(g_entries[i].module, entry->module);
+	if (same > 0)
+		snprintf(entry->name, sizeof(entry->name), "%s:%d", entry->module, same + 1);
+	else
+		snprintf(entry->name, sizeof(entry->name), "%s", entry->module);
+}
+
+/**
+ * Read a mix of requests; each line is "weight module [query]", and # starts a comment
+ * @param filename - The mix file
+ */
+static void LoadMix(const char * filename, char ** defines, int num_defines)
+{
+	FILE * file = fopen(filename, "r");
+	if (file == NULL)
+		Die("Couldn't open the mix file");
+
+	char * line = NULL;
+	size_t size = 0;
+	int line_number = 0;
+	while (getline(&line, &size, file) != -1)
+	{
+		++line_number;
+		line[strcspn(line, "#\r\n")] = '\0';
+		char * weight = strtok(line, " \t");
+		if (weight == NULL)
+			continue;
+		char * module = strtok(NULL, " \t");
+		char * query = strtok(NULL, " \t");
+		char * end;
+		long w = strtol(weight, &end, 10);
+		if (module == NULL || *end != '\0' || w <= 0 || w > 1000000)
+		{
+			fprintf(stderr, "fcgi_bench: %s:%d: Expected \"weight module [query]\"\n", filename, line_number);
+			exit(EXIT_FAILURE);
+		}
+		AddEntry(w, module, (query != NULL) ? query : "", defines, num_defines);
+	}
+	free(line);
+	fclose(file);
+
+	if (g_num_entries == 0)
+	{
+		fprintf(stderr, "fcgi_bench: %s has no requests\n", filename);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	const char * mix = NULL;
+	char * defines[MAX_DEFINES];
+	int num_defines = 0;
+	bool reconnect = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:n:t:w:c:rHP:D:m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'h': g_options.host = optarg; break;
+			case 'p': g_options.port = optarg; break;
+			case 'n': g_options.requests = strtol(optarg, NULL, 10); break;
+			case 't': g_options.duration = strtod(optarg, NULL); break;
+			case 'w': g_options.warmup = strtol(optarg, NULL, 10); break;
+			case 'c': g_options.clients = strtol(optarg, NULL, 10); break;
+			case 'r': reconnect = true; break;
+			case 'H': g_options.http = true; break;
+			case 'P': g_options.prefix = optarg; break;
+			case 'm': mix = optarg; break;
+			case 'D':
+				if (num_defines >= MAX_DEFINES || strchr(optarg, '=') == NULL)
+				{
+					fprintf(stderr, "%s: Expected at most %d of -D name=value\n", argv[0], MAX_DEFINES);
+					return EXIT_FAILURE;
+				}
+				defines[num_defines++] = optarg;
+				break;
+			default:
+				fprintf(stderr, USAGE, argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if ((mix == NULL) == (optind >= argc) || g_options.requests <= 0 || g_options.duration < 0
+		|| g_options.warmup < 0 || g_options.clients < 1 || g_options.clients > MAX_CLIENTS)
+	{
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (mix != NULL)
+		LoadMix(mix, defines, num_defines);
+	else
+		AddEntry(1, argv[optind], (optind + 1 < argc) ? argv[optind + 1] : "", defines, num_defines);
+
+	// The server answers one FastCGI connection at a time, so concurrent clients can't keep theirs
+	g_options.reconnect = reconnect || (!g_options.http && g_options.clients > 1);
+
+	Client * clients = calloc(g_options.clients, sizeof(Client));
+	if (clients == NULL)
+		Die("Out of memory");
+
+	// Warm up (and get the control key) on a connection of our own
+	Client * warmup = calloc(1, sizeof(Client));
+	if (warmup == NULL)
+		Die("Out of memory");
+	warmup->connection.sfd = -1;
+	for (long i = 0; i < g_options.warmup || i < 1; ++i)
+	{
+		Response response;
+		Request(&warmup->connection, Choose(&warmup->seed), &response);
+	}
+	Disconnect(&warmup->connection);
+	free(warmup);
+
+	struct timespec begin, finish;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	g_deadline = begin;
+	g_deadline.tv_sec += (time_t)g_options.duration;
+	g_deadline.tv_nsec += (long)(1e9 * (g_options.duration - (time_t)g_options.duration));
+	if (g_deadline.tv_nsec >= 1000000000L)
+	{
+		g_deadline.tv_sec++;
+		g_deadline.tv_nsec -= 1000000000L;
+	}
+
+	for (int c = 0; c < g_options.clients; ++c)
+	{
+		clients[c].seed = c + 1;
+		clients[c].connection.sfd = -1;
+		if (pthread_create(&clients[c].thread, NULL, Client_Loop, clients + c) != 0)
+			Die("Couldn't start a client");
+	}
+	for (int c = 0; c < g_options.clients; ++c)
+		pthread_join(clients[c].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	double elapsed = Elapsed(&begin, &finish);
+
+	if (mix != NULL)
+		printf("mix\t%s\n", mix);
+	else
+		printf("module\t%s\nquery\t%s\n", g_entries[0].module, g_entries[0].query);
+	printf("protocol\t%s\nclients\t%d\nconnections\t%s\nelapsed_s\t%f\n", g_options.http ? "http" : "fastcgi",
+		g_options.clients, g_options.reconnect ? "per_request" : "kept", elapsed);
+
+	Samples all = Combine(clients, 0, g_num_entries - 1);
+	PrintResults("", &all, elapsed);
+	free(all.latency);
+
+	// Results of each request in a mix
+	for (int e = 0; e < g_num_entries && g_num_entries > 1; ++e)
+	{
+		char prefix[80];
+		snprintf(prefix, sizeof(prefix), "%s/", g_entries[e].name);
+		Samples samples = Combine(clients, e, e);
+		PrintResults(prefix, &samples, elapsed);
+		free(samples.latency);
+	}
+	return EXIT_SUCCESS;
+}
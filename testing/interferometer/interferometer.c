@@ -1,288 +1,115 @@
 /**
  * @file interferometer.c
- * @purpose Implementation of interferometer related functions
+ * @purpose Benchmark of the interferometer sensor (server/sensors/interferometer.c) on synthetic fringes
  */
 
 #include "cv.h"
 #include "highgui_c.h"
-#include "interferometer.h"
+#include "sensors/interferometer.h"
+#include "bench.h"
 #include <math.h>
 
-/** Buffer for storing image data. Stored as a single intensity value for the laser light **/
-static CvMat * g_data = NULL;
-
-
-/** Camera capture pointer **/
+/** Camera capture pointer; a frame from it is used as the background if requested **/
 static CvCapture * g_capture = NULL;
 
-
-struct timeval start;
-
-#define PI 3.141592
-
 // For testing purposes
 double test_omega = 0.05;
-double test_angle = PI/2;
-double test_noise[] = {0,0,0.02};
+double test_angle = M_PI/2;
+double test_noise = 0.02;
 double test_phase = 0;
-double test_intensity = 1.0;
-
 
-static void Interferometer_TestSinusoid()
+/** What the benchmark works on **/
+typedef struct
 {
-	if (g_capture == NULL)
-	{
-		g_capture = cvCreateCameraCapture(0);
-	}
-
-	// Get image from camera
-	IplImage * img = cvQueryFrame(g_capture);
-
-	// Convert to CvMat
-	CvMat stub;
-	CvMat * background = cvGetMat(img, &stub, 0, 0);
-	// ... Honestly, I have no idea what the "stub" is for
-
-	if (g_data == NULL)
-	{
-		g_data = cvCreateMat(background->rows, background->cols, CV_32FC3);
-	}
-
-	//cvShowImage("background", background);
-
-	for (int x = 0; x < g_data->cols-1; ++x)
-	{
-		for (int y = 0; y < g_data->rows-1; ++y)
-		{
-			// Calculate pure sine in test direction
-			double r = x*cos(test_angle) + y*sin(test_angle);
-			double value = 0.5*test_intensity*(1+sin(test_omega*r + test_phase));
-
-			CvScalar s; 
-			s.val[0] = 0; s.val[1] = 0; s.val[2] = value;
-			CvScalar b = cvGet2D(background, y, x);
-
-
-			// Add noise & background image
-
-			// Get the order the right way round
-			double t = b.val[0];
-			b.val[0] = b.val[2];
-			b.val[2] = t;
-			for (int i = 0; i < 3; ++i)
-			{
-					
-				s.val[i] += (rand() % 1000) * 1e-3 * test_noise[i];
-				s.val[i] += b.val[i] / 255; // Camera image is 0-255
-			}
-
-			//printf("set %d,%d\n", x, y);
-
-		
-
-			cvSet2D(g_data,y, x, s);
-		}
-	}	
-
-
-}
-
-
-/**
- * Get an image from the Interferometer
- */
-static void Interferometer_GetImage()
+	/** Frame the fringes are drawn in **/
+	CameraFrame frame;
+	/** Rate the frames are taken to be captured at **/
+	double fps;
+	/** Amplitude (rad) and frequency (Hz) of the phase **/
+	double amplitude;
+	double frequency;
+	/** Phase drawn and measured in the last frame found, from the first **/
+	double last_phase;
+	double last_measured;
+} InterferometerBench;
+
+/** Draw a frame with the fringes at the phase for its time **/
+static double InterferometerBench_Generate(void * arg, int i)
 {
-
-
-	Interferometer_TestSinusoid();
-	//TODO: Implement camera 
-
+	InterferometerBench * b = arg;
+	test_phase = b->amplitude * sin(2*M_PI*b->frequency*i / b->fps);
+	Interferometer_TestSinusoid(b->frame.image, (g_capture != NULL) ? cvQueryFrame(g_capture) : NULL,
+		test_omega, test_angle, test_phase, test_noise);
+	b->frame.seq = i + 1;
+	return test_phase;
 }
 
-/**
- * Initialise the Interferometer
- */
-void Interferometer_Init()
+/** Find the phase in the frame **/
+static bool InterferometerBench_Measure(void * arg, double * value)
 {
-	
-	// Make an initial reading (will allocate memory the first time only).
-	Interferometer_Read(1); 
+	InterferometerBench * b = arg;
+	double values[1];
+	bool set = Interferometer_Analyse(&(b->frame), values);
+	*value = values[0];
+	return set;
 }
 
-/**
- * Cleanup Interferometer stuff
- */
-void Interferometer_Cleanup()
+/** Print time, specified change, specified phase, measured change and measured phase **/
+static void InterferometerBench_Found(void * arg, int i, double truth, double value)
 {
-	if (g_data != NULL)
-		cvReleaseMat(&g_data);
-
-	if (g_capture != NULL)
-		cvReleaseCapture(&g_capture);
-
+	InterferometerBench * b = arg;
+	printf("%f\t%f\t%f\t%f\t%f\n", i / b->fps, truth - b->last_phase, truth, value - b->last_measured, value);
+	b->last_phase = truth;
+	b->last_measured = value;
 }
 
 /**
- * Read the interferometer; gets the latest image, processes it, spits out a single number
- * @param samples - Number of columns to scan (increasing will slow down performance!)
- * @returns Value proportional to the change in interferometer path length since the last call to this function
+ * Generate frames with the fringes moving back and forth by several fringes, and compare the phase
+ * the sensor finds with the phase the fringes were drawn at.
+ * Prints time, specified change, specified phase, measured change and measured phase for each frame,
+ * then a summary on stderr.
  */
-double Interferometer_Read(int samples)
+int main(int argc, char ** argv)
 {
+	int frames = 300;
+	int width = 800, height = 600;
+	InterferometerBench b = {.fps = 30, .amplitude = 4*M_PI, .frequency = 0.2};
 
-
-
-
-	// Get the latest image
-	Interferometer_GetImage();
-	// Frequency of the sinusoid
-	static double omega = 0;
-	// Stores locations of nodes
-	static int nodes[MAXNODES];
-	// Current phase
-	static double phase = 0;
-
-	// Phase
-	double cur_phase = 0;
-
-	int xstep = g_data->cols / (samples+1);
-
-	// Used for testing to see where the nodes are identified
-	// (Can't modify g_data)
-	static CvMat * test_overlay = NULL;
-	if (test_overlay == NULL)
+	int c;
+	while ((c = getopt(argc, argv, "n:w:h:a:o:t:N:f:b")) != -1)
 	{
-		// Creates a memory leak; don't do this in the final version!
-		test_overlay = cvCreateMat(g_data->rows, g_data->cols, CV_32FC3);
-	}
-	cvZero(test_overlay);
-	//cvCopy(g_data, test_overlay, NULL);
-
-	// For each column to sample
-	for (int x = xstep; x < g_data->cols; x += xstep)
-	{
-		
-		double avg = 0.5; //TODO: Calculate from image
-		double threshold_dif = 0; //TODO: Pick this value
-
-		int num_nodes = 0;
-		
-		// Find nodes
-		for (int y = 1; y < g_data->rows-2 && num_nodes < MAXNODES; ++y)
-		{
-			if (num_nodes == 0 || abs(nodes[num_nodes-1] - y) > 1)
-			{
-				// A "node" is defined where the ajacent points are on opposite sides of the avg
-				double ldif = INTENSITY(cvGet2D(g_data, y-1,x)) - avg;
-				double rdif = INTENSITY(cvGet2D(g_data, y+1,x)) - avg;
-
-				// If that is the case, the product of the differences will be negative
-				if (ldif * rdif < -threshold_dif)
-				{
-
-					nodes[num_nodes++] = y;
-
-					// Put a white line on the overlay to indicate the node was found
-					for (int xx = 0; xx < g_data->cols; ++xx)
-					{
-						CvScalar s; // = cvGet2D(g_data, y, xx);
-						s.val[0] = 1; s.val[1] = 1; s.val[2] = 1;
-						cvSet2D(test_overlay, y, xx, s);
-					}
-				}
-			}
-		}
-
-		// Insufficient nodes found to continue
-		if (num_nodes < 2)
+		switch (c)
 		{
-			--samples;
-			continue;
+			case 'n': frames = atoi(optarg); break;
+			case 'w': width = atoi(optarg); break;
+			case 'h': height = atoi(optarg); break;
+			case 'a': b.amplitude = atof(optarg); break;
+			case 'o': test_omega = atof(optarg); break;
+			case 't': test_angle = atof(optarg); break;
+			case 'N': test_noise = atof(optarg); break;
+			case 'f': b.frequency = atof(optarg); break;
+			case 'b': g_capture = cvCreateCameraCapture(0); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n frames] [-w width] [-h height] [-a phase amplitude (rad)]"
+					" [-f phase frequency (Hz)] [-o omega (rad/px)] [-t angle (rad)] [-N noise] [-b (camera background)]\n", argv[0]);
+				exit(EXIT_FAILURE);
 		}
-
-		// Estimate angular frequency from two nodes TODO: Average between nodes
-		double slice_omega = (PI*(num_nodes-1)) / (nodes[num_nodes-1] - nodes[0]);
-		//printf("SLICE: %f vs %f\n", slice_omega, test_omega);
-
-		double slice_phase = 0;
-		for (int i = 0; i < num_nodes; ++i)
-		{
-			double this_phase = ((double)(i)*PI - slice_omega * nodes[i]);
-			//printf("Node %d gives phase %f\n", i, this_phase);
-			slice_phase += this_phase;
-		}
-		slice_phase /= num_nodes;
-		cur_phase += slice_phase;
 	}
 
-	// Average over samples
-	if (samples == 0)
-		return 0;
-
-	cur_phase /= samples;
-
-
+	IplImage * image = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+	b.frame.image = image;
+	Interferometer_Init("interferometer", 0);
 
-	// Get phase change since last call, save current phase
-	double result = (cur_phase - phase);
+	BenchResult result;
+	Bench_Run(frames, InterferometerBench_Generate, InterferometerBench_Measure, InterferometerBench_Found,
+		&b, true, &result);
+	fprintf(stderr, "%dx%d frames: %d, found: %d, %f ms each (%f fps), rms error %f rad, max error %f rad\n",
+		width, height, frames, result.found, 1e3 * result.busy / frames, frames / result.busy,
+		result.rms_error, result.max_error);
 
-	// HACK
-	if (abs(result) > 0.5*PI)
-	{
-		if (result > 0)
-			result -= PI;
-		else
-			result += PI;
-	}	
-	phase = cur_phase;
-
-	// Display the image with lines to indicate results of data processing
-	//cvShowImage("nodes", test_overlay);
-	//cvWaitKey(1);
-	cvAdd(test_overlay, g_data, test_overlay, NULL);
-	cvShowImage("overlay", test_overlay);
-	cvWaitKey(1);
-	return result;
-
-}
-
-/**
- * For testing purposes
- */
-int main(int argc, char ** argv)
-{
-	//cvNamedWindow( "display", CV_WINDOW_AUTOSIZE );// Create a window for display.
-	gettimeofday(&start, NULL);
-
-	//Interferometer_Read(1);
-	//exit(EXIT_SUCCESS);
-
-	Interferometer_Init();
-
-	double sum = 0;
-	double last_phase = test_phase;
-
-	struct timeval now;
-	double time = 0;
-
-	while (time < 20)
-	{
-		gettimeofday(&now, NULL);
-		time = TIMEVAL_DIFF(now, start);
-		
-		test_phase = 0.5*PI*sin(time);
-
-		
-		double delta = Interferometer_Read(1);
-		sum += delta;
-	
-		printf("%f\t%f\t%f\t%f\t%f\n", time, test_phase - last_phase, test_phase, delta, sum);	
-
-		last_phase = test_phase;
-		//break;
-	}
-	
+	Interferometer_Cleanup(0);
+	cvReleaseImage(&image);
+	if (g_capture != NULL)
+		cvReleaseCapture(&g_capture);
+	return (result.found == frames) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-
-
@@ -0,0 +1,241 @@
+/**
+ * @file data_bench.c
+ * @purpose Benchmark of the server's DataFiles (server/data.c); saving, reading, searching by time and printing.
+ * Prints a tab separated line for each result: name, value, unit.
+ */
+
+#include "data.h"
+#include "fastcgi.h"
+#include "metrics.h"
+#include "trace.h"
+#include "realtime.h"
+#include "bench.h"
+#include <math.h>
+#include <stdarg.h>
+
+/** Largest number of points in the file, if not given **/
+#define DEFAULT_POINTS (1 << 22)
+/** Number of searches timed at each size, if not given **/
+#define DEFAULT_SEARCHES 20000
+
+/** Number of bytes printed through FCGI_Write and FCGI_PrintRaw **/
+static size_t g_printed = 0;
+
+/** The server's metrics aren't needed **/
+void Metrics_Add(MetricCounter counter, int label, long amount)
+{
+}
+
+void Metrics_Set(MetricGauge gauge, int label, long value)
+{
+}
+
+/** Nor are traces **/
+void Trace_ThreadName(const char * format, ...)
+{
+}
+
+uint64_t Trace_Begin()
+{
+	return 0;
+}
+
+void Trace_End(uint64_t start, const char * name, const char * detail, long value)
+{
+}
+
+/** Nor is scheduling threads **/
+void Realtime_SetRole(RealtimeRole role)
+{
+}
+
+/** Count the bytes of a response instead of sending them **/
+void FCGI_Write(const void * data, size_t len)
+{
+	g_printed += len;
+}
+
+/** Count the bytes of a response instead of sending them **/
+void FCGI_PrintRaw(const char * format, ...)
+{
+	va_list va;
+	va_start(va, format);
+	g_printed += vsnprintf(NULL, 0, format, va);
+	va_end(va);
+}
+
+/** Count the bytes of a response instead of sending them **/
+void FCGI_JSONKey(const char * key)
+{
+	FCGI_PrintRaw(",\n\t\"%s\" : ", key);
+}
+
+/** Count the bytes of a response instead of sending them **/
+void FCGI_JSONDouble(const char * key, double value)
+{
+	FCGI_PrintRaw(",\n\t\"%s\" : %f", key, value);
+}
+
+/** Print a result **/
+static void Result(const char * name, double value, const char * unit)
+{
+	printf("%s\t%.6g\t%s\n", name, value, unit);
+	fflush(stdout);
+}
+
+/**
+ * Benchmark saving points the way the sensors do (batch of 1) and in larger batches
+ * @param df - The DataFile; emptied, then filled with points sampled at 1 kHz
+ * @param points - Number of points
+ */
+static void DataBench_Save(DataFile * df, int points)
+{
+	static DataPoint buffer[DATA_AGG_BUFSIZ];
+	int batches[] = {1, DATA_BUFSIZ, DATA_AGG_BUFSIZ};
+	for (int b = 0; b < sizeof(batches)/sizeof(int); ++b)
+	{
+		if (ftruncate(fileno(df->file), 0) != 0)
+			Fatal("Couldn't empty %s - %s", df->filename, strerror(errno));
+		df->num_points = 0;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < points; i += batches[b])
+		{
+			int amount = (points - i < batches[b]) ? points - i : batches[b];
+			for (int j = 0; j < amount; ++j)
+			{
+				buffer[j].time_stamp = 1e-3 * (i + j);
+				buffer[j].value = sin(1e-3 * (i + j));
+			}
+			Data_Save(df, buffer, amount);
+		}
+		fflush(df->file);
+		double elapsed = Bench_Since(&start);
+
+		char name[64];
+		snprintf(name, sizeof(name), "data_save/batch=%d/rate", batches[b]);
+		Result(name, points / elapsed, "points/s");
+	}
+}
+
+/**
+ * Benchmark reading points in order (as printing does) and one at a time at random (as searching does)
+ * @param df - The DataFile
+ * @param reads - Number of random reads
+ */
+static void DataBench_Read(DataFile * df, int reads)
+{
+	static DataPoint buffer[DATA_AGG_BUFSIZ];
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long total = 0;
+	for (int i = 0; i < df->num_points; i += DATA_AGG_BUFSIZ)
+		total += Data_Read(df, buffer, i, DATA_AGG_BUFSIZ);
+	double elapsed = Bench_Since(&start);
+	Result("data_read/sequential/rate", total * sizeof(DataPoint) / elapsed / 1e6, "MB/s");
+
+	unsigned seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < reads; ++i)
+		Data_Read(df, buffer, rand_r(&seed) % df->num_points, 1);
+	Result("data_read/random/latency", 1e6 * Bench_Since(&start) / reads, "us");
+}
+
+/**
+ * Benchmark searching by time, for files of increasing size
+ * @param df - The DataFile; it is searched as if it only had the first points
+ * @param searches - Number of searches at each size
+ */
+static void DataBench_Find(DataFile * df, int searches)
+{
+	int points = df->num_points;
+	unsigned seed = 1;
+	for (int size = 1000; size <= points; size *= 10)
+	{
+		df->num_points = size;
+		double total = 0, max = 0;
+		for (int i = 0; i < searches; ++i)
+		{
+			double time_stamp = 1e-3 * size * rand_r(&seed) / RAND_MAX;
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			Data_FindByTime(df, time_stamp, NULL);
+			double elapsed = Bench_Since(&start);
+			total += elapsed;
+			max = (elapsed > max) ? elapsed : max;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "data_find/points=%d/latency_mean", size);
+		Result(name, 1e6 * total / searches, "us");
+		snprintf(name, sizeof(name), "data_find/points=%d/latency_max", size);
+		Result(name, 1e6 * max, "us");
+	}
+	df->num_points = points;
+}
+
+/**
+ * Benchmark printing the whole file in each format, without sending it anywhere
+ * @param df - The DataFile
+ */
+static void DataBench_Print(DataFile * df)
+{
+	DataFormat formats[] = {TSV, JSON};
+	const char * names[] = {"tsv", "json"};
+	for (int f = 0; f < sizeof(formats)/sizeof(DataFormat); ++f)
+	{
+		g_printed = 0;
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		Data_PrintByIndexes(df, 0, df->num_points, formats[f]);
+		double elapsed = Bench_Since(&start);
+
+		char name[64];
+		snprintf(name, sizeof(name), "data_print/format=%s/rate", names[f]);
+		Result(name, g_printed / elapsed / 1e6, "MB/s");
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	int points = DEFAULT_POINTS;
+	int searches = DEFAULT_SEARCHES;
+	const char * dir = "/tmp";
+
+	int c;
+	while ((c = getopt(argc, argv, "n:s:d:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n': points = atoi(optarg); break;
+			case 's': searches = atoi(optarg); break;
+			case 'd': dir = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n points] [-s searches] [-d directory for the DataFile]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (points < 1000 || searches < 1)
+	{
+		fprintf(stderr, "%s: Need at least 1000 points and 1 search\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	char filename[BUFSIZ];
+	snprintf(filename, sizeof(filename), "%s/data_bench_%d", dir, (int)getpid());
+	DataFile df;
+	Data_Init(&df);
+	Data_Open(&df, filename);
+	freopen(NULL, "wb+", df.file);
+
+	printf("#name\tvalue\tunit\n");
+	DataBench_Save(&df, points);
+	DataBench_Read(&df, searches);
+	DataBench_Find(&df, searches);
+	DataBench_Print(&df);
+
+	Data_Close(&df);
+	unlink(filename);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+"""
+End to end benchmark of the server, run against the simulated pins so that it needs no hardware.
+
+Starts the server on a FastCGI socket (as spawn-fcgi would), then measures:
+	sample/...	the highest sample rate sustained with 1, 2, 4... sensors sampling as fast as they can
+	api/...	requests/s and latency of each module (using fcgi_bench)
+	download/...	MB/s of downloading a sensor's data in each format (using fcgi_bench)
+	data_.../...	DataFile save and read throughput, search latency and print rate (using data_bench)
+
+Results are printed as tab separated lines of name, value and unit, and can be compared with a baseline:
+	./server_bench.py -o new.tsv
+	./server_bench.py --compare old.tsv new.tsv
+"""
+
+import argparse
+import os
+import platform
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SERVER = os.path.join(HERE, "..", "..", "server", "server")
+FCGI_BENCH = os.path.join(HERE, "..", "fcgi_bench", "fcgi_bench")
+DATA_BENCH = os.path.join(HERE, "data_bench")
+
+# Sensors that read through the pins, in the order they are added to the benchmark
+PIN_SENSORS = ["Explode_Pressure_kPa", "Mains_Pressure_kPa", "Strain_Pressure_kPa", "Microphone",
+	"Strain_End_Hoop", "Strain_End_Long", "Strain_Mid_Hoop", "Strain_Mid_Long"]
+
+# Signals for the pressure sensors' ADCs; the other ADCs read 0
+SIM_DEFAULT = "adc1=sine:1500,500,1;adc3=sine:1500,500,2;adc5=sine:1500,500,4;noise=2"
+
+# Requests made of each module: (name, module, query); {sensor} is the id of the first sensor
+API_REQUESTS = [
+	("identify", "identify", ""),
+	("control", "control", "action=identify"),
+	("sensors", "sensors", "id={sensor}&start_time=1e9"),
+	("sensors_agg", "sensors", "id={sensor}&agg=min,max,mean&window=1"),
+	("actuators", "actuators", "id=0&start_time=1e9"),
+	("pin", "pin", "type=counters"),
+]
+
+# Formats that sensor data is downloaded in
+DOWNLOAD_FORMATS = ["tsv", "json", "bin"]
+
+
+class FastCGI:
+	"""Minimal FastCGI client; enough to make requests of the server one at a time. Each request has its own
+	connection, as the server only serves one connection at a time and fcgi_bench needs it too."""
+
+	def __init__(self, port):
+		self.port = port
+		self.cookie = ""
+
+	def record(self, kind, data):
+		return struct.pack(">BBHHBB", 1, kind, 1, len(data), 0, 0) + data
+
+	def request(self, module, query=""):
+		"""Make a request and return the body of the response"""
+		params = b""
+		for name, value in [("DOCUMENT_URI_LOCAL", module), ("QUERY_STRING", query),
+				("REQUEST_METHOD", "GET"), ("COOKIE_STRING", self.cookie), ("REMOTE_ADDR", "127.0.0.1")]:
+			name, value = name.encode(), value.encode()
+			params += struct.pack("BB", len(name), len(value)) + name + value
+		self.sock = socket.create_connection(("127.0.0.1", self.port))
+		self.sock.sendall(self.record(1, struct.pack(">HB5x", 1, 0)) + self.record(4, params)
+			+ self.record(4, b"") + self.record(5, b""))
+
+		output = b""
+		while True:
+			version, kind, request_id, length, padding, reserved = struct.unpack(">BBHHBB", self.read(8))
+			content = self.read(length + padding)[:length]
+			if kind == 3:
+				break
+			elif kind == 6:
+				output += content
+		self.sock.close()
+
+		headers, _, body = output.partition(b"\r\n\r\n")
+		match = re.search(rb"Set-Cookie: (mctxkey=[0-9a-f]+)", headers)
+		if match:
+			self.cookie = match.group(1).decode()
+		return body.decode(errors="replace")
+
+	def read(self, length):
+		data = b""
+		while len(data) < length:
+			more = self.sock.recv(length - len(data))
+			if not more:
+				raise IOError("Server closed the connection")
+			data += more
+		return data
+
+
+class Server:
+	"""The server, listening on a FastCGI socket with its experiments in a temporary directory"""
+
+	def __init__(self, binary, port, sim, log):
+		self.directory = tempfile.mkdtemp(prefix="server_bench_")
+		listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		listener.bind(("127.0.0.1", port))
+		listener.listen(64)
+		self.process = subprocess.Popen([binary, "-v", "0", "-e", self.directory, "-c", "0", "-s", "0",
+			"-t", "0", "-b", "sim:" + sim], stdin=listener.fileno(), stdout=subprocess.DEVNULL, stderr=log)
+		listener.close()
+		self.client = FastCGI(port)
+		self.client.request("identify")
+
+	def stop(self):
+		self.process.terminate()
+		self.process.wait()
+		subprocess.call(["rm", "-rf", self.directory])
+
+
+def running_time(body):
+	"""Get the time since the experiment started from a JSON response"""
+	return float(re.search(r'"running_time" : ([-0-9.e]+)', body).group(1))
+
+
+def sensor_ids(client):
+	"""Get the ids of the sensors, by name"""
+	body = client.request("identify", "sensors=1")
+	return dict((name, int(i)) for i, name in re.findall(r'"(\d+)" : \{"name" : "([^"]*)"', body))
+
+
+def bench_sample(client, sensors, duration, results):
+	"""Measure the sample rate with more and more sensors sampling as fast as they can"""
+	counts = [n for n in [1, 2, 4, 8, 16] if n < len(sensors)] + [len(sensors)]
+	for n in counts:
+		for i, sensor in enumerate(sensors):
+			client.request("sensors", "id=%d&sample_s=%s" % (sensor, "0" if i < n else "1"))
+		time.sleep(0.5)
+		start = running_time(client.request("sensors", "id=%d&start_time=1e9" % sensors[0]))
+		time.sleep(duration + 0.5)
+
+		rates = []
+		for sensor in sensors[:n]:
+			body = client.request("sensors", "id=%d&format=tsv&agg=count&window=%f&start_time=%f&end_time=%f"
+				% (sensor, duration, start, start + duration))
+			count = sum(int(line.split("\t")[1]) for line in body.splitlines() if "\t" in line)
+			rates.append(count / duration)
+		results.append(("sample/sensors=%d/rate_total" % n, sum(rates), "samples/s"))
+		results.append(("sample/sensors=%d/rate_min" % n, min(rates), "samples/s"))
+
+	for sensor in sensors:
+		client.request("sensors", "id=%d&sample_s=1" % sensor)
+
+
+def fcgi_bench(port, module, query, requests, warmup):
+	"""Run fcgi_bench and return its results"""
+	output = subprocess.check_output([FCGI_BENCH, "-p", str(port), "-n", str(requests), "-w", str(warmup),
+		module, query]).decode()
+	return dict(line.split("\t", 1) for line in output.splitlines() if "\t" in line)
+
+
+def bench_api(port, sensor, requests, results):
+	"""Measure the requests/s and latency of each module"""
+	for name, module, query in API_REQUESTS:
+		r = fcgi_bench(port, module, query.format(sensor=sensor), requests, requests // 10)
+		results.append(("api/module=%s/rate" % name, float(r["requests_per_s"]), "requests/s"))
+		results.append(("api/module=%s/latency_mean" % name, float(r["latency_mean_us"]), "us"))
+
+
+def bench_download(port, experiment, sensor, requests, results):
+	"""Measure the rate that a sensor's data is downloaded at, in each format"""
+	for fmt in DOWNLOAD_FORMATS:
+		r = fcgi_bench(port, "sensordl", "name=%s&id=%d&format=%s" % (experiment, sensor, fmt), requests, 1)
+		rate = float(r["requests_per_s"]) * float(r["bytes_per_response"]) / 1e6
+		results.append(("download/format=%s/rate" % fmt, rate, "MB/s"))
+	results.append(("download/size", float(r["bytes_per_response"]) / 1e6, "MB"))
+
+
+def bench_data(points, results):
+	"""Run data_bench and add its results"""
+	output = subprocess.check_output([DATA_BENCH, "-n", str(points), "-d", tempfile.gettempdir()]).decode()
+	for line in output.splitlines():
+		if not line.startswith("#"):
+			name, value, unit = line.split("\t")
+			results.append((name, float(value), unit))
+
+
+def read_results(filename):
+	"""Read a file of results, as a dict of name to (value, unit)"""
+	results = {}
+	with open(filename) as f:
+		for line in f:
+			if line.startswith("#") or "\t" not in line:
+				continue
+			name, value, unit = line.rstrip("\n").split("\t")
+			results[name] = (float(value), unit)
+	return results
+
+
+def compare(baseline, new, threshold):
+	"""Print the change in each result from a baseline; returns the number of results that got worse by more
+	than threshold percent"""
+	old, new = read_results(baseline), read_results(new)
+	worse = 0
+	print("#name\tbaseline\tnew\tunit\tchange_%")
+	for name in sorted(set(old) | set(new)):
+		if name not in old or name not in new:
+			print("%s\t%s\t%s\t%s\t" % (name, old.get(name, ("-",))[0], new.get(name, ("-",))[0],
+				(old.get(name) or new.get(name))[1]))
+			continue
+		(a, unit), (b, _) = old[name], new[name]
+		change = 100.0 * (b - a) / a if a != 0 else 0.0
+		# Rates and sizes are better higher; times are better lower
+		better_higher = "/s" in unit or unit in ("MB",)
+		regressed = (change < -threshold) if better_higher else (change > threshold)
+		worse += regressed
+		print("%s\t%g\t%g\t%s\t%+.1f%s" % (name, a, b, unit, change, "\tWORSE" if regressed else ""))
+	return worse
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+	parser.add_argument("-o", "--output", help="also write the results to this file")
+	parser.add_argument("-p", "--port", type=int, default=9015, help="port for the server's FastCGI socket")
+	parser.add_argument("--server", default=SERVER, help="server binary")
+	parser.add_argument("--sim", default=SIM_DEFAULT, help="configuration of the simulated pins (see pin_sim.c)")
+	parser.add_argument("--duration", type=float, default=2.0, help="time to measure each sample rate for (s)")
+	parser.add_argument("--requests", type=int, default=2000, help="requests of each module")
+	parser.add_argument("--downloads", type=int, default=5, help="downloads in each format")
+	parser.add_argument("--points", type=int, default=1 << 22, help="largest DataFile for data_bench")
+	parser.add_argument("--only", choices=["sample", "api", "download", "data"], action="append",
+		help="only run some of the benchmarks")
+	parser.add_argument("--log", default=os.devnull, help="file for the server's log")
+	parser.add_argument("--compare", nargs=2, metavar=("BASELINE", "NEW"),
+		help="compare two files of results instead; fails if any are worse by more than --threshold")
+	parser.add_argument("--threshold", type=float, default=10.0, help="percentage change counted as worse")
+	args = parser.parse_args()
+
+	if args.compare:
+		worse = compare(args.compare[0], args.compare[1], args.threshold)
+		if worse:
+			sys.stderr.write("%d results are more than %g%% worse than the baseline\n" % (worse, args.threshold))
+		return 1 if worse else 0
+
+	only = args.only or ["sample", "api", "download", "data"]
+	results = []
+	header = ["#server_bench %s" % time.strftime("%Y-%m-%d %H:%M:%S"),
+		"#host %s %s" % (platform.node(), platform.machine()),
+		"#revision %s" % subprocess.check_output(["git", "describe", "--always", "--dirty"], cwd=HERE).decode().strip(),
+		"#sim %s" % args.sim,
+		"#name\tvalue\tunit"]
+	print("\n".join(header))
+
+	if set(only) & set(["sample", "api", "download"]):
+		with open(args.log, "w") as log:
+			server = Server(args.server, args.port, args.sim, log)
+			try:
+				client = server.client
+				ids = sensor_ids(client)
+				sensors = [ids[name] for name in PIN_SENSORS if name in ids]
+				client.request("control", "action=start&name=bench&force=1")
+				if "sample" in only:
+					bench_sample(client, sensors, args.duration, results)
+				if "api" in only:
+					bench_api(args.port, sensors[0], args.requests, results)
+				client.request("control", "action=stop")
+				if "download" in only:
+					bench_download(args.port, "bench", sensors[0], args.downloads, results)
+			finally:
+				server.stop()
+		for r in results:
+			print("%s\t%.6g\t%s" % r)
+			sys.stdout.flush()
+
+	if "data" in only:
+		before = len(results)
+		bench_data(args.points, results)
+		for r in results[before:]:
+			print("%s\t%.6g\t%s" % r)
+
+	if args.output:
+		with open(args.output, "w") as f:
+			f.write("\n".join(header) + "\n")
+			f.writelines("%s\t%.6g\t%s\n" % r for r in results)
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,201 @@
+/**
+ * @file vision.c
+ * @purpose Benchmark of the camera based sensors on synthetic frames, across resolutions and noise levels.
+ * The sensors are compiled with -DANALYSIS_PROFILE so that the time spent in each stage can be reported.
+ */
+
+#include "cv.h"
+#include "sensors/dilatometer.h"
+#include "sensors/interferometer.h"
+#include "analysis.h"
+#include "bench.h"
+#include <math.h>
+
+/** Maximum number of stages that can be timed **/
+#define STAGES_MAX 8
+
+/** Time spent in each stage of the analysis being benchmarked **/
+static struct
+{
+	const char * name;
+	double time;
+} g_stages[STAGES_MAX];
+/** Number of stages timed **/
+static int g_num_stages = 0;
+
+/** Resolutions to benchmark **/
+static CvSize g_sizes[] = {{320, 240}, {640, 480}, {800, 600}, {1280, 960}};
+/** Noise levels to benchmark (fraction of full scale) **/
+static double g_noises[] = {0, 0.02, 0.05, 0.1};
+
+/** Limits that make the benchmark fail **/
+static struct
+{
+	/** Minimum frames per second (analysis only) **/
+	double fps;
+	/** Maximum rms error of the dilatometer (pixels at DILATOMETER_WIDTH) **/
+	double dilatometer;
+	/** Maximum rms error of the interferometer (radians) **/
+	double interferometer;
+	/** Minimum fraction of frames that must give a value **/
+	double found;
+} g_limits = {0, 0.25, 0.05, 0.95};
+
+/** Add the time since start to a stage of the analysis **/
+void Analysis_Profile(const char * stage, const struct timespec * start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int i = 0;
+	while (i < g_num_stages && strcmp(g_stages[i].name, stage) != 0)
+		++i;
+	if (i == g_num_stages)
+	{
+		if (g_num_stages >= STAGES_MAX)
+			return;
+		g_stages[g_num_stages].name = stage;
+		g_stages[g_num_stages++].time = 0;
+	}
+	g_stages[i].time += TIMEVAL_DIFF(end, *start);
+}
+
+/** What a benchmark works on **/
+typedef struct
+{
+	/** Whether the sensor is the dilatometer (otherwise the interferometer) **/
+	bool dilatometer;
+	/** Frame the test image is drawn in **/
+	CameraFrame frame;
+	/** Amount of noise in the frames (fraction of full scale) **/
+	double noise;
+} VisionBench;
+
+/** Draw a frame, moving the edge back and forth across half the frame, and the fringes by several fringes **/
+static double VisionBench_Generate(void * arg, int i)
+{
+	VisionBench * b = arg;
+	double truth = (b->dilatometer) ? 0.5*DILATOMETER_WIDTH + 0.25*DILATOMETER_WIDTH*sin(2*M_PI*i / 100)
+		: 4*M_PI*sin(2*M_PI*i / 150);
+	if (b->dilatometer)
+		Dilatometer_TestImage(b->frame.image, truth, b->noise);
+	else
+		Interferometer_TestSinusoid(b->frame.image, NULL, 0.05, M_PI/2, truth, b->noise);
+	b->frame.seq = i + 1;
+	return truth;
+}
+
+/** Analyse the frame; only the first channel is compared **/
+static bool VisionBench_Measure(void * arg, double * value)
+{
+	VisionBench * b = arg;
+	double values[ANALYSIS_CHANNELS_MAX];
+	unsigned set = (b->dilatometer) ? Dilatometer_Analyse(&(b->frame), values) : Interferometer_Analyse(&(b->frame), values);
+	*value = values[0];
+	return (set & 1);
+}
+
+/**
+ * Benchmark a sensor on one resolution and noise level, and print a line of results
+ * @param sensor - "dilatometer" or "interferometer"
+ * @param size - Size of the frames
+ * @param noise - Amount of noise in the frames (fraction of full scale)
+ * @param frames - Number of frames
+ * @returns true if the results are within g_limits
+ */
+static bool Vision_Benchmark(const char * sensor, CvSize size, double noise, int frames)
+{
+	bool dilatometer = (strcmp(sensor, "dilatometer") == 0);
+	IplImage * image = cvCreateImage(size, IPL_DEPTH_8U, 3);
+	VisionBench b = {.dilatometer = dilatometer, .frame = {.image = image}, .noise = noise};
+	g_num_stages = 0;
+	if (dilatometer)
+		Dilatometer_Init(sensor, DIL_POS);
+	else
+		Interferometer_Init(sensor, 0);
+
+	// The interferometer's phase starts from zero at the first frame it finds the fringes in
+	BenchResult result;
+	Bench_Run(frames, VisionBench_Generate, VisionBench_Measure, NULL, &b, !dilatometer, &result);
+
+	double fps = frames / result.busy;
+	double rms = result.rms_error;
+	printf("%s\t%d\t%d\t%.3f\t%d\t%d\t%.1f\t%.4f\t%.5f\t%.5f", sensor, size.width, size.height, noise,
+		frames, result.found, fps, 1e3 * result.busy / frames, rms, result.max_error);
+	for (int i = 0; i < g_num_stages; ++i)
+		printf("\t%s:%.4f", g_stages[i].name, 1e3 * g_stages[i].time / frames);
+	printf("\n");
+	fflush(stdout);
+
+	if (dilatometer)
+		Dilatometer_Cleanup(DIL_POS);
+	else
+		Interferometer_Cleanup(0);
+	cvReleaseImage(&image);
+
+	bool ok = true;
+	double limit = (dilatometer) ? g_limits.dilatometer : g_limits.interferometer;
+	if (result.found < g_limits.found * frames || rms > limit || fps < g_limits.fps)
+	{
+		fprintf(stderr, "FAIL %s %dx%d noise %.3f: found %d/%d, rms error %f (limit %f), %.1f fps (limit %.1f)\n",
+			sensor, size.width, size.height, noise, result.found, frames, rms, limit, fps, g_limits.fps);
+		ok = false;
+	}
+	return ok;
+}
+
+/**
+ * Benchmark the sensors at each resolution and noise level.
+ * Prints a tab separated line for each: sensor, width, height, noise, frames, frames found, frames per
+ * second, ms per frame, rms error, max error, then ms per frame in each stage.
+ * Exits with failure if any results are outside the limits.
+ */
+int main(int argc, char ** argv)
+{
+	int frames = 50;
+	const char * only = NULL;
+	int num_sizes = sizeof(g_sizes) / sizeof(CvSize);
+	int num_noises = sizeof(g_noises) / sizeof(double);
+
+	int c;
+	while ((c = getopt(argc, argv, "n:s:r:N:F:D:I:M:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n': frames = atoi(optarg); break;
+			case 's': only = optarg; break;
+			case 'r':
+				if (sscanf(optarg, "%dx%d", &(g_sizes[0].width), &(g_sizes[0].height)) != 2)
+				{
+					fprintf(stderr, "Resolution should be WIDTHxHEIGHT\n");
+					exit(EXIT_FAILURE);
+				}
+				num_sizes = 1;
+				break;
+			case 'N': g_noises[0] = atof(optarg); num_noises = 1; break;
+			case 'F': g_limits.fps = atof(optarg); break;
+			case 'D': g_limits.dilatometer = atof(optarg); break;
+			case 'I': g_limits.interferometer = atof(optarg); break;
+			case 'M': g_limits.found = atof(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n frames] [-s dilatometer|interferometer] [-r WIDTHxHEIGHT] [-N noise]"
+					" [-F min fps] [-D max dilatometer rms error (px)] [-I max interferometer rms error (rad)]"
+					" [-M min fraction of frames found]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	const char * sensors[] = {"dilatometer", "interferometer"};
+	bool ok = true;
+	printf("#sensor\twidth\theight\tnoise\tframes\tfound\tfps\tms\trms_error\tmax_error\tstage:ms...\n");
+	for (int s = 0; s < 2; ++s)
+	{
+		if (only != NULL && strcmp(only, sensors[s]) != 0)
+			continue;
+		for (int r = 0; r < num_sizes; ++r)
+		{
+			for (int n = 0; n < num_noises; ++n)
+				ok = Vision_Benchmark(sensors[s], g_sizes[r], g_noises[n], frames) && ok;
+		}
+	}
+	return (ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+}